@@ -12,6 +12,12 @@ DEL_REQ = 2
 GET_RESP = 3
 RESP = 4
 INFO = 11
+MGET_REQ = 15
+MPUT_REQ = 16
+MDEL_REQ = 17
+MGET_RESP = 18
+SCAN_REQ = 19
+SCAN_RESP = 20
 
 # Default timeout (in seconds)
 TIMEOUT = 3
@@ -73,8 +79,8 @@ class KVClient:
 
         try:
             unpacker = struct.Struct('I')
-            size = socket.ntohl(unpacker.unpack(self._sock.recv(4))[0])
-            data = self._sock.recv(size)
+            size = socket.ntohl(unpacker.unpack(self._recv_exactly(4))[0])
+            data = self._recv_exactly(size)
         except Exception as e:
             raise e
         if not data:
@@ -82,14 +88,32 @@ class KVClient:
 
         return KVMessage(json_data=data)
 
+    def _recv_exactly(self, size):
+        """
+        Reads SIZE bytes from this client's socket, fewer only if the
+        connection is closed first, so that messages streamed back to back
+        are split correctly.
+        """
+        data = b""
+        while len(data) < size:
+            chunk = self._sock.recv(size - len(data))
+            if not chunk:
+                break
+            data += chunk
+        return data
+
     def _disconnect(self):
         """
         Closes this client's existing connection to a server.
         """
         self._sock.close()
 
-    def info(self):
-        return self._send_request(INFO, "", "")
+    def info(self, format=""):
+        """
+        Returns the server's info and stats, as a JSON object if FORMAT is
+        "json".
+        """
+        return self._send_request(INFO, format, "")
 
     def put(self, key, value):
         """
@@ -113,6 +137,77 @@ class KVClient:
         self._check_key(key)
         return self._send_request(DEL_REQ, key)
 
+    def mget(self, keys):
+        """
+        GETs the values for the list of KEYS from the KV server and returns
+        them as a dict. Keys which do not exist map to None.
+        """
+        for key in keys:
+            self._check_key(key)
+        response = self._send_batch(MGET_REQ, [[key, None] for key in keys])
+        return dict((key, value) for key, value in response.batch)
+
+    def mput(self, pairs):
+        """
+        PUTs every key and value of the dict PAIRS to the KV server at once.
+        """
+        for key, value in pairs.items():
+            self._check_key(key)
+            self._check_value(value)
+        self._send_batch(MPUT_REQ, [[key, value] for key, value in pairs.items()])
+        return "SUCCESS"
+
+    def mdelete(self, keys):
+        """
+        DELs the values for the list of KEYS from the KV server at once.
+        """
+        for key in keys:
+            self._check_key(key)
+        self._send_batch(MDEL_REQ, [[key, None] for key in keys])
+        return "SUCCESS"
+
+    def scan(self, start=None, end=None, limit=None):
+        """
+        Returns a list of the (key, value) pairs on the KV server from START
+        up to but excluding END, in order, at most LIMIT of them. Any of the
+        three may be None to leave the scan unbounded that way.
+        """
+        message = KVMessage(msg_type=SCAN_REQ, key=start, value=end,
+                            msg=None if limit is None else str(limit))
+        pairs = []
+        self._connect()
+        message.send(self._sock)
+        response = self._listen()
+        while response.type == SCAN_RESP:
+            pairs.extend((key, value) for key, value in response.batch)
+            response = self._listen()
+        self._disconnect()
+
+        if response.type != RESP:
+            raise Exception(ERRORS["generic"])
+        elif response.message != "SUCCESS":
+            raise Exception(response.message)
+        return pairs
+
+    def _send_batch(self, req_type, batch):
+        """
+        Helper function for sending the three different types of batch
+        request. Returns the response.
+        """
+        message = KVMessage(msg_type=req_type, batch=batch)
+        self._connect()
+        message.send(self._sock)
+        response = self._listen()
+        self._disconnect()
+
+        if req_type == MGET_REQ and response.type == MGET_RESP:
+            return response
+        elif response.type != RESP:
+            raise Exception(ERRORS["generic"])
+        elif response.message != "SUCCESS":
+            raise Exception(response.message)
+        return response
+
     def _send_request(self, req_type, key, value=None):
         """
         Helper function for sending the three different types of request.
@@ -161,10 +256,10 @@ class KVMessage:
     """
 
     def __init__(self, msg_type=None, key=None, value=None, \
-                 msg=None, json_data=None):
+                 msg=None, json_data=None, batch=None):
         """
         This constructor must be called in one of two mutually exclusive ways:
-            1) with a msg_type (mandatory) and optional key, value, msg
+            1) with a msg_type (mandatory) and optional key, value, msg, batch
             2) with a JSON string (json_data -- incoming data from a connection)
         """
         if json_data:
@@ -174,6 +269,7 @@ class KVMessage:
             self.key = key
             self.value = value
             self.message = msg
+            self.batch = batch
 
     def __str__(self):
         return self._to_json()
@@ -195,6 +291,8 @@ class KVMessage:
             self.value = decoded["value"]
         if "message" in decoded:
             self.message = decoded["message"]
+        if "batch" in decoded:
+            self.batch = decoded["batch"]
 
     def _to_json(self):
         """
@@ -208,6 +306,8 @@ class KVMessage:
             d["value"] = self.value
         if self.message:
             d["message"] = self.message
+        if self.batch:
+            d["batch"] = self.batch
 
         return json.dumps(d)
 
@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "kvbloom.h"
+
+/* Stores in INDEXES the positions of the KVBLOOM_NUM_HASHES counters of the
+ * key whose kvhash_key is HASH in BLOOM. */
+static void kvbloom_indexes(kvbloom_t *bloom, uint64_t hash,
+    uint64_t *indexes) {
+  uint32_t h1 = (uint32_t) hash, h2 = (uint32_t) (hash >> 32) | 1;
+  unsigned int i;
+  for (i = 0; i < KVBLOOM_NUM_HASHES; i++)
+    indexes[i] = (h1 + (uint64_t) i * h2) & bloom->mask;
+}
+
+/* Initializes BLOOM, an empty filter for a store holding NUM_KEYS keys,
+ * mapped from FILENAME, which is created or resized as needed. Returns 0 if
+ * successful, else a negative error code. */
+int kvbloom_init(kvbloom_t *bloom, char *filename, unsigned int num_keys) {
+  uint64_t num_counters = KVBLOOM_MIN_COUNTERS;
+  void *map;
+  while (num_counters < (uint64_t) num_keys * KVBLOOM_COUNTERS_PER_KEY)
+    num_counters <<= 1;
+  memset(bloom, 0, sizeof(kvbloom_t));
+  bloom->fd = open(filename, O_RDWR | O_CREAT, 0600);
+  if (bloom->fd == -1)
+    return ERRFILACCESS;
+  bloom->size = sizeof(kvbloomheader_t) + num_counters;
+  /* Truncating to zero first discards the old counters. */
+  if (ftruncate(bloom->fd, 0) == -1
+      || ftruncate(bloom->fd, bloom->size) == -1) {
+    close(bloom->fd);
+    return ERRFILACCESS;
+  }
+  map = mmap(NULL, bloom->size, PROT_READ | PROT_WRITE, MAP_SHARED, bloom->fd,
+      0);
+  if (map == MAP_FAILED) {
+    close(bloom->fd);
+    return ERRFILACCESS;
+  }
+  bloom->header = (kvbloomheader_t *) map;
+  bloom->counters = (uint8_t *) map + sizeof(kvbloomheader_t);
+  bloom->mask = num_counters - 1;
+  bloom->header->magic = KVBLOOM_MAGIC;
+  bloom->header->num_counters = num_counters;
+  return 0;
+}
+
+/* Adds the key whose kvhash_key is HASH to BLOOM. */
+void kvbloom_add(kvbloom_t *bloom, uint64_t hash) {
+  uint64_t indexes[KVBLOOM_NUM_HASHES];
+  uint8_t count;
+  unsigned int i;
+  kvbloom_indexes(bloom, hash, indexes);
+  for (i = 0; i < KVBLOOM_NUM_HASHES; i++) {
+    count = __atomic_load_n(&bloom->counters[indexes[i]], __ATOMIC_RELAXED);
+    while (count < KVBLOOM_MAX_COUNT && !__atomic_compare_exchange_n(
+        &bloom->counters[indexes[i]], &count, count + 1, false,
+        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+/* Removes the key whose kvhash_key is HASH, which must have been added, from
+ * BLOOM. */
+void kvbloom_remove(kvbloom_t *bloom, uint64_t hash) {
+  uint64_t indexes[KVBLOOM_NUM_HASHES];
+  uint8_t count;
+  unsigned int i;
+  kvbloom_indexes(bloom, hash, indexes);
+  for (i = 0; i < KVBLOOM_NUM_HASHES; i++) {
+    count = __atomic_load_n(&bloom->counters[indexes[i]], __ATOMIC_RELAXED);
+    while (count > 0 && count < KVBLOOM_MAX_COUNT
+        && !__atomic_compare_exchange_n(&bloom->counters[indexes[i]], &count,
+          count - 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+/* Returns false if the key whose kvhash_key is HASH has certainly not been
+ * added to BLOOM, else true. */
+bool kvbloom_may_contain(kvbloom_t *bloom, uint64_t hash) {
+  uint64_t indexes[KVBLOOM_NUM_HASHES];
+  unsigned int i;
+  kvbloom_indexes(bloom, hash, indexes);
+  for (i = 0; i < KVBLOOM_NUM_HASHES; i++) {
+    if (__atomic_load_n(&bloom->counters[indexes[i]], __ATOMIC_ACQUIRE) == 0)
+      return false;
+  }
+  return true;
+}
+
+/* Unmaps BLOOM and closes its file, which is left in place. */
+void kvbloom_destroy(kvbloom_t *bloom) {
+  if (bloom->header != NULL)
+    munmap(bloom->header, bloom->size);
+  if (bloom->fd != -1)
+    close(bloom->fd);
+  bloom->header = NULL;
+  bloom->counters = NULL;
+  bloom->fd = -1;
+}
@@ -0,0 +1,69 @@
+#ifndef __KV_BLOOM__
+#define __KV_BLOOM__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "kvconstants.h"
+
+/* KVBloom is a counting bloom filter over the keys of a KVStore, which lets
+ * the store answer most lookups of absent keys without touching the disk.
+ *
+ * The filter holds a power of two number of one-byte counters. Each key maps
+ * to KVBLOOM_NUM_HASHES counters, picked by double hashing from the two
+ * halves of its kvhash_key, which the caller passes in, having computed it
+ * for other uses too. Adding a key increments its counters and removing it
+ * decrements them. A key may be present only if all of its counters are
+ * nonzero, so a zero counter proves it absent. A counter which reaches 255
+ * sticks there, as its true count is then unknown.
+ *
+ * The counters live in a file which is mapped into memory, so updates cost no
+ * system calls. The file is sized and refilled whenever the filter is
+ * initialized, with KVBLOOM_COUNTERS_PER_KEY counters per key the store held
+ * at the time, and at least KVBLOOM_MIN_COUNTERS. That keeps false
+ * positives under 0.3% at first, and under 3% once the store has doubled.
+ *
+ * Counters are updated atomically, so lookups need no lock. A KVStore adds a
+ * key before writing its entry and removes it after deleting the entry, so
+ * the filter never misses a key the store holds.
+ */
+
+/* The number of counters each key maps to. */
+#define KVBLOOM_NUM_HASHES 4
+
+/* The number of counters given to each key held when the filter is built. */
+#define KVBLOOM_COUNTERS_PER_KEY 16
+
+/* The smallest number of counters a filter is built with. */
+#define KVBLOOM_MIN_COUNTERS (1 << 16)
+
+/* The value a counter sticks at once it is reached. */
+#define KVBLOOM_MAX_COUNT 255
+
+/* The first bytes of a filter's file. */
+#define KVBLOOM_MAGIC 0x4B56424C4F4F4D31ULL
+
+/* The header at the start of a filter's file, followed by the counters. */
+typedef struct {
+  uint64_t magic;               /* KVBLOOM_MAGIC. */
+  uint64_t num_counters;        /* The number of counters which follow. */
+} kvbloomheader_t;
+
+/* A KVBloom. */
+typedef struct {
+  int fd;                       /* The file the counters are mapped from. */
+  kvbloomheader_t *header;      /* The start of the mapping. */
+  uint8_t *counters;            /* The counters, following HEADER. */
+  uint64_t mask;                /* The number of counters, less one. */
+  size_t size;                  /* The size of the mapping in bytes. */
+} kvbloom_t;
+
+int kvbloom_init(kvbloom_t *, char *filename, unsigned int num_keys);
+
+void kvbloom_add(kvbloom_t *, uint64_t hash);
+void kvbloom_remove(kvbloom_t *, uint64_t hash);
+bool kvbloom_may_contain(kvbloom_t *, uint64_t hash);
+
+void kvbloom_destroy(kvbloom_t *);
+
+#endif
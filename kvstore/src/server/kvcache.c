@@ -4,13 +4,21 @@
 #include <string.h>
 #include "kvconstants.h"
 #include "kvcache.h"
-#include "kvstore.h"
+#include "kvhash.h"
 
 /* Initializes KVCache CACHE. The cache will contains NUM_SETS KVCacheSets,
  * each containing up to ELEM_PER_SET entries. Returns 0 if successful, else a
  * negative error code. */
 int kvcache_init(kvcache_t *cache, unsigned int num_sets,
     unsigned int elem_per_set) {
+  return kvcache_init_policy(cache, num_sets, elem_per_set, KVPOLICY_CLOCK);
+}
+
+/* Initializes KVCache CACHE as kvcache_init does, with every set evicting
+ * entries according to POLICY. Returns 0 if successful, else a negative error
+ * code. */
+int kvcache_init_policy(kvcache_t *cache, unsigned int num_sets,
+    unsigned int elem_per_set, kvpolicy_type_t policy) {
   int i;
   if (num_sets == 0 || elem_per_set == 0)
     return -1;
@@ -19,43 +27,72 @@ int kvcache_init(kvcache_t *cache, unsigned int num_sets,
     return ENOMEM;
   cache->num_sets = num_sets;
   cache->elem_per_set = elem_per_set;
+  cache->policy = policy;
+  cache->write_ahead = NULL;
+  cache->write_ahead_aux = NULL;
   for (i = 0; i < num_sets; ++i) {
-    if (kvcacheset_init(&cache->sets[i], elem_per_set) != 0)
+    if (kvcacheset_init_policy(&cache->sets[i], elem_per_set, policy) != 0)
       return -1;
   }
   return 0;
 }
 
-/* Retrieves the cache set associated with a given KEY. The correct set can be
- * determined based on the hash of the KEY using the hash() function defined
- * within kvstore.h. */
-kvcacheset_t *get_cache_set(kvcache_t *cache, char *key) {
-  return &cache->sets[hash(key)%cache->num_sets];
+/* Retrieves the cache set associated with a key whose kvhash_key is HASH.
+ * The set is picked by the high half of the hash, as the low bits address
+ * the index within the set. */
+static kvcacheset_t *get_cache_set(kvcache_t *cache, uint64_t hash) {
+  return &cache->sets[(hash >> 32) % cache->num_sets];
 }
 
 /* Attempts to retrieve KEY from CACHE. If successful, returns 0 and stores the
  * associated value inside VALUE using malloc()d memory which should be free()d
- * later. Otherwise, returns a negative error code. */
+ * later. Otherwise, returns a negative error code. Takes no lock; see
+ * kvcacheset.h. */
 int kvcache_get(kvcache_t *cache, char *key, char **value) {
+  return kvcache_get_hashed(cache, key, kvhash_key(key), value);
+}
+
+/* As kvcache_get, for a KEY whose kvhash_key the caller has already
+ * computed as HASH. */
+int kvcache_get_hashed(kvcache_t *cache, char *key, uint64_t hash,
+    char **value) {
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
-  kvcacheset_t * temp24 = get_cache_set(cache, key);
-  pthread_rwlock_rdlock(&temp24->lock);
-  int x =  kvcacheset_get(temp24, key, value);
-  pthread_rwlock_unlock(&temp24->lock);
-  return x;
+  return kvcacheset_get(get_cache_set(cache, hash), key, hash, value);
+}
+
+/* Attempts to retrieve KEY from CACHE without copying its value. If
+ * successful, returns 0 and stores a reference to the chunk holding the value
+ * inside VALUE; VALUE->data may be read until the reference is dropped with
+ * kvchunk_release. Otherwise, returns a negative error code. Takes no lock. */
+int kvcache_get_chunk(kvcache_t *cache, char *key, kvchunk_t **value) {
+  return kvcache_get_chunk_hashed(cache, key, kvhash_key(key), value);
+}
+
+/* As kvcache_get_chunk, for a KEY whose kvhash_key is HASH. */
+int kvcache_get_chunk_hashed(kvcache_t *cache, char *key, uint64_t hash,
+    kvchunk_t **value) {
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  return kvcacheset_get_chunk(get_cache_set(cache, hash), key, hash, value);
 }
 
 /* Attempts to place the given KEY, VALUE entry into CACHE. Returns 0 if
  * successful, else a negative error code. */
 int kvcache_put(kvcache_t *cache, char *key, char *value) {
+  return kvcache_put_hashed(cache, key, kvhash_key(key), value);
+}
+
+/* As kvcache_put, for a KEY whose kvhash_key is HASH. */
+int kvcache_put_hashed(kvcache_t *cache, char *key, uint64_t hash,
+    char *value) {
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERRVALLEN;
-  kvcacheset_t * temp24 = get_cache_set(cache, key);
+  kvcacheset_t * temp24 = get_cache_set(cache, hash);
   pthread_rwlock_wrlock(&temp24->lock);
-  int x =  kvcacheset_put(temp24, key, value);
+  int x =  kvcacheset_put(temp24, key, hash, value);
   pthread_rwlock_unlock(&temp24->lock);
   return x;
 }
@@ -63,21 +100,126 @@ int kvcache_put(kvcache_t *cache, char *key, char *value) {
 /* Attempts to delete the given KEY from CACHE. Returns 0 if successful, else a
  * negative error code. */
 int kvcache_del(kvcache_t *cache, char *key) {
+  return kvcache_del_hashed(cache, key, kvhash_key(key));
+}
+
+/* As kvcache_del, for a KEY whose kvhash_key is HASH. */
+int kvcache_del_hashed(kvcache_t *cache, char *key, uint64_t hash) {
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
-  kvcacheset_t * temp24 = get_cache_set(cache, key);
+  kvcacheset_t * temp24 = get_cache_set(cache, hash);
   pthread_rwlock_wrlock(&temp24->lock);
-  int x =  kvcacheset_del(temp24, key);
+  int x =  kvcacheset_del(temp24, key, hash);
   pthread_rwlock_unlock(&temp24->lock);
   return x;
 }
 
+/* Hands the dirty write of KEY and VALUE, or the deletion of KEY if VALUE is
+ * NULL, to the write-ahead function of CACHE, if it has one. Must be called
+ * with the set of KEY write-locked. Returns 0 if successful, else a negative
+ * error code. */
+static int kvcache_write_ahead(kvcache_t *cache, char *key, char *value) {
+  int ret;
+  if (cache->write_ahead == NULL)
+    return 0;
+  ret = cache->write_ahead(key, value, cache->write_ahead_aux);
+  return ret < 0 ? ret : -ret;
+}
+
+/* Places the given KEY, VALUE entry into CACHE as a dirty entry, which is
+ * written back before it leaves the cache. Returns 0 if successful, else a
+ * negative error code. */
+int kvcache_put_dirty(kvcache_t *cache, char *key, char *value) {
+  return kvcache_put_dirty_hashed(cache, key, kvhash_key(key), value);
+}
+
+/* As kvcache_put_dirty, for a KEY whose kvhash_key is HASH. */
+int kvcache_put_dirty_hashed(kvcache_t *cache, char *key, uint64_t hash,
+    char *value) {
+  kvcacheset_t *cacheset;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (strlen(value) > MAX_VALLEN)
+    return ERRVALLEN;
+  cacheset = get_cache_set(cache, hash);
+  pthread_rwlock_wrlock(&cacheset->lock);
+  if ((ret = kvcache_write_ahead(cache, key, value)) == 0)
+    ret = kvcacheset_put_dirty(cacheset, key, hash, value);
+  pthread_rwlock_unlock(&cacheset->lock);
+  return ret;
+}
+
+/* Holds KEY in CACHE as deleted until the deletion is written back. GETs of
+ * KEY return ERRDELETED meanwhile. Returns 0 if successful, else a negative
+ * error code. */
+int kvcache_del_dirty(kvcache_t *cache, char *key) {
+  return kvcache_del_dirty_hashed(cache, key, kvhash_key(key));
+}
+
+/* As kvcache_del_dirty, for a KEY whose kvhash_key is HASH. */
+int kvcache_del_dirty_hashed(kvcache_t *cache, char *key, uint64_t hash) {
+  kvcacheset_t *cacheset;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  cacheset = get_cache_set(cache, hash);
+  pthread_rwlock_wrlock(&cacheset->lock);
+  if ((ret = kvcache_write_ahead(cache, key, NULL)) == 0)
+    ret = kvcacheset_del_dirty(cacheset, key, hash);
+  pthread_rwlock_unlock(&cacheset->lock);
+  return ret;
+}
+
+/* Makes every set of CACHE write its dirty entries back by calling
+ * WRITE_BACK with AUX. */
+void kvcache_set_write_back(kvcache_t *cache, kvwriteback_t write_back,
+    void *aux) {
+  unsigned int i;
+  for (i = 0; i < cache->num_sets; i++) {
+    pthread_rwlock_wrlock(&cache->sets[i].lock);
+    cache->sets[i].write_back = write_back;
+    cache->sets[i].write_back_aux = aux;
+    pthread_rwlock_unlock(&cache->sets[i].lock);
+  }
+}
+
+/* Makes CACHE hand every dirty write to WRITE_AHEAD, along with AUX, before
+ * making it, with the set of its key write-locked. A write which
+ * WRITE_AHEAD fails is not made. Must not be called while CACHE is in use. */
+void kvcache_set_write_ahead(kvcache_t *cache, kvwriteback_t write_ahead,
+    void *aux) {
+  cache->write_ahead = write_ahead;
+  cache->write_ahead_aux = aux;
+}
+
+/* Writes back every dirty entry of CACHE, one set at a time, each set being
+ * write-locked while its entries are written. Sets without dirty entries are
+ * skipped without taking their lock. Returns 0 if successful, else the first
+ * error encountered; every set is flushed regardless. */
+int kvcache_flush(kvcache_t *cache) {
+  kvcacheset_t *cacheset;
+  unsigned int i;
+  int ret = 0, err;
+  for (i = 0; i < cache->num_sets; i++) {
+    cacheset = &cache->sets[i];
+    if (__atomic_load_n(&cacheset->num_dirty, __ATOMIC_RELAXED) == 0)
+      continue;
+    pthread_rwlock_wrlock(&cacheset->lock);
+    err = kvcacheset_flush(cacheset);
+    pthread_rwlock_unlock(&cacheset->lock);
+    if (err != 0 && ret == 0)
+      ret = err;
+  }
+  return ret;
+}
+
 /* Returns the read-write lock associated with a given KEY within CACHE. Each
  * cache set has a separate lock. */
 pthread_rwlock_t *kvcache_getlock(kvcache_t *cache, char *key) {
   if (strlen(key) > MAX_KEYLEN)
     return NULL;
-  return &get_cache_set(cache, key)->lock;
+  return &get_cache_set(cache, kvhash_key(key))->lock;
 }
 
 /* Completely clears this cache. For testing purposes. */
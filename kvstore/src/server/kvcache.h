@@ -11,9 +11,9 @@
  * of entries in the cache. Each KVCacheSet maintains separate data structures;
  * thus, entries in different cache sets can be accessed/modified concurrently.
  * However, entries in the same cache set must be modified sequentially. This
- * is achieved using a read-write lock maintained by each cache set. The lock 
- * should be acquired/released from whoever will be calling the cache methods 
- * (i.e. KVServer and, later, TPCMaster).
+ * is achieved using a read-write lock maintained by each cache set, which
+ * kvcache_put and kvcache_del write-lock. kvcache_get takes no lock at all;
+ * the cache set detects and retries lookups which overlap a modification.
  *
  * The cache uses a second-chance replacement policy implemented within each
  * cache set.  You can think of this as a FIFO queue, where the entry that has
@@ -25,6 +25,25 @@
  * the front of the queue. Once an entry with a reference bit of false is
  * reached, evict that entry.  If an entry with a reference bit of true is
  * seen, set its reference bit to false, and move it to the back of the queue.
+ * Each cache set implements this queue as a CLOCK: a hand sweeping a fixed
+ * ring of slots, where the slot behind the hand is the back of the queue.
+ *
+ * Second chance is only the default. A cache initialized with
+ * kvcache_init_policy may instead use ARC or W-TinyLFU in every set, which
+ * keep frequently used entries when a scan goes through the cache; see
+ * kvpolicy.h.
+ *
+ * A key is hashed once per operation with kvhash_key: the high half of the
+ * hash picks its set, and the low half its place in the set's index. Callers
+ * which already hold a key's hash may pass it to the _hashed variants.
+ *
+ * A cache given a kvwriteback_t with kvcache_set_write_back can hold writes
+ * which have not reached the store yet: kvcache_put_dirty and
+ * kvcache_del_dirty leave their entry dirty until kvcache_flush, or its
+ * eviction, writes it back (see kvcacheset.h). A kvwriteback_t given with
+ * kvcache_set_write_ahead is called with each dirty write first, while its
+ * set is write-locked, so that writes to a key reach it in the order they
+ * reach the cache.
  */
 
 /* A KVCache. */
@@ -32,14 +51,36 @@ typedef struct {
   unsigned int num_sets;        /* The number of sets within this cache. */
   unsigned int elem_per_set;    /* The max number of elements that can be stored within each set. */
   kvcacheset_t *sets;           /* An array of all of the sets used in this cache. */
+  kvpolicy_type_t policy;       /* The replacement policy of every set. */
+  kvwriteback_t write_ahead;    /* Logs dirty writes before they are made, or NULL. */
+  void *write_ahead_aux;        /* Passed to WRITE_AHEAD. */
 } kvcache_t;
 
 int kvcache_init(kvcache_t *, unsigned int num_sets, unsigned int elem_per_set);
+int kvcache_init_policy(kvcache_t *, unsigned int num_sets,
+    unsigned int elem_per_set, kvpolicy_type_t policy);
 
 int kvcache_get(kvcache_t *, char *key, char **value);
+int kvcache_get_chunk(kvcache_t *, char *key, kvchunk_t **value);
 int kvcache_put(kvcache_t *, char *key, char *value);
 int kvcache_del(kvcache_t *, char *key);
 
+int kvcache_get_hashed(kvcache_t *, char *key, uint64_t hash, char **value);
+int kvcache_get_chunk_hashed(kvcache_t *, char *key, uint64_t hash,
+    kvchunk_t **value);
+int kvcache_put_hashed(kvcache_t *, char *key, uint64_t hash, char *value);
+int kvcache_del_hashed(kvcache_t *, char *key, uint64_t hash);
+
+int kvcache_put_dirty(kvcache_t *, char *key, char *value);
+int kvcache_del_dirty(kvcache_t *, char *key);
+int kvcache_put_dirty_hashed(kvcache_t *, char *key, uint64_t hash,
+    char *value);
+int kvcache_del_dirty_hashed(kvcache_t *, char *key, uint64_t hash);
+void kvcache_set_write_back(kvcache_t *, kvwriteback_t write_back, void *aux);
+void kvcache_set_write_ahead(kvcache_t *, kvwriteback_t write_ahead,
+    void *aux);
+int kvcache_flush(kvcache_t *);
+
 pthread_rwlock_t *kvcache_getlock(kvcache_t *, char *key);
 
 void kvcache_clear(kvcache_t *);
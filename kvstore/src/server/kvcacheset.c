@@ -1,166 +1,452 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdbool.h>
-#include "uthash.h"
-#include "utlist.h"
+#include <stdlib.h>
+#include <string.h>
 #include "kvconstants.h"
 #include "kvcacheset.h"
-#include <string.h>
+#include "kvhash.h"
+
+/* Marks the start of a modification to CACHESET. Concurrent GETs will retry
+ * until the matching kvcacheset_write_end. */
+static void kvcacheset_write_begin(kvcacheset_t *cacheset) {
+    __atomic_store_n(&cacheset->seq, cacheset->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/* Marks the end of a modification to CACHESET. */
+static void kvcacheset_write_end(kvcacheset_t *cacheset) {
+    __atomic_store_n(&cacheset->seq, cacheset->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Returns the length of the string held by CHUNK, clamped to the capacity of
+ * its class in case a concurrent writer is reusing the chunk. */
+static size_t kvcacheset_chunk_len(kvchunk_t *chunk) {
+    size_t len = __atomic_load_n(&chunk->length, __ATOMIC_RELAXED);
+    return len < chunk->cls->capacity ? len : chunk->cls->capacity - 1;
+}
+
+/* Returns true if CHUNK holds STR, of length LEN. Never reads past the end
+ * of CHUNK. */
+static bool kvcacheset_chunk_equals(kvchunk_t *chunk, char *str, size_t len) {
+    if (chunk == NULL)
+        return false;
+    return kvcacheset_chunk_len(chunk) == len
+        && kvhash_equals(chunk->data, str, len);
+}
+
+/* Returns the slot number holding KEY, of length KEYLEN and hash H, in
+ * CACHESET, or -1 if it is not present. Safe to call without the lock as long
+ * as the result is validated against SEQ afterwards. */
+static int kvcacheset_find(kvcacheset_t *cacheset, char *key, size_t keylen,
+        uint64_t h) {
+    unsigned int pos = h & cacheset->index_mask, i;
+    int slot;
+    for (i = 0; i <= cacheset->index_mask; i++) {
+        slot = cacheset->index[pos];
+        if (slot < 0 || slot >= (int) cacheset->elem_per_set)
+            return -1;
+        if (cacheset->entries[slot].hash == h
+                && kvcacheset_chunk_equals(__atomic_load_n(
+                    &cacheset->entries[slot].key, __ATOMIC_RELAXED), key, keylen))
+            return slot;
+        pos = (pos + 1) & cacheset->index_mask;
+    }
+    return -1;
+}
+
+/* Returns the position within the index of CACHESET which refers to SLOT. */
+static unsigned int kvcacheset_index_pos(kvcacheset_t *cacheset, int slot) {
+    unsigned int pos = cacheset->entries[slot].hash & cacheset->index_mask;
+    while (cacheset->index[pos] != slot)
+        pos = (pos + 1) & cacheset->index_mask;
+    return pos;
+}
+
+/* Inserts SLOT into the index of CACHESET. */
+static void kvcacheset_index_add(kvcacheset_t *cacheset, int slot) {
+    unsigned int pos = cacheset->entries[slot].hash & cacheset->index_mask;
+    while (cacheset->index[pos] >= 0)
+        pos = (pos + 1) & cacheset->index_mask;
+    cacheset->index[pos] = slot;
+}
+
+/* Removes SLOT from the index of CACHESET. Later members of the probe run are
+ * shifted back so that lookups never need tombstones. */
+static void kvcacheset_index_remove(kvcacheset_t *cacheset, int slot) {
+    unsigned int mask = cacheset->index_mask;
+    unsigned int hole = kvcacheset_index_pos(cacheset, slot), pos = hole, home;
+    cacheset->index[hole] = -1;
+    while (true) {
+        pos = (pos + 1) & mask;
+        if (cacheset->index[pos] < 0)
+            return;
+        home = cacheset->entries[cacheset->index[pos]].hash & mask;
+        /* Leave the member alone if its home lies cyclically in (hole, pos]. */
+        if ((hole <= pos) ? (hole < home && home <= pos)
+                : (hole < home || home <= pos))
+            continue;
+        cacheset->index[hole] = cacheset->index[pos];
+        cacheset->index[pos] = -1;
+        hole = pos;
+    }
+}
+
+/* Marks ENTRY of CACHESET dirty or clean, as given by DIRTY. NUM_DIRTY is
+ * read without the lock by kvcache_flush. */
+static void kvcacheset_mark(kvcacheset_t *cacheset, struct kvcacheentry *entry,
+        bool dirty) {
+    if (entry->dirty != dirty)
+        __atomic_store_n(&cacheset->num_dirty,
+            cacheset->num_dirty + (dirty ? 1 : -1), __ATOMIC_RELAXED);
+    entry->dirty = dirty;
+}
+
+/* Empties SLOT of CACHESET, removes it from the index and drops the set's
+ * references to its key and value. The chunk pointers are left in place;
+ * lock-free readers may still follow them, which is safe as chunk memory is
+ * type-stable. */
+static void kvcacheset_evict_slot(kvcacheset_t *cacheset, int slot) {
+    struct kvcacheentry *entry = &cacheset->entries[slot];
+    kvcacheset_index_remove(cacheset, slot);
+    kvchunk_release(entry->key);
+    if (entry->value != NULL)
+        kvchunk_release(entry->value);
+    kvcacheset_mark(cacheset, entry, false);
+    entry->valid = false;
+    cacheset->num_entries -= 1;
+}
+
+/* Hands the dirty entry in SLOT of CACHESET to the set's write-back function,
+ * and marks it clean if that succeeds. Returns 0 if successful, else a
+ * negative error code. */
+static int kvcacheset_write_back(kvcacheset_t *cacheset, int slot) {
+    struct kvcacheentry *entry = &cacheset->entries[slot];
+    int ret;
+    if (cacheset->write_back == NULL)
+        return -1;
+    ret = cacheset->write_back(entry->key->data,
+        entry->value != NULL ? entry->value->data : NULL,
+        cacheset->write_back_aux);
+    if (ret != 0)
+        return ret < 0 ? ret : -ret;
+    kvcacheset_mark(cacheset, entry, false);
+    return 0;
+}
+
+/* Picks the slot of the full CACHESET to evict to make room for the key whose
+ * kvhash_key is H, writing its entry back first if it is dirty. Returns the
+ * slot, or a negative error code if the entry could not be written back, in
+ * which case it stays in the set. */
+static int kvcacheset_victim(kvcacheset_t *cacheset, uint64_t h) {
+    int slot = kvpolicy_evict(&cacheset->policy, h), ret;
+    if (cacheset->entries[slot].dirty
+            && (ret = kvcacheset_write_back(cacheset, slot)) != 0) {
+        kvpolicy_insert(&cacheset->policy, slot, cacheset->entries[slot].hash);
+        return ret;
+    }
+    return slot;
+}
 
-/* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements.
- * ELEM_PER_SET must be at least 2.
+/* Replays the reads buffered by the policy of CACHESET if a GET finds the
+ * buffer filling up, unless a writer holds the lock, in which case it will
+ * drain the buffer itself. */
+static void kvcacheset_touch(kvcacheset_t *cacheset, int slot, uint64_t h) {
+    if (kvpolicy_touch(&cacheset->policy, slot, h)
+            && pthread_rwlock_trywrlock(&cacheset->lock) == 0) {
+        kvpolicy_drain(&cacheset->policy);
+        pthread_rwlock_unlock(&cacheset->lock);
+    }
+}
+
+/* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements, evicting
+ * with the CLOCK policy. ELEM_PER_SET must be at least 2.
  * Returns 0 if successful, else a negative error code. */
 int kvcacheset_init(kvcacheset_t *cacheset, unsigned int elem_per_set) {
+    return kvcacheset_init_policy(cacheset, elem_per_set, KVPOLICY_CLOCK);
+}
+
+/* Initializes CACHESET to hold a maximum of ELEM_PER_SET elements, evicting
+ * with POLICY. ELEM_PER_SET must be at least 2.
+ * Returns 0 if successful, else a negative error code. */
+int kvcacheset_init_policy(kvcacheset_t *cacheset, unsigned int elem_per_set,
+        kvpolicy_type_t policy) {
+    unsigned int index_size = 1;
     int ret;
     if (elem_per_set < 2)
         return -1;
     cacheset->elem_per_set = elem_per_set;
     if ((ret = pthread_rwlock_init(&cacheset->lock, NULL)) < 0)
         return ret;
-    cacheset->num_entries = 0;
-    cacheset->last = NULL;
-    cacheset->first = NULL;
+    /* Keep the index at most half full so probe runs stay short. */
+    while (index_size < 2 * elem_per_set)
+        index_size <<= 1;
+    cacheset->entries = calloc(elem_per_set, sizeof(struct kvcacheentry));
+    cacheset->index = malloc(index_size * sizeof(int));
+    cacheset->free_slots = malloc(elem_per_set * sizeof(int));
+    if (cacheset->entries == NULL || cacheset->index == NULL
+            || cacheset->free_slots == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+    if ((ret = kvslab_init(&cacheset->slab)) < 0)
+        goto error;
+    if ((ret = kvpolicy_init(&cacheset->policy, policy, elem_per_set)) != 0) {
+        kvslab_destroy(&cacheset->slab);
+        goto error;
+    }
+    cacheset->index_mask = index_size - 1;
+    cacheset->seq = 0;
+    cacheset->write_back = NULL;
+    cacheset->write_back_aux = NULL;
+    kvcacheset_clear(cacheset);
     return 0;
+
+error:
+    free(cacheset->entries);
+    free(cacheset->index);
+    free(cacheset->free_slots);
+    pthread_rwlock_destroy(&cacheset->lock);
+    return ret;
 }
 
 
-/* Get the entry corresponding to KEY from CACHESET. Returns 0 if successful,
- * else returns a negative error code. If successful, populates VALUE with a
- * malloced string which should later be freed. */
-int kvcacheset_get(kvcacheset_t *cacheset, char *key, char **value) {
-    //printf("in get.\n");
-    struct kvcacheentry *temp = cacheset->last;
-    if (!temp) {
+/* Get the entry corresponding to KEY, whose kvhash_key is H, from CACHESET.
+ * Returns 0 if successful, ERRDELETED if KEY is held as deleted, else
+ * returns a negative error code. If successful, populates VALUE with a
+ * malloced string which should later be freed. Takes no lock; if a writer
+ * modifies the set during the lookup, the lookup is retried. */
+int kvcacheset_get(kvcacheset_t *cacheset, char *key, uint64_t h,
+        char **value) {
+    char buf[MAX_VALLEN + 1];
+    size_t keylen = strlen(key);
+    unsigned int seq;
+    kvchunk_t *chunk;
+    size_t len = 0;
+    int slot;
+    do {
+        while ((seq = __atomic_load_n(&cacheset->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        slot = kvcacheset_find(cacheset, key, keylen, h);
+        chunk = NULL;
+        if (slot >= 0) {
+            chunk = __atomic_load_n(&cacheset->entries[slot].value,
+                __ATOMIC_RELAXED);
+            if (chunk != NULL) {
+                len = kvcacheset_chunk_len(chunk);
+                memcpy(buf, chunk->data, len);
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&cacheset->seq, __ATOMIC_RELAXED) != seq);
+    if (slot < 0) {
+        kvpolicy_miss(&cacheset->policy, h);
         return ERRNOKEY;
     }
-    int i;
-    for(i=0; i<cacheset->num_entries; i++) {
-        if(strcmp(temp->key, key)==0) {
-            //printf("h1 - %s - %s - %s\n", temp->key, key, temp->value);
-            *value = malloc(sizeof(temp->value));
-            strcpy(*value, temp->value);
-            temp->refbit = true;
-            return 0;
-        }
-        if(temp->prev==NULL) {
+    kvcacheset_touch(cacheset, slot, h);
+    if (chunk == NULL)
+        return ERRDELETED;
+    *value = malloc(len + 1);
+    if (*value == NULL)
+        return ENOMEM;
+    memcpy(*value, buf, len);
+    (*value)[len] = '\0';
+    return 0;
+}
+
+/* Get the entry corresponding to KEY, whose kvhash_key is H, from CACHESET
+ * without copying it.
+ * Returns 0 if successful, ERRDELETED if KEY is held as deleted, else
+ * returns a negative error code. If successful, populates VALUE with a
+ * reference to the chunk holding the cached value, which stays valid even if the entry is later overwritten or
+ * evicted. The caller must drop it with kvchunk_release. Takes no lock. */
+int kvcacheset_get_chunk(kvcacheset_t *cacheset, char *key, uint64_t h,
+        kvchunk_t **value) {
+    size_t keylen = strlen(key);
+    unsigned int seq;
+    kvchunk_t *chunk = NULL;
+    int slot;
+    while (true) {
+        while ((seq = __atomic_load_n(&cacheset->seq, __ATOMIC_ACQUIRE)) & 1)
+            ;
+        slot = kvcacheset_find(cacheset, key, keylen, h);
+        if (slot >= 0)
+            chunk = __atomic_load_n(&cacheset->entries[slot].value,
+                __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&cacheset->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+        if (slot < 0) {
+            kvpolicy_miss(&cacheset->policy, h);
             return ERRNOKEY;
-        } else {
-            temp = temp->prev;
         }
-    }
-    return ERRNOKEY;
-}
-
-/* Add the given KEY, VALUE pair to CACHESET. Returns 0 if successful, else
- * returns a negative error code. Should evict elements if necessary to not
- * exceed CACHESET->elem_per_set total entries. */
-int kvcacheset_put(kvcacheset_t *cacheset, char *key, char *value) {
-    // check if the size fits
-    if ((cacheset->num_entries)==(cacheset->elem_per_set)) {
-        /*iterate through each entry, beginning at the first and evict the first one with refbit false. */
-        int i;
-        struct kvcacheentry *temp1 = cacheset->first;
-        for(i=0; i<cacheset->num_entries; i++) {
-            if (temp1->refbit) {
-                temp1->refbit = false;
-                temp1 = temp1->next;
-                if(!temp1) {
-                    i=0;
-                    temp1 = cacheset->first;
-                }
-            } else {
-                kvcacheset_del(cacheset, temp1->key);
-                break;
-            }
+        if (chunk == NULL) {
+            kvcacheset_touch(cacheset, slot, h);
+            return ERRDELETED;
         }
+        /* The chunk may have been released since it was read; only keep the
+         * reference if the set still held it once the reference was taken. */
+        if (!kvchunk_tryhold(chunk))
+            continue;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&cacheset->seq, __ATOMIC_RELAXED) == seq)
+            break;
+        kvchunk_release(chunk);
     }
-    
-    int i;
-    struct kvcacheentry *temp1 = cacheset->first;
-    for(i=0; i<cacheset->num_entries; i++) {
-        if (strcmp(temp1->key, key)==0) {
-            temp1->value = realloc(temp1->value, sizeof(value));
-            strcpy(temp1->value, value);
-            return 0;
-        }
+    kvcacheset_touch(cacheset, slot, h);
+    *value = chunk;
+    return 0;
+}
+
+/* Stores VALUE for KEY, whose kvhash_key is H, in CACHESET, as a dirty
+ * entry if DIRTY, and as deleted if VALUE is NULL. A clean write leaves a
+ * dirty entry for KEY alone. Returns 0 if successful, else returns a
+ * negative error code. Evicts an entry, writing it back if it is dirty, if
+ * the set is full. */
+static int kvcacheset_store(kvcacheset_t *cacheset, char *key, uint64_t h,
+        char *value, bool dirty) {
+    struct kvcacheentry *entry;
+    kvchunk_t *keychunk = NULL, *valchunk = NULL, *old;
+    size_t keylen = strlen(key);
+    bool evict = false;
+    int slot;
+    if (keylen > MAX_KEYLEN)
+        return ERRKEYLEN;
+    if (value != NULL && strlen(value) > MAX_VALLEN)
+        return ERRVALLEN;
+    /* Writers are serialized by the set lock, so the lookup and allocations
+     * can happen before readers are made to wait. */
+    slot = kvcacheset_find(cacheset, key, keylen, h);
+    if (slot >= 0 && !dirty && cacheset->entries[slot].dirty)
+        return 0;
+    if (value != NULL
+            && (valchunk = kvslab_alloc(&cacheset->slab, value)) == NULL)
+        return ENOMEM;
+    kvpolicy_drain(&cacheset->policy);
+    if (slot >= 0) {
+        /* Overwriting an existing entry counts as a reference. */
+        entry = &cacheset->entries[slot];
+        old = entry->value;
+        kvcacheset_write_begin(cacheset);
+        __atomic_store_n(&entry->value, valchunk, __ATOMIC_RELAXED);
+        kvcacheset_write_end(cacheset);
+        kvcacheset_mark(cacheset, entry, dirty);
+        kvpolicy_access(&cacheset->policy, slot);
+        if (old != NULL)
+            kvchunk_release(old);
+        return 0;
     }
-    
-    //printf("hello!!\n");
-    struct kvcacheentry* temp = malloc(sizeof(struct kvcacheentry));
-    //printf("hello2!!%d %d %s\n", sizeof(key), sizeof(*key), key);
-    temp->key = malloc(sizeof(key));
-    strcpy(temp->key, key);
-    temp->value = malloc(sizeof(value));
-    strcpy(temp->value, value);
-    //printf("hello3!! %s\n", temp->key);
-    temp->refbit = false;
-    temp->next = NULL;
-    
-    if(cacheset->num_entries==0) {
-        temp->prev = NULL;
-        cacheset->first = temp;
-        cacheset->last = temp;
+    if ((keychunk = kvslab_alloc(&cacheset->slab, key)) == NULL) {
+        if (valchunk != NULL)
+            kvchunk_release(valchunk);
+        return ENOMEM;
+    }
+    /* Any write-back of the victim happens before readers are made to wait. */
+    if (cacheset->num_free > 0) {
+        slot = cacheset->free_slots[--cacheset->num_free];
+    } else if ((slot = kvcacheset_victim(cacheset, h)) < 0) {
+        kvchunk_release(keychunk);
+        if (valchunk != NULL)
+            kvchunk_release(valchunk);
+        return slot;
     } else {
-        temp->prev = cacheset->last;
-        cacheset->last->next = temp;
+        evict = true;
     }
-    cacheset->last = temp;
+    kvcacheset_write_begin(cacheset);
+    if (evict)
+        kvcacheset_evict_slot(cacheset, slot);
+    entry = &cacheset->entries[slot];
+    __atomic_store_n(&entry->key, keychunk, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->value, valchunk, __ATOMIC_RELAXED);
+    entry->hash = h;
+    entry->valid = true;
+    kvcacheset_index_add(cacheset, slot);
     cacheset->num_entries += 1;
-    //printf("reached end of put successfully.\n");
+    kvpolicy_insert(&cacheset->policy, slot, h);
+    kvcacheset_write_end(cacheset);
+    kvcacheset_mark(cacheset, entry, dirty);
     return 0;
 }
 
-/* Deletes the entry corresponding to KEY from CACHESET. Returns 0 if
- * successful, else returns a negative error code. */
-int kvcacheset_del(kvcacheset_t *cacheset, char *key) {
-    int i;
-    struct kvcacheentry *temp1 = cacheset->first;
-    for(i=0; i<cacheset->num_entries; i++) {
-        if (!temp1) {
-            return -1;
-        }
-        if (strcmp(temp1->key, key)==0) {
-            if (temp1->prev) {
-                //printf("%s\n", temp1->prev->key);
-                temp1->prev->next=temp1->next;
-            }
-            if (temp1->next) {
-                temp1->next->prev = temp1->prev;
-            }
-            if (strcmp(temp1->key, cacheset->first->key)==0) {
-                cacheset->first = temp1->next;
-            }
-            if (strcmp(temp1->key, cacheset->last->key)==0) {
-                cacheset->last = temp1->prev;
-            }
-            cacheset->num_entries -= 1;
-            free(temp1->key);
-            free(temp1->value);
-            free(temp1);
-            //printf("reaches end of del.\n");
-            return 0;
-        } else {
-            temp1 = temp1->next;
-        }
+/* Add the given KEY, VALUE pair to CACHESET, where H is the kvhash_key of
+ * KEY. Returns 0 if successful, else returns a negative error code. Should
+ * evict elements if necessary to not exceed CACHESET->elem_per_set total
+ * entries. The entry is clean; if KEY is held by a dirty entry, it is left
+ * as it is. */
+int kvcacheset_put(kvcacheset_t *cacheset, char *key, uint64_t h,
+        char *value) {
+    return kvcacheset_store(cacheset, key, h, value, false);
+}
+
+/* As kvcacheset_put, but stores VALUE as a dirty entry, which will be handed
+ * to the set's write-back function before it leaves the set. */
+int kvcacheset_put_dirty(kvcacheset_t *cacheset, char *key, uint64_t h,
+        char *value) {
+    if (value == NULL)
+        return ERRINVLDMSG;
+    return kvcacheset_store(cacheset, key, h, value, true);
+}
+
+/* Holds KEY, whose kvhash_key is H, in CACHESET as a dirty deleted entry,
+ * whose deletion will be handed to the set's write-back function before it
+ * leaves the set. Returns 0 if successful, else a negative error code. */
+int kvcacheset_del_dirty(kvcacheset_t *cacheset, char *key, uint64_t h) {
+    return kvcacheset_store(cacheset, key, h, NULL, true);
+}
+
+/* Hands every dirty entry of CACHESET to its write-back function, as a
+ * single batch, and marks them clean. Returns 0 if successful, else the
+ * first error returned by the write-back function; the entries it failed
+ * on stay dirty. Must be called with the set write-locked. */
+int kvcacheset_flush(kvcacheset_t *cacheset) {
+    unsigned int i;
+    int ret = 0, err;
+    for (i = 0; i < cacheset->elem_per_set && cacheset->num_dirty > 0; i++) {
+        if (!cacheset->entries[i].valid || !cacheset->entries[i].dirty)
+            continue;
+        if ((err = kvcacheset_write_back(cacheset, i)) != 0 && ret == 0)
+            ret = err;
     }
-    return -1;
+    return ret;
 }
 
-/* Completely clears this cache set. For testing purposes. */
+/* Deletes the entry corresponding to KEY, whose kvhash_key is H, from
+ * CACHESET. Returns 0 if successful, else returns a negative error code. A
+ * dirty entry is dropped without being written back. */
+int kvcacheset_del(kvcacheset_t *cacheset, char *key, uint64_t h) {
+    int slot = kvcacheset_find(cacheset, key, strlen(key), h);
+    if (slot < 0)
+        return -1;
+    kvpolicy_drain(&cacheset->policy);
+    kvpolicy_remove(&cacheset->policy, slot);
+    kvcacheset_write_begin(cacheset);
+    kvcacheset_evict_slot(cacheset, slot);
+    cacheset->free_slots[cacheset->num_free++] = slot;
+    kvcacheset_write_end(cacheset);
+    return 0;
+}
+
+/* Completely clears this cache set, dropping dirty entries without writing
+ * them back. For testing purposes. */
 void kvcacheset_clear(kvcacheset_t *cacheset) {
-    int i;
-    struct kvcacheentry *temp1 = cacheset->first;
-    for(i=0; i<cacheset->num_entries; i++) {
-        if(!temp1->next) {
-            free(temp1->key);
-            free(temp1->value);
-            free(temp1);
-            break;
+    unsigned int i;
+    kvcacheset_write_begin(cacheset);
+    for (i = 0; i <= cacheset->index_mask; i++)
+        cacheset->index[i] = -1;
+    for (i = 0; i < cacheset->elem_per_set; i++) {
+        if (cacheset->entries[i].valid) {
+            kvchunk_release(cacheset->entries[i].key);
+            if (cacheset->entries[i].value != NULL)
+                kvchunk_release(cacheset->entries[i].value);
         }
-        temp1 = temp1->next;
-        free(temp1->prev->key);
-        free(temp1->prev->value);
-        free(temp1->prev);
+        cacheset->entries[i].valid = false;
+        cacheset->entries[i].dirty = false;
+        /* Push in reverse so slots are handed out in ring order. */
+        cacheset->free_slots[i] = cacheset->elem_per_set - 1 - i;
     }
+    cacheset->num_free = cacheset->elem_per_set;
     cacheset->num_entries = 0;
-}
\ No newline at end of file
+    __atomic_store_n(&cacheset->num_dirty, 0, __ATOMIC_RELAXED);
+    kvpolicy_clear(&cacheset->policy);
+    kvcacheset_write_end(cacheset);
+}
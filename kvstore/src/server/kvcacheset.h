@@ -3,44 +3,97 @@
 
 #include <pthread.h>
 #include <stdbool.h>
-#include "uthash.h"
+#include <stdint.h>
+#include "kvconstants.h"
+#include "kvpolicy.h"
+#include "kvslab.h"
 
 /* KVCacheSet represents a single distinct set of elements within a KVCache.
  *
- * Elements within a KVCacheSet may not be accessed/modified concurrently. The
- * read-write lock within the KVCacheSet struct should be used to enforce this.
- * The lock should be acquired/released from whoever will be calling the 
- * cache methods (i.e. KVServer and, later, TPCMaster).
+ * Entries live in a contiguous array of ELEM_PER_SET slots. Which entry is
+ * evicted when the set is full is left to the set's KVPolicy, which orders the
+ * slots as it sees fit: CLOCK (second chance, see kvcache.h) by default, or
+ * ARC or W-TinyLFU if the set is initialized with kvcacheset_init_policy (see
+ * kvpolicy.h). Keys are located through an open-addressing
+ * (linear probing) index of slot numbers, so lookups are O(1) regardless of
+ * ELEM_PER_SET. The index is addressed by the low bits of the key's
+ * kvhash_key, which the caller computes once and passes in; KVCache picks
+ * the set from its high bits.
  *
- * A KVCacheSet may not store more than ELEM_PER_SET entries. The eviction
- * policy used is the second-chance algorithm. See kvcache.h for more details
- * on this algorithm.
+ * Modifications (PUT, DEL, clear) may not run concurrently. The read-write
+ * lock within the KVCacheSet struct should be write-locked by whoever calls
+ * those methods (i.e. KVCache). GETs take no lock at all: writers bump SEQ to
+ * an odd value while they modify the set and back to an even value when done,
+ * and a GET that overlaps a write simply retries. A GET reports its hit or
+ * miss to the policy through kvpolicy_touch and kvpolicy_miss, which take no
+ * lock either; reads buffered by the policy are replayed by the next writer.
+ *
+ * Keys and values are held in reference-counted chunks allocated from the
+ * set's own KVSlab, so a PUT does no malloc once the slab has warmed up.
+ * Slots and the index are allocated once at init and chunk memory is never
+ * unmapped, so a GET racing with a writer may read stale data but never
+ * touches freed memory; every read of a chunk is bounded by its class
+ * capacity. kvcacheset_get_chunk hands out a reference to the cached value
+ * chunk itself instead of copying it.
+ *
+ * A set may also hold writes which have not reached the store yet (write-
+ * back). kvcacheset_put_dirty and kvcacheset_del_dirty mark their entry
+ * dirty; a deleted key is kept as an entry without a value, which GETs
+ * report as ERRDELETED rather than ERRNOKEY, so that callers do not go on to
+ * read the key from the store. Dirty entries are handed to the set's
+ * kvwriteback_t, with the set write-locked, when kvcacheset_flush is called
+ * and before they are evicted; an entry whose write-back fails stays dirty
+ * and is not evicted. A clean PUT never replaces a dirty entry, which is
+ * newer than anything read from the store.
  */
 
+/* Called with the KEY and VALUE of a dirty entry, or a NULL VALUE if KEY was
+ * deleted, and the AUX given along with it, to write the entry back to the
+ * store. Returns 0 if successful, else a negative error code. */
+typedef int (*kvwriteback_t)(char *key, char *value, void *aux);
+
 /* An entry within the KVCacheSet. */
 struct kvcacheentry {
-  char *key;                      /* The entry's key. */
-  char *value;                    /* The entry's value. */
-  bool refbit;                    /* Used to determine if this entry has been used. */
-  struct kvcacheentry *next;	  /* Stores the next entry in the list. */
-  struct kvcacheentry *prev;	  /* Stores the previous entry in the list. */
+  kvchunk_t *key;                 /* The entry's key. */
+  kvchunk_t *value;               /* The entry's value, or NULL if its key was deleted. */
+  uint64_t hash;                  /* The kvhash_key of KEY, used by the index. */
+  bool valid;                     /* True if this slot currently holds an entry. */
+  bool dirty;                     /* True if the entry has not been written back yet. */
 };
 
 /* A KVCacheSet. */
 typedef struct {
   unsigned int elem_per_set;      /* The max number of elements which can be stored in this set. */
-  pthread_rwlock_t lock;          /* The lock which can be used to lock this set. */
+  pthread_rwlock_t lock;          /* The lock which writers use to lock this set. */
   int num_entries;                /* The current number of entries in this set. */
-  struct kvcacheentry *last;	  /* Stores the last entry. */
-  struct kvcacheentry *first;	  /* Stores the first entry. */
+  unsigned int seq;               /* Odd while a writer is modifying this set. */
+  struct kvcacheentry *entries;   /* The ELEM_PER_SET entry slots. */
+  int *index;                     /* Open-addressing table of slot numbers, -1 if empty. */
+  unsigned int index_mask;        /* The size of INDEX minus one (a power of two). */
+  kvpolicy_t policy;              /* Picks the entry to evict when the set is full. */
+  int *free_slots;                /* Stack of slots which hold no entry. */
+  int num_free;                   /* The number of slots in FREE_SLOTS. */
+  kvslab_t slab;                  /* Allocates the chunks holding keys and values. */
+  unsigned int num_dirty;         /* The number of dirty entries in this set. */
+  kvwriteback_t write_back;       /* Writes dirty entries back, or NULL if there are none. */
+  void *write_back_aux;           /* Passed to WRITE_BACK. */
 } kvcacheset_t;
 
 int kvcacheset_init(kvcacheset_t *, unsigned int elem_per_set);
+int kvcacheset_init_policy(kvcacheset_t *, unsigned int elem_per_set,
+    kvpolicy_type_t policy);
+
+int kvcacheset_get(kvcacheset_t *, char *key, uint64_t hash, char **value);
+int kvcacheset_get_chunk(kvcacheset_t *, char *key, uint64_t hash,
+    kvchunk_t **value);
+int kvcacheset_put(kvcacheset_t *, char *key, uint64_t hash, char *value);
+int kvcacheset_del(kvcacheset_t *, char *key, uint64_t hash);
 
-int kvcacheset_get(kvcacheset_t *, char *key, char **value);
-int kvcacheset_put(kvcacheset_t *, char *key, char *value);
-int kvcacheset_del(kvcacheset_t *, char *key);
+int kvcacheset_put_dirty(kvcacheset_t *, char *key, uint64_t hash,
+    char *value);
+int kvcacheset_del_dirty(kvcacheset_t *, char *key, uint64_t hash);
+int kvcacheset_flush(kvcacheset_t *);
 
 void kvcacheset_clear(kvcacheset_t *);
 
-#endif
\ No newline at end of file
+#endif
@@ -8,6 +8,9 @@
 #define MAX_KEYLEN 1024
 #define MAX_VALLEN 1024
 
+/* Maximum number of entries in a batch message. */
+#define MAX_BATCHLEN 1024
+
 /* Maximum length for a file name. */
 #define MAX_FILENAME 1024
 
@@ -39,7 +42,16 @@ typedef enum {
   VOTE_COMMIT,
   VOTE_ABORT,
   REGISTER,
-  INFO
+  INFO,
+  DEREGISTER,
+  MIGRATE,
+  TRANSFER,
+  MGETREQ,
+  MPUTREQ,
+  MDELREQ,
+  MGETRESP,
+  SCANREQ,
+  SCANRESP
 } msgtype_t;
 
 /* Possible TPC states. */
@@ -66,5 +78,7 @@ typedef enum {
 #define ERRFILCRT -16
 /* Error returned if error was encountered accessing a file. */
 #define ERRFILACCESS -17
+/* Error returned by a cache which holds a key as deleted (see kvcacheset.h). */
+#define ERRDELETED -18
 
 #endif
@@ -0,0 +1,104 @@
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "kvhash.h"
+
+/* The constants the state is mixed with, from wyhash. */
+#define KVHASH_P0 0xa0761d6478bd642fULL
+#define KVHASH_P1 0xe7037ed1a0b428dbULL
+#define KVHASH_P2 0x8ebc6af09c88c6e3ULL
+#define KVHASH_P3 0x589965cc75374cc3ULL
+
+/* Multiplies A by B into 128 bits, returning the XOR of both halves. */
+static uint64_t kvhash_mix(uint64_t a, uint64_t b) {
+  __uint128_t r = (__uint128_t) a * b;
+  return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/* Reads 8 bytes from P, which need not be aligned. */
+static uint64_t kvhash_read64(const uint8_t *p) {
+  uint64_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Reads 4 bytes from P, which need not be aligned. */
+static uint64_t kvhash_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+/* Returns the 64-bit hash of the LEN bytes at DATA under SEED. */
+uint64_t kvhash(const void *data, size_t len, uint64_t seed) {
+  const uint8_t *p = data;
+  uint64_t a, b, s1, s2;
+  size_t i = len, mid;
+  seed ^= kvhash_mix(seed ^ KVHASH_P0, KVHASH_P1);
+  if (len <= 16) {
+    if (len >= 4) {
+      mid = (len >> 3) << 2;
+      a = (kvhash_read32(p) << 32) | kvhash_read32(p + mid);
+      b = (kvhash_read32(p + len - 4) << 32) | kvhash_read32(p + len - 4 - mid);
+    } else if (len > 0) {
+      a = ((uint64_t) p[0] << 16) | ((uint64_t) p[len >> 1] << 8) | p[len - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (i > 48) {
+      s1 = s2 = seed;
+      do {
+        seed = kvhash_mix(kvhash_read64(p) ^ KVHASH_P1,
+            kvhash_read64(p + 8) ^ seed);
+        s1 = kvhash_mix(kvhash_read64(p + 16) ^ KVHASH_P2,
+            kvhash_read64(p + 24) ^ s1);
+        s2 = kvhash_mix(kvhash_read64(p + 32) ^ KVHASH_P3,
+            kvhash_read64(p + 40) ^ s2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= s1 ^ s2;
+    }
+    while (i > 16) {
+      seed = kvhash_mix(kvhash_read64(p) ^ KVHASH_P1,
+          kvhash_read64(p + 8) ^ seed);
+      p += 16;
+      i -= 16;
+    }
+    /* The last 16 bytes, which may overlap those already read. */
+    a = kvhash_read64(p + i - 16);
+    b = kvhash_read64(p + i - 8);
+  }
+  return kvhash_mix(KVHASH_P1 ^ len, kvhash_mix(a ^ KVHASH_P1, b ^ seed));
+}
+
+/* Returns the hash of the string KEY under KVHASH_SEED. */
+uint64_t kvhash_key(char *key) {
+  return kvhash(key, strlen(key), KVHASH_SEED);
+}
+
+/* Returns true if the LEN bytes at A and B are equal. */
+bool kvhash_equals(const char *a, const char *b, size_t len) {
+  uint64_t x1, x2, y1, y2;
+  if (len >= 8 && len <= 16) {
+    memcpy(&x1, a, 8);
+    memcpy(&y1, b, 8);
+    memcpy(&x2, a + len - 8, 8);
+    memcpy(&y2, b + len - 8, 8);
+    return ((x1 ^ y1) | (x2 ^ y2)) == 0;
+  }
+#ifdef __SSE2__
+  if (len > 16 && len <= 32) {
+    __m128i lo = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) a),
+        _mm_loadu_si128((const __m128i *) b));
+    __m128i hi = _mm_cmpeq_epi8(
+        _mm_loadu_si128((const __m128i *) (a + len - 16)),
+        _mm_loadu_si128((const __m128i *) (b + len - 16)));
+    return _mm_movemask_epi8(_mm_and_si128(lo, hi)) == 0xFFFF;
+  }
+#endif
+  return memcmp(a, b, len) == 0;
+}
@@ -0,0 +1,37 @@
+#ifndef __KV_HASH__
+#define __KV_HASH__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* KVHash is the hash function used to place keys in memory: in the sets of a
+ * KVCache and their indexes, in a KVStore's bloom filter and, for stores of
+ * format KVSTORE_FORMAT_KVHASH, in the names of entry files.
+ *
+ * The hash follows the design of wyhash: the key is read eight bytes at a
+ * time, and each pair of words is folded into the state by a 64x64->128 bit
+ * multiplication whose halves are XORed together. Keys of up to 16 bytes are
+ * read with a few overlapping loads and no loop at all. Every bit of the
+ * result depends on every bit of the key, so any of its bits may be used to
+ * pick a set or a slot.
+ *
+ * The hash is seeded. KVHASH_SEED is the seed of kvhash_key, which must stay
+ * fixed since the hash names files on disk; tables private to a process may
+ * use a seed of their own with kvhash.
+ *
+ * kvhash_equals compares two keys of known, equal length. Keys of up to 32
+ * bytes, which are most of them, are compared with two overlapping loads of
+ * 8 or 16 bytes from each (SSE2 registers where available) rather than a loop;
+ * longer keys fall back to memcmp, which the C library vectorizes.
+ */
+
+/* The seed of kvhash_key. */
+#define KVHASH_SEED 0x2d358dccaa6c78a5ULL
+
+uint64_t kvhash(const void *data, size_t len, uint64_t seed);
+uint64_t kvhash_key(char *key);
+
+bool kvhash_equals(const char *a, const char *b, size_t len);
+
+#endif
@@ -0,0 +1,117 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvhist.h"
+
+/* Returns the bucket holding VALUE in a histogram keeping SUB_BITS bits of
+ * precision. */
+unsigned int kvhist_bucket(uint64_t value, unsigned int sub_bits) {
+  uint64_t half = 1ULL << (sub_bits - 1);
+  unsigned int shift;
+  if (value < 2 * half)
+    return value;
+  shift = 63 - __builtin_clzll(value) - sub_bits + 1;
+  return shift * half + (value >> shift);
+}
+
+/* Returns the largest value which falls in BUCKET of a histogram keeping
+ * SUB_BITS bits of precision. */
+uint64_t kvhist_bucket_max(unsigned int bucket, unsigned int sub_bits) {
+  uint64_t half = 1ULL << (sub_bits - 1);
+  unsigned int shift;
+  if (bucket < 2 * half)
+    return bucket;
+  shift = bucket / half - 1;
+  /* The top bucket wraps around to UINT64_MAX. */
+  return ((bucket - shift * half + 1) << shift) - 1;
+}
+
+/* Returns the value which PERCENTILE percent of the TOTAL values counted in
+ * COUNTS, the buckets of a histogram keeping SUB_BITS bits of precision, are
+ * at or below, rounded up to the top of its bucket but never above MAX, the
+ * largest value counted. Returns 0 if TOTAL is 0. */
+uint64_t kvhist_bucket_percentile(uint64_t *counts, unsigned int sub_bits,
+    uint64_t total, uint64_t max, double percentile) {
+  uint64_t rank, seen = 0, value;
+  double exact;
+  unsigned int i;
+  if (total == 0)
+    return 0;
+  if (percentile > 100)
+    percentile = 100;
+  exact = percentile / 100 * total;
+  rank = (uint64_t) exact;
+  if (rank < exact || rank == 0)
+    rank++;
+  for (i = 0; i < KVHIST_BUCKETS(sub_bits) - 1; i++) {
+    seen += counts[i];
+    if (seen >= rank)
+      break;
+  }
+  value = kvhist_bucket_max(i, sub_bits);
+  return value < max ? value : max;
+}
+
+/* Initializes HIST, an empty histogram. Returns 0 if successful, else a
+ * negative error code. */
+int kvhist_init(kvhist_t *hist) {
+  hist->counts = calloc(KVHIST_NUM_BUCKETS, sizeof(uint64_t));
+  if (hist->counts == NULL)
+    return ENOMEM;
+  kvhist_reset(hist);
+  return 0;
+}
+
+/* Records VALUE in HIST. */
+void kvhist_record(kvhist_t *hist, uint64_t value) {
+  hist->counts[kvhist_bucket(value, KVHIST_SUB_BITS)]++;
+  hist->total++;
+  hist->sum += value;
+  if (value < hist->min)
+    hist->min = value;
+  if (value > hist->max)
+    hist->max = value;
+}
+
+/* Adds every value recorded in SRC to DST. */
+void kvhist_merge(kvhist_t *dst, kvhist_t *src) {
+  unsigned int i;
+  for (i = 0; i < KVHIST_NUM_BUCKETS; i++)
+    dst->counts[i] += src->counts[i];
+  dst->total += src->total;
+  dst->sum += src->sum;
+  if (src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+}
+
+/* Returns the value which PERCENTILE percent of the values recorded in HIST
+ * are at or below, rounded up to the top of its bucket but never above the
+ * largest value recorded. Returns 0 if HIST is empty. */
+uint64_t kvhist_percentile(kvhist_t *hist, double percentile) {
+  return kvhist_bucket_percentile(hist->counts, KVHIST_SUB_BITS, hist->total,
+      hist->max, percentile);
+}
+
+/* Returns the mean of the values recorded in HIST, or 0 if it is empty. */
+double kvhist_mean(kvhist_t *hist) {
+  if (hist->total == 0)
+    return 0;
+  return (double) hist->sum / hist->total;
+}
+
+/* Forgets every value recorded in HIST. */
+void kvhist_reset(kvhist_t *hist) {
+  memset(hist->counts, 0, KVHIST_NUM_BUCKETS * sizeof(uint64_t));
+  hist->total = 0;
+  hist->min = UINT64_MAX;
+  hist->max = 0;
+  hist->sum = 0;
+}
+
+/* Frees the buckets of HIST. */
+void kvhist_destroy(kvhist_t *hist) {
+  free(hist->counts);
+  hist->counts = NULL;
+}
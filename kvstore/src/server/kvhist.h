@@ -0,0 +1,60 @@
+#ifndef __KV_HIST__
+#define __KV_HIST__
+
+#include <stdint.h>
+
+/* KVHist is a latency histogram in the style of HdrHistogram: it records
+ * values from 0 up to UINT64_MAX in a fixed amount of memory, and reports
+ * percentiles of them to within a fixed relative precision.
+ *
+ * Values below 2^KVHIST_SUB_BITS each get a bucket of their own. Above that,
+ * each power of two is split into 2^(KVHIST_SUB_BITS - 1) equal buckets, so
+ * a value is only ever reported as at most 1/2^(KVHIST_SUB_BITS - 1) above
+ * its true value: with the default of 8 bits, latencies are exact up to 255
+ * units and within 0.8% beyond. A value is placed with a single
+ * count-leading-zeros and a shift, so recording is cheap enough to do on
+ * every request.
+ *
+ * A histogram is not locked. Each thread of a benchmark keeps its own and
+ * they are added together with kvhist_merge once the run is over.
+ *
+ * The bucketing itself is exposed, for any number of bits of precision, so
+ * that coarser histograms kept elsewhere (see kvstats.h) share it, and the
+ * percentiles read from them.
+ */
+
+/* The number of bits of precision kept of each value. */
+#define KVHIST_SUB_BITS 8
+
+/* The number of buckets of a histogram keeping SUB_BITS bits of precision. */
+#define KVHIST_BUCKETS(sub_bits) ((64 - (sub_bits) + 2) << ((sub_bits) - 1))
+
+/* The number of buckets of a KVHist. */
+#define KVHIST_NUM_BUCKETS KVHIST_BUCKETS(KVHIST_SUB_BITS)
+
+/* A KVHist. */
+typedef struct {
+  uint64_t *counts;         /* The number of values in each bucket. */
+  uint64_t total;           /* The number of values recorded. */
+  uint64_t min;             /* The smallest value recorded, or UINT64_MAX. */
+  uint64_t max;             /* The largest value recorded. */
+  long double sum;          /* The sum of the values recorded. */
+} kvhist_t;
+
+unsigned int kvhist_bucket(uint64_t value, unsigned int sub_bits);
+uint64_t kvhist_bucket_max(unsigned int bucket, unsigned int sub_bits);
+uint64_t kvhist_bucket_percentile(uint64_t *counts, unsigned int sub_bits,
+    uint64_t total, uint64_t max, double percentile);
+
+int kvhist_init(kvhist_t *);
+
+void kvhist_record(kvhist_t *, uint64_t value);
+void kvhist_merge(kvhist_t *dst, kvhist_t *src);
+
+uint64_t kvhist_percentile(kvhist_t *, double percentile);
+double kvhist_mean(kvhist_t *);
+
+void kvhist_reset(kvhist_t *);
+void kvhist_destroy(kvhist_t *);
+
+#endif
@@ -0,0 +1,341 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/stat.h>
+#include "kvindex.h"
+
+/* Allocates a node holding a copy of KEY with LEVEL levels. Returns the node,
+ * or NULL if out of memory. */
+static kvindexnode_t *kvindex_node_new(char *key, unsigned int level) {
+  kvindexnode_t *node;
+  node = calloc(1, sizeof(kvindexnode_t) + level * sizeof(kvindexnode_t *));
+  if (node == NULL)
+    return NULL;
+  node->level = level;
+  if (key != NULL) {
+    if ((node->key = malloc(strlen(key) + 1)) == NULL) {
+      free(node);
+      return NULL;
+    }
+    strcpy(node->key, key);
+  }
+  return node;
+}
+
+/* Picks the number of levels of a new node of INDEX. */
+static unsigned int kvindex_random_level(kvindex_t *index) {
+  unsigned int level = 1;
+  while (level < KVINDEX_MAX_LEVEL
+      && rand_r(&index->seed) % KVINDEX_BRANCHING == 0)
+    level++;
+  return level;
+}
+
+/* Descends INDEX to the last node at each level whose key is below KEY, or
+ * not above it if INCLUSIVE is false, storing them in UPDATE unless it is
+ * NULL. Returns the last such node on the bottom level. */
+static kvindexnode_t *kvindex_descend(kvindex_t *index, char *key,
+    bool inclusive, kvindexnode_t **update) {
+  kvindexnode_t *node = index->head, *next;
+  int i, cmp;
+  for (i = index->level - 1; i >= 0; i--) {
+    while ((next = node->next[i]) != NULL) {
+      cmp = strcmp(next->key, key);
+      if (cmp > 0 || (cmp == 0 && inclusive))
+        break;
+      node = next;
+    }
+    if (update != NULL)
+      update[i] = node;
+  }
+  return node;
+}
+
+/* Adds KEY to the skiplist of INDEX, setting *ADDED to whether it was not
+ * already present. Returns 0 if successful, else an error code. */
+static int kvindex_add(kvindex_t *index, char *key, bool *added) {
+  kvindexnode_t *update[KVINDEX_MAX_LEVEL], *node;
+  unsigned int level, i;
+  *added = false;
+  node = kvindex_descend(index, key, true, update)->next[0];
+  if (node != NULL && strcmp(node->key, key) == 0)
+    return 0;
+  level = kvindex_random_level(index);
+  if ((node = kvindex_node_new(key, level)) == NULL)
+    return ENOMEM;
+  for (i = index->level; i < level; i++)
+    update[i] = index->head;
+  if (level > index->level)
+    index->level = level;
+  for (i = 0; i < level; i++) {
+    node->next[i] = update[i]->next[i];
+    update[i]->next[i] = node;
+  }
+  index->size++;
+  *added = true;
+  return 0;
+}
+
+/* Removes KEY from the skiplist of INDEX. Returns 1 if it was removed, else
+ * 0 if it was not present. */
+static int kvindex_delete(kvindex_t *index, char *key) {
+  kvindexnode_t *update[KVINDEX_MAX_LEVEL], *node;
+  unsigned int i;
+  node = kvindex_descend(index, key, true, update)->next[0];
+  if (node == NULL || strcmp(node->key, key) != 0)
+    return 0;
+  for (i = 0; i < node->level; i++)
+    update[i]->next[i] = node->next[i];
+  while (index->level > 1 && index->head->next[index->level - 1] == NULL)
+    index->level--;
+  free(node->key);
+  free(node);
+  index->size--;
+  return 1;
+}
+
+/* Writes a record of OP on KEY to FD. Returns 0 if successful, else a
+ * negative error code. */
+static int kvindex_write_record(int fd, char op, char *key) {
+  char record[1 + sizeof(uint32_t) + MAX_KEYLEN];
+  uint32_t length = strlen(key), netlength = htonl(length);
+  size_t size = 1 + sizeof(uint32_t) + length, done = 0;
+  ssize_t n;
+  if (length > MAX_KEYLEN)
+    return ERRKEYLEN;
+  record[0] = op;
+  memcpy(record + 1, &netlength, sizeof(uint32_t));
+  memcpy(record + 1 + sizeof(uint32_t), key, length);
+  while (done < size) {
+    n = write(fd, record + done, size - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return ERRFILACCESS;
+    done += n;
+  }
+  return 0;
+}
+
+/* Replays the file of INDEX into its skiplist, truncating away a torn
+ * record at its tail. Returns 0 if successful, else a negative error code. */
+static int kvindex_load(kvindex_t *index) {
+  char header[1 + sizeof(uint32_t)], key[MAX_KEYLEN + 1];
+  uint32_t length;
+  off_t good = 0;
+  bool added;
+  FILE *file;
+  int ret = 0;
+  if ((file = fopen(index->filename, "r")) == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && fread(header, sizeof(header), 1, file) == 1) {
+    memcpy(&length, header + 1, sizeof(uint32_t));
+    length = ntohl(length);
+    if (length > MAX_KEYLEN || (header[0] != KVINDEX_ADD
+        && header[0] != KVINDEX_DEL))
+      break;
+    if (length > 0 && fread(key, length, 1, file) != 1)
+      break;
+    key[length] = '\0';
+    if (header[0] == KVINDEX_ADD)
+      ret = kvindex_add(index, key, &added);
+    else
+      kvindex_delete(index, key);
+    index->records++;
+    good += sizeof(header) + length;
+  }
+  fclose(file);
+  if (ret != 0)
+    return ret;
+  if (truncate(index->filename, good) == -1)
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Rewrites the file of INDEX to hold only a record for each of its keys.
+ * Returns 0 if successful, else a negative error code. */
+static int kvindex_compact(kvindex_t *index) {
+  char tmpname[MAX_FILENAME + 4];
+  kvindexnode_t *node;
+  int fd, ret = 0;
+  sprintf(tmpname, "%s.tmp", index->filename);
+  fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+  if (fd == -1)
+    return ERRFILACCESS;
+  for (node = index->head->next[0]; node != NULL && ret == 0;
+      node = node->next[0])
+    ret = kvindex_write_record(fd, KVINDEX_ADD, node->key);
+  if (ret == 0 && (fsync(fd) == -1 || rename(tmpname, index->filename) == -1))
+    ret = ERRFILACCESS;
+  if (ret != 0) {
+    close(fd);
+    remove(tmpname);
+    return ret;
+  }
+  close(index->fd);
+  index->fd = fd;
+  index->records = index->size;
+  return 0;
+}
+
+/* Returns true if the file of INDEX holds enough dead records to be
+ * compacted. */
+static bool kvindex_should_compact(kvindex_t *index) {
+  return index->records >= KVINDEX_COMPACT_MIN
+      && index->records > KVINDEX_COMPACT_RATIO * index->size;
+}
+
+/* Initializes INDEX, persisted in FILENAME, loading the keys already in
+ * FILENAME if it exists. Sets *CREATED to whether FILENAME was newly
+ * created, in which case the index is empty. Returns 0 if successful, else a
+ * negative error code. */
+int kvindex_init(kvindex_t *index, char *filename, bool *created) {
+  struct stat st;
+  int ret;
+  if (strlen(filename) >= MAX_FILENAME)
+    return ERRFILLEN;
+  memset(index, 0, sizeof(kvindex_t));
+  strcpy(index->filename, filename);
+  index->level = 1;
+  index->seed = (unsigned int) getpid();
+  if ((index->head = kvindex_node_new(NULL, KVINDEX_MAX_LEVEL)) == NULL)
+    return ENOMEM;
+  pthread_rwlock_init(&index->lock, NULL);
+  *created = stat(filename, &st) == -1;
+  index->fd = open(filename, O_WRONLY | O_CREAT | O_APPEND, 0600);
+  if (index->fd == -1) {
+    free(index->head);
+    return ERRFILACCESS;
+  }
+  ret = kvindex_load(index);
+  if (ret == 0 && kvindex_should_compact(index))
+    ret = kvindex_compact(index);
+  if (ret != 0)
+    kvindex_destroy(index);
+  return ret;
+}
+
+/* Adds KEY to INDEX, doing nothing if it is already there. Returns 0 if
+ * successful, else a negative error code. */
+int kvindex_insert(kvindex_t *index, char *key) {
+  bool added;
+  int ret;
+  pthread_rwlock_wrlock(&index->lock);
+  ret = kvindex_add(index, key, &added);
+  if (ret == 0 && added) {
+    ret = kvindex_write_record(index->fd, KVINDEX_ADD, key);
+    if (ret == 0)
+      index->records++;
+    else
+      kvindex_delete(index, key);
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return ret;
+}
+
+/* Removes KEY from INDEX, doing nothing if it is not there. Compacts the
+ * file of INDEX if it has grown too long; if that fails, the file is left
+ * as it is, to be compacted by a later removal. Returns 0 if successful,
+ * else a negative error code. */
+int kvindex_remove(kvindex_t *index, char *key) {
+  int ret = 0;
+  pthread_rwlock_wrlock(&index->lock);
+  if (kvindex_delete(index, key)) {
+    ret = kvindex_write_record(index->fd, KVINDEX_DEL, key);
+    if (ret == 0)
+      index->records++;
+    if (ret == 0 && kvindex_should_compact(index))
+      kvindex_compact(index);
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return ret;
+}
+
+/* Finds the keys of INDEX from START, inclusive if INCLUSIVE is set, up to
+ * but excluding END, in order. START and END may be NULL to leave the range
+ * unbounded at that end. At most LIMIT keys are returned, unless LIMIT is 0.
+ * Points KEYS at a malloced array of NUM_KEYS malloced copies of the keys,
+ * all of which should be freed. Returns 0 if successful, else a negative
+ * error code. */
+int kvindex_range(kvindex_t *index, char *start, bool inclusive, char *end,
+    unsigned int limit, char ***keys, unsigned int *num_keys) {
+  kvindexnode_t *node;
+  unsigned int cap = 0;
+  char **tmp;
+  int ret = 0;
+  *keys = NULL;
+  *num_keys = 0;
+  pthread_rwlock_rdlock(&index->lock);
+  if (start == NULL)
+    node = index->head->next[0];
+  else
+    node = kvindex_descend(index, start, inclusive, NULL)->next[0];
+  for (; node != NULL && (limit == 0 || *num_keys < limit);
+      node = node->next[0]) {
+    if (end != NULL && strcmp(node->key, end) >= 0)
+      break;
+    if (*num_keys == cap) {
+      cap = (cap == 0) ? 16 : 2 * cap;
+      if ((tmp = realloc(*keys, cap * sizeof(char *))) == NULL) {
+        ret = ENOMEM;
+        break;
+      }
+      *keys = tmp;
+    }
+    if (((*keys)[*num_keys] = malloc(strlen(node->key) + 1)) == NULL) {
+      ret = ENOMEM;
+      break;
+    }
+    strcpy((*keys)[(*num_keys)++], node->key);
+  }
+  pthread_rwlock_unlock(&index->lock);
+  if (ret != 0) {
+    while (*num_keys > 0)
+      free((*keys)[--*num_keys]);
+    free(*keys);
+    *keys = NULL;
+  }
+  return ret;
+}
+
+/* Calls ITER with every key of INDEX, in order, and AUX, stopping early if
+ * ITER returns nonzero. INDEX is locked for reading throughout, so ITER must
+ * not modify it. Returns the nonzero value ITER returned, else 0. */
+int kvindex_iterate(kvindex_t *index, kvindex_iter_t iter, void *aux) {
+  kvindexnode_t *node;
+  int ret = 0;
+  pthread_rwlock_rdlock(&index->lock);
+  for (node = index->head->next[0]; node != NULL && ret == 0;
+      node = node->next[0])
+    ret = iter(node->key, aux);
+  pthread_rwlock_unlock(&index->lock);
+  return ret;
+}
+
+/* Returns the number of keys in INDEX. */
+unsigned int kvindex_size(kvindex_t *index) {
+  unsigned int size;
+  pthread_rwlock_rdlock(&index->lock);
+  size = index->size;
+  pthread_rwlock_unlock(&index->lock);
+  return size;
+}
+
+/* Frees the skiplist of INDEX and closes its file, which is left in place. */
+void kvindex_destroy(kvindex_t *index) {
+  kvindexnode_t *node, *next;
+  for (node = index->head; node != NULL; node = next) {
+    next = node->next[0];
+    free(node->key);
+    free(node);
+  }
+  index->head = NULL;
+  index->size = 0;
+  if (index->fd != -1)
+    close(index->fd);
+  index->fd = -1;
+}
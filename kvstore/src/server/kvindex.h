@@ -0,0 +1,89 @@
+#ifndef __KV_INDEX__
+#define __KV_INDEX__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "kvconstants.h"
+
+/* KVIndex is an ordered index of the keys held by a KVStore, which lets a
+ * store be scanned in key order although its entries are placed by hash.
+ *
+ * The keys are kept in memory in a skiplist, ordered by strcmp. Each node is
+ * given a random height of up to KVINDEX_MAX_LEVEL levels, each level being
+ * kept with probability 1/KVINDEX_BRANCHING, so a lookup, insertion or
+ * removal costs O(log n) expected comparisons, and a range is found with a
+ * single descent followed by a walk along the bottom level.
+ *
+ * The index is persisted in a single append-only file: every key added or
+ * removed appends a record holding the operation, the key's length as four
+ * bytes in network byte order, and the key itself (without its null
+ * terminator). kvindex_init replays the file, dropping a torn record at its
+ * tail. Whenever the file holds at least KVINDEX_COMPACT_MIN records and
+ * more than KVINDEX_COMPACT_RATIO records per live key, whether at
+ * kvindex_init or as keys are removed, it is rewritten holding only the live
+ * keys. The file is rewritten to a temporary file which is fsynced and then
+ * replaces it, so a crash never loses the index.
+ *
+ * Records are not fsynced as they are appended. A KVStore adds a key to its
+ * index before writing the entry, and removes it only after the entry is
+ * gone, so that if the process crashes the index may name keys the store
+ * lacks but never misses one. If the machine itself crashes, the records
+ * appended last may be lost, and the index may miss keys written shortly
+ * before the crash.
+ */
+
+/* The number of levels a node may have. */
+#define KVINDEX_MAX_LEVEL 24
+
+/* The inverse of the probability that a node reaches the next level up. */
+#define KVINDEX_BRANCHING 4
+
+/* The number of records per live key at which the file is compacted. */
+#define KVINDEX_COMPACT_RATIO 2
+
+/* The fewest records the file must hold before it is compacted. */
+#define KVINDEX_COMPACT_MIN 64
+
+/* The operations a record in the file may hold. */
+#define KVINDEX_ADD 'A'
+#define KVINDEX_DEL 'D'
+
+/* A single key in the skiplist. */
+typedef struct kvindexnode {
+  char *key;                        /* The key. */
+  unsigned int level;               /* The number of levels in NEXT. */
+  struct kvindexnode *next[];       /* The next node at each level. */
+} kvindexnode_t;
+
+/* A KVIndex. */
+typedef struct {
+  char filename[MAX_FILENAME];      /* The file the index is persisted in. */
+  int fd;                           /* FILENAME, opened for appending. */
+  pthread_rwlock_t lock;            /* Protects everything below. */
+  kvindexnode_t *head;              /* A sentinel node of KVINDEX_MAX_LEVEL levels. */
+  unsigned int level;               /* The number of levels in use. */
+  unsigned int size;                /* The number of keys in the index. */
+  unsigned int records;             /* The number of records in the file. */
+  unsigned int seed;                /* The state used to pick node heights. */
+} kvindex_t;
+
+/* Called by kvindex_iterate with each KEY in the index and the AUX passed
+ * in. A nonzero return value stops the iteration. */
+typedef int (*kvindex_iter_t)(char *key, void *aux);
+
+int kvindex_init(kvindex_t *, char *filename, bool *created);
+
+int kvindex_insert(kvindex_t *, char *key);
+int kvindex_remove(kvindex_t *, char *key);
+
+int kvindex_range(kvindex_t *, char *start, bool inclusive, char *end,
+    unsigned int limit, char ***keys, unsigned int *num_keys);
+
+int kvindex_iterate(kvindex_t *, kvindex_iter_t iter, void *aux);
+
+unsigned int kvindex_size(kvindex_t *);
+
+void kvindex_destroy(kvindex_t *);
+
+#endif
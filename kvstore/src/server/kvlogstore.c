@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include "kvlogstore.h"
+
+static void *kvlogstore_compactor(void *aux);
+
+/* Computes the FNV-1a checksum of a record with header HEADER, whose key and
+ * value are stored contiguously in DATA. */
+static uint32_t kvlogstore_checksum(kvlogrecord_t *header, char *data) {
+  uint32_t sum = 2166136261u;
+  uint32_t lengths[2] = {header->keylen, header->vallen};
+  unsigned char *p = (unsigned char *) lengths;
+  size_t i;
+  for (i = 0; i < sizeof(lengths); i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  p = (unsigned char *) data;
+  for (i = 0; i < header->keylen + header->vallen; i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  return sum;
+}
+
+/* Returns the total size of a record whose header is HEADER. */
+static off_t kvlogstore_record_size(kvlogrecord_t *header) {
+  return sizeof(kvlogrecord_t) + header->keylen + header->vallen;
+}
+
+/* Reads exactly SIZE bytes at OFFSET of FD into BUF, retrying on short reads.
+ * Returns 0 if successful, else -1. */
+static int kvlogstore_pread_full(int fd, void *buf, size_t size, off_t offset) {
+  ssize_t ret;
+  size_t done = 0;
+  while (done < size) {
+    ret = pread(fd, (char *) buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return -1;
+    done += ret;
+  }
+  return 0;
+}
+
+/* Writes exactly SIZE bytes of BUF at OFFSET of FD, retrying on short writes.
+ * Returns 0 if successful, else -1. */
+static int kvlogstore_pwrite_full(int fd, void *buf, size_t size, off_t offset) {
+  ssize_t ret;
+  size_t done = 0;
+  while (done < size) {
+    ret = pwrite(fd, (char *) buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return -1;
+    done += ret;
+  }
+  return 0;
+}
+
+/* Fills FILENAME with the path of the file named NAME within STORE's
+ * directory. Returns 0 if successful, or ERRFILLEN if the path does not fit
+ * in MAX_FILENAME. */
+static int kvlogstore_path(kvlogstore_t *store, char *filename,
+    const char *name) {
+  if (snprintf(filename, MAX_FILENAME, "%s/%s", store->dirname, name)
+      >= MAX_FILENAME)
+    return ERRFILLEN;
+  return 0;
+}
+
+/* Fills FILENAME with the path of the segment with the given ID within
+ * STORE. Returns 0 if successful, or ERRFILLEN if the path does not fit in
+ * MAX_FILENAME. */
+static int kvlogstore_segment_path(kvlogstore_t *store, char *filename,
+    unsigned int id) {
+  if (snprintf(filename, MAX_FILENAME, "%s/%u%s", store->dirname, id,
+      KVLOGSTORE_FILETYPE) >= MAX_FILENAME)
+    return ERRFILLEN;
+  return 0;
+}
+
+/* Opens (creating if necessary) the segment with the given ID within STORE,
+ * growing the segment table as needed. Returns 0 if successful, else a
+ * negative error code. */
+static int kvlogstore_open_segment(kvlogstore_t *store, unsigned int id) {
+  char filename[MAX_FILENAME];
+  kvlogsegment_t *segments;
+  struct stat st;
+  unsigned int i, num_segments;
+  int fd;
+  if (id >= store->num_segments) {
+    num_segments = (store->num_segments == 0) ? 8 : store->num_segments;
+    while (num_segments <= id) {
+      if (num_segments > UINT_MAX / 2)
+        return -ENOMEM;
+      num_segments *= 2;
+    }
+    segments = realloc(store->segments, num_segments * sizeof(kvlogsegment_t));
+    if (segments == NULL)
+      return -ENOMEM;
+    for (i = store->num_segments; i < num_segments; i++) {
+      segments[i].fd = -1;
+      segments[i].size = 0;
+      segments[i].dead = 0;
+    }
+    store->segments = segments;
+    store->num_segments = num_segments;
+  }
+  if (kvlogstore_segment_path(store, filename, id) != 0)
+    return ERRFILLEN;
+  if ((fd = open(filename, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR)) < 0)
+    return ERRFILACCESS;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return ERRFILACCESS;
+  }
+  store->segments[id].fd = fd;
+  store->segments[id].size = st.st_size;
+  store->segments[id].dead = 0;
+  return 0;
+}
+
+/* Seals the active segment of STORE and starts a new one. Wakes up the
+ * compaction thread, since the sealed segment may be eligible. Must be called
+ * with the write lock held. Returns 0 if successful, else a negative error
+ * code. */
+static int kvlogstore_roll(kvlogstore_t *store) {
+  int ret;
+  if ((ret = kvlogstore_open_segment(store, store->active + 1)) < 0)
+    return ret;
+  store->active++;
+  pthread_mutex_lock(&store->compact_lock);
+  store->compact_pending = true;
+  pthread_cond_signal(&store->compact_cond);
+  pthread_mutex_unlock(&store->compact_lock);
+  return 0;
+}
+
+/* Appends a record for KEY and VALUE to the active segment of STORE. A NULL
+ * VALUE appends a tombstone. The segment and offset the record was written to
+ * are stored in SEGMENT and OFFSET. Must be called with the write lock held.
+ * Returns 0 if successful, else a negative error code. */
+static int kvlogstore_append(kvlogstore_t *store, char *key, char *value,
+    unsigned int *segment, off_t *offset) {
+  kvlogrecord_t *record;
+  kvlogsegment_t *active;
+  size_t size;
+  int ret = 0;
+  uint32_t keylen = strlen(key) + 1;
+  uint32_t vallen = (value == NULL) ? 0 : strlen(value) + 1;
+  size = sizeof(kvlogrecord_t) + keylen + vallen;
+  record = malloc(size);
+  if (record == NULL)
+    return -ENOMEM;
+  record->keylen = keylen;
+  record->vallen = vallen;
+  memcpy((char *) (record + 1), key, keylen);
+  if (value != NULL)
+    memcpy((char *) (record + 1) + keylen, value, vallen);
+  record->checksum = kvlogstore_checksum(record, (char *) (record + 1));
+  active = &store->segments[store->active];
+  if (kvlogstore_pwrite_full(active->fd, record, size, active->size) < 0) {
+    free(record);
+    return ERRFILACCESS;
+  }
+  *segment = store->active;
+  *offset = active->size;
+  active->size += size;
+  free(record);
+  if (active->size >= KVLOGSTORE_SEGMENT_SIZE)
+    ret = kvlogstore_roll(store);
+  return ret;
+}
+
+/* Marks the record that ENTRY currently points to as dead. */
+static void kvlogstore_mark_dead(kvlogstore_t *store, kvlogindex_t *entry) {
+  store->segments[entry->segment].dead += sizeof(kvlogrecord_t)
+      + strlen(entry->key) + 1 + entry->vallen;
+}
+
+/* Points the index entry for KEY within STORE at the value of length VALLEN
+ * located in SEGMENT at OFFSET, creating the entry if needed. Returns 0 if
+ * successful, else a negative error code. */
+static int kvlogstore_index_put(kvlogstore_t *store, char *key,
+    unsigned int segment, off_t offset, uint32_t vallen) {
+  kvlogindex_t *entry;
+  HASH_FIND_STR(store->index, key, entry);
+  if (entry != NULL) {
+    kvlogstore_mark_dead(store, entry);
+  } else {
+    entry = malloc(sizeof(kvlogindex_t));
+    if (entry == NULL)
+      return -ENOMEM;
+    entry->key = malloc(strlen(key) + 1);
+    if (entry->key == NULL) {
+      free(entry);
+      return -ENOMEM;
+    }
+    strcpy(entry->key, key);
+    HASH_ADD_KEYPTR(hh, store->index, entry->key, strlen(entry->key), entry);
+  }
+  entry->segment = segment;
+  entry->offset = offset;
+  entry->vallen = vallen;
+  return 0;
+}
+
+/* Removes the index entry for KEY within STORE, if any. */
+static void kvlogstore_index_del(kvlogstore_t *store, char *key) {
+  kvlogindex_t *entry;
+  HASH_FIND_STR(store->index, key, entry);
+  if (entry == NULL)
+    return;
+  kvlogstore_mark_dead(store, entry);
+  HASH_DEL(store->index, entry);
+  free(entry->key);
+  free(entry);
+}
+
+/* Validates the record located at OFFSET within the SIZE bytes of segment
+ * data in BUF. Returns the size of the record if it is intact, else 0. */
+static off_t kvlogstore_check_record(char *buf, off_t size, off_t offset) {
+  kvlogrecord_t header;
+  char *data;
+  if (size - offset < (off_t) sizeof(kvlogrecord_t))
+    return 0;
+  memcpy(&header, buf + offset, sizeof(kvlogrecord_t));
+  if (header.keylen == 0 || header.keylen > MAX_KEYLEN + 1
+      || header.vallen > MAX_VALLEN + 1
+      || size - offset < kvlogstore_record_size(&header))
+    return 0;
+  data = buf + offset + sizeof(kvlogrecord_t);
+  if (data[header.keylen - 1] != '\0'
+      || (header.vallen > 0 && data[header.keylen + header.vallen - 1] != '\0'))
+    return 0;
+  if (kvlogstore_checksum(&header, data) != header.checksum)
+    return 0;
+  return kvlogstore_record_size(&header);
+}
+
+/* Reads the first SIZE bytes of the segment open on FD into malloc()d memory
+ * which should later be free()d. Returns NULL on error. */
+static char *kvlogstore_load_segment(int fd, off_t size) {
+  char *buf = malloc(size > 0 ? size : 1);
+  if (buf == NULL)
+    return NULL;
+  if (kvlogstore_pread_full(fd, buf, size, 0) < 0) {
+    free(buf);
+    return NULL;
+  }
+  return buf;
+}
+
+/* Replays every record of segment ID within STORE into the index. A torn or
+ * corrupted record ends the segment; the file is truncated at that point.
+ * Returns 0 if successful, else a negative error code. */
+static int kvlogstore_replay(kvlogstore_t *store, unsigned int id) {
+  kvlogsegment_t *segment = &store->segments[id];
+  kvlogrecord_t header;
+  off_t offset = 0, recsize;
+  char *buf, *key;
+  int ret = 0;
+  if (segment->size == 0)
+    return 0;
+  if ((buf = kvlogstore_load_segment(segment->fd, segment->size)) == NULL)
+    return ERRFILACCESS;
+  while (offset < segment->size) {
+    if ((recsize = kvlogstore_check_record(buf, segment->size, offset)) == 0)
+      break;
+    memcpy(&header, buf + offset, sizeof(kvlogrecord_t));
+    key = buf + offset + sizeof(kvlogrecord_t);
+    if (header.vallen > 0) {
+      ret = kvlogstore_index_put(store, key, id, offset, header.vallen);
+    } else {
+      kvlogstore_index_del(store, key);
+      segment->dead += recsize;
+    }
+    if (ret < 0)
+      break;
+    offset += recsize;
+  }
+  free(buf);
+  if (ret == 0 && offset < segment->size) {
+    if (ftruncate(segment->fd, offset) == -1)
+      ret = ERRFILACCESS;
+    segment->size = offset;
+  }
+  return ret;
+}
+
+/* Comparator used to sort segment IDs in increasing order. */
+static int kvlogstore_idcmp(const void *a, const void *b) {
+  unsigned int x = *(unsigned int *) a, y = *(unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/* Frees the index of STORE and closes its segments. */
+static void kvlogstore_release(kvlogstore_t *store) {
+  kvlogindex_t *entry, *tmp;
+  unsigned int i;
+  HASH_ITER(hh, store->index, entry, tmp) {
+    HASH_DEL(store->index, entry);
+    free(entry->key);
+    free(entry);
+  }
+  for (i = 0; i < store->num_segments; i++) {
+    if (store->segments[i].fd >= 0)
+      close(store->segments[i].fd);
+  }
+  free(store->segments);
+  store->segments = NULL;
+  store->num_segments = 0;
+}
+
+/* Initializes kvlogstore STORE. Uses DIRNAME as the directory in which to
+ * store the segments of this store, creating the directory if necessary. Any
+ * segments already present in DIRNAME are replayed to rebuild the index.
+ * Returns 0 if successful, else a negative error code. */
+int kvlogstore_init(kvlogstore_t *store, char *dirname) {
+  struct stat st;
+  struct dirent *dent;
+  DIR *dir;
+  unsigned int *ids = NULL, *tmp, num_ids = 0, last = 0, i;
+  size_t namelen, typelen = strlen(KVLOGSTORE_FILETYPE);
+  char *end;
+  int ret = 0;
+  if (strlen(dirname) >= MAX_FILENAME - 32)
+    return ERRFILLEN;
+  if (stat(dirname, &st) == -1) {
+    if (mkdir(dirname, 0700) == -1)
+      return -errno;
+  }
+  memset(store, 0, sizeof(kvlogstore_t));
+  strcpy(store->dirname, dirname);
+  pthread_rwlock_init(&store->lock, NULL);
+  pthread_mutex_init(&store->compact_lock, NULL);
+  pthread_mutex_init(&store->compact_run, NULL);
+  pthread_cond_init(&store->compact_cond, NULL);
+
+  if ((dir = opendir(dirname)) == NULL)
+    return ERRFILACCESS;
+  while ((dent = readdir(dir)) != NULL) {
+    namelen = strlen(dent->d_name);
+    if (namelen <= typelen
+        || strcmp(dent->d_name + namelen - typelen, KVLOGSTORE_FILETYPE) != 0)
+      continue;
+    tmp = realloc(ids, (num_ids + 1) * sizeof(unsigned int));
+    if (tmp == NULL) {
+      ret = -ENOMEM;
+      break;
+    }
+    ids = tmp;
+    ids[num_ids] = strtoul(dent->d_name, &end, 10);
+    if (end == dent->d_name + namelen - typelen)
+      num_ids++;
+  }
+  closedir(dir);
+  if (ret == 0)
+    qsort(ids, num_ids, sizeof(unsigned int), kvlogstore_idcmp);
+  for (i = 0; ret == 0 && i < num_ids; i++) {
+    if ((ret = kvlogstore_open_segment(store, ids[i])) == 0)
+      ret = kvlogstore_replay(store, ids[i]);
+    last = ids[i];
+  }
+  free(ids);
+  if (ret != 0) {
+    kvlogstore_release(store);
+    return ret;
+  }
+
+  if (num_ids == 0) {
+    ret = kvlogstore_open_segment(store, 0);
+    store->active = 0;
+  } else {
+    store->active = last;
+    if (store->segments[store->active].size >= KVLOGSTORE_SEGMENT_SIZE
+        && (ret = kvlogstore_open_segment(store, store->active + 1)) == 0)
+      store->active++;
+  }
+  if (ret < 0) {
+    kvlogstore_release(store);
+    return ret;
+  }
+  /* Segments left over from before a restart may already be worth compacting. */
+  store->compact_pending = true;
+  if ((ret = pthread_create(&store->compactor, NULL, kvlogstore_compactor,
+      store)) != 0) {
+    kvlogstore_release(store);
+    return -ret;
+  }
+  return 0;
+}
+
+/* Attempts to retrieve the entry denoted by KEY from STORE using a single
+ * read. Returns 0 if successful, else a negative error code. The entry's
+ * value will be placed into VALUE using malloc()d memory which should be
+ * free()d later. */
+int kvlogstore_get(kvlogstore_t *store, char *key, char **value) {
+  kvlogindex_t *entry;
+  size_t keylen = strlen(key);
+  int fd;
+  if (keylen > MAX_KEYLEN)
+    return ERRKEYLEN;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND_STR(store->index, key, entry);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRNOKEY;
+  }
+  *value = malloc(entry->vallen);
+  if (*value == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return -ENOMEM;
+  }
+  fd = store->segments[entry->segment].fd;
+  if (kvlogstore_pread_full(fd, *value, entry->vallen, entry->offset
+      + sizeof(kvlogrecord_t) + keylen + 1) < 0) {
+    pthread_rwlock_unlock(&store->lock);
+    free(*value);
+    *value = NULL;
+    return ERRFILACCESS;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return 0;
+}
+
+/* Returns true if STORE contains KEY, else false. Never touches disk. */
+bool kvlogstore_haskey(kvlogstore_t *store, char *key) {
+  kvlogindex_t *entry;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_FIND_STR(store->index, key, entry);
+  pthread_rwlock_unlock(&store->lock);
+  return entry != NULL;
+}
+
+/* Calls ITER with every live key in STORE, its value and AUX, in no
+ * particular order, stopping early if ITER returns nonzero. STORE is locked
+ * for reading throughout, so ITER must not modify it. Returns the nonzero
+ * value ITER returned, 0 once every key has been visited, or a negative error
+ * code if a value could not be read. */
+int kvlogstore_iterate(kvlogstore_t *store, kvlogstore_iter_t iter,
+    void *aux) {
+  kvlogindex_t *entry, *tmp;
+  char *value;
+  int ret = 0;
+  pthread_rwlock_rdlock(&store->lock);
+  HASH_ITER(hh, store->index, entry, tmp) {
+    if ((value = malloc(entry->vallen)) == NULL) {
+      ret = -ENOMEM;
+      break;
+    }
+    if (kvlogstore_pread_full(store->segments[entry->segment].fd, value,
+        entry->vallen, entry->offset + sizeof(kvlogrecord_t)
+        + strlen(entry->key) + 1) < 0) {
+      free(value);
+      ret = ERRFILACCESS;
+      break;
+    }
+    ret = iter(entry->key, value, aux);
+    free(value);
+    if (ret != 0)
+      break;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Appends the given KEY, VALUE entry to STORE. Returns 0 if successful, else
+ * a negative error code. Lengths are assumed to have been checked by the
+ * caller (see kvstore_put_check). */
+int kvlogstore_put(kvlogstore_t *store, char *key, char *value) {
+  unsigned int segment;
+  off_t offset;
+  int ret;
+  pthread_rwlock_wrlock(&store->lock);
+  ret = kvlogstore_append(store, key, value, &segment, &offset);
+  if (ret == 0)
+    ret = kvlogstore_index_put(store, key, segment, offset, strlen(value) + 1);
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Removes the given KEY entry from STORE by appending a tombstone. Returns 0
+ * if successful, else a negative error code. */
+int kvlogstore_del(kvlogstore_t *store, char *key) {
+  kvlogindex_t *entry;
+  unsigned int segment;
+  off_t offset;
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  pthread_rwlock_wrlock(&store->lock);
+  HASH_FIND_STR(store->index, key, entry);
+  if (entry == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRNOKEY;
+  }
+  ret = kvlogstore_append(store, key, NULL, &segment, &offset);
+  if (ret == 0) {
+    kvlogstore_index_del(store, key);
+    store->segments[segment].dead += sizeof(kvlogrecord_t) + strlen(key) + 1;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Rewrites the live records of segment ID into the active segment of STORE
+ * and removes segment ID. If ID is the active segment it is sealed first.
+ * Tombstones are carried forward unless no older segment remains which could
+ * still hold a value they shadow. If a record of segment ID cannot be read or
+ * copied, the segment is kept, along with the records not yet copied out of
+ * it. Returns 0 if successful, else a negative error code. */
+int kvlogstore_compact(kvlogstore_t *store, unsigned int id) {
+  char filename[MAX_FILENAME], *buf, *key;
+  kvlogrecord_t header;
+  kvlogindex_t *entry;
+  unsigned int i, segment;
+  off_t size, offset = 0, recsize, newoffset;
+  bool oldest = true;
+  int fd, ret = 0;
+
+  pthread_mutex_lock(&store->compact_run);
+  pthread_rwlock_wrlock(&store->lock);
+  if (id >= store->num_segments || store->segments[id].fd < 0) {
+    pthread_rwlock_unlock(&store->lock);
+    pthread_mutex_unlock(&store->compact_run);
+    return ERRFILACCESS;
+  }
+  if (id == store->active && (ret = kvlogstore_roll(store)) < 0) {
+    pthread_rwlock_unlock(&store->lock);
+    pthread_mutex_unlock(&store->compact_run);
+    return ret;
+  }
+  fd = store->segments[id].fd;
+  size = store->segments[id].size;
+  pthread_rwlock_unlock(&store->lock);
+
+  /* Sealed segments are immutable and only removed by a compaction, which
+   * COMPACT_RUN serializes, so they can be read without the lock. */
+  if ((buf = kvlogstore_load_segment(fd, size)) == NULL) {
+    pthread_mutex_unlock(&store->compact_run);
+    return ERRFILACCESS;
+  }
+
+  pthread_rwlock_wrlock(&store->lock);
+  for (i = 0; i < id; i++) {
+    if (store->segments[i].fd >= 0)
+      oldest = false;
+  }
+  while (ret == 0 && offset < size) {
+    if ((recsize = kvlogstore_check_record(buf, size, offset)) == 0)
+      break;
+    memcpy(&header, buf + offset, sizeof(kvlogrecord_t));
+    key = buf + offset + sizeof(kvlogrecord_t);
+    HASH_FIND_STR(store->index, key, entry);
+    if (header.vallen > 0) {
+      if (entry != NULL && entry->segment == id && entry->offset == offset) {
+        ret = kvlogstore_append(store, key, key + header.keylen, &segment,
+            &newoffset);
+        if (ret == 0) {
+          entry->segment = segment;
+          entry->offset = newoffset;
+          store->segments[id].dead += recsize;
+        }
+      }
+    } else if (entry == NULL && !oldest) {
+      ret = kvlogstore_append(store, key, NULL, &segment, &newoffset);
+      if (ret == 0)
+        store->segments[segment].dead += recsize;
+    }
+    offset += recsize;
+  }
+  if (ret == 0 && offset < size)
+    ret = ERRFILACCESS;
+  if (ret == 0) {
+    close(store->segments[id].fd);
+    store->segments[id].fd = -1;
+    store->segments[id].size = 0;
+    store->segments[id].dead = 0;
+    if (kvlogstore_segment_path(store, filename, id) != 0)
+      ret = ERRFILLEN;
+    else if (remove(filename) == -1)
+      ret = -errno;
+  }
+  pthread_rwlock_unlock(&store->lock);
+  pthread_mutex_unlock(&store->compact_run);
+  free(buf);
+  return ret;
+}
+
+/* Returns the ID of a sealed segment of STORE which is at least
+ * KVLOGSTORE_COMPACT_RATIO percent dead, or -1 if there is none. */
+static long kvlogstore_pick_victim(kvlogstore_t *store) {
+  kvlogsegment_t *segment;
+  unsigned int i;
+  long victim = -1;
+  pthread_rwlock_rdlock(&store->lock);
+  for (i = 0; i < store->active; i++) {
+    segment = &store->segments[i];
+    if (segment->fd >= 0 && segment->size > 0
+        && segment->dead * 100 >= segment->size * KVLOGSTORE_COMPACT_RATIO) {
+      victim = i;
+      break;
+    }
+  }
+  pthread_rwlock_unlock(&store->lock);
+  return victim;
+}
+
+/* Background thread which compacts sealed segments of the store AUX whenever
+ * one is sealed, until kvlogstore_clean is called. */
+static void *kvlogstore_compactor(void *aux) {
+  kvlogstore_t *store = (kvlogstore_t *) aux;
+  long victim;
+  while (true) {
+    pthread_mutex_lock(&store->compact_lock);
+    while (!store->compact_pending && !store->stopping)
+      pthread_cond_wait(&store->compact_cond, &store->compact_lock);
+    if (store->stopping) {
+      pthread_mutex_unlock(&store->compact_lock);
+      return NULL;
+    }
+    store->compact_pending = false;
+    pthread_mutex_unlock(&store->compact_lock);
+    while ((victim = kvlogstore_pick_victim(store)) >= 0) {
+      if (kvlogstore_compact(store, victim) < 0)
+        break;
+    }
+  }
+}
+
+/* Stops the compaction thread, deletes all segments in STORE and removes the
+ * store directory. */
+int kvlogstore_clean(kvlogstore_t *store) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  DIR *dir;
+
+  pthread_mutex_lock(&store->compact_lock);
+  store->stopping = true;
+  pthread_cond_signal(&store->compact_cond);
+  pthread_mutex_unlock(&store->compact_lock);
+  pthread_join(store->compactor, NULL);
+
+  pthread_rwlock_wrlock(&store->lock);
+  kvlogstore_release(store);
+  pthread_rwlock_unlock(&store->lock);
+
+  if ((dir = opendir(store->dirname)) == NULL)
+    return 0;
+  while ((dent = readdir(dir)) != NULL) {
+    if (kvlogstore_path(store, filename, dent->d_name) == 0)
+      remove(filename);
+  }
+  closedir(dir);
+  remove(store->dirname);
+  return 0;
+}
@@ -0,0 +1,101 @@
+#ifndef __KV_LOG_STORE__
+#define __KV_LOG_STORE__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "uthash.h"
+#include "kvconstants.h"
+
+/* KVLogStore is a log-structured alternative to the one-file-per-entry
+ * layout used by KVStore. It is selected with kvstore_init_backend.
+ *
+ * Entries are never rewritten in place. Every PUT and DEL is appended as a
+ * record to the active segment file within the store directory, named
+ *    sprintf(filename, "%u%s", segment_id, KVLOGSTORE_FILETYPE);
+ * Once the active segment grows past KVLOGSTORE_SEGMENT_SIZE it is sealed and
+ * a new segment with the next ID is started. Segment IDs increase
+ * monotonically, so replaying segments in ID order reproduces the store.
+ *
+ * An in-memory index maps each live key to the segment and offset of its most
+ * recent value, so a GET costs a single pread() and a miss costs no I/O. The
+ * index is rebuilt by scanning all segments at kvlogstore_init. A torn record
+ * at the tail of the newest segment (e.g. after a crash) is truncated away.
+ *
+ * Overwritten values and tombstones leave dead bytes behind in older
+ * segments. A background compaction thread copies the live records of any
+ * sealed segment which is at least KVLOGSTORE_COMPACT_RATIO percent dead into
+ * the active segment and then removes the old segment file.
+ */
+
+/* The filetype to append to the filenames of segments within the store. */
+#define KVLOGSTORE_FILETYPE ".seg"
+
+/* The size after which the active segment is sealed. */
+#define KVLOGSTORE_SEGMENT_SIZE (4 * 1024 * 1024)
+
+/* The percentage of dead bytes at which a sealed segment is compacted. */
+#define KVLOGSTORE_COMPACT_RATIO 50
+
+/* The on-disk header of a single record. It is followed by KEYLEN bytes of
+ * null-terminated key and VALLEN bytes of null-terminated value. A VALLEN of
+ * 0 marks a tombstone (a blank value "" still has a VALLEN of 1). CHECKSUM
+ * covers the lengths, the key and the value. */
+typedef struct {
+  uint32_t checksum;          /* Checksum of the remainder of the record. */
+  uint32_t keylen;            /* Length of the key, including null terminator. */
+  uint32_t vallen;            /* Length of the value, including null terminator. */
+} kvlogrecord_t;
+
+/* The location of the current value of a single key. */
+typedef struct kvlogindex {
+  char *key;                  /* The key, also used as the hash key. */
+  unsigned int segment;       /* The ID of the segment holding the value. */
+  off_t offset;               /* The offset of the record within the segment. */
+  uint32_t vallen;            /* The length of the value, including null terminator. */
+  UT_hash_handle hh;          /* Makes this structure hashable. */
+} kvlogindex_t;
+
+/* Called by kvlogstore_iterate with each live KEY and its VALUE, and the
+ * AUX passed in. A nonzero return value stops the iteration. */
+typedef int (*kvlogstore_iter_t)(char *key, char *value, void *aux);
+
+/* A single segment file. */
+typedef struct {
+  int fd;                     /* Open fd for the segment, or -1 if removed. */
+  off_t size;                 /* Number of bytes written to the segment. */
+  off_t dead;                 /* Number of bytes which are no longer live. */
+} kvlogsegment_t;
+
+/* A KVLogStore. */
+typedef struct {
+  char dirname[MAX_FILENAME];   /* The directory holding the segment files. */
+  kvlogindex_t *index;          /* Maps keys to their current location. */
+  kvlogsegment_t *segments;     /* All segments, indexed by segment ID. */
+  unsigned int num_segments;    /* The number of slots in SEGMENTS. */
+  unsigned int active;          /* The ID of the segment currently appended to. */
+  pthread_rwlock_t lock;        /* Protects the index and the segment table. */
+  pthread_mutex_t compact_lock; /* Protects COMPACT_PENDING and STOPPING. */
+  pthread_cond_t compact_cond;  /* Signalled when a segment is sealed. */
+  pthread_mutex_t compact_run;  /* Serializes compactions. */
+  bool compact_pending;         /* True if a sealed segment may need compacting. */
+  bool stopping;                /* True once the compaction thread should exit. */
+  pthread_t compactor;          /* The background compaction thread. */
+} kvlogstore_t;
+
+int kvlogstore_init(kvlogstore_t *, char *dirname);
+
+int kvlogstore_get(kvlogstore_t *, char *key, char **value);
+int kvlogstore_put(kvlogstore_t *, char *key, char *value);
+int kvlogstore_del(kvlogstore_t *, char *key);
+
+bool kvlogstore_haskey(kvlogstore_t *, char *key);
+
+int kvlogstore_iterate(kvlogstore_t *, kvlogstore_iter_t iter, void *aux);
+
+int kvlogstore_compact(kvlogstore_t *, unsigned int segment);
+
+int kvlogstore_clean(kvlogstore_t *);
+
+#endif
@@ -1,30 +1,166 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 #include <json-c/json.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <string.h>
 #include "kvmessage.h"
+#include "uthash.h"
 
-/* Receives and returns a message from socket SOCKFD.
- * Returns NULL if there is an error. */
-kvmessage_t *kvmessage_parse(int sockfd) {
-  json_object *new_obj;
-  kvmessage_t *msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
-  int size;
+/* The per-thread connection used by kvmessage_parse and kvmessage_send. */
+static pthread_key_t kvmessage_conn_key;
+static pthread_once_t kvmessage_conn_once = PTHREAD_ONCE_INIT;
 
-  /* First read the size of the incoming message */
-  if (read(sockfd, &size, 4) < 4) {
-    return NULL;
+/* Reads exactly LEN bytes from SOCKFD into BUF, retrying short and
+ * interrupted reads. A read which times out shuts SOCKFD down, since the
+ * rest of the message may still arrive and could not be told apart from the
+ * next one. Returns 0 if successful, else -1 if the socket was closed or an
+ * error occurred. */
+static int kvconn_read_full(int sockfd, void *buf, size_t len) {
+  char *pos = buf;
+  ssize_t n;
+  while (len > 0) {
+    n = read(sockfd, pos, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      shutdown(sockfd, SHUT_RDWR);
+    if (n <= 0)
+      return -1;
+    pos += n;
+    len -= n;
   }
-  /* Then create the buffer and read in the data */
-  size = ntohl(size);
-  char buffer[size];
-  if (read(sockfd, buffer, size) < size) {
+  return 0;
+}
+
+/* Writes every byte described by the IOVCNT buffers of IOV to SOCKFD with
+ * as few writev calls as possible, retrying short and interrupted writes.
+ * IOV is modified. Returns the number of bytes written. */
+static int kvconn_writev_full(int sockfd, struct iovec *iov, int iovcnt) {
+  int sent = 0;
+  ssize_t n;
+  while (iovcnt > 0) {
+    n = writev(sockfd, iov, iovcnt);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    sent += n;
+    while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char *) iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return sent;
+}
+
+/* Ensures that CONN's buffer can hold at least SIZE bytes. Returns 0 if
+ * successful, else -1. */
+static int kvconn_reserve(kvconn_t *conn, size_t size) {
+  size_t bufsize = conn->bufsize ? conn->bufsize : KVCONN_MIN_BUFSIZE;
+  char *buf;
+  if (size <= conn->bufsize)
+    return 0;
+  while (bufsize < size)
+    bufsize *= 2;
+  if ((buf = realloc(conn->buf, bufsize)) == NULL)
+    return -1;
+  conn->buf = buf;
+  conn->bufsize = bufsize;
+  return 0;
+}
+
+/* Releases CONN's buffer if an unusually large message grew it, so an idle
+ * connection does not pin that memory. */
+static void kvconn_trim(kvconn_t *conn) {
+  if (conn->bufsize > KVCONN_MAX_IDLE_BUFSIZE) {
+    free(conn->buf);
+    conn->buf = NULL;
+    conn->bufsize = 0;
+  }
+}
+
+/* Initializes CONN to send and receive messages on socket SOCKFD. The
+ * buffer is allocated lazily. */
+void kvconn_init(kvconn_t *conn, int sockfd) {
+  conn->sockfd = sockfd;
+  conn->buf = NULL;
+  conn->bufsize = 0;
+}
+
+/* Frees CONN's buffer. Does not close its socket. */
+void kvconn_destroy(kvconn_t *conn) {
+  free(conn->buf);
+  conn->buf = NULL;
+  conn->bufsize = 0;
+}
+
+/* Returns a malloced, null-terminated copy of the LEN bytes at DATA. */
+static char *kvmessage_strndup(const char *data, size_t len) {
+  char *str = malloc(len + 1);
+  if (str == NULL)
     return NULL;
+  memcpy(str, data, len);
+  str[len] = '\0';
+  return str;
+}
+
+/* Frees the first SIZE pairs of BATCH, and BATCH itself. */
+static void kvmessage_free_batch(kvpair_t *batch, unsigned int size) {
+  unsigned int i;
+  for (i = 0; i < size; i++) {
+    free(batch[i].key);
+    free(batch[i].value);
+  }
+  free(batch);
+}
+
+/* Populates the batch of MSG from ARRAY, a JSON array of [key, value]
+ * arrays. Pairs which are not arrays of a string and a string or null are
+ * skipped. */
+static void kvmessage_decode_json_batch(kvmessage_t *msg, json_object *array) {
+  json_object *pair, *key, *value;
+  size_t i, len;
+  if (json_object_get_type(array) != json_type_array)
+    return;
+  len = json_object_array_length(array);
+  if (len == 0 || len > MAX_BATCHLEN)
+    return;
+  if ((msg->batch = calloc(len, sizeof(kvpair_t))) == NULL)
+    return;
+  for (i = 0; i < len; i++) {
+    pair = json_object_array_get_idx(array, i);
+    if (json_object_get_type(pair) != json_type_array
+        || json_object_array_length(pair) != 2)
+      continue;
+    key = json_object_array_get_idx(pair, 0);
+    value = json_object_array_get_idx(pair, 1);
+    if (json_object_get_type(key) != json_type_string)
+      continue;
+    msg->batch[msg->batch_size].key = kvmessage_strndup(
+        json_object_get_string(key), strlen(json_object_get_string(key)));
+    if (json_object_get_type(value) == json_type_string)
+      msg->batch[msg->batch_size].value = kvmessage_strndup(
+          json_object_get_string(value), strlen(json_object_get_string(value)));
+    msg->batch_size++;
   }
+}
 
+/* Populates MSG from the null-terminated JSON body BUFFER. */
+static void kvmessage_decode_json(kvmessage_t *msg, const char *buffer) {
+  json_object *new_obj;
   struct json_object *value_obj;
+  msg->format = KVMESSAGE_JSON;
   new_obj = json_tokener_parse(buffer);
   if (json_object_object_get_ex(new_obj, "type", &value_obj)) {
     int type = json_object_get_int(value_obj);
@@ -33,51 +169,323 @@ kvmessage_t *kvmessage_parse(int sockfd) {
 
   if (json_object_object_get_ex(new_obj, "key", &value_obj)) {
     const char *key = json_object_get_string(value_obj);
-    char *key_buf = calloc(1, strlen(key) + 1);
-    memcpy(key_buf, key, strlen(key) + 1);
-    msg->key = key_buf;
+    msg->key = kvmessage_strndup(key, strlen(key));
   }
   if (json_object_object_get_ex(new_obj, "value", &value_obj)) {
     const char *value = json_object_get_string(value_obj);
-    char *value_buf = calloc(1, strlen(value) + 1);
-    memcpy(value_buf, value, strlen(value) + 1);
-    msg->value = value_buf;
+    msg->value = kvmessage_strndup(value, strlen(value));
   }
   if (json_object_object_get_ex(new_obj, "message", &value_obj)) {
     const char *message = json_object_get_string(value_obj);
-    char *message_buf = calloc(1, strlen(message) + 1);
-    memcpy(message_buf, message, strlen(message) + 1);
-    msg->message = message_buf;
+    msg->message = kvmessage_strndup(message, strlen(message));
   }
+  if (json_object_object_get_ex(new_obj, "txid", &value_obj))
+    msg->txid = (uint64_t) json_object_get_int64(value_obj);
+  if (json_object_object_get_ex(new_obj, "batch", &value_obj))
+    kvmessage_decode_json_batch(msg, value_obj);
   json_object_put(new_obj);
+}
+
+/* Reads one length-prefixed binary field from the SIZE byte body BUFFER at
+ * *POS into a malloced string stored in *FIELD, advancing *POS past it. A
+ * field of length KVMESSAGE_NO_FIELD is absent, and leaves *FIELD NULL.
+ * Returns 0 if successful, else -1 if the field overruns the body. */
+static int kvmessage_decode_field(const char *buffer, size_t size, size_t *pos,
+    char **field) {
+  uint32_t len;
+  if (size - *pos < 4)
+    return -1;
+  memcpy(&len, buffer + *pos, 4);
+  len = ntohl(len);
+  *pos += 4;
+  if (len == KVMESSAGE_NO_FIELD) {
+    *field = NULL;
+    return 0;
+  }
+  if (size - *pos < len)
+    return -1;
+  if ((*field = kvmessage_strndup(buffer + *pos, len)) == NULL)
+    return -1;
+  *pos += len;
+  return 0;
+}
+
+/* Returns the eight-byte integer in network byte order at DATA. */
+static uint64_t kvmessage_decode_u64(const char *data) {
+  uint32_t high, low;
+  memcpy(&high, data, 4);
+  memcpy(&low, data + 4, 4);
+  return ((uint64_t) ntohl(high) << 32) | ntohl(low);
+}
+
+/* Populates MSG from the SIZE byte binary body BUFFER. Returns 0 if
+ * successful, else -1 if the body is malformed. */
+static int kvmessage_decode_binary(kvmessage_t *msg, const char *buffer,
+    size_t size) {
+  size_t pos = 3;
+  unsigned char flags;
+  if (size < 3)
+    return -1;
+  msg->format = KVMESSAGE_BINARY;
+  msg->type = (unsigned char) buffer[1];
+  flags = buffer[2];
+  if ((flags & KVMESSAGE_HAS_KEY)
+      && kvmessage_decode_field(buffer, size, &pos, &msg->key) < 0)
+    return -1;
+  if ((flags & KVMESSAGE_HAS_VALUE)
+      && kvmessage_decode_field(buffer, size, &pos, &msg->value) < 0)
+    return -1;
+  if ((flags & KVMESSAGE_HAS_MESSAGE)
+      && kvmessage_decode_field(buffer, size, &pos, &msg->message) < 0)
+    return -1;
+  if (flags & KVMESSAGE_HAS_TXID) {
+    if (size - pos < 8)
+      return -1;
+    msg->txid = kvmessage_decode_u64(buffer + pos);
+    pos += 8;
+  }
+  if (flags & KVMESSAGE_HAS_BATCH) {
+    uint32_t count, i;
+    if (size - pos < 4)
+      return -1;
+    memcpy(&count, buffer + pos, 4);
+    count = ntohl(count);
+    pos += 4;
+    if (count == 0 || count > MAX_BATCHLEN)
+      return -1;
+    if ((msg->batch = calloc(count, sizeof(kvpair_t))) == NULL)
+      return -1;
+    for (i = 0; i < count; i++) {
+      if (kvmessage_decode_field(buffer, size, &pos, &msg->batch[i].key) < 0
+          || msg->batch[i].key == NULL)
+        return -1;
+      msg->batch_size++;
+      if (kvmessage_decode_field(buffer, size, &pos, &msg->batch[i].value) < 0)
+        return -1;
+    }
+  }
+  return 0;
+}
+
+/* Receives and returns a message from CONN. Reads exactly one
+ * length-prefixed message into CONN's buffer, so several messages may be
+ * sent back to back on the same connection. Returns NULL if there is an
+ * error. */
+kvmessage_t *kvconn_parse(kvconn_t *conn) {
+  kvmessage_t *msg;
+  int size;
+
+  /* First read the size of the incoming message */
+  if (kvconn_read_full(conn->sockfd, &size, 4) < 0) {
+    return NULL;
+  }
+  /* Then read the data into the connection's buffer */
+  size = ntohl(size);
+  if (size < 0 || size > KVMESSAGE_MAX_SIZE) {
+    return NULL;
+  }
+  if (kvconn_reserve(conn, size + 1) < 0) {
+    return NULL;
+  }
+  if (kvconn_read_full(conn->sockfd, conn->buf, size) < 0) {
+    return NULL;
+  }
+  conn->buf[size] = '\0';
+
+  msg = (kvmessage_t *) calloc(1, sizeof(kvmessage_t));
+  if (msg != NULL) {
+    if (size > 0 && (unsigned char) conn->buf[0] == KVMESSAGE_BINARY_V1) {
+      if (kvmessage_decode_binary(msg, conn->buf, size) < 0) {
+        kvmessage_free(msg);
+        msg = NULL;
+      }
+    } else {
+      kvmessage_decode_json(msg, conn->buf);
+    }
+  }
+  kvconn_trim(conn);
   return msg;
 }
 
-/* Sends MESSAGE on socket SOCKFD. Includes whichever fields are
- * non-null in the message. Returns the number of bytes which were sent. */
-int kvmessage_send(kvmessage_t *message, int sockfd) {
-  int sent = 0;
-  json_object *json = json_object_new_object();
-  json_object_object_add(json, "type", json_object_new_int(message->type));
+/* Appends FIELD to the binary body at *POS as a length-prefixed field,
+ * advancing *POS past it. A NULL FIELD is given the length
+ * KVMESSAGE_NO_FIELD. */
+static void kvmessage_encode_field(char **pos, const char *field) {
+  uint32_t len = field ? strlen(field) : 0;
+  uint32_t netlen = htonl(field ? len : KVMESSAGE_NO_FIELD);
+  memcpy(*pos, &netlen, 4);
+  if (len > 0)
+    memcpy(*pos + 4, field, len);
+  *pos += 4 + len;
+}
+
+/* Encodes MESSAGE in the binary encoding into CONN's buffer. Returns the
+ * size of the body, else -1 if the buffer could not be grown. */
+static int kvconn_encode_binary(kvconn_t *conn, kvmessage_t *message) {
+  size_t size = 3;
+  unsigned char flags = 0;
+  uint32_t high, low, count;
+  unsigned int i;
+  char *pos;
   if (message->key) {
-    json_object_object_add(json, "key", json_object_new_string(message->key));
+    flags |= KVMESSAGE_HAS_KEY;
+    size += 4 + strlen(message->key);
   }
   if (message->value) {
-    json_object_object_add(json, "value",
-        json_object_new_string(message->value));
+    flags |= KVMESSAGE_HAS_VALUE;
+    size += 4 + strlen(message->value);
   }
   if (message->message) {
-    json_object_object_add(json, "message",
-        json_object_new_string(message->message));
-  }
-  const char *json_string = json_object_to_json_string(json);
-  int size = htonl(strlen(json_string));
-  sent += write(sockfd, &size, 4);
-  sent += write(sockfd, json_string, strlen(json_string));
-  json_object_put(json);
+    flags |= KVMESSAGE_HAS_MESSAGE;
+    size += 4 + strlen(message->message);
+  }
+  if (message->txid) {
+    flags |= KVMESSAGE_HAS_TXID;
+    size += 8;
+  }
+  if (message->batch) {
+    flags |= KVMESSAGE_HAS_BATCH;
+    size += 4;
+    for (i = 0; i < message->batch_size; i++) {
+      size += 8 + strlen(message->batch[i].key);
+      if (message->batch[i].value)
+        size += strlen(message->batch[i].value);
+    }
+  }
+  if (kvconn_reserve(conn, size) < 0)
+    return -1;
+  conn->buf[0] = (char) KVMESSAGE_BINARY_V1;
+  conn->buf[1] = (char) message->type;
+  conn->buf[2] = (char) flags;
+  pos = conn->buf + 3;
+  if (message->key)
+    kvmessage_encode_field(&pos, message->key);
+  if (message->value)
+    kvmessage_encode_field(&pos, message->value);
+  if (message->message)
+    kvmessage_encode_field(&pos, message->message);
+  if (message->txid) {
+    high = htonl(message->txid >> 32);
+    low = htonl(message->txid & 0xffffffff);
+    memcpy(pos, &high, 4);
+    memcpy(pos + 4, &low, 4);
+    pos += 8;
+  }
+  if (message->batch) {
+    count = htonl(message->batch_size);
+    memcpy(pos, &count, 4);
+    pos += 4;
+    for (i = 0; i < message->batch_size; i++) {
+      kvmessage_encode_field(&pos, message->batch[i].key);
+      kvmessage_encode_field(&pos, message->batch[i].value);
+    }
+  }
+  return size;
+}
+
+/* Sends MESSAGE on CONN, encoded as given by MESSAGE->format. Includes
+ * whichever fields are non-null in the message. The length prefix and body
+ * go out in a single writev, so they are never split into separate segments
+ * by Nagle's algorithm. Returns the number of bytes which were sent. */
+int kvconn_send(kvconn_t *conn, kvmessage_t *message) {
+  struct iovec iov[2];
+  json_object *json = NULL, *batch, *pair;
+  uint32_t size;
+  unsigned int i;
+  int sent, len;
+  if (message->format == KVMESSAGE_BINARY) {
+    if ((len = kvconn_encode_binary(conn, message)) < 0)
+      return 0;
+    iov[1].iov_base = conn->buf;
+    iov[1].iov_len = len;
+  } else {
+    json = json_object_new_object();
+    json_object_object_add(json, "type", json_object_new_int(message->type));
+    if (message->key) {
+      json_object_object_add(json, "key", json_object_new_string(message->key));
+    }
+    if (message->value) {
+      json_object_object_add(json, "value",
+          json_object_new_string(message->value));
+    }
+    if (message->message) {
+      json_object_object_add(json, "message",
+          json_object_new_string(message->message));
+    }
+    if (message->txid) {
+      json_object_object_add(json, "txid",
+          json_object_new_int64((int64_t) message->txid));
+    }
+    if (message->batch) {
+      batch = json_object_new_array();
+      for (i = 0; i < message->batch_size; i++) {
+        pair = json_object_new_array();
+        json_object_array_add(pair,
+            json_object_new_string(message->batch[i].key));
+        json_object_array_add(pair, message->batch[i].value
+            ? json_object_new_string(message->batch[i].value) : NULL);
+        json_object_array_add(batch, pair);
+      }
+      json_object_object_add(json, "batch", batch);
+    }
+    const char *json_string = json_object_to_json_string(json);
+    iov[1].iov_base = (void *) json_string;
+    iov[1].iov_len = strlen(json_string);
+  }
+  size = htonl(iov[1].iov_len);
+  iov[0].iov_base = &size;
+  iov[0].iov_len = 4;
+  sent = kvconn_writev_full(conn->sockfd, iov, 2);
+  if (json != NULL)
+    json_object_put(json);
+  kvconn_trim(conn);
   return sent;
 }
 
+/* Frees a thread's connection when the thread exits. */
+static void kvmessage_conn_free(void *conn) {
+  kvconn_destroy(conn);
+  free(conn);
+}
+
+/* Creates the key holding each thread's connection. */
+static void kvmessage_conn_key_create(void) {
+  pthread_key_create(&kvmessage_conn_key, kvmessage_conn_free);
+}
+
+/* Returns the calling thread's connection, pointed at SOCKFD. Its buffer is
+ * reused by every message the thread sends or receives through
+ * kvmessage_parse and kvmessage_send, whatever the socket. */
+static kvconn_t *kvmessage_thread_conn(int sockfd) {
+  kvconn_t *conn;
+  pthread_once(&kvmessage_conn_once, kvmessage_conn_key_create);
+  conn = pthread_getspecific(kvmessage_conn_key);
+  if (conn == NULL) {
+    if ((conn = malloc(sizeof(kvconn_t))) == NULL)
+      return NULL;
+    kvconn_init(conn, sockfd);
+    pthread_setspecific(kvmessage_conn_key, conn);
+  }
+  conn->sockfd = sockfd;
+  return conn;
+}
+
+/* Receives and returns a message from socket SOCKFD. Reads exactly one
+ * length-prefixed message, so several messages may be sent back to back on
+ * the same socket. Returns NULL if there is an error. */
+kvmessage_t *kvmessage_parse(int sockfd) {
+  kvconn_t *conn = kvmessage_thread_conn(sockfd);
+  return (conn != NULL) ? kvconn_parse(conn) : NULL;
+}
+
+/* Sends MESSAGE on socket SOCKFD, encoded as given by MESSAGE->format.
+ * Includes whichever fields are non-null in the message. Returns the number
+ * of bytes which were sent. */
+int kvmessage_send(kvmessage_t *message, int sockfd) {
+  kvconn_t *conn = kvmessage_thread_conn(sockfd);
+  return (conn != NULL) ? kvconn_send(conn, message) : 0;
+}
+
 /* Frees the memory for MESSAGE. Assumes that the message itself and all
  * fields were allocated using malloc/calloc (which will be the case for a
  * message created using kvmessage_parse). */
@@ -88,5 +496,60 @@ void kvmessage_free(kvmessage_t *message) {
     free(message->value);
   if (message->message)
     free(message->message);
+  if (message->batch)
+    kvmessage_free_batch(message->batch, message->batch_size);
   free(message);
 }
+
+/* A key of a batch, used to find keys named twice. */
+typedef struct {
+  char *key;                    /* The key, also used as the hash key. */
+  UT_hash_handle hh;            /* Makes this structure hashable. */
+} kvbatchkey_t;
+
+/* Reorders the BATCH_SIZE writes of BATCH so that the writes which are not
+ * overridden by a later write to the same key come first, in the order they
+ * were sent, and returns how many there are, or -1 on error. Pairs without
+ * a key are kept, for the caller to reject. */
+int kvmessage_last_writes(kvpair_t *batch, unsigned int batch_size) {
+  kvbatchkey_t *keys, *seen = NULL, *found;
+  kvpair_t pair;
+  unsigned int i, n = 0;
+  if (batch == NULL || batch_size == 0)
+    return 0;
+  if ((keys = calloc(batch_size, sizeof(kvbatchkey_t))) == NULL)
+    return -1;
+  for (i = batch_size; i-- > 0; ) {
+    if (batch[i].key == NULL)
+      continue;
+    HASH_FIND_STR(seen, batch[i].key, found);
+    if (found != NULL)
+      continue;
+    keys[i].key = batch[i].key;
+    HASH_ADD_KEYPTR(hh, seen, keys[i].key, strlen(keys[i].key), &keys[i]);
+  }
+  HASH_CLEAR(hh, seen);
+  for (i = 0; i < batch_size; i++) {
+    if (batch[i].key != NULL && keys[i].key == NULL)
+      continue;
+    pair = batch[n];
+    batch[n++] = batch[i];
+    batch[i] = pair;
+  }
+  free(keys);
+  return n;
+}
+
+/* Reads the number of keys the SCANREQ MESSAGE asks for into LIMIT, 0 if it
+ * names no limit. Returns 0 if successful, else ERRINVLDMSG if the limit is
+ * not a number. */
+int kvmessage_scan_limit(kvmessage_t *message, unsigned int *limit) {
+  char *end;
+  *limit = 0;
+  if (message->message == NULL)
+    return 0;
+  *limit = (unsigned int) strtoul(message->message, &end, 10);
+  if (end == message->message || *end != '\0')
+    return ERRINVLDMSG;
+  return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef __KV_MESSAGE__
 #define __KV_MESSAGE__
 
+#include <stdint.h>
 #include "kvconstants.h"
 
 /* KVMessage is used to send messages across sockets.
@@ -12,19 +13,110 @@
  * kvmessage_parse reads the first four bytes of the message, uses this to determine
  * the size of the remainder of the message, then parses the remainder of the message
  * as JSON and populates whichever fields of the message are present in the incoming JSON.
+ * It reads exactly one message, so a connection may carry any number of messages back
+ * to back. Messages larger than KVMESSAGE_MAX_SIZE bytes are rejected. If the socket has a
+ * receive timeout (SO_RCVTIMEO) and it expires, kvmessage_parse shuts the socket down, as
+ * the rest of the message may still arrive and the connection could no longer be framed.
+ *
+ * The body may alternatively use a compact binary encoding, which avoids building and
+ * parsing a JSON tree for every message. A binary body starts with a version byte
+ * (KVMESSAGE_BINARY_V1), which can never begin a JSON object, followed by the type
+ * byte, a byte of KVMESSAGE_HAS_* flags saying which fields are present, and then
+ * each present field (key, value, message, in that order) as a four-byte length in
+ * network byte order followed by that many bytes, and finally, if the message has a
+ * transaction ID, the ID as eight bytes in network byte order. kvmessage_parse accepts either
+ * encoding and records which one it saw in the message's FORMAT, and kvmessage_send
+ * uses the message's FORMAT, so servers answer each request in the encoding it was
+ * sent in. A client thus chooses the encoding for its connection simply by using it;
+ * JSON remains the default, and is what kvclient.py speaks.
+ *
+ * The batch messages MGETREQ, MPUTREQ, MDELREQ and MGETRESP carry up to MAX_BATCHLEN
+ * <key, value> pairs in BATCH instead of a single KEY and VALUE; a pair's VALUE is NULL
+ * where it does not apply, or for a key an MGETRESP did not find. In JSON, BATCH is an
+ * array of two-element [key, value] arrays under "batch", with null for a missing
+ * value. In the binary encoding, the KVMESSAGE_HAS_BATCH flag marks that the message
+ * ends with the number of pairs as four bytes in network byte order, followed by each
+ * pair's key and value as fields, a missing value having the length
+ * KVMESSAGE_NO_FIELD. Where an MPUTREQ or MDELREQ names a key more than once, the last
+ * write to it wins; kvmessage_last_writes picks those writes out.
+ *
+ * A SCANREQ asks for the keys from KEY up to but excluding VALUE, in strcmp
+ * order, either of which may be absent to leave the range open at that end,
+ * and at most as many as the decimal number in MESSAGE, if present. It is
+ * answered by a stream of SCANRESPs, each holding the next keys of the range
+ * and their values in BATCH, and ended by a RESP whose MESSAGE is
+ * MSG_SUCCESS if the whole range was sent, else an error message.
  */
 
+/* The largest message body kvmessage_parse will accept. */
+#define KVMESSAGE_MAX_SIZE (1 << 24)
+
+/* The first byte of a body in version 1 of the binary encoding. */
+#define KVMESSAGE_BINARY_V1 0xB1
+
+/* Flags marking which fields are present in a binary body. */
+#define KVMESSAGE_HAS_KEY 0x1
+#define KVMESSAGE_HAS_VALUE 0x2
+#define KVMESSAGE_HAS_MESSAGE 0x4
+#define KVMESSAGE_HAS_TXID 0x8
+#define KVMESSAGE_HAS_BATCH 0x10
+
+/* The length given in the binary encoding to a field which is absent. */
+#define KVMESSAGE_NO_FIELD 0xFFFFFFFF
+
+/* The encodings a message body may use on the wire. */
+typedef enum {
+  KVMESSAGE_JSON,    /* A JSON object. */
+  KVMESSAGE_BINARY   /* Version 1 of the binary encoding. */
+} kvformat_t;
+
+/* A single <key, value> pair of a batch message. */
+typedef struct {
+  char *key;         /* The key. */
+  char *value;       /* The value, or NULL if there is none. */
+} kvpair_t;
+
 typedef struct {
   msgtype_t type;    /* The type of this message. */
   char *key;         /* The key this message stores. May be NULL, depending on type. */
   char *value;       /* The value this message stores. May be NULL, depending on type. */
   char *message;     /* The message this message stores. May be NULL, depending on type. */
+  uint64_t txid;     /* The TPC transaction this message belongs to, or 0 if none. */
+  kvformat_t format; /* The encoding this message was received in, or should be sent in. */
+  kvpair_t *batch;   /* The pairs of a batch message, or NULL. */
+  unsigned int batch_size; /* The number of pairs in BATCH. */
 } kvmessage_t;
 
+/* A connection's buffered I/O state. Message bodies are read into and
+ * encoded in BUF, which is reused from one message to the next and only grows
+ * when a larger message comes along. Reads and writes are retried until whole
+ * messages have been transferred. kvmessage_parse and kvmessage_send use a
+ * kvconn kept by each thread; callers holding a connection open can keep a
+ * kvconn of their own alongside it. */
+typedef struct {
+  int sockfd;        /* The socket messages are sent and received on. */
+  char *buf;         /* The buffer for message bodies, or NULL if not yet needed. */
+  size_t bufsize;    /* The size of BUF. */
+} kvconn_t;
+
+/* The size BUF starts at when first needed. */
+#define KVCONN_MIN_BUFSIZE 4096
+
+/* The largest BUF kept between messages. */
+#define KVCONN_MAX_IDLE_BUFSIZE (1 << 16)
+
+void kvconn_init(kvconn_t *, int sockfd);
+kvmessage_t *kvconn_parse(kvconn_t *);
+int kvconn_send(kvconn_t *, kvmessage_t *);
+void kvconn_destroy(kvconn_t *);
+
 kvmessage_t *kvmessage_parse(int sockfd);
 
 int kvmessage_send(kvmessage_t *, int sockfd);
 
 void kvmessage_free(kvmessage_t *);
 
+int kvmessage_scan_limit(kvmessage_t *, unsigned int *limit);
+int kvmessage_last_writes(kvpair_t *batch, unsigned int batch_size);
+
 #endif
@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvpolicy.h"
+#include "utlist.h"
+
+/* Puts SLOT at the most recently used end of LIST in POLICY. */
+static void kvpolicy_push(kvpolicy_t *policy, int slot, unsigned char list) {
+  kvpolicynode_t *node = &policy->nodes[slot];
+  node->list = list;
+  DL_PREPEND(policy->lists[list], node);
+  policy->sizes[list]++;
+}
+
+/* Takes SLOT off whichever list of POLICY holds it. */
+static void kvpolicy_unlink(kvpolicy_t *policy, int slot) {
+  kvpolicynode_t *node = &policy->nodes[slot];
+  if (node->list == KVPOLICY_NONE)
+    return;
+  DL_DELETE(policy->lists[node->list], node);
+  policy->sizes[node->list]--;
+  node->list = KVPOLICY_NONE;
+}
+
+/* Returns the least recently used slot on LIST in POLICY, or -1 if LIST is
+ * empty. */
+static int kvpolicy_lru(kvpolicy_t *policy, unsigned char list) {
+  if (policy->lists[list] == NULL)
+    return -1;
+  return policy->lists[list]->prev - policy->nodes;
+}
+
+/* Moves SLOT to the most recently used end of LIST in POLICY. */
+static void kvpolicy_move(kvpolicy_t *policy, int slot, unsigned char list) {
+  kvpolicy_unlink(policy, slot);
+  kvpolicy_push(policy, slot, list);
+}
+
+/* Records in the ring buffer of POLICY that SLOT, whose hash is HASH, was
+ * read. Returns true once the buffer is half full. */
+static bool kvpolicy_buffer_read(kvpolicy_t *policy, int slot, uint64_t hash) {
+  unsigned int pos = __atomic_fetch_add(&policy->buffer_tail, 1,
+      __ATOMIC_RELAXED);
+  __atomic_store_n(&policy->buffer[pos & (KVPOLICY_BUFFER_SIZE - 1)],
+      ((uint64_t) (slot + 1) << 32) | (uint32_t) hash, __ATOMIC_RELEASE);
+  return pos - __atomic_load_n(&policy->buffer_head, __ATOMIC_RELAXED)
+      >= KVPOLICY_BUFFER_SIZE / 2;
+}
+
+/* Starts the hand of a CLOCK POLICY at the first slot. */
+static int kvpolicy_clock_init(kvpolicy_t *policy) {
+  policy->clock.hand = 0;
+  return 0;
+}
+
+static void kvpolicy_clock_insert(kvpolicy_t *policy, int slot) {
+  policy->nodes[slot].list = KVPOLICY_CLOCK_RING;
+  policy->nodes[slot].refbit = false;
+}
+
+static void kvpolicy_clock_access(kvpolicy_t *policy, int slot) {
+  __atomic_store_n(&policy->nodes[slot].refbit, true, __ATOMIC_RELAXED);
+}
+
+static void kvpolicy_clock_remove(kvpolicy_t *policy, int slot) {
+  policy->nodes[slot].list = KVPOLICY_NONE;
+  policy->nodes[slot].refbit = false;
+}
+
+/* Advances the CLOCK hand of POLICY until it reaches an entry whose reference
+ * bit is clear, giving every referenced entry it passes a second chance. */
+static int kvpolicy_clock_evict(kvpolicy_t *policy, uint64_t hash) {
+  kvpolicynode_t *node;
+  int slot;
+  while (true) {
+    slot = policy->clock.hand;
+    policy->clock.hand = (policy->clock.hand + 1) % policy->capacity;
+    node = &policy->nodes[slot];
+    if (node->list != KVPOLICY_NONE
+        && !__atomic_exchange_n(&node->refbit, false, __ATOMIC_RELAXED))
+      break;
+  }
+  kvpolicy_clock_remove(policy, slot);
+  return slot;
+}
+
+static bool kvpolicy_clock_touch(kvpolicy_t *policy, int slot,
+    uint64_t hash) {
+  __atomic_store_n(&policy->nodes[slot].refbit, true, __ATOMIC_RELAXED);
+  return false;
+}
+
+static void kvpolicy_clock_clear(kvpolicy_t *policy) {
+  policy->clock.hand = 0;
+}
+
+static void kvpolicy_clock_destroy(kvpolicy_t *policy) {
+}
+
+/* Returns the ghost of the key whose hash is HASH in an ARC POLICY, or NULL if
+ * it has none. */
+static kvpolicyghost_t *kvpolicy_arc_find(kvpolicy_t *policy, uint64_t hash) {
+  kvpolicyghost_t *ghost;
+  HASH_FIND(hh, policy->arc.table, &hash, sizeof(uint64_t), ghost);
+  return ghost;
+}
+
+/* Takes GHOST off its ghost list in an ARC POLICY. */
+static void kvpolicy_arc_forget(kvpolicy_t *policy, kvpolicyghost_t *ghost) {
+  HASH_DEL(policy->arc.table, ghost);
+  DL_DELETE(policy->arc.lists[ghost->list], ghost);
+  policy->arc.sizes[ghost->list]--;
+  ghost->next = policy->arc.free;
+  policy->arc.free = ghost;
+}
+
+/* Forgets the oldest ghost on ghost list LIST of an ARC POLICY. */
+static void kvpolicy_arc_forget_lru(kvpolicy_t *policy, unsigned char list) {
+  kvpolicy_arc_forget(policy, policy->arc.lists[list]->prev);
+}
+
+/* Remembers the key whose hash is HASH on ghost list LIST of an ARC POLICY. */
+static void kvpolicy_arc_remember(kvpolicy_t *policy, uint64_t hash,
+    unsigned char list) {
+  kvpolicyghost_t *ghost = kvpolicy_arc_find(policy, hash);
+  if (ghost != NULL)
+    kvpolicy_arc_forget(policy, ghost);
+  if (policy->arc.free == NULL)
+    kvpolicy_arc_forget_lru(policy, policy->arc.sizes[KVPOLICY_ARC_B2] > 0
+        ? KVPOLICY_ARC_B2 : KVPOLICY_ARC_B1);
+  ghost = policy->arc.free;
+  policy->arc.free = ghost->next;
+  ghost->hash = hash;
+  ghost->list = list;
+  DL_PREPEND(policy->arc.lists[list], ghost);
+  policy->arc.sizes[list]++;
+  HASH_ADD(hh, policy->arc.table, hash, sizeof(uint64_t), ghost);
+}
+
+/* Adapts the target size of T1 in an ARC POLICY if the key whose hash is HASH
+ * has a ghost, which is then forgotten. Returns true if there was a ghost. */
+static bool kvpolicy_arc_adapt(kvpolicy_t *policy, uint64_t hash) {
+  kvpolicyghost_t *ghost = kvpolicy_arc_find(policy, hash);
+  unsigned int b1 = policy->arc.sizes[KVPOLICY_ARC_B1];
+  unsigned int b2 = policy->arc.sizes[KVPOLICY_ARC_B2], delta;
+  if (ghost == NULL)
+    return false;
+  if (ghost->list == KVPOLICY_ARC_B1) {
+    delta = (b2 > b1) ? b2 / b1 : 1;
+    policy->arc.target = (policy->arc.target + delta < policy->capacity)
+        ? policy->arc.target + delta : policy->capacity;
+  } else {
+    delta = (b1 > b2) ? b1 / b2 : 1;
+    policy->arc.target = (policy->arc.target > delta)
+        ? policy->arc.target - delta : 0;
+  }
+  kvpolicy_arc_forget(policy, ghost);
+  return true;
+}
+
+/* Puts every ghost of an ARC POLICY on its free list and resets its target. */
+static void kvpolicy_arc_reset(kvpolicy_t *policy) {
+  unsigned int i;
+  policy->arc.table = NULL;
+  policy->arc.free = NULL;
+  for (i = 0; i < 2 * policy->capacity + 1; i++) {
+    policy->arc.ghosts[i].next = policy->arc.free;
+    policy->arc.free = &policy->arc.ghosts[i];
+  }
+  policy->arc.lists[KVPOLICY_ARC_B1] = policy->arc.lists[KVPOLICY_ARC_B2] = NULL;
+  policy->arc.sizes[KVPOLICY_ARC_B1] = policy->arc.sizes[KVPOLICY_ARC_B2] = 0;
+  policy->arc.target = 0;
+  policy->arc.promote = false;
+}
+
+/* Allocates the ghosts of an ARC POLICY, which remembers up to twice as many
+ * keys as it holds, plus one for the ghost left by an eviction before the
+ * lists are trimmed. */
+static int kvpolicy_arc_init(kvpolicy_t *policy) {
+  policy->arc.ghosts = calloc(2 * policy->capacity + 1,
+      sizeof(kvpolicyghost_t));
+  if (policy->arc.ghosts == NULL)
+    return ENOMEM;
+  kvpolicy_arc_reset(policy);
+  return 0;
+}
+
+/* Adds SLOT to T2 if its key had a ghost, else to T1, then trims the ghost
+ * lists so that T1 and B1 hold at most CAPACITY keys, and all four lists at
+ * most twice that. */
+static void kvpolicy_arc_insert(kvpolicy_t *policy, int slot) {
+  unsigned int *sizes = policy->arc.sizes;
+  bool promote = kvpolicy_arc_adapt(policy, policy->nodes[slot].hash)
+      || policy->arc.promote;
+  policy->arc.promote = false;
+  kvpolicy_push(policy, slot, promote ? KVPOLICY_ARC_T2 : KVPOLICY_ARC_T1);
+  while (sizes[KVPOLICY_ARC_B1] > 0 && policy->sizes[KVPOLICY_ARC_T1]
+      + sizes[KVPOLICY_ARC_B1] > policy->capacity)
+    kvpolicy_arc_forget_lru(policy, KVPOLICY_ARC_B1);
+  while (policy->sizes[KVPOLICY_ARC_T1] + policy->sizes[KVPOLICY_ARC_T2]
+      + sizes[KVPOLICY_ARC_B1] + sizes[KVPOLICY_ARC_B2] > 2 * policy->capacity)
+    kvpolicy_arc_forget_lru(policy, sizes[KVPOLICY_ARC_B2] > 0
+        ? KVPOLICY_ARC_B2 : KVPOLICY_ARC_B1);
+}
+
+/* Moves SLOT, which has now been seen more than once, to the front of T2. */
+static void kvpolicy_arc_access(kvpolicy_t *policy, int slot) {
+  kvpolicy_move(policy, slot, KVPOLICY_ARC_T2);
+}
+
+/* Evicts the LRU entry of T1 if T1 exceeds its target size, else that of T2,
+ * leaving a ghost of it behind. A ghost hit by the incoming key adapts the
+ * target first, as in the paper's REPLACE. */
+static int kvpolicy_arc_evict(kvpolicy_t *policy, uint64_t hash) {
+  kvpolicyghost_t *ghost = kvpolicy_arc_find(policy, hash);
+  bool in_b2 = ghost != NULL && ghost->list == KVPOLICY_ARC_B2;
+  unsigned int t1 = policy->sizes[KVPOLICY_ARC_T1];
+  int slot;
+  if (kvpolicy_arc_adapt(policy, hash))
+    policy->arc.promote = true;
+  if (t1 > 0 && (t1 > policy->arc.target
+      || (in_b2 && t1 == policy->arc.target)
+      || policy->sizes[KVPOLICY_ARC_T2] == 0)) {
+    slot = kvpolicy_lru(policy, KVPOLICY_ARC_T1);
+    kvpolicy_arc_remember(policy, policy->nodes[slot].hash, KVPOLICY_ARC_B1);
+  } else {
+    slot = kvpolicy_lru(policy, KVPOLICY_ARC_T2);
+    kvpolicy_arc_remember(policy, policy->nodes[slot].hash, KVPOLICY_ARC_B2);
+  }
+  kvpolicy_unlink(policy, slot);
+  return slot;
+}
+
+static bool kvpolicy_arc_touch(kvpolicy_t *policy, int slot, uint64_t hash) {
+  return kvpolicy_buffer_read(policy, slot, hash);
+}
+
+/* Forgets every ghost of an ARC POLICY and resets its target. */
+static void kvpolicy_arc_clear(kvpolicy_t *policy) {
+  HASH_CLEAR(hh, policy->arc.table);
+  kvpolicy_arc_reset(policy);
+}
+
+static void kvpolicy_arc_destroy(kvpolicy_t *policy) {
+  HASH_CLEAR(hh, policy->arc.table);
+  free(policy->arc.ghosts);
+  policy->arc.ghosts = NULL;
+}
+
+/* Sizes the window and protected segment of a W-TinyLFU POLICY, each at least
+ * one slot if the set is big enough, and allocates its sketch. */
+static int kvpolicy_tinylfu_init(kvpolicy_t *policy) {
+  unsigned int main_cap;
+  policy->tinylfu.window_cap = policy->capacity * KVPOLICY_WINDOW_PERCENT / 100;
+  if (policy->tinylfu.window_cap == 0)
+    policy->tinylfu.window_cap = 1;
+  main_cap = policy->capacity - policy->tinylfu.window_cap;
+  policy->tinylfu.protected_cap = main_cap * KVPOLICY_PROTECTED_PERCENT / 100;
+  return kvsketch_init(&policy->tinylfu.sketch, policy->capacity);
+}
+
+/* Adds SLOT to the window of a W-TinyLFU POLICY. While the set has free
+ * slots, entries the window pushes out move to probation without a contest. */
+static void kvpolicy_tinylfu_insert(kvpolicy_t *policy, int slot) {
+  kvsketch_increment(&policy->tinylfu.sketch, policy->nodes[slot].hash);
+  kvpolicy_push(policy, slot, KVPOLICY_WINDOW);
+  while (policy->sizes[KVPOLICY_WINDOW] > policy->tinylfu.window_cap)
+    kvpolicy_move(policy, kvpolicy_lru(policy, KVPOLICY_WINDOW),
+        KVPOLICY_PROBATION);
+}
+
+/* Counts a use of SLOT in a W-TinyLFU POLICY and moves it up: within the
+ * window, or from probation to protected, demoting the LRU entry of the
+ * protected segment to probation if it overflows. */
+static void kvpolicy_tinylfu_access(kvpolicy_t *policy, int slot) {
+  kvpolicynode_t *node = &policy->nodes[slot];
+  kvsketch_increment(&policy->tinylfu.sketch, node->hash);
+  if (node->list == KVPOLICY_WINDOW || policy->tinylfu.protected_cap == 0) {
+    kvpolicy_move(policy, slot, node->list);
+    return;
+  }
+  kvpolicy_move(policy, slot, KVPOLICY_PROTECTED);
+  while (policy->sizes[KVPOLICY_PROTECTED] > policy->tinylfu.protected_cap)
+    kvpolicy_move(policy, kvpolicy_lru(policy, KVPOLICY_PROTECTED),
+        KVPOLICY_PROBATION);
+}
+
+/* Evicts either the LRU entry of the window of a W-TinyLFU POLICY or the LRU
+ * entry of its main area, whichever the sketch says is less frequent; ties
+ * go against the window's entry, so a key seen once never displaces one seen
+ * as often. A window entry which wins moves to probation. */
+static int kvpolicy_tinylfu_evict(kvpolicy_t *policy, uint64_t hash) {
+  kvsketch_t *sketch = &policy->tinylfu.sketch;
+  int candidate, victim = kvpolicy_lru(policy, KVPOLICY_PROBATION);
+  if (victim < 0)
+    victim = kvpolicy_lru(policy, KVPOLICY_PROTECTED);
+  if (policy->sizes[KVPOLICY_WINDOW] >= policy->tinylfu.window_cap
+      || victim < 0) {
+    candidate = kvpolicy_lru(policy, KVPOLICY_WINDOW);
+    if (victim >= 0
+        && kvsketch_estimate(sketch, policy->nodes[candidate].hash)
+        > kvsketch_estimate(sketch, policy->nodes[victim].hash))
+      kvpolicy_move(policy, candidate, KVPOLICY_PROBATION);
+    else
+      victim = candidate;
+  }
+  kvpolicy_unlink(policy, victim);
+  return victim;
+}
+
+static bool kvpolicy_tinylfu_touch(kvpolicy_t *policy, int slot,
+    uint64_t hash) {
+  return kvpolicy_buffer_read(policy, slot, hash);
+}
+
+static void kvpolicy_tinylfu_miss(kvpolicy_t *policy, uint64_t hash) {
+  kvsketch_increment(&policy->tinylfu.sketch, hash);
+}
+
+static void kvpolicy_tinylfu_clear(kvpolicy_t *policy) {
+  kvsketch_clear(&policy->tinylfu.sketch);
+}
+
+static void kvpolicy_tinylfu_destroy(kvpolicy_t *policy) {
+  kvsketch_destroy(&policy->tinylfu.sketch);
+}
+
+static const kvpolicy_ops_t kvpolicy_clock_ops = {
+  kvpolicy_clock_init, kvpolicy_clock_insert, kvpolicy_clock_access,
+  kvpolicy_clock_remove, kvpolicy_clock_evict, kvpolicy_clock_touch, NULL,
+  kvpolicy_clock_clear, kvpolicy_clock_destroy
+};
+
+static const kvpolicy_ops_t kvpolicy_arc_ops = {
+  kvpolicy_arc_init, kvpolicy_arc_insert, kvpolicy_arc_access,
+  kvpolicy_unlink, kvpolicy_arc_evict, kvpolicy_arc_touch, NULL,
+  kvpolicy_arc_clear, kvpolicy_arc_destroy
+};
+
+static const kvpolicy_ops_t kvpolicy_tinylfu_ops = {
+  kvpolicy_tinylfu_init, kvpolicy_tinylfu_insert, kvpolicy_tinylfu_access,
+  kvpolicy_unlink, kvpolicy_tinylfu_evict, kvpolicy_tinylfu_touch,
+  kvpolicy_tinylfu_miss, kvpolicy_tinylfu_clear, kvpolicy_tinylfu_destroy
+};
+
+/* Initializes POLICY, a policy of type TYPE for a set of CAPACITY slots, all
+ * of them empty. Returns 0 if successful, else a negative error code. */
+int kvpolicy_init(kvpolicy_t *policy, kvpolicy_type_t type,
+    unsigned int capacity) {
+  int ret;
+  memset(policy, 0, sizeof(kvpolicy_t));
+  switch (type) {
+    case KVPOLICY_CLOCK:
+      policy->ops = &kvpolicy_clock_ops;
+      break;
+    case KVPOLICY_ARC:
+      policy->ops = &kvpolicy_arc_ops;
+      break;
+    case KVPOLICY_TINYLFU:
+      policy->ops = &kvpolicy_tinylfu_ops;
+      break;
+    default:
+      return -1;
+  }
+  policy->type = type;
+  policy->capacity = capacity;
+  policy->nodes = calloc(capacity, sizeof(kvpolicynode_t));
+  if (policy->nodes == NULL)
+    return ENOMEM;
+  if ((ret = policy->ops->init(policy)) != 0) {
+    free(policy->nodes);
+    policy->nodes = NULL;
+  }
+  return ret;
+}
+
+/* Notes that SLOT of POLICY, which was empty, now holds the key whose
+ * kvhash_key is HASH. */
+void kvpolicy_insert(kvpolicy_t *policy, int slot, uint64_t hash) {
+  policy->nodes[slot].hash = hash;
+  policy->ops->insert(policy, slot);
+}
+
+/* Notes that the entry in SLOT of POLICY was used by a writer. */
+void kvpolicy_access(kvpolicy_t *policy, int slot) {
+  policy->ops->access(policy, slot);
+}
+
+/* Notes that SLOT of POLICY was emptied, other than by kvpolicy_evict. */
+void kvpolicy_remove(kvpolicy_t *policy, int slot) {
+  policy->ops->remove(policy, slot);
+}
+
+/* Picks the slot of POLICY to evict to make room for the key whose
+ * kvhash_key is HASH. Must only be called when every slot is in use. Returns
+ * the slot, which POLICY then considers empty. */
+int kvpolicy_evict(kvpolicy_t *policy, uint64_t hash) {
+  return policy->ops->evict(policy, hash);
+}
+
+/* Notes that a GET read the entry in SLOT of POLICY, whose kvhash_key is
+ * HASH. Takes no lock. Returns true if the caller should drain POLICY, should
+ * it manage to take the set's lock without waiting. */
+bool kvpolicy_touch(kvpolicy_t *policy, int slot, uint64_t hash) {
+  return policy->ops->touch(policy, slot, hash);
+}
+
+/* Notes that a GET missed the key whose kvhash_key is HASH. Takes no lock. */
+void kvpolicy_miss(kvpolicy_t *policy, uint64_t hash) {
+  if (policy->ops->miss != NULL)
+    policy->ops->miss(policy, hash);
+}
+
+/* Replays the reads buffered by kvpolicy_touch into POLICY, skipping those
+ * whose slot has since been emptied or given to another key. */
+void kvpolicy_drain(kvpolicy_t *policy) {
+  unsigned int tail = __atomic_load_n(&policy->buffer_tail, __ATOMIC_ACQUIRE);
+  unsigned int head = policy->buffer_head;
+  uint64_t read;
+  int slot;
+  /* Reads more than a buffer behind have been overwritten. */
+  if (tail - head > KVPOLICY_BUFFER_SIZE)
+    head = tail - KVPOLICY_BUFFER_SIZE;
+  for (; head != tail; head++) {
+    read = __atomic_exchange_n(
+        &policy->buffer[head & (KVPOLICY_BUFFER_SIZE - 1)], 0,
+        __ATOMIC_ACQUIRE);
+    if (read == 0)
+      continue;
+    slot = (int) (read >> 32) - 1;
+    if (slot < (int) policy->capacity
+        && policy->nodes[slot].list != KVPOLICY_NONE
+        && (uint32_t) policy->nodes[slot].hash == (uint32_t) read)
+      policy->ops->access(policy, slot);
+  }
+  __atomic_store_n(&policy->buffer_head, tail, __ATOMIC_RELAXED);
+}
+
+/* Empties every slot of POLICY and drops its buffered reads. */
+void kvpolicy_clear(kvpolicy_t *policy) {
+  unsigned int i;
+  for (i = 0; i < policy->capacity; i++) {
+    policy->nodes[i].list = KVPOLICY_NONE;
+    policy->nodes[i].refbit = false;
+  }
+  for (i = 0; i < KVPOLICY_NUM_LISTS; i++) {
+    policy->lists[i] = NULL;
+    policy->sizes[i] = 0;
+  }
+  for (i = 0; i < KVPOLICY_BUFFER_SIZE; i++)
+    __atomic_store_n(&policy->buffer[i], 0, __ATOMIC_RELAXED);
+  policy->buffer_head = __atomic_load_n(&policy->buffer_tail,
+      __ATOMIC_RELAXED);
+  policy->ops->clear(policy);
+}
+
+/* Frees the state of POLICY. */
+void kvpolicy_destroy(kvpolicy_t *policy) {
+  if (policy->nodes == NULL)
+    return;
+  policy->ops->destroy(policy);
+  free(policy->nodes);
+  policy->nodes = NULL;
+}
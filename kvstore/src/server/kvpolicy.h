@@ -0,0 +1,174 @@
+#ifndef __KV_POLICY__
+#define __KV_POLICY__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "kvsketch.h"
+#include "uthash.h"
+
+/* KVPolicy is the replacement policy of a KVCacheSet: it decides which entry
+ * is evicted when a full set is given a new one. The set owns the slots its
+ * entries live in, and tells its policy about every slot it fills, reads or
+ * empties; the policy keeps whatever order it needs over those slots and
+ * names the victim when asked. A policy is a table of functions,
+ * kvpolicy_ops_t, plus the state kept in kvpolicy_t, so another policy may be
+ * added by writing a new table. Three are provided:
+ *
+ * KVPOLICY_CLOCK is second chance, described in kvcache.h, and is the
+ * default. It is cheap, but a scan of keys read once sweeps the hand over the
+ * whole set, clearing every reference bit, and flushes the set.
+ *
+ * KVPOLICY_ARC is the Adaptive Replacement Cache of Megiddo and Modha. Entries
+ * seen once live in list T1 and entries seen again in list T2, both kept in
+ * LRU order. The hashes of keys recently evicted from each are remembered in
+ * the ghost lists B1 and B2; a miss on a ghost of B1 means T1 was too small,
+ * and grows the target size of T1, while a miss on a ghost of B2 shrinks it.
+ * A scan only ever churns T1, so entries in T2 survive it.
+ *
+ * KVPOLICY_TINYLFU is W-TinyLFU, as in Caffeine. New entries enter a small
+ * LRU window, of KVPOLICY_WINDOW_PERCENT of the set. The entry the window
+ * pushes out must then beat the LRU entry of the main area, by the frequency
+ * a KVSketch estimates for each, to stay in the cache. The main area is a
+ * segmented LRU: entries enter its probation segment and move to the
+ * protected segment, of KVPOLICY_PROTECTED_PERCENT of the main area, when hit
+ * again. Keys read once never win against popular ones, so a scan only
+ * churns the window.
+ *
+ * All calls are made with the set write-locked, except kvpolicy_touch and
+ * kvpolicy_miss, which lock-free GETs make. CLOCK's touch just sets the
+ * slot's reference bit. ARC and W-TinyLFU cannot reorder their lists without
+ * the lock, so a touch appends the slot, along with the low half of its hash,
+ * to a ring buffer of KVPOLICY_BUFFER_SIZE reads, which kvpolicy_drain
+ * replays into the lists. Writers drain the buffer before changing the set,
+ * and a GET which finds the buffer half full drains it itself if it can take
+ * the lock without waiting. The buffer is lossy: a read made while it is full
+ * overwrites an older one, and a replayed read is ignored if its slot has
+ * since been given to another key. Lost reads only make the order a little
+ * less exact. W-TinyLFU counts in its sketch every read it replays, every
+ * PUT and, straight away since the sketch needs no lock, every miss.
+ */
+
+/* The replacement policies. */
+typedef enum {
+  KVPOLICY_CLOCK,
+  KVPOLICY_ARC,
+  KVPOLICY_TINYLFU
+} kvpolicy_type_t;
+
+/* The number of reads the ring buffer holds (a power of two). */
+#define KVPOLICY_BUFFER_SIZE 64
+
+/* The share of a W-TinyLFU set given to its window, as a percentage. */
+#define KVPOLICY_WINDOW_PERCENT 1
+
+/* The share of a W-TinyLFU main area given to its protected segment. */
+#define KVPOLICY_PROTECTED_PERCENT 80
+
+/* The lists a slot may be on. Policies use the lists they need. */
+#define KVPOLICY_NONE 0          /* The slot holds no entry. */
+#define KVPOLICY_CLOCK_RING 1    /* CLOCK keeps no list; its slots are marked as in use. */
+#define KVPOLICY_ARC_T1 1        /* ARC entries seen once. */
+#define KVPOLICY_ARC_T2 2        /* ARC entries seen at least twice. */
+#define KVPOLICY_WINDOW 1        /* W-TinyLFU window. */
+#define KVPOLICY_PROBATION 2     /* W-TinyLFU main area, probation segment. */
+#define KVPOLICY_PROTECTED 3     /* W-TinyLFU main area, protected segment. */
+#define KVPOLICY_NUM_LISTS 4
+
+/* The ghost lists of ARC. */
+#define KVPOLICY_ARC_B1 0
+#define KVPOLICY_ARC_B2 1
+
+/* The policy's view of a single slot of a set. */
+typedef struct kvpolicynode {
+  uint64_t hash;                  /* The kvhash_key of the slot's key. */
+  unsigned char list;             /* The list holding this slot, or KVPOLICY_NONE. */
+  bool refbit;                    /* CLOCK: set if the entry was used since the hand passed. */
+  struct kvpolicynode *prev;      /* The neighbours of this slot in LIST. */
+  struct kvpolicynode *next;
+} kvpolicynode_t;
+
+/* A key recently evicted by ARC, remembered by its hash alone. */
+typedef struct kvpolicyghost {
+  uint64_t hash;                  /* The kvhash_key of the evicted key. */
+  unsigned char list;             /* KVPOLICY_ARC_B1 or KVPOLICY_ARC_B2. */
+  struct kvpolicyghost *prev;     /* The neighbours of this ghost in its list. */
+  struct kvpolicyghost *next;
+  UT_hash_handle hh;              /* Finds ghosts by HASH. */
+} kvpolicyghost_t;
+
+typedef struct kvpolicy kvpolicy_t;
+
+/* The functions implementing a policy. All but TOUCH and MISS are called with
+ * the set write-locked; MISS may be NULL. */
+typedef struct {
+  /* Sets up the policy's own state. Returns 0 if successful, else a negative
+   * error code. */
+  int (*init)(kvpolicy_t *);
+  /* Notes that SLOT, which was empty, now holds the entry whose hash is in
+   * its node. */
+  void (*insert)(kvpolicy_t *, int slot);
+  /* Notes that the entry in SLOT was used. */
+  void (*access)(kvpolicy_t *, int slot);
+  /* Notes that SLOT was emptied other than by eviction. */
+  void (*remove)(kvpolicy_t *, int slot);
+  /* Picks the slot to evict to make room for the entry whose hash is HASH,
+   * in a set whose every slot is in use, and forgets it. Returns the slot. */
+  int (*evict)(kvpolicy_t *, uint64_t hash);
+  /* Notes, without the lock, that the entry in SLOT, whose hash is HASH, was
+   * read. Returns true if the ring buffer should be drained. */
+  bool (*touch)(kvpolicy_t *, int slot, uint64_t hash);
+  /* Notes, without the lock, that the key whose hash is HASH was missed. */
+  void (*miss)(kvpolicy_t *, uint64_t hash);
+  /* Forgets every slot. */
+  void (*clear)(kvpolicy_t *);
+  /* Frees the policy's own state. */
+  void (*destroy)(kvpolicy_t *);
+} kvpolicy_ops_t;
+
+/* The replacement policy of a set of CAPACITY slots. */
+struct kvpolicy {
+  const kvpolicy_ops_t *ops;      /* The functions implementing this policy. */
+  kvpolicy_type_t type;           /* Which policy OPS implements. */
+  unsigned int capacity;          /* The number of slots in the set. */
+  kvpolicynode_t *nodes;          /* One node per slot. */
+  kvpolicynode_t *lists[KVPOLICY_NUM_LISTS];  /* Each list, most recently used first. */
+  unsigned int sizes[KVPOLICY_NUM_LISTS];     /* The number of slots on each list. */
+  uint64_t buffer[KVPOLICY_BUFFER_SIZE];      /* Reads not yet replayed, 0 if empty. */
+  unsigned int buffer_tail;       /* The number of reads ever made. */
+  unsigned int buffer_head;       /* The number of reads ever replayed or lost. */
+  union {
+    struct {
+      unsigned int hand;          /* The next slot considered for eviction. */
+    } clock;
+    struct {
+      unsigned int target;        /* The size T1 is steered towards. */
+      bool promote;               /* The entry being added hit a ghost. */
+      kvpolicyghost_t *ghosts;    /* The 2 * CAPACITY + 1 ghosts. */
+      kvpolicyghost_t *free;      /* The ghosts on neither ghost list. */
+      kvpolicyghost_t *table;     /* The ghosts on a ghost list, by hash. */
+      kvpolicyghost_t *lists[2];  /* B1 and B2, most recently evicted first. */
+      unsigned int sizes[2];      /* The number of ghosts on B1 and B2. */
+    } arc;
+    struct {
+      unsigned int window_cap;    /* The size of the window. */
+      unsigned int protected_cap; /* The size of the protected segment. */
+      kvsketch_t sketch;          /* The frequencies of recently seen keys. */
+    } tinylfu;
+  };
+};
+
+int kvpolicy_init(kvpolicy_t *, kvpolicy_type_t, unsigned int capacity);
+
+void kvpolicy_insert(kvpolicy_t *, int slot, uint64_t hash);
+void kvpolicy_access(kvpolicy_t *, int slot);
+void kvpolicy_remove(kvpolicy_t *, int slot);
+int kvpolicy_evict(kvpolicy_t *, uint64_t hash);
+
+bool kvpolicy_touch(kvpolicy_t *, int slot, uint64_t hash);
+void kvpolicy_miss(kvpolicy_t *, uint64_t hash);
+void kvpolicy_drain(kvpolicy_t *);
+
+void kvpolicy_clear(kvpolicy_t *);
+void kvpolicy_destroy(kvpolicy_t *);
+
+#endif
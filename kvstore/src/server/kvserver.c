@@ -2,12 +2,17 @@
 #include <stdio.h>
 #include <errno.h>
 #include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 #include "kvconstants.h"
+#include "kvhash.h"
 #include "kvcache.h"
 #include "kvstore.h"
 #include "kvmessage.h"
 #include "kvserver.h"
+#include "kvstats.h"
 #include "tpclog.h"
+#include "tpcmaster.h"
 #include "socket_server.h"
 
 /* Initializes a kvserver. Will return 0 if successful, or a negative error
@@ -19,11 +24,24 @@
 int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
     int port, bool use_tpc) {
+  return kvserver_init_backend(server, dirname, num_sets, elem_per_set,
+      max_threads, hostname, port, use_tpc, KVSTORE_FILES, KVPOLICY_CLOCK);
+}
+
+/* Initializes a kvserver as kvserver_init does, with its store laid out as
+ * BACKEND and its cache evicting entries according to POLICY. Returns 0 if
+ * successful, or a negative error code if not. */
+int kvserver_init_backend(kvserver_t *server, char *dirname,
+    unsigned int num_sets, unsigned int elem_per_set, unsigned int max_threads,
+    const char *hostname, int port, bool use_tpc, kvstore_backend_t backend,
+    kvpolicy_type_t policy) {
   int ret;
-  ret = kvcache_init(&server->cache, num_sets, elem_per_set);
+  ret = kvcache_init_policy(&server->cache, num_sets, elem_per_set, policy);
   if (ret < 0) return ret;
-  ret = kvstore_init(&server->store, dirname);
+  ret = kvstore_init_backend(&server->store, dirname, backend);
   if (ret < 0) return ret;
+  ret = kvstats_init(&server->stats);
+  if (ret != 0) return ret;
   if (use_tpc) {
       ret = tpclog_init(&server->log, dirname);
       if (ret < 0) return ret;
@@ -36,7 +54,15 @@ int kvserver_init(kvserver_t *server, char *dirname, unsigned int num_sets,
   server->use_tpc = use_tpc;
   server->max_threads = max_threads;
   server->handle = kvserver_handle;
-  server->tpc_op = NULL;
+  server->txns = NULL;
+  server->txn_keys = NULL;
+  server->checkpointing = false;
+  server->write_back = false;
+  server->use_wal = false;
+  ret = pthread_mutex_init(&server->txn_lock, NULL);
+  if (ret != 0) return -ret;
+  ret = pthread_cond_init(&server->txn_done, NULL);
+  if (ret != 0) return -ret;
   return 0;
 }
 
@@ -49,6 +75,7 @@ int kvserver_register_master(kvserver_t *server, int sockfd) {
   kvmessage_t reqmsg, *respmsg;
   memset(&reqmsg, 0, sizeof(kvmessage_t));
   reqmsg.type = REGISTER;
+  reqmsg.format = KVMESSAGE_BINARY;
   reqmsg.key = server->hostname;
   char buf[256];
   sprintf(buf, "%d", server->port);
@@ -59,18 +86,49 @@ int kvserver_register_master(kvserver_t *server, int sockfd) {
   return 0;
 }
 
+/* Sends a message to deregister SERVER from a TPCMaster over a socket located
+ * at SOCKFD which has previously been connected, so that the master moves
+ * SERVER's data to other slaves. Does not close the socket when done.
+ * Returns 0 if successful, else -1. */
+int kvserver_deregister_master(kvserver_t *server, int sockfd) {
+  kvmessage_t reqmsg, *respmsg;
+  char port[16];
+  int ret;
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = DEREGISTER;
+  reqmsg.format = KVMESSAGE_BINARY;
+  reqmsg.key = server->hostname;
+  sprintf(port, "%d", server->port);
+  reqmsg.value = port;
+  kvmessage_send(&reqmsg, sockfd);
+  respmsg = kvmessage_parse(sockfd);
+  if (respmsg == NULL)
+    return -1;
+  ret = (respmsg->message && strcmp(respmsg->message, MSG_SUCCESS) == 0) ? 0 : -1;
+  kvmessage_free(respmsg);
+  return ret;
+}
 
 /* Attempts to get KEY from SERVER. Returns 0 if successful, else a negative
  * error code.  If successful, VALUE will point to a string which should later
  * be free()d.  If the KEY is in cache, take the value from there. Otherwise,
- * go to the store and update the value in the cache. */
+ * go to the store and update the value in the cache. KEY is hashed once, for
+ * both. */
 int kvserver_get(kvserver_t *server, char *key, char **value) {
+  uint64_t hash = kvhash_key(key);
+  uint64_t start;
   int x;
-  x = kvcache_get(&(server->cache), key, value);
+  x = kvcache_get_hashed(&(server->cache), key, hash, value);
+  kvstats_count(&server->stats, (x == 0 || x == ERRDELETED)
+      ? KVSTATS_CACHE_HIT : KVSTATS_CACHE_MISS);
+  if (x == ERRDELETED)
+    return ERRNOKEY;
   if (x!=0) {
-    x = kvstore_get(&(server->store), key, value);
+    start = kvstats_now();
+    x = kvstore_get_hashed(&(server->store), key, hash, value);
+    kvstats_time(&server->stats, KVSTATS_STORE_READ, start);
     if (x==0) {
-      kvcache_put(&(server->cache), key, *value);
+      kvcache_put_hashed(&(server->cache), key, hash, *value);
     }
   }
   return x;
@@ -82,45 +140,947 @@ int kvserver_put_check(kvserver_t *server, char *key, char *value) {
   return kvstore_put_check(&(server->store), key, value);
 }
 
+/* Logs the PUT of KEY and VALUE, or the DEL of KEY if VALUE is NULL, to the
+ * write-ahead log of the server _SERVER. Called by the cache with the set of
+ * KEY write-locked, so that writes to KEY are logged in the order they reach
+ * the cache. Returns 0 if successful, else a negative error code. */
+static int kvserver_log_write(char *key, char *value, void *_server) {
+  kvserver_t *server = (kvserver_t *) _server;
+  uint64_t start = kvstats_now();
+  int ret;
+  ret = tpclog_log(&server->log, value != NULL ? PUTREQ : DELREQ, key, value);
+  kvstats_time(&server->stats, KVSTATS_LOG_WRITE, start);
+  return ret;
+}
+
+/* Leaves the PUT of KEY and VALUE, or the DEL of KEY if VALUE is NULL, whose
+ * kvhash_key is HASH, in the cache of SERVER as a dirty entry for the
+ * flusher, logging it to the
+ * write-ahead log of SERVER first if it has one. A flush waiting for a
+ * checkpoint holds back new writes until those already logged are in the
+ * cache. Returns 0 if successful, else a negative error code. */
+static int kvserver_write_dirty(kvserver_t *server, char *key, uint64_t hash,
+    char *value) {
+  int ret;
+  if (server->use_wal) {
+    pthread_mutex_lock(&server->flush_lock);
+    while (server->drainers > 0)
+      pthread_cond_wait(&server->wal_cond, &server->flush_lock);
+    server->wal_writers++;
+    pthread_mutex_unlock(&server->flush_lock);
+  }
+  if (value != NULL)
+    ret = kvcache_put_dirty_hashed(&server->cache, key, hash, value);
+  else
+    ret = kvcache_del_dirty_hashed(&server->cache, key, hash);
+  if (server->use_wal) {
+    pthread_mutex_lock(&server->flush_lock);
+    if (--server->wal_writers == 0 && server->drainers > 0)
+      pthread_cond_broadcast(&server->wal_cond);
+    pthread_mutex_unlock(&server->flush_lock);
+  }
+  return ret;
+}
+
 /* Inserts the given KEY, VALUE pair into this server's store and cache. Access
  * to the cache should be concurrent if the keys are in different cache sets.
+ * In write-back mode, the pair only goes to the cache, as a dirty entry.
  * Returns 0 if successful, else a negative error code. */
 int kvserver_put(kvserver_t *server, char *key, char *value) {
+  uint64_t hash = kvhash_key(key);
+  uint64_t start = kvstats_now();
   int x, y;
-  x =  kvstore_put(&(server->store), key, value);
-  y =  kvcache_put(&(server->cache), key, value);
+  if (server->write_back)
+    return kvserver_write_dirty(server, key, hash, value);
+  x =  kvstore_put_hashed(&(server->store), key, hash, value);
+  kvstats_time(&server->stats, KVSTATS_STORE_WRITE, start);
+  y =  kvcache_put_hashed(&(server->cache), key, hash, value);
   return x || y;
 }
 
-/* Checks if the given KEY can be deleted from this server's store.
- * Returns 0 if it can, else a negative error code. */
+/* Checks if the given KEY, whose kvhash_key is HASH, can be deleted from this
+ * server's store. Returns 0 if it can, else a negative error code. In
+ * write-back mode, the cache is checked first, as it may hold writes the
+ * store has not seen. */
+static int kvserver_del_check_hashed(kvserver_t *server, char *key,
+    uint64_t hash) {
+  kvchunk_t *value;
+  int ret;
+  if (server->write_back) {
+    ret = kvcache_get_chunk_hashed(&server->cache, key, hash, &value);
+    if (ret == 0)
+      kvchunk_release(value);
+    if (ret == 0 || ret == ERRKEYLEN)
+      return ret;
+    if (ret == ERRDELETED)
+      return ERRNOKEY;
+  }
+  return kvstore_del_check_hashed(&(server->store), key, hash);
+}
+
+/* As kvserver_del_check_hashed, hashing KEY itself. */
 int kvserver_del_check(kvserver_t *server, char *key) {
-  return kvstore_del_check(&(server->store), key);
+  return kvserver_del_check_hashed(server, key, kvhash_key(key));
 }
 
 /* Removes the given KEY from this server's store and cache. Access to the
- * cache should be concurrent if the keys are in different cache sets. Returns
- * 0 if successful, else a negative error code. */
+ * cache should be concurrent if the keys are in different cache sets. In
+ * write-back mode, KEY is only held as deleted by the cache, as a dirty
+ * entry. Returns 0 if successful, else a negative error code. */
 int kvserver_del(kvserver_t *server, char *key) {
+  uint64_t hash = kvhash_key(key);
+  uint64_t start = kvstats_now();
   int x, y;
-  x =  kvstore_del(&(server->store), key);
-  y =  kvcache_del(&(server->cache), key);
+  if (server->write_back) {
+    if ((x = kvserver_del_check_hashed(server, key, hash)) != 0)
+      return x;
+    return kvserver_write_dirty(server, key, hash, NULL);
+  }
+  x =  kvstore_del_hashed(&(server->store), key, hash);
+  kvstats_time(&server->stats, KVSTATS_STORE_WRITE, start);
+  y =  kvcache_del_hashed(&(server->cache), key, hash);
   return x || y;
 }
 
-/* Returns an info string about SERVER including its hostname and port. */
-char *kvserver_get_info_message(kvserver_t *server) {
-  char info[1024], buf[256];
+/* Returns an info string about SERVER including its hostname and port,
+ * followed by its stats, or NULL if there is not enough memory. The string
+ * is malloced and should later be freed. If FORMAT is KVSTATS_JSON, the
+ * string is a JSON object holding the time, hostname, port and stats. */
+char *kvserver_get_info_message(kvserver_t *server, char *format) {
+  char info[1024], buf[256], *stats, *msg;
+  json_object *json;
   time_t ltime = time(NULL);
+  if (format != NULL && strcmp(format, KVSTATS_JSON) == 0) {
+    json = kvstats_json(&server->stats);
+    json_object_object_add(json, "timestamp", json_object_new_int64(ltime));
+    json_object_object_add(json, "host",
+        json_object_new_string(server->hostname));
+    json_object_object_add(json, "port", json_object_new_int(server->port));
+    stats = (char *) json_object_to_json_string(json);
+    if ((msg = malloc(strlen(stats) + 1)) != NULL)
+      strcpy(msg, stats);
+    json_object_put(json);
+    return msg;
+  }
   strcpy(info, asctime(localtime(&ltime)));
-  sprintf(buf, "{%s, %d}", server->hostname, server->port);
+  sprintf(buf, "{%s, %d}\nStats:\n", server->hostname, server->port);
   strcat(info, buf);
-  char *msg = malloc(strlen(info));
-  strcpy(msg, info);
+  if ((stats = kvstats_text(&server->stats)) == NULL)
+    return NULL;
+  if ((msg = malloc(strlen(info) + strlen(stats) + 1)) != NULL) {
+    strcpy(msg, info);
+    strcat(msg, stats);
+  }
+  free(stats);
   return msg;
 }
 
 
+/* Writes the dirty cache entry KEY and VALUE, or the deletion of KEY if VALUE
+ * is NULL, to the store of the server _SERVER. Deleting a key which the
+ * store does not have succeeds. Returns 0 if successful, else a negative
+ * error code. */
+static int kvserver_write_entry(char *key, char *value, void *_server) {
+  kvserver_t *server = (kvserver_t *) _server;
+  uint64_t start = kvstats_now();
+  int ret;
+  if (value != NULL)
+    ret = kvstore_put(&server->store, key, value);
+  else if ((ret = kvstore_del(&server->store, key)) == ERRNOKEY)
+    ret = 0;
+  kvstats_time(&server->stats, KVSTATS_STORE_WRITE, start);
+  if (ret == 0)
+    kvstats_count(&server->stats, KVSTATS_WRITE_BACK);
+  return ret;
+}
+
+/* Writes every PUT and DEL left in the write-ahead log of SERVER by a
+ * previous run to its store, in order, then empties the log. Returns 0 if
+ * successful, else a negative error code. */
+static int kvserver_replay_wal(kvserver_t *server) {
+  logentry_t *op;
+  int ret = 0;
+  tpclog_iterate_begin(&server->log);
+  while ((op = tpclog_iterate_next(&server->log)) != NULL) {
+    if (ret == 0 && op->type == PUTREQ)
+      ret = kvserver_write_entry(op->data, op->data + strlen(op->data) + 1,
+          server);
+    else if (ret == 0 && op->type == DELREQ)
+      ret = kvserver_write_entry(op->data, NULL, server);
+    free(op);
+  }
+  return (ret == 0) ? tpclog_clear_log(&server->log) : ret;
+}
+
+/* The body of the flusher thread of the server _SERVER: flushes its cache
+ * every FLUSH_INTERVAL milliseconds until told to stop. */
+static void *kvserver_flusher(void *_server) {
+  kvserver_t *server = (kvserver_t *) _server;
+  struct timespec deadline;
+  pthread_mutex_lock(&server->flush_lock);
+  while (!server->stopping) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += server->flush_interval / 1000;
+    deadline.tv_nsec += (server->flush_interval % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec += 1;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&server->flush_cond, &server->flush_lock, &deadline);
+    if (server->stopping)
+      break;
+    pthread_mutex_unlock(&server->flush_lock);
+    kvserver_flush(server);
+    pthread_mutex_lock(&server->flush_lock);
+  }
+  pthread_mutex_unlock(&server->flush_lock);
+  return NULL;
+}
+
+/* Starts the flusher thread of SERVER. Returns 0 if successful, else a
+ * negative error code. */
+static int kvserver_start_flusher(kvserver_t *server) {
+  server->stopping = false;
+  return -pthread_create(&server->flusher, NULL, kvserver_flusher, server);
+}
+
+/* Stops the flusher thread of SERVER and waits for it to exit. */
+static void kvserver_stop_flusher(kvserver_t *server) {
+  pthread_mutex_lock(&server->flush_lock);
+  server->stopping = true;
+  pthread_cond_signal(&server->flush_cond);
+  pthread_mutex_unlock(&server->flush_lock);
+  pthread_join(server->flusher, NULL);
+}
+
+/* Destroys the lock and condition variables SERVER uses in write-back mode,
+ * once its flusher has stopped. */
+static void kvserver_destroy_flush_sync(kvserver_t *server) {
+  pthread_cond_destroy(&server->wal_cond);
+  pthread_cond_destroy(&server->flush_cond);
+  pthread_mutex_destroy(&server->flush_lock);
+}
+
+/* Switches the non-TPC SERVER to write-back mode, flushing its cache every
+ * FLUSH_INTERVAL milliseconds, and logging each write to a write-ahead log
+ * in the store's directory first if USE_WAL. Writes left in that log by a
+ * previous run are written to the store before anything else. Must not be
+ * called while SERVER is handling requests. Returns 0 if successful, else a
+ * negative error code. */
+int kvserver_enable_write_back(kvserver_t *server, unsigned int flush_interval,
+    bool use_wal) {
+  int ret;
+  if (server->use_tpc || server->write_back || flush_interval == 0)
+    return -1;
+  if (use_wal) {
+    if ((ret = tpclog_init(&server->log, server->store.dirname)) < 0)
+      return ret;
+    if ((ret = kvserver_replay_wal(server)) != 0) {
+      tpclog_destroy(&server->log);
+      return ret;
+    }
+  }
+  if ((ret = pthread_mutex_init(&server->flush_lock, NULL)) != 0
+      || (ret = pthread_cond_init(&server->flush_cond, NULL)) != 0
+      || (ret = pthread_cond_init(&server->wal_cond, NULL)) != 0)
+    return -ret;
+  server->use_wal = use_wal;
+  server->flush_interval = flush_interval;
+  server->wal_writers = 0;
+  server->drainers = 0;
+  kvcache_set_write_back(&server->cache, kvserver_write_entry, server);
+  if (use_wal)
+    kvcache_set_write_ahead(&server->cache, kvserver_log_write, server);
+  server->write_back = true;
+  if ((ret = kvserver_start_flusher(server)) != 0) {
+    server->write_back = false;
+    server->use_wal = false;
+    kvcache_set_write_back(&server->cache, NULL, NULL);
+    kvcache_set_write_ahead(&server->cache, NULL, NULL);
+    kvserver_destroy_flush_sync(server);
+  }
+  return ret;
+}
+
+/* Writes every dirty entry of SERVER's cache back to its store. With a
+ * write-ahead log, the LSN the log has reached is noted first, once every
+ * write logged before it is in the cache, and the log is truncated below it
+ * if every entry was written back. Does nothing outside of write-back mode.
+ * Returns 0 if successful, else a negative error code. */
+int kvserver_flush(kvserver_t *server) {
+  uint64_t checkpoint = 0;
+  int ret;
+  if (!server->write_back)
+    return 0;
+  if (server->use_wal) {
+    pthread_mutex_lock(&server->flush_lock);
+    server->drainers++;
+    while (server->wal_writers > 0)
+      pthread_cond_wait(&server->wal_cond, &server->flush_lock);
+    checkpoint = tpclog_next_lsn(&server->log);
+    if (--server->drainers == 0)
+      pthread_cond_broadcast(&server->wal_cond);
+    pthread_mutex_unlock(&server->flush_lock);
+  }
+  ret = kvcache_flush(&server->cache);
+  if (ret == 0 && server->use_wal)
+    ret = tpclog_truncate(&server->log, checkpoint);
+  return ret;
+}
+
+/* Switches SERVER back to writing through, after stopping its flusher and
+ * writing back every dirty entry of its cache. If an entry cannot be written
+ * back, SERVER stays in write-back mode, with its flusher running again.
+ * Must not be called while SERVER is handling requests. Returns 0 if
+ * successful, else a negative error code. */
+int kvserver_disable_write_back(kvserver_t *server) {
+  int ret;
+  if (!server->write_back)
+    return 0;
+  kvserver_stop_flusher(server);
+  if ((ret = kvserver_flush(server)) != 0) {
+    kvserver_start_flusher(server);
+    return ret;
+  }
+  server->write_back = false;
+  kvcache_set_write_back(&server->cache, NULL, NULL);
+  kvcache_set_write_ahead(&server->cache, NULL, NULL);
+  if (server->use_wal) {
+    tpclog_clear_log(&server->log);
+    tpclog_destroy(&server->log);
+  }
+  server->use_wal = false;
+  kvserver_destroy_flush_sync(server);
+  return 0;
+}
+
+
+/* Returns the prepared transaction of SERVER which writes KEY, or NULL if
+ * there is none. Must be called with SERVER's txn_lock held. */
+static tpctxn_t *kvserver_txn_for_key(kvserver_t *server, char *key) {
+  tpctxnkey_t *found;
+  HASH_FIND_STR(server->txn_keys, key, found);
+  return (found != NULL) ? found->txn : NULL;
+}
+
+/* Returns the checkpoint LSN of SERVER's log: the LSN of the oldest entry
+ * which prepared a transaction that is still prepared, or UINT64_MAX if there
+ * is none. No entry before it is needed by kvserver_rebuild_state. Must be
+ * called with SERVER's txn_lock held. */
+static uint64_t kvserver_checkpoint_lsn(kvserver_t *server) {
+  tpctxn_t *txn, *tmp;
+  uint64_t lsn = UINT64_MAX;
+  HASH_ITER(hh, server->txns, txn, tmp) {
+    if (txn->lsn < lsn)
+      lsn = txn->lsn;
+  }
+  return lsn;
+}
+
+/* Adds a prepared transaction TXID of type TYPE writing the NUM_PAIRS keys
+ * and values of PAIRS (whose values are ignored for a DELREQ), logged at
+ * LSN, to SERVER. Must be called with SERVER's txn_lock held. Returns 0 if
+ * successful, else a negative error code. */
+static int kvserver_txn_add(kvserver_t *server, uint64_t txid, msgtype_t type,
+    kvpair_t *pairs, unsigned int num_pairs, uint64_t lsn) {
+  tpctxn_t *txn = calloc(1, sizeof(tpctxn_t));
+  unsigned int i;
+  if (txn == NULL)
+    return -1;
+  txn->txid = txid;
+  txn->type = type;
+  txn->lsn = lsn;
+  txn->pairs = calloc(num_pairs, sizeof(kvpair_t));
+  txn->keys = calloc(num_pairs, sizeof(tpctxnkey_t));
+  if (txn->pairs == NULL || txn->keys == NULL)
+    goto error;
+  for (i = 0; i < num_pairs; i++, txn->num_pairs++) {
+    txn->pairs[i].key = malloc(strlen(pairs[i].key) + 1);
+    if (txn->pairs[i].key == NULL)
+      goto error;
+    strcpy(txn->pairs[i].key, pairs[i].key);
+    if (type == PUTREQ) {
+      txn->pairs[i].value = malloc(strlen(pairs[i].value) + 1);
+      if (txn->pairs[i].value == NULL) {
+        txn->num_pairs++;
+        goto error;
+      }
+      strcpy(txn->pairs[i].value, pairs[i].value);
+    }
+  }
+  for (i = 0; i < num_pairs; i++) {
+    txn->keys[i].key = txn->pairs[i].key;
+    txn->keys[i].txn = txn;
+    HASH_ADD_KEYPTR(hh, server->txn_keys, txn->keys[i].key,
+        strlen(txn->keys[i].key), &txn->keys[i]);
+  }
+  HASH_ADD(hh, server->txns, txid, sizeof(uint64_t), txn);
+  return 0;
+
+error:
+  for (i = 0; i < txn->num_pairs; i++) {
+    free(txn->pairs[i].key);
+    free(txn->pairs[i].value);
+  }
+  free(txn->pairs);
+  free(txn->keys);
+  free(txn);
+  return -1;
+}
+
+/* Frees TXN, which is not in any server's transactions. */
+static void kvserver_txn_free(tpctxn_t *txn) {
+  unsigned int i;
+  for (i = 0; i < txn->num_pairs; i++) {
+    free(txn->pairs[i].key);
+    free(txn->pairs[i].value);
+  }
+  free(txn->pairs);
+  free(txn->keys);
+  free(txn);
+}
+
+/* Takes TXN and its keys out of SERVER's transactions, without freeing it.
+ * Must be called with SERVER's txn_lock held. */
+static void kvserver_txn_unlink(kvserver_t *server, tpctxn_t *txn) {
+  unsigned int i;
+  for (i = 0; i < txn->num_pairs; i++)
+    HASH_DEL(server->txn_keys, &txn->keys[i]);
+  HASH_DEL(server->txns, txn);
+}
+
+/* Removes TXN from SERVER and frees it. Must be called with SERVER's txn_lock
+ * held. */
+static void kvserver_txn_remove(kvserver_t *server, tpctxn_t *txn) {
+  kvserver_txn_unlink(server, txn);
+  kvserver_txn_free(txn);
+}
+
+/* Writes PAIR, a PUT or DEL as given by TYPE, through to SERVER's store
+ * and cache, retrying until it succeeds. A DEL is done once its key is gone
+ * from the store; the cache need not hold the key, e.g. after a rebuild. */
+static void kvserver_apply_write(kvserver_t *server, msgtype_t type,
+    kvpair_t *pair) {
+  if (type == PUTREQ) {
+    while (kvserver_put(server, pair->key, pair->value));
+  } else {
+    while (kvserver_del(server, pair->key)
+        && kvstore_haskey(&server->store, pair->key));
+  }
+}
+
+/* Writes the PUTs or DELs held by TXN through to SERVER's store and cache. */
+static void kvserver_txn_apply(kvserver_t *server, tpctxn_t *txn) {
+  unsigned int i;
+  for (i = 0; i < txn->num_pairs; i++)
+    kvserver_apply_write(server, txn->type, &txn->pairs[i]);
+}
+
+/* Takes a checkpoint of SERVER's log if KVSERVER_CHECKPOINT_ENTRIES entries
+ * have been logged since the last one. Called once the response to a
+ * request of type TYPE has been sent, so that no request waits on the
+ * checkpoint. A failed checkpoint is simply tried again after the next
+ * entry. */
+static void kvserver_maybe_checkpoint(kvserver_t *server, msgtype_t type) {
+  if (!server->use_tpc || (type != PUTREQ && type != DELREQ
+      && type != MPUTREQ && type != MDELREQ && type != COMMIT
+      && type != ABORT))
+    return;
+  if (tpclog_tail_length(&server->log) >= KVSERVER_CHECKPOINT_ENTRIES)
+    kvserver_checkpoint(server);
+}
+
+/* Checks that the NUM_PAIRS writes of PAIRS, PUTs or DELs as given by TYPE,
+ * can all be applied to SERVER: each PUT or DEL would succeed on its own.
+ * Batches reach here with only the last write to each key (see
+ * kvserver_request_writes). Returns 0 if they can, else a negative error
+ * code. */
+static int kvserver_check_writes(kvserver_t *server, msgtype_t type,
+    kvpair_t *pairs, unsigned int num_pairs) {
+  unsigned int i;
+  int ret = 0;
+  if (pairs == NULL || num_pairs == 0 || num_pairs > MAX_BATCHLEN)
+    return ERRINVLDMSG;
+  for (i = 0; i < num_pairs && ret == 0; i++) {
+    if (pairs[i].key == NULL || (type == PUTREQ && pairs[i].value == NULL))
+      return ERRINVLDMSG;
+    if (type == PUTREQ)
+      ret = kvserver_put_check(server, pairs[i].key, pairs[i].value);
+    else
+      ret = kvserver_del_check(server, pairs[i].key);
+  }
+  return ret;
+}
+
+/* Points PAIRS and NUM_PAIRS at the writes of the PUT, DEL, MPUTREQ or
+ * MDELREQ REQMSG, using SINGLE to hold the write of a PUT or DEL, and TYPE
+ * at whether they are PUTREQs or DELREQs. Where a batch names a key more
+ * than once, only its last write to the key is kept (see
+ * kvmessage_last_writes), which reorders the batch. Returns 0 if
+ * successful, else a negative error code. */
+static int kvserver_request_writes(kvmessage_t *reqmsg, kvpair_t *single,
+    kvpair_t **pairs, unsigned int *num_pairs, msgtype_t *type) {
+  int n;
+  if (reqmsg->type == MPUTREQ || reqmsg->type == MDELREQ) {
+    if ((n = kvmessage_last_writes(reqmsg->batch, reqmsg->batch_size)) < 0)
+      return -ENOMEM;
+    *pairs = reqmsg->batch;
+    *num_pairs = n;
+    *type = (reqmsg->type == MPUTREQ) ? PUTREQ : DELREQ;
+    return 0;
+  }
+  single->key = reqmsg->key;
+  single->value = (reqmsg->type == PUTREQ) ? reqmsg->value : NULL;
+  *pairs = single;
+  *num_pairs = 1;
+  *type = reqmsg->type;
+  return 0;
+}
+
+/* Handles the first phase of the TPC PUT or DEL REQMSG, or of the batch of
+ * them in an MPUTREQ or MDELREQ, voting on whether its transaction can
+ * commit. A transaction is prepared, and its request logged as a single
+ * entry, only if the vote is VOTE_COMMIT. The log is first truncated at its
+ * checkpoint, which empties it whenever no other transaction is prepared.
+ *
+ * The transaction is added before its request is logged, and is given the
+ * LSN the log will hand out next, which its entry's LSN cannot be below. The
+ * log is written without holding the txn_lock, so that the prepares, COMMITs
+ * and ABORTs of unrelated transactions share the log's fsyncs. */
+static void kvserver_handle_prepare(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  tpctxn_t *txn;
+  kvpair_t single, *pairs;
+  unsigned int num_pairs, i;
+  msgtype_t type;
+  uint64_t checkpoint, start;
+  int check;
+  if (kvserver_request_writes(reqmsg, &single, &pairs, &num_pairs, &type)
+      < 0) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    respmsg->type = VOTE_ABORT;
+    kvstats_count(&server->stats, KVSTATS_VOTE_ABORT);
+    return;
+  }
+  pthread_mutex_lock(&server->txn_lock);
+  HASH_FIND(hh, server->txns, &reqmsg->txid, sizeof(uint64_t), txn);
+  if (txn != NULL) {
+    pthread_mutex_unlock(&server->txn_lock);
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    respmsg->type = RESP;
+    return;
+  }
+  for (i = 0; pairs != NULL && i < num_pairs; i++) {
+    if (pairs[i].key != NULL && kvserver_txn_for_key(server, pairs[i].key)) {
+      /* The key is already being written by another transaction. */
+      pthread_mutex_unlock(&server->txn_lock);
+      respmsg->message = ERRMSG_GENERIC_ERROR;
+      respmsg->type = VOTE_ABORT;
+      kvstats_count(&server->stats, KVSTATS_VOTE_ABORT);
+      return;
+    }
+  }
+  check = kvserver_check_writes(server, type, pairs, num_pairs);
+  if (check == 0)
+    check = kvserver_txn_add(server, reqmsg->txid, type, pairs, num_pairs,
+        tpclog_next_lsn(&server->log));
+  checkpoint = kvserver_checkpoint_lsn(server);
+  pthread_mutex_unlock(&server->txn_lock);
+
+  if (check == 0) {
+    tpclog_truncate(&server->log, checkpoint);
+    start = kvstats_now();
+    if (reqmsg->type == MPUTREQ || reqmsg->type == MDELREQ)
+      check = tpclog_log_batch(&server->log, reqmsg->txid, reqmsg->type,
+          pairs, num_pairs, NULL);
+    else
+      check = tpclog_log_txn(&server->log, reqmsg->txid, reqmsg->type,
+          reqmsg->key, reqmsg->type == PUTREQ ? reqmsg->value : NULL, NULL);
+    kvstats_time(&server->stats, KVSTATS_LOG_WRITE, start);
+    if (check != 0) {
+      pthread_mutex_lock(&server->txn_lock);
+      HASH_FIND(hh, server->txns, &reqmsg->txid, sizeof(uint64_t), txn);
+      kvserver_txn_remove(server, txn);
+      pthread_mutex_unlock(&server->txn_lock);
+    }
+  }
+  if (check) {
+    respmsg->message = GETMSG(check);
+    respmsg->type = VOTE_ABORT;
+  } else {
+    respmsg->type = VOTE_COMMIT;
+  }
+  kvstats_count(&server->stats,
+      check ? KVSTATS_VOTE_ABORT : KVSTATS_VOTE_COMMIT);
+}
+
+/* Handles the COMMIT REQMSG, applying its transaction if it is prepared.
+ * The COMMIT is logged before the write, so that it will be finished upon
+ * rebuild, but after the transaction is marked as committing, so that a
+ * checkpoint which misses the mark has an LSN no greater than the COMMIT's.
+ * The write itself happens without holding the txn_lock, so commits of
+ * unrelated transactions proceed concurrently; the transaction stays
+ * prepared until it has been applied, so the log is not truncated under
+ * it. A duplicate COMMIT, arriving while the first is still being applied,
+ * waits for the write to finish before it is acknowledged. */
+static void kvserver_handle_commit(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  tpctxn_t *txn;
+  bool apply = false;
+  uint64_t start;
+  pthread_mutex_lock(&server->txn_lock);
+  HASH_FIND(hh, server->txns, &reqmsg->txid, sizeof(uint64_t), txn);
+  if (txn != NULL && !txn->committing)
+    apply = txn->committing = true;
+  while (!apply && txn != NULL && txn->committing) {
+    pthread_cond_wait(&server->txn_done, &server->txn_lock);
+    HASH_FIND(hh, server->txns, &reqmsg->txid, sizeof(uint64_t), txn);
+  }
+  pthread_mutex_unlock(&server->txn_lock);
+  start = kvstats_now();
+  tpclog_log_txn(&server->log, reqmsg->txid, COMMIT, NULL, NULL, NULL);
+  kvstats_time(&server->stats, KVSTATS_LOG_WRITE, start);
+  if (apply) {
+    kvserver_txn_apply(server, txn);
+    pthread_mutex_lock(&server->txn_lock);
+    kvserver_txn_remove(server, txn);
+    pthread_cond_broadcast(&server->txn_done);
+    pthread_mutex_unlock(&server->txn_lock);
+    kvstats_count(&server->stats, KVSTATS_COMMIT);
+  }
+  respmsg->type = ACK;
+}
+
+/* Handles the ABORT REQMSG, discarding its transaction if it is prepared.
+ * The transaction is discarded before the ABORT is logged, so that a
+ * checkpoint which still holds it has an LSN no greater than the ABORT's. */
+static void kvserver_handle_abort(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  tpctxn_t *txn;
+  uint64_t start;
+  pthread_mutex_lock(&server->txn_lock);
+  HASH_FIND(hh, server->txns, &reqmsg->txid, sizeof(uint64_t), txn);
+  if (txn != NULL && !txn->committing) {
+    kvserver_txn_remove(server, txn);
+    kvstats_count(&server->stats, KVSTATS_ABORT);
+  }
+  pthread_mutex_unlock(&server->txn_lock);
+  start = kvstats_now();
+  tpclog_log_txn(&server->log, reqmsg->txid, ABORT, NULL, NULL, NULL);
+  kvstats_time(&server->stats, KVSTATS_LOG_WRITE, start);
+  respmsg->type = ACK;
+}
+
+/* A MIGRATE in progress: the segments of the master's ring it names, and
+ * where the keys hashing into them go. */
+typedef struct {
+  unsigned int vnodes;      /* The number of points per slave on the master's ring. */
+  int64_t *ranges;          /* Exclusive lower and inclusive upper bound of each segment. */
+  unsigned int num_ranges;  /* The number of segments in RANGES. */
+  char *host;               /* The host of the slave gaining the keys, or NULL to drop them. */
+  int port;                 /* The port of the slave gaining the keys. */
+  int sockfd;               /* The connection to that slave, or -1 until needed. */
+  kvconn_t conn;            /* Buffers the TRANSFERs sent on SOCKFD. */
+  char **keys;              /* The keys to send or drop. */
+  unsigned int num_keys;    /* The number of keys in KEYS. */
+  unsigned int cap;         /* The number of keys KEYS has room for. */
+} kvmigration_t;
+
+/* Parses MESSAGE, the ring description of a MIGRATE, into MIGRATION: the
+ * master's number of points per slave, followed by the two bounds of each
+ * segment, all separated by spaces. Returns 0 if successful, else a
+ * negative error code. */
+static int kvserver_parse_migration(kvmigration_t *migration, char *message) {
+  unsigned int count;
+  char *pos, *end;
+  if (message == NULL)
+    return ERRINVLDMSG;
+  migration->vnodes = (unsigned int) strtoul(message, &end, 10);
+  if (end == message)
+    return ERRINVLDMSG;
+  /* Each bound takes up at least two characters. */
+  migration->ranges = malloc((strlen(end) / 2 + 1) * sizeof(int64_t));
+  if (migration->ranges == NULL)
+    return ENOMEM;
+  for (count = 0, pos = end; ; pos = end, count++) {
+    migration->ranges[count] = strtoll(pos, &end, 10);
+    if (end == pos)
+      break;
+  }
+  if (count % 2 != 0)
+    return ERRINVLDMSG;
+  migration->num_ranges = count / 2;
+  return 0;
+}
+
+/* Returns true if KEY hashes into one of the segments named by MIGRATION. A
+ * segment whose lower bound is not below its upper bound wraps around the
+ * end of the ring. */
+static bool kvserver_migration_covers(kvmigration_t *migration, char *key) {
+  int64_t hash = tpcmaster_ring_hash(migration->vnodes, key), lo, hi;
+  unsigned int i;
+  for (i = 0; i < migration->num_ranges; i++) {
+    lo = migration->ranges[2 * i];
+    hi = migration->ranges[2 * i + 1];
+    if (lo < hi ? (hash > lo && hash <= hi) : (hash > lo || hash <= hi))
+      return true;
+  }
+  return false;
+}
+
+/* Called with each KEY and VALUE in a store being migrated by _MIGRATION.
+ * Records KEY to be sent or dropped once the iteration is over, so that no
+ * network I/O happens while the store is being iterated over. Returns 0 if
+ * successful, else a negative error code, which stops the migration. */
+static int kvserver_migrate_entry(char *key, char *value, void *_migration) {
+  kvmigration_t *migration = (kvmigration_t *) _migration;
+  char **keys;
+  if (!kvserver_migration_covers(migration, key))
+    return 0;
+  if (migration->num_keys == migration->cap) {
+    keys = realloc(migration->keys, (2 * migration->cap + 16) * sizeof(char *));
+    if (keys == NULL)
+      return -1;
+    migration->keys = keys;
+    migration->cap = 2 * migration->cap + 16;
+  }
+  if ((migration->keys[migration->num_keys] = malloc(strlen(key) + 1)) == NULL)
+    return -1;
+  strcpy(migration->keys[migration->num_keys++], key);
+  return 0;
+}
+
+/* Sends each key recorded by MIGRATION, with its value read afresh from
+ * SERVER's store, to the slave gaining it as a TRANSFER, connecting on the
+ * first one. A key deleted since it was recorded is skipped. Returns 0 if
+ * successful, else a negative error code. */
+static int kvserver_migrate_send(kvserver_t *server,
+    kvmigration_t *migration) {
+  kvmessage_t msg;
+  unsigned int i;
+  char *value;
+  int ret = 0;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = TRANSFER;
+  msg.format = KVMESSAGE_BINARY;
+  for (i = 0; i < migration->num_keys && ret == 0; i++) {
+    if (kvstore_get(&server->store, migration->keys[i], &value) != 0)
+      continue;
+    if (migration->sockfd == -1) {
+      migration->sockfd = connect_to(migration->host, migration->port,
+          TPCMASTER_TIMEOUT);
+      if (migration->sockfd != -1)
+        kvconn_init(&migration->conn, migration->sockfd);
+    }
+    msg.key = migration->keys[i];
+    msg.value = value;
+    if (migration->sockfd == -1 || kvconn_send(&migration->conn, &msg) <= 0)
+      ret = -1;
+    free(value);
+  }
+  return ret;
+}
+
+/* Handles the MIGRATE REQMSG from the master, which names segments of its
+ * ring in MESSAGE and, in KEY and VALUE, the host and port of the slave
+ * taking them over. Every key of SERVER hashing into those segments is sent
+ * to that slave as a TRANSFER over a single connection, which is only opened
+ * if there is at least one; the stream is ended by a TRANSFER without a key,
+ * which the slave acknowledges once it has stored everything. Without a KEY
+ * and VALUE, the keys are instead deleted from SERVER. The keys are gathered
+ * first and only then sent, so the store is not held up by the network.
+ * RESPMSG reports
+ * MSG_SUCCESS once every key has been handled. */
+static void kvserver_handle_migrate(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  kvmigration_t migration;
+  kvmessage_t msg, *ack;
+  unsigned int i;
+  int ret;
+  memset(&migration, 0, sizeof(kvmigration_t));
+  migration.sockfd = -1;
+  if (reqmsg->key != NULL && reqmsg->value != NULL) {
+    migration.host = reqmsg->key;
+    migration.port = atoi(reqmsg->value);
+  }
+  ret = kvserver_parse_migration(&migration, reqmsg->message);
+  if (ret == 0)
+    ret = kvstore_iterate(&server->store, kvserver_migrate_entry, &migration);
+  if (ret == 0 && migration.host != NULL)
+    ret = kvserver_migrate_send(server, &migration);
+  if (ret == 0 && migration.sockfd != -1) {
+    memset(&msg, 0, sizeof(kvmessage_t));
+    msg.type = TRANSFER;
+    msg.format = KVMESSAGE_BINARY;
+    ack = (kvconn_send(&migration.conn, &msg) > 0)
+        ? kvconn_parse(&migration.conn) : NULL;
+    if (ack == NULL || ack->message == NULL
+        || strcmp(ack->message, MSG_SUCCESS) != 0)
+      ret = -1;
+    if (ack != NULL)
+      kvmessage_free(ack);
+  }
+  if (migration.sockfd != -1) {
+    kvconn_destroy(&migration.conn);
+    close(migration.sockfd);
+  }
+  for (i = 0; i < migration.num_keys; i++) {
+    if (ret == 0 && migration.host == NULL)
+      kvserver_del(server, migration.keys[i]);
+    free(migration.keys[i]);
+  }
+  free(migration.keys);
+  free(migration.ranges);
+  respmsg->type = RESP;
+  respmsg->message = (ret == 0) ? MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
+}
+
+/* Handles a stream of TRANSFER messages on SOCKFD, starting with REQMSG,
+ * sent by a slave handing SERVER the keys of segments it now owns. Each
+ * message up to the first one without a key is written straight into the
+ * store and cache, and the whole stream is then answered in RESPMSG. */
+static void kvserver_handle_transfer(kvserver_t *server, kvmessage_t *reqmsg,
+    int sockfd, kvmessage_t *respmsg) {
+  kvmessage_t *msg = reqmsg;
+  int ret = 0;
+  while (msg != NULL && msg->type == TRANSFER && msg->key != NULL) {
+    if (ret == 0 && msg->value != NULL)
+      ret = kvserver_put(server, msg->key, msg->value);
+    if (msg != reqmsg)
+      kvmessage_free(msg);
+    msg = kvmessage_parse(sockfd);
+  }
+  if (msg == NULL || msg->type != TRANSFER)
+    ret = -1;
+  if (msg != NULL && msg != reqmsg)
+    kvmessage_free(msg);
+  respmsg->type = RESP;
+  respmsg->message = (ret == 0) ? MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
+}
+
+/* A SCANRESP being filled with the keys of a scan. */
+typedef struct {
+  int sockfd;               /* The connection the scan is streamed to. */
+  kvmessage_t msg;          /* The SCANRESP, whose BATCH is PAIRS. */
+  kvpair_t pairs[KVSERVER_SCAN_CHUNK]; /* Malloced copies of the keys and values. */
+} kvscan_t;
+
+/* Sends the pairs gathered in SCAN, if any, as a SCANRESP and frees them.
+ * Returns 0 if successful, else -1 if the SCANRESP could not be sent. */
+static int kvserver_scan_flush(kvscan_t *scan) {
+  unsigned int i;
+  int ret = 0;
+  if (scan->msg.batch_size > 0 && kvmessage_send(&scan->msg, scan->sockfd) <= 0)
+    ret = -1;
+  for (i = 0; i < scan->msg.batch_size; i++) {
+    free(scan->pairs[i].key);
+    free(scan->pairs[i].value);
+  }
+  scan->msg.batch_size = 0;
+  return ret;
+}
+
+/* Adds KEY and VALUE to the scan _SCAN, sending them on once it holds
+ * KVSERVER_SCAN_CHUNK pairs. Returns 0 if successful, else nonzero to stop
+ * the scan. */
+static int kvserver_scan_pair(char *key, char *value, void *_scan) {
+  kvscan_t *scan = (kvscan_t *) _scan;
+  kvpair_t *pair = &scan->pairs[scan->msg.batch_size];
+  pair->key = malloc(strlen(key) + 1);
+  pair->value = malloc(strlen(value) + 1);
+  if (pair->key == NULL || pair->value == NULL) {
+    free(pair->key);
+    free(pair->value);
+    return -1;
+  }
+  strcpy(pair->key, key);
+  strcpy(pair->value, value);
+  if (++scan->msg.batch_size == KVSERVER_SCAN_CHUNK)
+    return kvserver_scan_flush(scan);
+  return 0;
+}
+
+/* Handles the SCANREQ REQMSG, streaming the keys of SERVER's store in the
+ * range it asks for, and their values, on SOCKFD as SCANRESPs. RESPMSG ends
+ * the stream, reporting whether every key was sent. In write-back mode, the
+ * cache is flushed first so that the store holds every write. */
+static void kvserver_handle_scan(kvserver_t *server, kvmessage_t *reqmsg,
+    int sockfd, kvmessage_t *respmsg) {
+  kvscan_t *scan;
+  unsigned int limit;
+  int ret;
+  respmsg->type = RESP;
+  if (kvmessage_scan_limit(reqmsg, &limit) != 0) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if ((scan = calloc(1, sizeof(kvscan_t))) == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  scan->sockfd = sockfd;
+  scan->msg.type = SCANRESP;
+  scan->msg.format = reqmsg->format;
+  scan->msg.batch = scan->pairs;
+  ret = kvserver_flush(server);
+  if (ret == 0)
+    ret = kvstore_scan(&server->store, reqmsg->key, reqmsg->value, limit,
+        kvserver_scan_pair, scan);
+  if (kvserver_scan_flush(scan) != 0)
+    ret = -1;
+  free(scan);
+  respmsg->message = (ret == 0) ? MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
+}
+
+/* Handles the MGETREQ REQMSG, answering with an MGETRESP in RESPMSG which
+ * holds every key of REQMSG's batch, in order, along with its value, or no
+ * value if SERVER does not have the key. The batch of RESPMSG shares its
+ * keys with REQMSG, but its values and the batch itself should be freed. */
+static void kvserver_handle_mget(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  unsigned int i;
+  respmsg->type = RESP;
+  if (reqmsg->batch == NULL || reqmsg->batch_size == 0) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  respmsg->batch = calloc(reqmsg->batch_size, sizeof(kvpair_t));
+  if (respmsg->batch == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  for (i = 0; i < reqmsg->batch_size; i++) {
+    respmsg->batch[i].key = reqmsg->batch[i].key;
+    if (kvserver_get(server, reqmsg->batch[i].key, &respmsg->batch[i].value))
+      respmsg->batch[i].value = NULL;
+  }
+  respmsg->batch_size = reqmsg->batch_size;
+  respmsg->type = MGETRESP;
+}
+
+/* Handles the MPUTREQ or MDELREQ REQMSG outside of TPC, applying every
+ * write of its batch if all of them can be applied, and none otherwise.
+ * Where a key is written more than once, the last write wins. RESPMSG
+ * reports MSG_SUCCESS or the error which stopped the batch. */
+static void kvserver_handle_mwrite(kvserver_t *server, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  kvpair_t single, *pairs;
+  unsigned int num_pairs, i;
+  msgtype_t type;
+  int ret;
+  ret = kvserver_request_writes(reqmsg, &single, &pairs, &num_pairs, &type);
+  if (ret == 0)
+    ret = kvserver_check_writes(server, type, pairs, num_pairs);
+  for (i = 0; ret == 0 && i < num_pairs; i++) {
+    if (type == PUTREQ)
+      ret = kvserver_put(server, pairs[i].key, pairs[i].value);
+    else
+      ret = kvserver_del(server, pairs[i].key);
+  }
+  respmsg->type = RESP;
+  respmsg->message = (ret == 0) ? MSG_SUCCESS : GETMSG(ret);
+}
+
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Assumes that the request should be handled as a TPC
@@ -144,79 +1104,26 @@ void kvserver_handle_tpc(kvserver_t *server, kvmessage_t *reqmsg,
       }
       break;
     case PUTREQ:
-      if (server->tpc_op){
-        respmsg->message = ERRMSG_INVALID_REQUEST;
-        respmsg->type = RESP;
-        break;
-      }
-      tpclog_clear_log(&server->log);
-      tpclog_log(&server->log, PUTREQ, reqmsg->key, reqmsg->value);
-      check = kvserver_put_check(server, reqmsg->key, reqmsg->value);
-      if (check){
-        respmsg->message = GETMSG(check);
-        respmsg->type = VOTE_ABORT;
-      } else {
-        server->tpc_op = malloc(sizeof(kvmessage_t));
-        server->tpc_op->type = reqmsg->type;
-        server->tpc_op->key = malloc(256);
-        strcpy(server->tpc_op->key, reqmsg->key);
-        server->tpc_op->value = malloc(256);
-        strcpy(server->tpc_op->value, reqmsg->value);
-        respmsg->type = VOTE_COMMIT;
-      }
-      break;
     case DELREQ:
-      if (server->tpc_op){
-        respmsg->message = ERRMSG_INVALID_REQUEST;
-        respmsg->type = RESP;
-        break;
-      }
-      tpclog_clear_log(&server->log);
-      tpclog_log(&server->log, DELREQ, reqmsg->key, NULL);
-      check = kvserver_del_check(server, reqmsg->key);
-      if (check){
-        respmsg->message = GETMSG(check);
-        respmsg->type = VOTE_ABORT;
-      } else {
-        server->tpc_op = malloc(sizeof(kvmessage_t));
-        server->tpc_op->type = reqmsg->type;
-        server->tpc_op->key = malloc(256);
-        strcpy(server->tpc_op->key, reqmsg->key);
-        respmsg->type = VOTE_COMMIT;
-      }
+    case MPUTREQ:
+    case MDELREQ:
+      kvserver_handle_prepare(server, reqmsg, respmsg);
+      break;
+    case MGETREQ:
+      kvserver_handle_mget(server, reqmsg, respmsg);
       break;
     case COMMIT:
-      tpclog_log(&server->log, COMMIT, NULL, NULL);
-      if (!server->tpc_op){
-        respmsg->type = ACK;
-        break;
-      }
-      else if (server->tpc_op->type == PUTREQ) {
-        while (kvserver_put(server, server->tpc_op->key, server->tpc_op->value));
-      } else {
-        while (kvserver_del(server, server->tpc_op->key));
-      }
-      respmsg->type = ACK;
-      if (server->tpc_op){
-        free(server->tpc_op->key);
-        if (server->tpc_op->type == PUTREQ) free(server->tpc_op->value);
-        free(server->tpc_op);
-        server->tpc_op = NULL;
-      }
+      kvserver_handle_commit(server, reqmsg, respmsg);
       break;
     case ABORT:
-      tpclog_log(&server->log, ABORT, NULL, NULL);
-      if (!server->tpc_op){
-        respmsg->type = ACK;
-        break;
-      }
-      respmsg->type = ACK;
-      if (server->tpc_op){
-        free(server->tpc_op->key);
-        if (server->tpc_op->type == PUTREQ) free(server->tpc_op->value);
-        free(server->tpc_op);
-        server->tpc_op = NULL;
-      }
+      kvserver_handle_abort(server, reqmsg, respmsg);
+      break;
+    case MIGRATE:
+      kvserver_handle_migrate(server, reqmsg, respmsg);
+      break;
+    default:
+      respmsg->type = RESP;
+      respmsg->message = ERRMSG_NOT_IMPLEMENTED;
       break;
   }
 }
@@ -268,82 +1175,365 @@ void kvserver_handle_no_tpc(kvserver_t *server, kvmessage_t *reqmsg,
         }
       }
       break;
+    case MGETREQ:
+      kvserver_handle_mget(server, reqmsg, respmsg);
+      break;
+    case MPUTREQ: case MDELREQ:
+      kvserver_handle_mwrite(server, reqmsg, respmsg);
+      break;
     default: 
       respmsg->type = RESP;
     respmsg->message = ERRMSG_NOT_IMPLEMENTED;
   }
 }
 
+/* Answers the GETREQ REQMSG straight out of SERVER's cache if KEY is cached,
+ * sending the cached value over SOCKFD without copying it out of the cache.
+ * Returns true if a response was sent. */
+static bool kvserver_handle_cached_get(kvserver_t *server, kvmessage_t *reqmsg,
+    int sockfd) {
+  kvmessage_t respmsg;
+  kvchunk_t *value;
+  if (reqmsg->type != GETREQ || reqmsg->key == NULL)
+    return false;
+  if (kvcache_get_chunk(&server->cache, reqmsg->key, &value) != 0)
+    return false;
+  kvstats_count(&server->stats, KVSTATS_CACHE_HIT);
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  respmsg.type = GETRESP;
+  respmsg.key = reqmsg->key;
+  respmsg.value = value->data;
+  respmsg.format = reqmsg->format;
+  kvmessage_send(&respmsg, sockfd);
+  kvchunk_release(value);
+  return true;
+}
+
+/* Returns the timer of SERVER's stats which times requests of TYPE, or
+ * KVSTATS_NUM_TIMERS if they are not timed. On a TPC server, PUTs and DELs
+ * are the first phase of their transactions, and COMMITs and ABORTs the
+ * second. */
+static kvtimer_t kvserver_timer(kvserver_t *server, msgtype_t type) {
+  switch (type) {
+    case GETREQ: case MGETREQ:
+      return KVSTATS_GET;
+    case PUTREQ: case MPUTREQ:
+      return server->use_tpc ? KVSTATS_PREPARE : KVSTATS_PUT;
+    case DELREQ: case MDELREQ:
+      return server->use_tpc ? KVSTATS_PREPARE : KVSTATS_DEL;
+    case COMMIT: case ABORT:
+      return server->use_tpc ? KVSTATS_DECIDE : KVSTATS_NUM_TIMERS;
+    default:
+      return KVSTATS_NUM_TIMERS;
+  }
+}
+
 /* Generic entrypoint for this SERVER. Takes in a socket on SOCKFD, which
  * should already be connected to an incoming request. Processes the request
  * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
+ * internal handler. Every request is timed in SERVER's stats, from the moment
+ * it has been read until its response has been sent. */
 void kvserver_handle(kvserver_t *server, int sockfd, void *extra) {
   kvmessage_t *reqmsg, *respmsg;
+  kvtimer_t timer = KVSTATS_NUM_TIMERS;
+  char *info = NULL;
+  unsigned int i;
+  uint64_t start;
   respmsg = calloc(1, sizeof(kvmessage_t));
   reqmsg = kvmessage_parse(sockfd);
+  start = kvstats_now();
   void (*server_handler)(kvserver_t *server, kvmessage_t *reqmsg,
       kvmessage_t *respmsg);
   server_handler = server->use_tpc ?
     kvserver_handle_tpc : kvserver_handle_no_tpc;
+  if (reqmsg != NULL)
+    timer = kvserver_timer(server, reqmsg->type);
+  if (reqmsg != NULL && kvserver_handle_cached_get(server, reqmsg, sockfd)) {
+    kvstats_time(&server->stats, timer, start);
+    free(respmsg);
+    kvmessage_free(reqmsg);
+    return;
+  }
   if (reqmsg == NULL) {
     respmsg->type = RESP;
     respmsg->message = ERRMSG_INVALID_REQUEST;
+  } else if (reqmsg->type == INFO) {
+    respmsg->type = RESP;
+    info = kvserver_get_info_message(server, reqmsg->key);
+    respmsg->message = (info != NULL) ? info : ERRMSG_GENERIC_ERROR;
+    respmsg->format = reqmsg->format;
+  } else if (reqmsg->type == TRANSFER && server->use_tpc) {
+    kvserver_handle_transfer(server, reqmsg, sockfd, respmsg);
+    respmsg->format = reqmsg->format;
+  } else if (reqmsg->type == SCANREQ) {
+    kvserver_handle_scan(server, reqmsg, sockfd, respmsg);
+    respmsg->format = reqmsg->format;
   } else {
     server_handler(server, reqmsg, respmsg);
+    respmsg->format = reqmsg->format;
   }
   kvmessage_send(respmsg, sockfd);
+  if (timer != KVSTATS_NUM_TIMERS)
+    kvstats_time(&server->stats, timer, start);
+  if (reqmsg != NULL)
+    kvserver_maybe_checkpoint(server, reqmsg->type);
+  free(info);
+  if (respmsg->batch != NULL) {
+    for (i = 0; i < respmsg->batch_size; i++)
+      free(respmsg->batch[i].value);
+    free(respmsg->batch);
+  }
   if (reqmsg != NULL)
     kvmessage_free(reqmsg);
 }
 
+/* Points PAIRS, a malloced array which should be freed, at the NUM_PAIRS
+ * writes held in the data of the log entry OP, PUTREQs or DELREQs as given
+ * by TYPE. The keys and values point into OP. Returns 0 if successful, else
+ * a negative error code. */
+static int kvserver_entry_writes(logentry_t *op, msgtype_t type,
+    kvpair_t **pairs, unsigned int *num_pairs) {
+  char *pos, *end = op->data + op->length;
+  unsigned int count = 0;
+  for (pos = op->data; pos < end; pos += strlen(pos) + 1)
+    count++;
+  if (type == PUTREQ)
+    count /= 2;
+  if (count == 0 || (*pairs = calloc(count, sizeof(kvpair_t))) == NULL)
+    return -1;
+  *num_pairs = count;
+  for (pos = op->data, count = 0; count < *num_pairs; count++) {
+    (*pairs)[count].key = pos;
+    pos += strlen(pos) + 1;
+    if (type == PUTREQ) {
+      (*pairs)[count].value = pos;
+      pos += strlen(pos) + 1;
+    }
+  }
+  return 0;
+}
+
+/* Takes a checkpoint of SERVER's log: a snapshot of its prepared
+ * transactions, each followed by a COMMIT if it is being committed, as of
+ * the LSN the log will hand out next. Transactions are prepared before
+ * their entry is logged, marked as committing before their COMMIT is
+ * logged, and discarded before their ABORT is logged, so every entry whose
+ * effect the snapshot misses has an LSN no lower than the checkpoint's. The
+ * snapshot is taken under the txn_lock, and written without it. Does
+ * nothing if a checkpoint is already being taken. Returns 0 if successful,
+ * else a negative error code. */
+int kvserver_checkpoint(kvserver_t *server) {
+  tpccheckpoint_t ckpt;
+  tpctxn_t *txn, *tmp;
+  int ret = 0;
+  pthread_mutex_lock(&server->txn_lock);
+  if (server->checkpointing) {
+    pthread_mutex_unlock(&server->txn_lock);
+    return 0;
+  }
+  server->checkpointing = true;
+  tpclog_checkpoint_init(&ckpt, tpclog_next_lsn(&server->log));
+  HASH_ITER(hh, server->txns, txn, tmp) {
+    ret = tpclog_checkpoint_add(&ckpt, txn->txid,
+        (txn->type == PUTREQ) ? MPUTREQ : MDELREQ, txn->pairs,
+        txn->num_pairs, txn->lsn);
+    if (ret == 0 && txn->committing)
+      ret = tpclog_checkpoint_add(&ckpt, txn->txid, COMMIT, NULL, 0,
+          txn->lsn);
+    if (ret != 0)
+      break;
+  }
+  pthread_mutex_unlock(&server->txn_lock);
+
+  if (ret == 0)
+    ret = tpclog_checkpoint_write(&server->log, &ckpt);
+  tpclog_checkpoint_destroy(&ckpt);
+  pthread_mutex_lock(&server->txn_lock);
+  server->checkpointing = false;
+  pthread_mutex_unlock(&server->txn_lock);
+  return ret;
+}
+
+/* A single write of a committed transaction found while rebuilding state. */
+typedef struct {
+  msgtype_t type;           /* PUTREQ or DELREQ. */
+  kvpair_t *pair;           /* The key written, and its value for a PUTREQ. */
+} kvreplaywrite_t;
+
+/* The writes of the committed transactions found while rebuilding state
+ * whose keys fall into a single partition, in the order they were
+ * committed, which a single thread writes to the store. */
+typedef struct {
+  kvserver_t *server;       /* The server being rebuilt. */
+  kvreplaywrite_t *writes;  /* The writes of the partition. */
+  unsigned int num_writes;  /* The number of writes in WRITES. */
+} kvreplay_t;
+
+/* Writes the writes of REPLAY to its server's store, in order. */
+static void *kvserver_replay(void *aux) {
+  kvreplay_t *replay = aux;
+  unsigned int i;
+  for (i = 0; i < replay->num_writes; i++)
+    kvserver_apply_write(replay->server, replay->writes[i].type,
+        replay->writes[i].pair);
+  return NULL;
+}
+
+/* Writes the NUM_TXNS committed transactions of TXNS, in order, to SERVER's
+ * store. Their writes are split once into KVSERVER_REPLAY_THREADS
+ * partitions by the hash of their keys, keeping their order within each
+ * partition, and each partition is written by a thread of its own, so that
+ * the writes to any one key still happen in order. A single partition,
+ * written by the calling thread, is used for fewer writes than partitions
+ * or if the partitions cannot be allocated, and a partition whose thread
+ * cannot be started is written by the calling thread. */
+static void kvserver_replay_committed(kvserver_t *server, tpctxn_t **txns,
+    unsigned int num_txns) {
+  kvreplay_t replays[KVSERVER_REPLAY_THREADS];
+  pthread_t threads[KVSERVER_REPLAY_THREADS];
+  bool started[KVSERVER_REPLAY_THREADS];
+  unsigned int counts[KVSERVER_REPLAY_THREADS] = {0};
+  unsigned int i, j, k, num_writes = 0;
+  unsigned int *parts = NULL;
+  kvreplaywrite_t *writes = NULL;
+  for (i = 0; i < num_txns; i++)
+    num_writes += txns[i]->num_pairs;
+  if (num_writes >= KVSERVER_REPLAY_THREADS) {
+    parts = malloc(num_writes * sizeof(unsigned int));
+    writes = malloc(num_writes * sizeof(kvreplaywrite_t));
+  }
+  if (parts == NULL || writes == NULL) {
+    free(parts);
+    free(writes);
+    for (i = 0; i < num_txns; i++)
+      kvserver_txn_apply(server, txns[i]);
+    return;
+  }
+
+  /* Hash each key once, then place each write in its partition's slice. */
+  for (i = 0, k = 0; i < num_txns; i++) {
+    for (j = 0; j < txns[i]->num_pairs; j++, k++) {
+      parts[k] = kvhash_key(txns[i]->pairs[j].key) % KVSERVER_REPLAY_THREADS;
+      counts[parts[k]]++;
+    }
+  }
+  for (i = 0, k = 0; i < KVSERVER_REPLAY_THREADS; k += counts[i++]) {
+    replays[i].server = server;
+    replays[i].writes = writes + k;
+    replays[i].num_writes = 0;
+  }
+  for (i = 0, k = 0; i < num_txns; i++) {
+    for (j = 0; j < txns[i]->num_pairs; j++, k++) {
+      replays[parts[k]].writes[replays[parts[k]].num_writes].type =
+          txns[i]->type;
+      replays[parts[k]].writes[replays[parts[k]].num_writes++].pair =
+          &txns[i]->pairs[j];
+    }
+  }
+  free(parts);
+
+  for (i = 0; i < KVSERVER_REPLAY_THREADS; i++)
+    started[i] = pthread_create(&threads[i], NULL, kvserver_replay,
+        &replays[i]) == 0;
+  for (i = 0; i < KVSERVER_REPLAY_THREADS; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      kvserver_replay(&replays[i]);
+  }
+  free(writes);
+}
+
 /* Restore SERVER back to the state it should be in, according to the
- * associated LOG.  Must be called on an initialized  SERVER. Only restores the
- * state of the most recent TPC transaction, assuming that all previous actions
- * have been written to persistent storage. Should restore SERVER to its exact
- * state; e.g. if SERVER had written into its log that it received a PUTREQ but
- * no corresponding COMMIT/ABORT, after calling this function SERVER should
- * again be waiting for a COMMIT/ABORT.  This should also ensure that as soon
- * as a server logs a COMMIT, even if it crashes immediately after (before the
+ * associated LOG.  Must be called on an initialized  SERVER. Loads the log's
+ * checkpoint, if any, and the entries logged since, and goes through them
+ * in order: each PUTREQ or DELREQ, or batch of them, prepares its
+ * transaction again, each ABORT discards its transaction, if prepared, and
+ * each COMMIT sets its transaction, if prepared, aside to be written to the
+ * store once every entry has been gone through. Any transaction left
+ * without a COMMIT/ABORT is thus again waiting for one, and as soon as a
+ * server logs a COMMIT, even if it crashes immediately after (before the
  * KVStore has a chance to write to disk), the COMMIT will be finished upon
- * rebuild. The cache need not be the same as before rebuilding.
+ * rebuild. The committed transactions are then written to the store in
+ * parallel (see kvserver_replay_committed). The log is only truncated at its
+ * checkpoint, so between them the checkpoint and the log hold every entry
+ * of every transaction which was still prepared, and earlier actions are
+ * assumed to have been written to persistent storage. The cache need not be
+ * the same as before rebuilding.
  *
- * Checkpoint 2 only. */
+ * Checkpoint 2 only. Returns 0 if successful, else a negative error code. */
 int kvserver_rebuild_state(kvserver_t *server) {
-  logentry_t *op, *op2;
-  op2 = NULL;
-  tpclog_iterate_begin(&server->log);
-  op = tpclog_iterate_next(&server->log);
-  if (op){
-    if (tpclog_iterate_has_next(&server->log)){
-      op2 = tpclog_iterate_next(&server->log);
-      if (op2->type == COMMIT){
-        if (op->type == DELREQ) kvserver_del(server, op->data);
-        else {
-          char *c = op->data + strlen(op->data) + 1;
-          kvserver_put(server, op->data, c);
-        }
+  tpclogimage_t image;
+  logentry_t *op;
+  tpctxn_t *txn, **committed = NULL, **grown;
+  kvpair_t *pairs;
+  unsigned int num_pairs, num_committed = 0, cap = 0, i;
+  msgtype_t type;
+  int ret;
+  if ((ret = tpclog_load(&server->log, &image)) != 0) {
+    tpclog_image_destroy(&image);
+    return ret;
+  }
+  pthread_mutex_lock(&server->txn_lock);
+  for (i = 0; i < image.num_entries; i++) {
+    op = image.entries[i];
+    HASH_FIND(hh, server->txns, &op->txid, sizeof(uint64_t), txn);
+    if (op->type == PUTREQ || op->type == DELREQ || op->type == MPUTREQ
+        || op->type == MDELREQ) {
+      if (txn != NULL)
+        kvserver_txn_remove(server, txn);
+      type = (op->type == PUTREQ || op->type == MPUTREQ) ? PUTREQ : DELREQ;
+      if (kvserver_entry_writes(op, type, &pairs, &num_pairs) == 0) {
+        kvserver_txn_add(server, op->txid, type, pairs, num_pairs, op->lsn);
+        free(pairs);
       }
-      free(op2);
-    }
-    else{
-      server->tpc_op = malloc(sizeof(kvmessage_t));
-      server->tpc_op->type = op->type;
-      server->tpc_op->key = malloc(256);
-      strcpy(server->tpc_op->key, &op->data[0]);
-      if (op->type == PUTREQ){
-        char *c = op->data + strlen(op->data) + 1;
-        server->tpc_op->value = malloc(256);
-        strcpy(server->tpc_op->value, c);
+    } else if (txn != NULL && op->type == COMMIT) {
+      if (num_committed == cap) {
+        cap = cap ? cap * 2 : 16;
+        if ((grown = realloc(committed, cap * sizeof(tpctxn_t *))) == NULL) {
+          /* Write what has been set aside so far, to keep the order. */
+          kvserver_replay_committed(server, committed, num_committed);
+          for (; num_committed > 0; num_committed--)
+            kvserver_txn_free(committed[num_committed - 1]);
+          cap = 0;
+          kvserver_txn_apply(server, txn);
+          kvserver_txn_remove(server, txn);
+          continue;
+        }
+        committed = grown;
       }
+      kvserver_txn_unlink(server, txn);
+      committed[num_committed++] = txn;
+    } else if (txn != NULL) {
+      kvserver_txn_remove(server, txn);
     }
-    free(op);
   }
+  kvserver_replay_committed(server, committed, num_committed);
+  for (i = 0; i < num_committed; i++)
+    kvserver_txn_free(committed[i]);
+  free(committed);
+  pthread_mutex_unlock(&server->txn_lock);
+  tpclog_image_destroy(&image);
   return 0;
 }
 
 /* Deletes all current entries in SERVER's store and removes the store
- * directory.  Also cleans the associated log. */
+ * directory.  Also cleans the associated log. In write-back mode, the
+ * flusher is stopped and the dirty entries of the cache are dropped along
+ * with the rest of it. */
 int kvserver_clean(kvserver_t *server) {
+  if (server->write_back) {
+    kvserver_stop_flusher(server);
+    server->write_back = false;
+    kvcache_set_write_back(&server->cache, NULL, NULL);
+    kvcache_set_write_ahead(&server->cache, NULL, NULL);
+    kvcache_clear(&server->cache);
+    if (server->use_wal) {
+      tpclog_clear_log(&server->log);
+      tpclog_destroy(&server->log);
+    }
+    server->use_wal = false;
+    kvserver_destroy_flush_sync(server);
+  }
   return kvstore_clean(&server->store);
 }
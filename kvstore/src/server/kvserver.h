@@ -1,11 +1,15 @@
 #ifndef __KV_SERVER__
 #define __KV_SERVER__
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include "kvcache.h"
 #include "kvstore.h"
 #include "kvmessage.h"
+#include "kvstats.h"
 #include "tpclog.h"
+#include "uthash.h"
 
 /* KVServer defines a server which will be used to store <key, value> pairs.
  *
@@ -22,7 +26,7 @@
  * to get an entry from cache before accessing its store to eliminate the need
  * to access disk when possible. The cache should write-through; that is, when
  * a new entry is stored, it should be written to both the cache and the store
- * immediately.
+ * immediately, unless write-back is enabled (see below).
  *
  * A KVServer can operate in two modes; TPC or non-TPC. In non-TPC mode, all
  * PUT and DEL requests go immediately to the cache/store. In TPC mode, 2-Phase
@@ -36,10 +40,102 @@
  * A TPC KVServer maintains state beyond the current KVStore entries, so a
  * TPCLog is used to log incoming requests and can be used to recreate the
  * state of the server upon crash recovery.
+ *
+ * A transaction which stays prepared keeps every entry logged after it in
+ * the log, so the log, and the time taken to replay it, would grow without
+ * bound. Once KVSERVER_CHECKPOINT_ENTRIES entries have been logged since
+ * the last checkpoint, the server takes a new one (see tpclog.h), after
+ * sending the response to the request which logged the last of them: a
+ * snapshot of its prepared transactions, and of which of them are being
+ * committed, after which only the entries logged since the snapshot need
+ * be kept. kvserver_rebuild_state loads the checkpoint and the log's tail
+ * at once, works out which transactions are prepared and which were
+ * committed, and writes the latter to the store from
+ * KVSERVER_REPLAY_THREADS threads, each writing the keys which hash into
+ * its own partition, so that the writes to each key are still applied in
+ * the order they were committed.
+ *
+ * Every TPC message carries the ID of the transaction it belongs to, so a TPC
+ * KVServer can hold any number of prepared transactions at once, as long as
+ * no two of them touch the same key. A COMMIT or ABORT applies to the
+ * transaction with its ID only. Messages sent without an ID all belong to
+ * transaction 0, which behaves as a single transaction slot.
+ *
+ * When slaves join or leave, the master asks a TPC KVServer holding segments
+ * of its ring which change hands to MIGRATE them: the server streams the
+ * keys in those segments to their new owner as TRANSFER messages, which are
+ * written straight into its store, or drops them if it has lost them.
+ *
+ * Both modes also accept batches of up to MAX_BATCHLEN keys: an MGETREQ is
+ * answered with an MGETRESP holding every key asked for and its value, or
+ * no value if the key is absent, and an MPUTREQ or MDELREQ is applied in
+ * full or not at all. Where a batch names the same key more than once, the
+ * last write to it wins, just as when the batch goes through a master. In TPC
+ * mode, an MPUTREQ or MDELREQ is prepared as a single transaction, logged
+ * as a single entry, and committed or aborted as a whole.
+ *
+ * Both modes answer a SCANREQ from the ordered index of the store, streaming
+ * the keys in its range and their values back in SCANRESPs of up to
+ * KVSERVER_SCAN_CHUNK pairs each. A scan reads committed entries only, and
+ * sees writes committed while it runs if they fall after its position.
+ *
+ * A non-TPC KVServer may instead run in write-back mode, enabled with
+ * kvserver_enable_write_back: a PUT or DEL only leaves a dirty entry in the
+ * cache (see kvcacheset.h), so it takes memory time rather than disk time. A
+ * flusher thread writes the dirty entries of each cache set back to the
+ * store, as a batch, every FLUSH_INTERVAL milliseconds; repeated writes to
+ * a key between flushes are coalesced into one, and a dirty entry is also
+ * written back when it is evicted. A SCANREQ flushes the cache first, as it
+ * reads the store. Without a write-ahead log, writes not yet written back
+ * are lost if the server crashes. With one, each write is first appended to
+ * a TPCLog in the store's directory, sharing fsyncs with concurrent writes,
+ * the log is truncated once a flush has written back everything it holds,
+ * and writes left in it by a crash are written to the store when write-back
+ * is next enabled.
+ *
+ * A KVServer keeps stats (see kvstats.h) of its cache hits and misses, its
+ * votes and decisions, and the time taken by each request, each access to
+ * its store and each write to its log, and answers an INFO request with
+ * them, in JSON if the request's key is KVSTATS_JSON.
  */
+
+/* The number of pairs sent in each SCANRESP. */
+#define KVSERVER_SCAN_CHUNK 128
+
+/* The default number of milliseconds between flushes in write-back mode. */
+#define KVSERVER_FLUSH_INTERVAL 100
+
+/* The number of entries logged since the last checkpoint which prompt a
+ * TPC KVServer to take a new one while transactions are prepared. */
+#define KVSERVER_CHECKPOINT_ENTRIES 1024
+
+/* The number of threads writing committed transactions to the store while
+ * rebuilding state. */
+#define KVSERVER_REPLAY_THREADS 4
+
 struct kvserver;
 typedef void (*kvhandle_t)(struct kvserver *, int sockfd, void *extra);
 
+/* A key written by a prepared transaction. */
+typedef struct tpctxnkey {
+  char *key;                /* The key, also used as the hash key. */
+  struct tpctxn *txn;       /* The transaction writing KEY. */
+  UT_hash_handle hh;        /* Makes this structure hashable. */
+} tpctxnkey_t;
+
+/* A PUT or DEL, or a batch of them, which this server has voted to commit,
+ * but which has not yet been committed or aborted. */
+typedef struct tpctxn {
+  uint64_t txid;            /* The ID of the transaction, also used as the hash key. */
+  msgtype_t type;           /* PUTREQ or DELREQ, for a batch as well. */
+  kvpair_t *pairs;          /* The keys being written, and their values (NULL for a DELREQ). */
+  unsigned int num_pairs;   /* The number of pairs in PAIRS. */
+  tpctxnkey_t *keys;        /* The key of each pair, as held by the server's TXN_KEYS. */
+  uint64_t lsn;             /* No greater than the LSN of the entry which prepared it. */
+  bool committing;          /* True once a COMMIT is being applied. */
+  UT_hash_handle hh;        /* Makes this structure hashable. */
+} tpctxn_t;
+
 /* A KVServer. Stores the associated KVCache and KVStore, as well as whether or
  * not this is a TPC-enabled server. */
 typedef struct kvserver {
@@ -53,14 +149,33 @@ typedef struct kvserver {
   int sockfd;               /* The socket fd this server is currently listening on (if any). */
   int port;                 /* The port this server should listen on. */
   char *hostname;           /* The host this server should listen on. */
-  kvmessage_t *tpc_op;        /* The operation undergoing TPC */
+  tpctxn_t *txns;           /* The prepared transactions, keyed by ID. */
+  tpctxnkey_t *txn_keys;    /* The keys written by TXNS, keyed by key. */
+  pthread_mutex_t txn_lock; /* Protects TXNS and orders it with the log. */
+  pthread_cond_t txn_done;  /* Signalled as committing transactions are applied. */
+  bool checkpointing;       /* True while a checkpoint is being taken. */
+  kvstats_t stats;          /* Counts this server's events and times its requests. */
+  bool write_back;          /* True if PUTs and DELs are written back by a flusher. */
+  bool use_wal;             /* True if write-back PUTs and DELs are first logged to LOG. */
+  unsigned int flush_interval; /* The milliseconds between flushes. */
+  pthread_t flusher;        /* Writes dirty cache entries back to the store. */
+  pthread_mutex_t flush_lock; /* Protects the fields below. */
+  pthread_cond_t flush_cond; /* Signalled to stop the flusher. */
+  pthread_cond_t wal_cond;  /* Signalled as WAL_WRITERS drains and as DRAINERS reaches 0. */
+  bool stopping;            /* True once the flusher should stop. */
+  unsigned int wal_writers; /* The writes logged but not yet in the cache. */
+  unsigned int drainers;    /* The flushes waiting for WAL_WRITERS to reach 0. */
 } kvserver_t;
 
 int kvserver_init(kvserver_t *, char *dirname, unsigned int num_sets,
     unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
     int port, bool use_tpc);
+int kvserver_init_backend(kvserver_t *, char *dirname, unsigned int num_sets,
+    unsigned int elem_per_set, unsigned int max_threads, const char *hostname,
+    int port, bool use_tpc, kvstore_backend_t backend, kvpolicy_type_t policy);
 
 int kvserver_register_master(kvserver_t *, int sockfd);
+int kvserver_deregister_master(kvserver_t *, int sockfd);
 
 void kvserver_handle(kvserver_t *, int sockfd, void *extra);
 
@@ -73,6 +188,14 @@ int kvserver_get(kvserver_t *, char *key, char **value);
 int kvserver_put(kvserver_t *, char *key, char *value);
 int kvserver_del(kvserver_t *, char *key);
 
+char *kvserver_get_info_message(kvserver_t *, char *format);
+
+int kvserver_enable_write_back(kvserver_t *, unsigned int flush_interval,
+    bool use_wal);
+int kvserver_flush(kvserver_t *);
+int kvserver_disable_write_back(kvserver_t *);
+
+int kvserver_checkpoint(kvserver_t *);
 int kvserver_rebuild_state(kvserver_t *);
 
 int kvserver_clean(kvserver_t *);
@@ -0,0 +1,100 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kvsketch.h"
+
+/* The odd multipliers picking a counter in each row. */
+static const uint64_t kvsketch_seeds[KVSKETCH_DEPTH] = {
+  0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL,
+  0x9ae16a3b2f90404fULL, 0xcbf29ce484222325ULL
+};
+
+/* Returns the position within SKETCH of the counter of HASH in ROW. */
+static unsigned int kvsketch_index(kvsketch_t *sketch, uint64_t hash,
+    unsigned int row) {
+  return row * sketch->width
+      + (unsigned int) ((hash * kvsketch_seeds[row]) >> sketch->shift);
+}
+
+/* Halves every counter of SKETCH. Each counter is halved with a
+ * compare-and-swap, so that an increment racing with it is not lost. */
+static void kvsketch_age(kvsketch_t *sketch) {
+  unsigned int i;
+  uint8_t count;
+  for (i = 0; i < KVSKETCH_DEPTH * sketch->width; i++) {
+    count = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+    while (count > 0 && !__atomic_compare_exchange_n(&sketch->counters[i],
+        &count, count >> 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  __atomic_sub_fetch(&sketch->samples, sketch->sample_limit / 2,
+      __ATOMIC_RELAXED);
+}
+
+/* Initializes SKETCH, an empty sketch sized for estimating the frequencies of
+ * about NUM_KEYS keys at a time. Returns 0 if successful, else a negative
+ * error code. */
+int kvsketch_init(kvsketch_t *sketch, unsigned int num_keys) {
+  unsigned int log = KVSKETCH_MIN_LOG_WIDTH;
+  if (num_keys == 0)
+    return -1;
+  /* Twice as many counters per row as keys keeps collisions rare. */
+  while ((1U << log) < 2 * num_keys)
+    log++;
+  sketch->width = 1U << log;
+  sketch->shift = 64 - log;
+  sketch->counters = calloc(KVSKETCH_DEPTH * sketch->width, sizeof(uint8_t));
+  if (sketch->counters == NULL)
+    return ENOMEM;
+  sketch->samples = 0;
+  sketch->sample_limit = KVSKETCH_SAMPLE_FACTOR * num_keys;
+  return 0;
+}
+
+/* Records an occurrence of the key whose kvhash_key is HASH in SKETCH. May be
+ * called without a lock: each counter is bumped with a compare-and-swap, so
+ * concurrent increments are never lost. */
+void kvsketch_increment(kvsketch_t *sketch, uint64_t hash) {
+  unsigned int row, i;
+  uint8_t count;
+  for (row = 0; row < KVSKETCH_DEPTH; row++) {
+    i = kvsketch_index(sketch, hash, row);
+    count = __atomic_load_n(&sketch->counters[i], __ATOMIC_RELAXED);
+    while (count < KVSKETCH_MAX_COUNT
+        && !__atomic_compare_exchange_n(&sketch->counters[i], &count,
+        count + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+  }
+  /* Only the increment reaching the limit ages the sketch. */
+  if (__atomic_add_fetch(&sketch->samples, 1, __ATOMIC_RELAXED)
+      == sketch->sample_limit)
+    kvsketch_age(sketch);
+}
+
+/* Returns the estimated number of occurrences of the key whose kvhash_key is
+ * HASH in SKETCH, which is never less than the number recorded since the
+ * counters were last halved. */
+unsigned int kvsketch_estimate(kvsketch_t *sketch, uint64_t hash) {
+  unsigned int row, min = KVSKETCH_MAX_COUNT;
+  uint8_t count;
+  for (row = 0; row < KVSKETCH_DEPTH; row++) {
+    count = __atomic_load_n(&sketch->counters[kvsketch_index(sketch, hash,
+        row)], __ATOMIC_RELAXED);
+    if (count < min)
+      min = count;
+  }
+  return min;
+}
+
+/* Resets every counter of SKETCH to zero. */
+void kvsketch_clear(kvsketch_t *sketch) {
+  memset(sketch->counters, 0, KVSKETCH_DEPTH * sketch->width);
+  sketch->samples = 0;
+}
+
+/* Frees the counters of SKETCH. */
+void kvsketch_destroy(kvsketch_t *sketch) {
+  free(sketch->counters);
+  sketch->counters = NULL;
+}
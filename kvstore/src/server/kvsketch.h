@@ -0,0 +1,58 @@
+#ifndef __KV_SKETCH__
+#define __KV_SKETCH__
+
+#include <stdint.h>
+
+/* KVSketch is a count-min sketch, which estimates how often each key has been
+ * seen in a small, fixed amount of memory. It is used by the W-TinyLFU cache
+ * policy (see kvpolicy.h) to judge whether a new entry deserves the room of
+ * the entry it would displace.
+ *
+ * The sketch holds KVSKETCH_DEPTH rows of counters. A key, given by its
+ * kvhash_key, increments one counter in every row, picked by multiplying the
+ * hash by a different odd constant per row and keeping the top bits; its
+ * estimate is the smallest of those counters, which may exceed the true count
+ * when keys collide but is never below it. Counters saturate at
+ * KVSKETCH_MAX_COUNT, as only the frequencies of recently popular keys matter.
+ *
+ * To let the sketch forget keys which used to be popular, every counter is
+ * halved once KVSKETCH_SAMPLE_FACTOR increments per expected key have been
+ * made since the last halving.
+ *
+ * Increments and estimates take no lock: counters are read and written with
+ * relaxed atomics, so increments racing on the same counter may be lost. An
+ * occasional undercount only makes the sketch slightly less eager to admit a
+ * key, which is harmless.
+ */
+
+/* The number of rows of counters. */
+#define KVSKETCH_DEPTH 4
+
+/* The value at which counters stop counting. */
+#define KVSKETCH_MAX_COUNT 15
+
+/* The log2 of the fewest counters a row may have, so that the small sketches
+ * of small cache sets still tell keys apart. */
+#define KVSKETCH_MIN_LOG_WIDTH 6
+
+/* The number of increments per expected key after which counters are halved. */
+#define KVSKETCH_SAMPLE_FACTOR 10
+
+/* A KVSketch. */
+typedef struct {
+  uint8_t *counters;              /* KVSKETCH_DEPTH rows of WIDTH counters. */
+  unsigned int width;             /* The number of counters per row (a power of two). */
+  unsigned int shift;             /* 64 minus the log2 of WIDTH. */
+  unsigned int samples;           /* The increments made since the last halving. */
+  unsigned int sample_limit;      /* The value of SAMPLES at which counters are halved. */
+} kvsketch_t;
+
+int kvsketch_init(kvsketch_t *, unsigned int num_keys);
+
+void kvsketch_increment(kvsketch_t *, uint64_t hash);
+unsigned int kvsketch_estimate(kvsketch_t *, uint64_t hash);
+
+void kvsketch_clear(kvsketch_t *);
+void kvsketch_destroy(kvsketch_t *);
+
+#endif
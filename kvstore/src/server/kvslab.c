@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kvslab.h"
+
+/* The usable capacity of each size class. The last class must fit the
+ * longest key or value plus its null terminator. */
+static const size_t kvslab_capacities[KVSLAB_NUM_CLASSES] = {
+  16, 32, 64, 128, 256, 512,
+  (MAX_KEYLEN > MAX_VALLEN ? MAX_KEYLEN : MAX_VALLEN) + 1
+};
+
+/* Initializes SLAB with empty free lists. Returns 0 if successful, else a
+ * negative error code. */
+int kvslab_init(kvslab_t *slab) {
+  int i, ret;
+  for (i = 0; i < KVSLAB_NUM_CLASSES; i++) {
+    slab->classes[i].capacity = kvslab_capacities[i];
+    slab->classes[i].free = NULL;
+    slab->classes[i].pages = NULL;
+    if ((ret = pthread_mutex_init(&slab->classes[i].lock, NULL)) != 0) {
+      while (--i >= 0)
+        pthread_mutex_destroy(&slab->classes[i].lock);
+      return -ret;
+    }
+  }
+  return 0;
+}
+
+/* Frees every page of SLAB. No chunk of SLAB may be used afterwards, so it
+ * must only be called once nothing holds or reads one. */
+void kvslab_destroy(kvslab_t *slab) {
+  kvslabpage_t *page, *next;
+  int i;
+  for (i = 0; i < KVSLAB_NUM_CLASSES; i++) {
+    for (page = slab->classes[i].pages; page != NULL; page = next) {
+      next = page->next;
+      free(page);
+    }
+    slab->classes[i].pages = NULL;
+    slab->classes[i].free = NULL;
+    pthread_mutex_destroy(&slab->classes[i].lock);
+  }
+}
+
+/* Returns the size in bytes of a chunk of class CLS, rounded up so that
+ * every chunk within a page stays pointer-aligned. */
+static size_t kvslab_chunk_size(kvslabclass_t *cls) {
+  size_t size = sizeof(kvchunk_t) + cls->capacity;
+  return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/* Allocates a new page for CLS and pushes its chunks onto the free list.
+ * Must be called with the class lock held. Returns 0 if successful, else a
+ * negative error code. */
+static int kvslab_grow(kvslabclass_t *cls) {
+  size_t size = kvslab_chunk_size(cls);
+  kvslabpage_t *page = malloc(sizeof(kvslabpage_t)
+      + size * KVSLAB_CHUNKS_PER_PAGE);
+  kvchunk_t *chunk;
+  int i;
+  if (page == NULL)
+    return -1;
+  page->next = cls->pages;
+  cls->pages = page;
+  for (i = KVSLAB_CHUNKS_PER_PAGE - 1; i >= 0; i--) {
+    chunk = (kvchunk_t *) ((char *) (page + 1) + i * size);
+    chunk->cls = cls;
+    chunk->refcount = 0;
+    chunk->next = cls->free;
+    cls->free = chunk;
+  }
+  return 0;
+}
+
+/* Copies the null-terminated STR into a chunk of the smallest class of SLAB
+ * that fits it. Returns the chunk, holding a single reference, or NULL if STR
+ * is too long or memory is exhausted. */
+kvchunk_t *kvslab_alloc(kvslab_t *slab, const char *str) {
+  size_t len = strlen(str);
+  kvslabclass_t *cls = NULL;
+  kvchunk_t *chunk;
+  int i;
+  for (i = 0; i < KVSLAB_NUM_CLASSES; i++) {
+    if (len < slab->classes[i].capacity) {
+      cls = &slab->classes[i];
+      break;
+    }
+  }
+  if (cls == NULL)
+    return NULL;
+  pthread_mutex_lock(&cls->lock);
+  if (cls->free == NULL && kvslab_grow(cls) < 0) {
+    pthread_mutex_unlock(&cls->lock);
+    return NULL;
+  }
+  chunk = cls->free;
+  cls->free = chunk->next;
+  pthread_mutex_unlock(&cls->lock);
+  memcpy(chunk->data, str, len + 1);
+  chunk->length = len;
+  __atomic_store_n(&chunk->refcount, 1, __ATOMIC_RELEASE);
+  return chunk;
+}
+
+/* Takes a reference to CHUNK unless it is free. Used by lock-free readers
+ * which may race with the last reference being dropped; since chunk memory
+ * is never unmapped, this is safe to call on a chunk that was freed. Returns
+ * true if a reference was taken. */
+bool kvchunk_tryhold(kvchunk_t *chunk) {
+  unsigned int refcount = __atomic_load_n(&chunk->refcount, __ATOMIC_RELAXED);
+  while (refcount > 0) {
+    if (__atomic_compare_exchange_n(&chunk->refcount, &refcount, refcount + 1,
+        true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return true;
+  }
+  return false;
+}
+
+/* Drops a reference to CHUNK, returning it to its free list if it was the
+ * last one. */
+void kvchunk_release(kvchunk_t *chunk) {
+  kvslabclass_t *cls = chunk->cls;
+  if (__atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  pthread_mutex_lock(&cls->lock);
+  chunk->next = cls->free;
+  cls->free = chunk;
+  pthread_mutex_unlock(&cls->lock);
+}
@@ -0,0 +1,69 @@
+#ifndef __KV_SLAB__
+#define __KV_SLAB__
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "kvconstants.h"
+
+/* KVSlab is a size-class allocator for the keys and values held by a
+ * KVCacheSet.
+ *
+ * Strings are stored in chunks. Each chunk belongs to one of
+ * KVSLAB_NUM_CLASSES size classes, the largest of which fits MAX_KEYLEN or
+ * MAX_VALLEN characters plus a null terminator. Chunks are carved out of
+ * pages that are allocated on demand and only returned to the system by
+ * kvslab_destroy, so chunk memory is type-stable: a freed chunk is only ever
+ * reused as a chunk of the same class. This is what lets cache GETs read
+ * chunks without a lock (see kvcacheset.h).
+ *
+ * Chunks are reference counted. kvslab_alloc returns a chunk holding one
+ * reference; kvchunk_release drops one and returns the chunk to its class's
+ * free list once none remain. A holder may read DATA for as long as it holds
+ * a reference, which is how zero-copy cache GETs hand out values.
+ */
+
+/* The number of size classes. */
+#define KVSLAB_NUM_CLASSES 7
+
+/* The number of chunks carved from each newly allocated page. */
+#define KVSLAB_CHUNKS_PER_PAGE 32
+
+struct kvslabclass;
+
+/* A reference-counted chunk holding a null-terminated string. */
+typedef struct kvchunk {
+  struct kvslabclass *cls;      /* The size class this chunk belongs to. */
+  unsigned int refcount;        /* The number of references held, 0 if free. */
+  unsigned int length;          /* The length of DATA, excluding the null terminator. */
+  struct kvchunk *next;         /* The next chunk on the free list. */
+  char data[];                  /* The string itself. */
+} kvchunk_t;
+
+/* A page of chunks, which follow it in memory. */
+typedef struct kvslabpage {
+  struct kvslabpage *next;      /* The next page of the same class. */
+} kvslabpage_t;
+
+/* A single size class. */
+typedef struct kvslabclass {
+  size_t capacity;              /* The number of bytes available in DATA. */
+  pthread_mutex_t lock;         /* Protects FREE and PAGES. */
+  kvchunk_t *free;              /* Chunks of this class which are not in use. */
+  kvslabpage_t *pages;          /* Every page allocated for this class. */
+} kvslabclass_t;
+
+/* A KVSlab. */
+typedef struct {
+  kvslabclass_t classes[KVSLAB_NUM_CLASSES];
+} kvslab_t;
+
+int kvslab_init(kvslab_t *);
+void kvslab_destroy(kvslab_t *);
+
+kvchunk_t *kvslab_alloc(kvslab_t *, const char *str);
+
+bool kvchunk_tryhold(kvchunk_t *);
+void kvchunk_release(kvchunk_t *);
+
+#endif
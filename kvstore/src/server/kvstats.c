@@ -0,0 +1,205 @@
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "kvstats.h"
+
+/* The names of the counters and timers, as reported by INFO. */
+static const char *kvstats_counter_names[KVSTATS_NUM_COUNTERS] = {
+  "cache_hits", "cache_misses", "votes_commit", "votes_abort", "commits",
+  "aborts", "write_backs"
+};
+static const char *kvstats_timer_names[KVSTATS_NUM_TIMERS] = {
+  "get", "put", "del", "store_read", "store_write", "log_write", "prepare",
+  "decide"
+};
+
+/* The longest line of kvstats_text. */
+#define KVSTATS_LINE_LEN 160
+
+/* The shard of the calling thread, or -1 until it is given one. */
+static __thread int kvstats_thread_shard = -1;
+
+/* The number of threads which have been given a shard. */
+static unsigned int kvstats_num_threads;
+
+/* Returns the shard of STATS which the calling thread writes to. */
+static kvstatshard_t *kvstats_shard(kvstats_t *stats) {
+  if (kvstats_thread_shard < 0)
+    kvstats_thread_shard = __atomic_fetch_add(&kvstats_num_threads, 1,
+        __ATOMIC_RELAXED) % KVSTATS_SHARDS;
+  return &stats->shards[kvstats_thread_shard];
+}
+
+/* Initializes STATS, with every counter and timer at zero. Returns 0 if
+ * successful, else a negative error code. */
+int kvstats_init(kvstats_t *stats) {
+  void *shards;
+  if (posix_memalign(&shards, 64, KVSTATS_SHARDS * sizeof(kvstatshard_t)))
+    return ENOMEM;
+  memset(shards, 0, KVSTATS_SHARDS * sizeof(kvstatshard_t));
+  stats->shards = shards;
+  return 0;
+}
+
+/* Returns the current time in nanoseconds, for timing latencies. */
+uint64_t kvstats_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Counts an occurrence of COUNTER in STATS. */
+void kvstats_count(kvstats_t *stats, kvcounter_t counter) {
+  __atomic_add_fetch(&kvstats_shard(stats)->counters[counter], 1,
+      __ATOMIC_RELAXED);
+}
+
+/* Records a LATENCY in nanoseconds for TIMER in STATS. */
+void kvstats_record(kvstats_t *stats, kvtimer_t timer, uint64_t latency) {
+  kvstatshard_t *shard = kvstats_shard(stats);
+  uint64_t max;
+  __atomic_add_fetch(&shard->buckets[timer][kvhist_bucket(latency,
+      KVSTATS_SUB_BITS)], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shard->sums[timer], latency, __ATOMIC_RELAXED);
+  max = __atomic_load_n(&shard->maxes[timer], __ATOMIC_RELAXED);
+  while (latency > max && !__atomic_compare_exchange_n(&shard->maxes[timer],
+      &max, latency, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Records the time elapsed since START, as given by kvstats_now, for TIMER
+ * in STATS. */
+void kvstats_time(kvstats_t *stats, kvtimer_t timer, uint64_t start) {
+  kvstats_record(stats, timer, kvstats_now() - start);
+}
+
+/* Returns the number of occurrences of COUNTER in STATS. */
+uint64_t kvstats_counter(kvstats_t *stats, kvcounter_t counter) {
+  uint64_t total = 0;
+  unsigned int i;
+  for (i = 0; i < KVSTATS_SHARDS; i++)
+    total += __atomic_load_n(&stats->shards[i].counters[counter],
+        __ATOMIC_RELAXED);
+  return total;
+}
+
+/* Returns the latency in microseconds which PERCENTILE percent of the TOTAL
+ * latencies counted in BUCKETS are at or below, never above MAX. */
+static double kvstats_percentile(uint64_t *buckets, uint64_t total,
+    uint64_t max, double percentile) {
+  return kvhist_bucket_percentile(buckets, KVSTATS_SUB_BITS, total, max,
+      percentile) / 1000.0;
+}
+
+/* Summarizes the latencies recorded for TIMER in STATS into TIMING. */
+void kvstats_timing(kvstats_t *stats, kvtimer_t timer, kvtiming_t *timing) {
+  uint64_t buckets[KVSTATS_NUM_BUCKETS], sum = 0, max = 0, value;
+  unsigned int i, j;
+  memset(buckets, 0, sizeof(buckets));
+  memset(timing, 0, sizeof(kvtiming_t));
+  for (i = 0; i < KVSTATS_SHARDS; i++) {
+    for (j = 0; j < KVSTATS_NUM_BUCKETS; j++) {
+      value = __atomic_load_n(&stats->shards[i].buckets[timer][j],
+          __ATOMIC_RELAXED);
+      buckets[j] += value;
+      timing->count += value;
+    }
+    sum += __atomic_load_n(&stats->shards[i].sums[timer], __ATOMIC_RELAXED);
+    value = __atomic_load_n(&stats->shards[i].maxes[timer], __ATOMIC_RELAXED);
+    if (value > max)
+      max = value;
+  }
+  if (timing->count == 0)
+    return;
+  timing->mean = (double) sum / timing->count / 1000;
+  timing->p50 = kvstats_percentile(buckets, timing->count, max, 50);
+  timing->p90 = kvstats_percentile(buckets, timing->count, max, 90);
+  timing->p99 = kvstats_percentile(buckets, timing->count, max, 99);
+  timing->p999 = kvstats_percentile(buckets, timing->count, max, 99.9);
+  timing->max = max / 1000.0;
+}
+
+/* Returns the number of characters an snprintf of KVSTATS_LINE_LEN bytes
+ * which returned N actually wrote, as a truncated line stops short of N. */
+static size_t kvstats_line_end(int n) {
+  if (n < 0)
+    return 0;
+  return (n < KVSTATS_LINE_LEN) ? n : KVSTATS_LINE_LEN - 1;
+}
+
+/* Returns a malloced string, which should later be freed, listing every
+ * counter of STATS and a summary of every timer, one per line, or NULL if
+ * there is not enough memory. */
+char *kvstats_text(kvstats_t *stats) {
+  kvtiming_t timing;
+  char *text, *pos;
+  unsigned int i;
+  text = malloc((KVSTATS_NUM_COUNTERS + KVSTATS_NUM_TIMERS)
+      * KVSTATS_LINE_LEN + 1);
+  if (text == NULL)
+    return NULL;
+  pos = text;
+  *pos = '\0';
+  for (i = 0; i < KVSTATS_NUM_COUNTERS; i++)
+    pos += kvstats_line_end(snprintf(pos, KVSTATS_LINE_LEN, "%s: %llu\n",
+        kvstats_counter_names[i],
+        (unsigned long long) kvstats_counter(stats, i)));
+  for (i = 0; i < KVSTATS_NUM_TIMERS; i++) {
+    kvstats_timing(stats, i, &timing);
+    pos += kvstats_line_end(snprintf(pos, KVSTATS_LINE_LEN,
+        "%s: count=%llu mean=%.1fus p50=%.1fus p90=%.1fus p99=%.1fus "
+        "p99.9=%.1fus max=%.1fus\n",
+        kvstats_timer_names[i], (unsigned long long) timing.count,
+        timing.mean, timing.p50, timing.p90, timing.p99, timing.p999,
+        timing.max));
+  }
+  /* Drop the last newline. */
+  if (pos > text)
+    pos[-1] = '\0';
+  return text;
+}
+
+/* Returns a new JSON object, which should later be released with
+ * json_object_put, holding every counter of STATS under "counters" and a
+ * summary of every timer, in microseconds, under "latencies". */
+json_object *kvstats_json(kvstats_t *stats) {
+  json_object *json, *counters, *latencies, *latency;
+  kvtiming_t timing;
+  unsigned int i;
+  json = json_object_new_object();
+  counters = json_object_new_object();
+  for (i = 0; i < KVSTATS_NUM_COUNTERS; i++)
+    json_object_object_add(counters, kvstats_counter_names[i],
+        json_object_new_int64((int64_t) kvstats_counter(stats, i)));
+  json_object_object_add(json, "counters", counters);
+  latencies = json_object_new_object();
+  for (i = 0; i < KVSTATS_NUM_TIMERS; i++) {
+    kvstats_timing(stats, i, &timing);
+    latency = json_object_new_object();
+    json_object_object_add(latency, "count",
+        json_object_new_int64((int64_t) timing.count));
+    json_object_object_add(latency, "mean_us",
+        json_object_new_double(timing.mean));
+    json_object_object_add(latency, "p50_us",
+        json_object_new_double(timing.p50));
+    json_object_object_add(latency, "p90_us",
+        json_object_new_double(timing.p90));
+    json_object_object_add(latency, "p99_us",
+        json_object_new_double(timing.p99));
+    json_object_object_add(latency, "p999_us",
+        json_object_new_double(timing.p999));
+    json_object_object_add(latency, "max_us",
+        json_object_new_double(timing.max));
+    json_object_object_add(latencies, kvstats_timer_names[i], latency);
+  }
+  json_object_object_add(json, "latencies", latencies);
+  return json;
+}
+
+/* Frees the shards of STATS. */
+void kvstats_destroy(kvstats_t *stats) {
+  free(stats->shards);
+  stats->shards = NULL;
+}
@@ -0,0 +1,103 @@
+#ifndef __KV_STATS__
+#define __KV_STATS__
+
+#include <stdint.h>
+#include <json-c/json.h>
+#include "kvhist.h"
+
+/* KVStats counts the events of a KVServer or TPCMaster, and the latencies of
+ * its requests, cheaply enough to be left on at all times. Both answer INFO
+ * requests with a summary of them.
+ *
+ * Rather than sharing a single set of counters, which every thread would
+ * fight over, the stats are split into KVSTATS_SHARDS shards, each on its own
+ * cache lines. A thread is given a shard the first time it records anything
+ * and keeps it; as long as there are no more threads than shards, no two
+ * threads write to the same shard. Shards are updated with relaxed atomic
+ * adds, so threads which do end up sharing one never lose an update, and no
+ * lock is ever taken. Reading the stats sums every shard, and may see some
+ * of the updates made while it runs but not others.
+ *
+ * Each timer is a log-bucketed histogram of latencies in nanoseconds, using
+ * the buckets of kvhist.h with KVSTATS_SUB_BITS bits of precision, so a
+ * percentile is reported at most 1/2^(KVSTATS_SUB_BITS - 1) above its true
+ * value.
+ */
+
+/* The number of shards the stats are split into. */
+#define KVSTATS_SHARDS 16
+
+/* The number of bits of precision kept of each latency. */
+#define KVSTATS_SUB_BITS 4
+
+/* The key of an INFO request asking for its answer in JSON. */
+#define KVSTATS_JSON "json"
+
+/* The events counted. */
+typedef enum {
+  KVSTATS_CACHE_HIT,        /* A GET answered from the cache. */
+  KVSTATS_CACHE_MISS,       /* A GET which missed the cache. */
+  KVSTATS_VOTE_COMMIT,      /* A VOTE_COMMIT cast by a slave, or received by a master. */
+  KVSTATS_VOTE_ABORT,       /* A VOTE_ABORT, or a slave which failed to vote. */
+  KVSTATS_COMMIT,           /* A transaction committed. */
+  KVSTATS_ABORT,            /* A transaction aborted. */
+  KVSTATS_WRITE_BACK,       /* A dirty cache entry written back to the store. */
+  KVSTATS_NUM_COUNTERS
+} kvcounter_t;
+
+/* The latencies timed. */
+typedef enum {
+  KVSTATS_GET,              /* A GET or MGETREQ. */
+  KVSTATS_PUT,              /* A PUT or MPUTREQ, or the whole transaction on a master. */
+  KVSTATS_DEL,              /* A DEL or MDELREQ, or the whole transaction on a master. */
+  KVSTATS_STORE_READ,       /* A read from the store. */
+  KVSTATS_STORE_WRITE,      /* A write to the store. */
+  KVSTATS_LOG_WRITE,        /* A write to the TPC log. */
+  KVSTATS_PREPARE,          /* The first phase of a transaction. */
+  KVSTATS_DECIDE,           /* The second phase of a transaction. */
+  KVSTATS_NUM_TIMERS
+} kvtimer_t;
+
+/* The number of buckets of each timer. */
+#define KVSTATS_NUM_BUCKETS KVHIST_BUCKETS(KVSTATS_SUB_BITS)
+
+/* One shard of a KVStats. */
+typedef struct {
+  uint64_t counters[KVSTATS_NUM_COUNTERS];  /* The count of each event. */
+  uint64_t sums[KVSTATS_NUM_TIMERS];        /* The sum of each timer's latencies. */
+  uint64_t maxes[KVSTATS_NUM_TIMERS];       /* The largest latency of each timer. */
+  uint64_t buckets[KVSTATS_NUM_TIMERS][KVSTATS_NUM_BUCKETS]; /* Each timer's histogram. */
+} __attribute__((aligned(64))) kvstatshard_t;
+
+/* A KVStats. */
+typedef struct {
+  kvstatshard_t *shards;    /* KVSTATS_SHARDS shards. */
+} kvstats_t;
+
+/* A summary of the latencies of a single timer, in microseconds. */
+typedef struct {
+  uint64_t count;           /* The number of latencies recorded. */
+  double mean;              /* Their mean. */
+  double p50;               /* Their median. */
+  double p90;               /* Their 90th percentile. */
+  double p99;               /* Their 99th percentile. */
+  double p999;              /* Their 99.9th percentile. */
+  double max;               /* The largest of them. */
+} kvtiming_t;
+
+int kvstats_init(kvstats_t *);
+
+uint64_t kvstats_now(void);
+void kvstats_count(kvstats_t *, kvcounter_t counter);
+void kvstats_record(kvstats_t *, kvtimer_t timer, uint64_t latency);
+void kvstats_time(kvstats_t *, kvtimer_t timer, uint64_t start);
+
+uint64_t kvstats_counter(kvstats_t *, kvcounter_t counter);
+void kvstats_timing(kvstats_t *, kvtimer_t timer, kvtiming_t *timing);
+
+char *kvstats_text(kvstats_t *);
+json_object *kvstats_json(kvstats_t *);
+
+void kvstats_destroy(kvstats_t *);
+
+#endif
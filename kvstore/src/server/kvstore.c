@@ -5,6 +5,7 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include "kvhash.h"
 #include "kvstore.h"
 
 /* The djb2 string hash algorithm
@@ -18,32 +19,189 @@ unsigned long hash(char *str) {
   return hash;
 }
 
+/* Returns the hash naming the entry files of KEY in STORE, which depends on
+ * the store's format. */
+unsigned long kvstore_hash(kvstore_t *store, char *key) {
+  if (store->format == KVSTORE_FORMAT_DJB2)
+    return hash(key);
+  return kvhash_key(key);
+}
+
+/* Returns the hash naming the entry files in STORE of KEY, whose
+ * kvhash_key, which the bloom filter uses, is KEYHASH. In the current format
+ * both are the same, so KEY is only hashed once. */
+static unsigned long kvstore_hashval(kvstore_t *store, char *key,
+    uint64_t keyhash) {
+  if (store->format == KVSTORE_FORMAT_DJB2)
+    return hash(key);
+  return keyhash;
+}
+
+/* Returns true if NAME is the name of an entry file. */
+static bool kvstore_is_entry(char *name) {
+  size_t namelen = strlen(name), typelen = strlen(KVSTORE_FILETYPE);
+  return namelen > typelen
+      && strcmp(name + namelen - typelen, KVSTORE_FILETYPE) == 0;
+}
+
+/* Fills FILENAME with the path of the file named NAME within STORE's
+ * directory. Returns 0 if successful, or ERRFILLEN if the path does not fit
+ * in MAX_FILENAME. */
+static int kvstore_path(kvstore_t *store, char *filename, const char *name) {
+  if (snprintf(filename, MAX_FILENAME, "%s/%s", store->dirname, name)
+      >= MAX_FILENAME)
+    return ERRFILLEN;
+  return 0;
+}
+
+/* Reads the format of STORE from its format file. A directory without one is
+ * given the current format, unless it already holds entries, in which case
+ * they were named under the djb2 format; either way the format is recorded.
+ * Returns 0 if successful, else a negative error code. */
+static int kvstore_open_format(kvstore_t *store) {
+  char filename[MAX_FILENAME];
+  struct dirent *dent;
+  unsigned int format;
+  DIR *kvstoredir;
+  FILE *file;
+  if (kvstore_path(store, filename, KVSTORE_FORMAT_FILENAME) != 0)
+    return ERRFILLEN;
+  if ((file = fopen(filename, "r")) != NULL) {
+    if (fscanf(file, "%u", &format) != 1)
+      format = 0;
+    fclose(file);
+    if (format != KVSTORE_FORMAT_DJB2 && format != KVSTORE_FORMAT_KVHASH)
+      return ERRFILACCESS;
+    store->format = format;
+    return 0;
+  }
+  store->format = KVSTORE_FORMAT_CURRENT;
+  if ((kvstoredir = opendir(store->dirname)) == NULL)
+    return ERRFILACCESS;
+  while ((dent = readdir(kvstoredir)) != NULL) {
+    if (kvstore_is_entry(dent->d_name)) {
+      store->format = KVSTORE_FORMAT_DJB2;
+      break;
+    }
+  }
+  closedir(kvstoredir);
+  if ((file = fopen(filename, "w")) == NULL)
+    return ERRFILACCESS;
+  fprintf(file, "%u\n", store->format);
+  if (fclose(file) != 0)
+    return ERRFILACCESS;
+  return 0;
+}
+
+/* Adds KEY to the index AUX. Used to build the index of a store whose
+ * directory predates it. */
+static int kvstore_index_key(char *key, char *value, void *aux) {
+  return kvindex_insert((kvindex_t *) aux, key);
+}
+
+/* Adds KEY to the bloom filter AUX. */
+static int kvstore_bloom_key(char *key, void *aux) {
+  kvbloom_add((kvbloom_t *) aux, kvhash_key(key));
+  return 0;
+}
+
+/* Builds the bloom filter of STORE from its index. Returns 0 if successful,
+ * else a negative error code. */
+static int kvstore_open_bloom(kvstore_t *store) {
+  char filename[MAX_FILENAME];
+  int ret;
+  if (kvstore_path(store, filename, KVSTORE_BLOOM_FILENAME) != 0)
+    return ERRFILLEN;
+  if ((store->bloom = malloc(sizeof(kvbloom_t))) == NULL)
+    return ENOMEM;
+  ret = kvbloom_init(store->bloom, filename, kvindex_size(store->index));
+  if (ret != 0) {
+    free(store->bloom);
+    store->bloom = NULL;
+    return ret;
+  }
+  return kvindex_iterate(store->index, kvstore_bloom_key, store->bloom);
+}
+
+/* Opens the index of STORE, building it from STORE's entries if its file did
+ * not exist yet, and then its bloom filter if it uses one. Returns 0 if
+ * successful, else a negative error code. */
+static int kvstore_open_index(kvstore_t *store) {
+  char filename[MAX_FILENAME];
+  bool created;
+  int ret;
+  if (kvstore_path(store, filename, KVSTORE_INDEX_FILENAME) != 0)
+    return ERRFILLEN;
+  if ((store->index = malloc(sizeof(kvindex_t))) == NULL)
+    return ENOMEM;
+  if ((ret = kvindex_init(store->index, filename, &created)) != 0) {
+    free(store->index);
+    store->index = NULL;
+    return ret;
+  }
+  if (created)
+    ret = kvstore_iterate(store, kvstore_index_key, store->index);
+  if (ret == 0 && store->backend == KVSTORE_FILES)
+    ret = kvstore_open_bloom(store);
+  return ret;
+}
+
 /* Initializes kvstore STORE. Uses DIRNAME as the directory in which to store
  * the entries of this store, creating the directory if necessary. Returns 0 if
  * successful, else a negative error code. */
 int kvstore_init(kvstore_t *store, char *dirname) {
+  return kvstore_init_backend(store, dirname, KVSTORE_FILES);
+}
+
+/* Initializes kvstore STORE to use the on-disk layout BACKEND within DIRNAME,
+ * creating the directory if necessary. Returns 0 if successful, else a
+ * negative error code. */
+int kvstore_init_backend(kvstore_t *store, char *dirname,
+    kvstore_backend_t backend) {
   struct stat st;
+  int ret;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
   }
   strcpy(store->dirname, dirname);
   pthread_rwlock_init(&store->lock, NULL);
-  return 0;
+  store->backend = backend;
+  store->logstore = NULL;
+  store->index = NULL;
+  store->bloom = NULL;
+  store->format = KVSTORE_FORMAT_CURRENT;
+  if (backend == KVSTORE_FILES && (ret = kvstore_open_format(store)) != 0)
+    return ret;
+  if (backend == KVSTORE_LOG) {
+    store->logstore = malloc(sizeof(kvlogstore_t));
+    if (store->logstore == NULL)
+      return ENOMEM;
+    if ((ret = kvlogstore_init(store->logstore, dirname)) != 0) {
+      free(store->logstore);
+      store->logstore = NULL;
+      return ret;
+    }
+  }
+  return kvstore_open_index(store);
 }
 
-/* Attempts to find an entry matching KEY within the store.
+/* Attempts to find an entry matching KEY, whose kvhash_key is KEYHASH and
+ * whose entry files are named by HASHVAL, within the store.
  *
  * Returns a nonnegative integer representing the location of the entry within
- * its hash chain (so, the entry's filename is "hash(key)-returnval.entry").
+ * its hash chain (so, the entry's filename is "HASHVAL-returnval.entry").
  *
  * Returns a negative error code if the entry is not found or an error
  * occurred.
  *
  * If VALUE is not NULL, the value of the entry will be placed into VALUE using
- * malloced memory which should be freed later. */
-int find_entry(kvstore_t *store, char *key, char **value) {
-  unsigned long hashval;
+ * malloced memory which should be freed later.
+ *
+ * A key ruled out by the store's bloom filter is reported missing without
+ * touching the disk. */
+static int kvstore_find(kvstore_t *store, char *key, uint64_t keyhash,
+    unsigned long hashval, char **value) {
   unsigned int counter = 0;
   char currfile[MAX_FILENAME];
   size_t keylen = strlen(key);
@@ -52,9 +210,10 @@ int find_entry(kvstore_t *store, char *key, char **value) {
   kventry_t *entry, header;
   if (keylen > MAX_KEYLEN)
     return ERRKEYLEN;
+  if (store->bloom != NULL && !kvbloom_may_contain(store->bloom, keyhash))
+    return ERRNOKEY;
   if (stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
-  hashval = hash(key);
   pthread_rwlock_rdlock(&store->lock);
   sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, counter++,
       KVSTORE_FILETYPE);
@@ -92,16 +251,52 @@ int find_entry(kvstore_t *store, char *key, char **value) {
   return ERRNOKEY;
 }
 
+/* As kvstore_find, hashing KEY itself. */
+int find_entry(kvstore_t *store, char *key, char **value) {
+  uint64_t keyhash;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  keyhash = kvhash_key(key);
+  return kvstore_find(store, key, keyhash,
+      kvstore_hashval(store, key, keyhash), value);
+}
+
 /* Returns true if STORE contains KEY, else false. */
 bool kvstore_haskey(kvstore_t *store, char *key) {
-  return find_entry(store, key, NULL) >= 0;
+  return kvstore_haskey_hashed(store, key, kvhash_key(key));
+}
+
+/* As kvstore_haskey, for a KEY whose kvhash_key is HASH. */
+bool kvstore_haskey_hashed(kvstore_t *store, char *key, uint64_t hash) {
+  if (store->backend == KVSTORE_LOG)
+    return store->logstore != NULL && strlen(key) <= MAX_KEYLEN
+        && kvlogstore_haskey(store->logstore, key);
+  if (strlen(key) > MAX_KEYLEN)
+    return false;
+  return kvstore_find(store, key, hash, kvstore_hashval(store, key, hash),
+      NULL) >= 0;
 }
 
 /* Attempts to retrieve the entry denoted by KEY from STORE.
  * Returns 0 if successful, else a negative error code. The entry's value will
  * be placed into VALUE using malloc()d memory which should be free()d later. */
 int kvstore_get(kvstore_t *store, char *key, char **value) {
-  int ret = find_entry(store, key, value);
+  return kvstore_get_hashed(store, key, kvhash_key(key), value);
+}
+
+/* As kvstore_get, for a KEY whose kvhash_key is HASH. */
+int kvstore_get_hashed(kvstore_t *store, char *key, uint64_t hash,
+    char **value) {
+  int ret;
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  if (store->backend == KVSTORE_LOG) {
+    if (store->logstore == NULL)
+      return ERRFILACCESS;
+    return kvlogstore_get(store->logstore, key, value);
+  }
+  ret = kvstore_find(store, key, hash, kvstore_hashval(store, key, hash),
+      value);
   if (ret < 0)
     return ret;
   else
@@ -116,6 +311,8 @@ int kvstore_put_check(kvstore_t *store, char *key, char *value) {
     return ERRKEYLEN;
   if (strlen(value) > MAX_VALLEN)
     return ERRVALLEN;
+  if (store->backend == KVSTORE_LOG)
+    return (store->logstore == NULL) ? ERRFILACCESS : 0;
   if (stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
   return 0;
@@ -123,8 +320,15 @@ int kvstore_put_check(kvstore_t *store, char *key, char *value) {
 
 /* Adds the given KEY, VALUE entry to STORE. Returns 0 if successful, else a
  * negative error code. See kvserver.h for a complete description of how
- * entries are stored. */
+ * entries are stored. KEY is added to the index and bloom filter before the
+ * entry is written. */
 int kvstore_put(kvstore_t *store, char *key, char *value) {
+  return kvstore_put_hashed(store, key, kvhash_key(key), value);
+}
+
+/* As kvstore_put, for a KEY whose kvhash_key is KEYHASH. */
+int kvstore_put_hashed(kvstore_t *store, char *key, uint64_t keyhash,
+    char *value) {
   unsigned long hashval;
   int counter, check;
   size_t keylen = strlen(key), vallen = strlen(value);
@@ -134,9 +338,24 @@ int kvstore_put(kvstore_t *store, char *key, char *value) {
   kventry_t *entry;
   if ((check = kvstore_put_check(store, key, value)) < 0)
     return check;
-  hashval = hash(key);
-  counter = find_entry(store, key, NULL);
+  if (store->backend == KVSTORE_LOG) {
+    pthread_rwlock_wrlock(&store->lock);
+    if (store->index == NULL
+        || (check = kvindex_insert(store->index, key)) == 0)
+      check = kvlogstore_put(store->logstore, key, value);
+    pthread_rwlock_unlock(&store->lock);
+    return check;
+  }
+  hashval = kvstore_hashval(store, key, keyhash);
+  counter = kvstore_find(store, key, keyhash, hashval, NULL);
   pthread_rwlock_wrlock(&store->lock);
+  if (store->index != NULL
+      && (check = kvindex_insert(store->index, key)) != 0) {
+    pthread_rwlock_unlock(&store->lock);
+    return check;
+  }
+  if (counter < 0 && store->bloom != NULL)
+    kvbloom_add(store->bloom, keyhash);
   if (counter >= 0) {
     /* Entry already exists, just update it. */
     sprintf(filename, "%s/%lu-%u%s", store->dirname, hashval, counter,
@@ -168,31 +387,57 @@ int kvstore_put(kvstore_t *store, char *key, char *value) {
 /* Checks if STORE can successfully remove the given KEY.
  * Returns 0 if it can, else a negative error code indicating why it cannot. */
 int kvstore_del_check(kvstore_t *store, char *key) {
+  return kvstore_del_check_hashed(store, key, kvhash_key(key));
+}
+
+/* As kvstore_del_check, for a KEY whose kvhash_key is HASH. */
+int kvstore_del_check_hashed(kvstore_t *store, char *key, uint64_t hash) {
   struct stat st;
   if (strlen(key) > MAX_KEYLEN)
     return ERRKEYLEN;
-  if (stat(store->dirname, &st) == -1)
+  if (store->backend == KVSTORE_LOG && store->logstore == NULL)
+    return ERRFILACCESS;
+  if (store->backend == KVSTORE_FILES && stat(store->dirname, &st) == -1)
     return ERRFILACCESS;
-  if (!kvstore_haskey(store, key))
+  if (!kvstore_haskey_hashed(store, key, hash))
     return ERRNOKEY;
   return 0;
 }
 
 /* Removes the given KEY entry from STORE. Returns 0 if successful, else a
  * negative error code. Any hash chains which are disrupted by the deletion of
- * KEY will be reconnected within this function. */
+ * KEY will be reconnected within this function. KEY is removed from the index
+ * and bloom filter once the entry is gone. */
 int kvstore_del(kvstore_t *store, char *key) {
+  return kvstore_del_hashed(store, key, kvhash_key(key));
+}
+
+/* As kvstore_del, for a KEY whose kvhash_key is KEYHASH. */
+int kvstore_del_hashed(kvstore_t *store, char *key, uint64_t keyhash) {
   char delfile[MAX_FILENAME];
   int chainpos;
   unsigned long hashval;
   unsigned int counter;
   char currfile[MAX_FILENAME];
   struct stat st;
-  chainpos = find_entry(store, key, NULL);
+  int ret;
+  if (store->backend == KVSTORE_LOG) {
+    if (store->logstore == NULL)
+      return ERRFILACCESS;
+    pthread_rwlock_wrlock(&store->lock);
+    ret = kvlogstore_del(store->logstore, key);
+    if (ret == 0 && store->index != NULL)
+      kvindex_remove(store->index, key);
+    pthread_rwlock_unlock(&store->lock);
+    return ret;
+  }
+  if (strlen(key) > MAX_KEYLEN)
+    return ERRKEYLEN;
+  hashval = kvstore_hashval(store, key, keyhash);
+  chainpos = kvstore_find(store, key, keyhash, hashval, NULL);
   if (chainpos < 0)
     return chainpos;
   counter = chainpos;
-  hashval = hash(key);
   pthread_rwlock_wrlock(&store->lock);
   sprintf(delfile, "%s/%lu-%u%s", store->dirname, hashval, chainpos, KVSTORE_FILETYPE);
   sprintf(currfile, "%s/%lu-%u%s", store->dirname, hashval, ++counter, KVSTORE_FILETYPE);
@@ -216,15 +461,133 @@ int kvstore_del(kvstore_t *store, char *key) {
       return errno;
     }
   }
+  if (store->index != NULL)
+    kvindex_remove(store->index, key);
+  if (store->bloom != NULL)
+    kvbloom_remove(store->bloom, keyhash);
   pthread_rwlock_unlock(&store->lock);
   return 0;
 }
 
+/* Calls ITER with every key in STORE, its value and AUX, in no particular
+ * order, stopping early if ITER returns nonzero. STORE is locked for reading
+ * throughout, so ITER must not modify it. Returns the nonzero value ITER
+ * returned, 0 once every entry has been visited, or a negative error code if
+ * the store could not be read. */
+int kvstore_iterate(kvstore_t *store, kvstore_iter_t iter, void *aux) {
+  struct dirent *dent;
+  char filename[MAX_FILENAME];
+  kventry_t *entry, header;
+  DIR *kvstoredir;
+  FILE *file;
+  int ret = 0;
+  if (store->backend == KVSTORE_LOG) {
+    if (store->logstore == NULL)
+      return ERRFILACCESS;
+    return kvlogstore_iterate(store->logstore, iter, aux);
+  }
+  pthread_rwlock_rdlock(&store->lock);
+  if ((kvstoredir = opendir(store->dirname)) == NULL) {
+    pthread_rwlock_unlock(&store->lock);
+    return ERRFILACCESS;
+  }
+  while (ret == 0 && (dent = readdir(kvstoredir)) != NULL) {
+    if (!kvstore_is_entry(dent->d_name))
+      continue;
+    if (kvstore_path(store, filename, dent->d_name) != 0
+        || (file = fopen(filename, "r")) == NULL)
+      continue;
+    if (fread(&header, sizeof(kventry_t), 1, file) != 1
+        || (entry = malloc(sizeof(kventry_t) + header.length)) == NULL) {
+      fclose(file);
+      continue;
+    }
+    fseek(file, 0L, SEEK_SET);
+    if (fread(entry, sizeof(kventry_t) + header.length, 1, file) == 1)
+      ret = iter(entry->data, entry->data + strlen(entry->data) + 1, aux);
+    fclose(file);
+    free(entry);
+  }
+  closedir(kvstoredir);
+  pthread_rwlock_unlock(&store->lock);
+  return ret;
+}
+
+/* Calls ITER with each key of STORE from START up to but excluding END, in
+ * strcmp order, along with its value and AUX. START and END may be NULL to
+ * leave the range unbounded at that end. Stops after LIMIT keys unless LIMIT
+ * is 0, or early if ITER returns nonzero. Keys are taken from the index
+ * KVSTORE_SCAN_BATCH at a time and their values read as they are visited, so
+ * STORE is not locked while ITER runs; a key removed before it is reached is
+ * skipped. Returns the nonzero value ITER returned, 0 once the range has been
+ * visited, or a negative error code if the store could not be read. */
+int kvstore_scan(kvstore_t *store, char *start, char *end, unsigned int limit,
+    kvstore_iter_t iter, void *aux) {
+  char **keys, *value, *cursor = NULL, *from = start;
+  unsigned int num_keys, want, visited = 0, i;
+  bool inclusive = true;
+  int ret = 0, check;
+  if (store->index == NULL)
+    return ERRFILACCESS;
+  while (ret == 0 && (limit == 0 || visited < limit)) {
+    want = KVSTORE_SCAN_BATCH;
+    if (limit != 0 && limit - visited < want)
+      want = limit - visited;
+    ret = kvindex_range(store->index, from, inclusive, end, want, &keys,
+        &num_keys);
+    if (ret != 0)
+      break;
+    for (i = 0; i < num_keys; i++) {
+      if (ret == 0) {
+        check = kvstore_get(store, keys[i], &value);
+        if (check == 0) {
+          visited++;
+          ret = iter(keys[i], value, aux);
+          free(value);
+        } else if (check != ERRNOKEY) {
+          ret = check;
+        }
+      }
+      if (i + 1 < num_keys)
+        free(keys[i]);
+    }
+    /* The last key is kept to resume the scan after it. */
+    free(cursor);
+    cursor = (num_keys > 0) ? keys[num_keys - 1] : NULL;
+    free(keys);
+    if (num_keys < want)
+      break;
+    from = cursor;
+    inclusive = false;
+  }
+  free(cursor);
+  return ret;
+}
+
 /* Deletes all current entries in STORE and removes the store directory. */
 int kvstore_clean(kvstore_t *store) {
   struct dirent *dent;
   char filename[MAX_FILENAME];
-  DIR *kvstoredir = opendir(store->dirname);
+  DIR *kvstoredir;
+  if (store->index != NULL) {
+    kvindex_destroy(store->index);
+    free(store->index);
+    store->index = NULL;
+  }
+  if (store->bloom != NULL) {
+    kvbloom_destroy(store->bloom);
+    free(store->bloom);
+    store->bloom = NULL;
+  }
+  if (store->backend == KVSTORE_LOG) {
+    if (store->logstore == NULL)
+      return 0;
+    kvlogstore_clean(store->logstore);
+    free(store->logstore);
+    store->logstore = NULL;
+    return 0;
+  }
+  kvstoredir = opendir(store->dirname);
   if (kvstoredir == NULL)
     return 0;
   while ((dent = readdir(kvstoredir)) != NULL) {
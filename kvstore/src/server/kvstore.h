@@ -4,6 +4,9 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include "kvconstants.h"
+#include "kvbloom.h"
+#include "kvindex.h"
+#include "kvlogstore.h"
 
 /* KVStore defines the persistent storage used by a server to store <key, value> entries.
  *
@@ -18,33 +21,84 @@
  * even by a program compiled by a different compiler. The LENGTH field of kventry_t
  * is used to determine how large an entry and its associated file are.
  *
- * The name of the file that stores an entry is determined by the djb2 string
- * hash of the entry's key, which can be found using the hash() function. To
+ * The name of the file that stores an entry is determined by a hash of the
+ * entry's key, which can be found using the kvstore_hash() function. To
  * resolve collisions, hash chaining is used, thus the file names of entries
  * within the store directory should have the format:
- *    hash(key)-chainpos.entry
+ *    kvstore_hash(store, key)-chainpos.entry
  *        OR, more explicitly:
- *    sprintf(filename, "%lu-%u.entry", hash(key), chainpos);
+ *    sprintf(filename, "%lu-%u.entry", kvstore_hash(store, key), chainpos);
  * chainpos represents the entry's position within its hash chain, which should
  * start from 0.  If a collision is found when storing an entry, the new entry
  * will have a chainpos of 1, and so on.  Chains should always be complete;
  * that is, you may never have a chain which has entries with a chainpos of 0
  * and 2 but not 1.
  *
+ * Which hash is used depends on the store's format, recorded as a decimal
+ * number in the file KVSTORE_FORMAT_FILENAME within the directory. Stores
+ * of format KVSTORE_FORMAT_DJB2 name entries by the djb2 string hash of the
+ * key, found using the hash() function; stores of format
+ * KVSTORE_FORMAT_KVHASH use its kvhash_key (see kvhash.h), which is much
+ * faster to compute and is also the hash of the key in the bloom filter, so a
+ * key is hashed once per operation. Callers which already hold a key's
+ * kvhash_key may pass it to the _hashed variants, so that it is not computed
+ * again. New stores use the latter. A directory
+ * without a format file which already holds entries predates the file, and
+ * is given the djb2 format so that its entries are still found.
+ *
  * All state is stored in persistent file storage, so it is valid to initialize
  * a KVStore using a directory name which was previously used for a KVStore,
  * and the new store will be an exact clone of the old store.
+ *
+ * The layout above is the default KVSTORE_FILES backend. A store initialized
+ * with kvstore_init_backend(store, dirname, KVSTORE_LOG) instead keeps its
+ * entries in append-only segment files managed by a KVLogStore (see
+ * kvlogstore.h). The kvstore_* API is identical for both backends; a
+ * directory must always be reopened with the backend that created it.
  */
 
 /* The filetype to append to the filenames of entries within the log. */
 #define KVSTORE_FILETYPE ".entry"
 
+/* The name of the file holding a store's index of keys. */
+#define KVSTORE_INDEX_FILENAME "keys.index"
+
+/* The name of the file holding a store's bloom filter. */
+#define KVSTORE_BLOOM_FILENAME "keys.bloom"
+
+/* The name of the file holding a store's format. */
+#define KVSTORE_FORMAT_FILENAME "format"
+
+/* The formats of a KVSTORE_FILES store, which differ in how entry files are
+ * named, and the format new stores are given. */
+#define KVSTORE_FORMAT_DJB2 1
+#define KVSTORE_FORMAT_KVHASH 2
+#define KVSTORE_FORMAT_CURRENT KVSTORE_FORMAT_KVHASH
+
+/* The number of keys kvstore_scan takes from the index at a time. */
+#define KVSTORE_SCAN_BATCH 64
+
+/* The on-disk layouts a KVStore can use. */
+typedef enum {
+  KVSTORE_FILES,               /* One file per entry, named by hash chain. */
+  KVSTORE_LOG                  /* Append-only segments, see kvlogstore.h. */
+} kvstore_backend_t;
+
 /* A KVStore. */
 typedef struct {
   char dirname[MAX_FILENAME];  /* The name of the directory used to store its entries. */
   pthread_rwlock_t lock;       /* The lock used to make KVStore's functions thread-safe. */
+  kvstore_backend_t backend;   /* The layout used by this store. */
+  kvlogstore_t *logstore;      /* The log-structured store, if BACKEND is KVSTORE_LOG. */
+  kvindex_t *index;            /* The ordered index of the store's keys. */
+  kvbloom_t *bloom;            /* The filter of the store's keys, if BACKEND is KVSTORE_FILES. */
+  unsigned int format;         /* How entry files are named, if BACKEND is KVSTORE_FILES. */
 } kvstore_t;
 
+/* Called by kvstore_iterate with each KEY in the store and its VALUE, and the
+ * AUX passed in. A nonzero return value stops the iteration. */
+typedef int (*kvstore_iter_t)(char *key, char *value, void *aux);
+
 /* A single kvstore entry.
  * data stores both the key and the value, in the form:
  *   key_string \0 value_string \0
@@ -55,8 +109,10 @@ typedef struct {
 } kventry_t;
 
 unsigned long hash(char *str);
+unsigned long kvstore_hash(kvstore_t *, char *key);
 
 int kvstore_init(kvstore_t *, char *dirname);
+int kvstore_init_backend(kvstore_t *, char *dirname, kvstore_backend_t);
 
 int kvstore_get(kvstore_t *, char *key, char **value);
 
@@ -68,6 +124,16 @@ int kvstore_del_check(kvstore_t *, char *key);
 
 bool kvstore_haskey(kvstore_t *, char *key);
 
+int kvstore_get_hashed(kvstore_t *, char *key, uint64_t hash, char **value);
+int kvstore_put_hashed(kvstore_t *, char *key, uint64_t hash, char *value);
+int kvstore_del_hashed(kvstore_t *, char *key, uint64_t hash);
+int kvstore_del_check_hashed(kvstore_t *, char *key, uint64_t hash);
+bool kvstore_haskey_hashed(kvstore_t *, char *key, uint64_t hash);
+
+int kvstore_iterate(kvstore_t *, kvstore_iter_t iter, void *aux);
+int kvstore_scan(kvstore_t *, char *start, char *end, unsigned int limit,
+    kvstore_iter_t iter, void *aux);
+
 int kvstore_clean(kvstore_t *);
 
 #endif
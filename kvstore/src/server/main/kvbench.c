@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "kvconstants.h"
+#include "kvhash.h"
+#include "kvhist.h"
+#include "kvmessage.h"
+#include "socket_server.h"
+
+const char *USAGE = "Usage: kvbench "
+    "[-c connections] [--connections connections] "
+    "[-d seconds] [--duration seconds] "
+    "[-k keys] [--keys keys] "
+    "[-D distribution] [--distribution distribution] "
+    "[-s theta] [--zipf-theta theta] "
+    "[-r percent] [--read-percent percent] "
+    "[-v bytes] [--value-size bytes] "
+    "[-R rate] [--rate rate] "
+    "[-l] [--load] [-K] [--keep-alive] [-b] [--binary] "
+    "[host (default=localhost)] [port (default=8888)]\n"
+    "  distributions: uniform, zipfian (default)\n"
+    "  A rate of 0 (the default) runs closed-loop, each connection sending its\n"
+    "  next request as soon as the last is answered. A positive rate runs\n"
+    "  open-loop at that many requests per second in total, and measures each\n"
+    "  latency from when its request was due, so a stalled server is charged\n"
+    "  for the requests it held up.\n"
+    "  --keep-alive sends every request of a connection over one socket, which\n"
+    "  the server must be running with --epoll to allow.";
+
+/* The key distributions. */
+typedef enum {
+  KVBENCH_UNIFORM,
+  KVBENCH_ZIPFIAN
+} kvbench_dist_t;
+
+/* The names of the key distributions, in kvbench_dist_t order. */
+const char *DISTRIBUTIONS[] = {"uniform", "zipfian"};
+
+/* The operations measured. */
+#define KVBENCH_GET 0
+#define KVBENCH_PUT 1
+
+/* A benchmark run, as configured on the command line. */
+typedef struct {
+  struct sockaddr_in addr;     /* The server under test. */
+  int connections;             /* The number of concurrent connections. */
+  int duration;                /* The length of the run in seconds. */
+  unsigned long keys;          /* The number of distinct keys. */
+  kvbench_dist_t dist;         /* How keys are picked. */
+  double theta;                /* The skew of the zipfian distribution. */
+  int read_percent;            /* The share of requests which are GETs. */
+  int value_size;              /* The length of the values PUT. */
+  double rate;                 /* The requests per second of an open-loop run, or 0. */
+  bool load;                   /* Whether every key is PUT before the run. */
+  bool keep_alive;             /* Whether each connection keeps one socket open. */
+  kvformat_t format;           /* The encoding requests are sent in. */
+  double zetan;                /* The zipfian normalization constant over KEYS. */
+  double eta;                  /* The zipfian constants of Gray et al. */
+  double alpha;
+  double half_pow_theta;       /* 0.5 to the power THETA. */
+  pthread_barrier_t loaded;    /* Passed once every connection is ready to start. */
+} kvbench_config_t;
+
+/* The state of one connection of a run. */
+typedef struct {
+  pthread_t thread;            /* The thread driving this connection. */
+  kvbench_config_t *config;    /* The run this connection is part of. */
+  int id;                      /* The index of this connection. */
+  uint64_t rand;               /* The state of this connection's random numbers. */
+  kvconn_t conn;               /* The open socket, if KEEP_ALIVE. */
+  bool connected;              /* Whether CONN is open. */
+  char *value;                 /* The value PUT by every request. */
+  kvhist_t hists[2];           /* The latencies in nanoseconds of GETs and PUTs. */
+  uint64_t misses;             /* The GETs answered with ERRMSG_NO_KEY. */
+  uint64_t errors[2];          /* The GETs and PUTs which failed. */
+} kvbench_worker_t;
+
+/* Set once the timed run is over. */
+int kvbench_stop;
+
+/* Returns the current time on the monotonic clock, in nanoseconds. */
+static uint64_t kvbench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleeps until the monotonic clock reads DEADLINE nanoseconds. */
+static void kvbench_sleep_until(uint64_t deadline) {
+  struct timespec ts;
+  ts.tv_sec = deadline / 1000000000ULL;
+  ts.tv_nsec = deadline % 1000000000ULL;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    ;
+}
+
+/* Returns the next of WORKER's random numbers (splitmix64). */
+static uint64_t kvbench_rand(kvbench_worker_t *worker) {
+  uint64_t z = (worker->rand += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Returns a random number in [0, 1) for WORKER. */
+static double kvbench_uniform(kvbench_worker_t *worker) {
+  return (kvbench_rand(worker) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/* Computes the constants of the zipfian distribution of CONFIG, as in Gray
+ * et al., "Quickly Generating Billion-Record Synthetic Databases". */
+static void kvbench_zipf_init(kvbench_config_t *config) {
+  double zeta2 = 1 + pow(0.5, config->theta);
+  unsigned long i;
+  config->half_pow_theta = pow(0.5, config->theta);
+  config->alpha = 1 / (1 - config->theta);
+  config->zetan = 0;
+  for (i = 1; i <= config->keys; i++)
+    config->zetan += 1 / pow((double) i, config->theta);
+  config->eta = (1 - pow(2.0 / config->keys, 1 - config->theta))
+      / (1 - zeta2 / config->zetan);
+}
+
+/* Picks the index of the next key WORKER requests. Zipfian ranks are
+ * scattered over the key space by hashing, so the popular keys are not all
+ * neighbours and land on different slaves. */
+static unsigned long kvbench_next_key(kvbench_worker_t *worker) {
+  kvbench_config_t *config = worker->config;
+  double u, uz;
+  uint64_t rank;
+  if (config->dist == KVBENCH_UNIFORM)
+    return kvbench_rand(worker) % config->keys;
+  u = kvbench_uniform(worker);
+  uz = u * config->zetan;
+  if (uz < 1)
+    rank = 0;
+  else if (uz < 1 + config->half_pow_theta)
+    rank = 1;
+  else
+    rank = (uint64_t) (config->keys
+        * pow(config->eta * u - config->eta + 1, config->alpha));
+  if (rank >= config->keys)
+    rank = config->keys - 1;
+  return kvhash(&rank, sizeof(rank), KVHASH_SEED) % config->keys;
+}
+
+/* Sends REQMSG for WORKER and waits for the answer. Returns the response,
+ * which should be freed with kvmessage_free, or NULL if the request failed. */
+static kvmessage_t *kvbench_request(kvbench_worker_t *worker,
+    kvmessage_t *reqmsg) {
+  kvbench_config_t *config = worker->config;
+  kvmessage_t *respmsg;
+  int sockfd;
+  if (!config->keep_alive) {
+    if ((sockfd = connect_to_address(&config->addr, 0)) < 0)
+      return NULL;
+    respmsg = (kvmessage_send(reqmsg, sockfd) < 0) ? NULL
+        : kvmessage_parse(sockfd);
+    close(sockfd);
+    return respmsg;
+  }
+  if (!worker->connected) {
+    if ((sockfd = connect_to_address(&config->addr, 0)) < 0)
+      return NULL;
+    kvconn_init(&worker->conn, sockfd);
+    worker->connected = true;
+  }
+  respmsg = (kvconn_send(&worker->conn, reqmsg) < 0) ? NULL
+      : kvconn_parse(&worker->conn);
+  if (respmsg == NULL) {
+    /* Start over on a fresh socket with the next request. */
+    close(worker->conn.sockfd);
+    kvconn_destroy(&worker->conn);
+    worker->connected = false;
+  }
+  return respmsg;
+}
+
+/* Performs OP on key number INDEX for WORKER. Returns 0 if the server
+ * answered as expected, 1 if a GET found no value, else -1. */
+static int kvbench_op(kvbench_worker_t *worker, int op, unsigned long index) {
+  kvmessage_t reqmsg, *respmsg;
+  char key[32];
+  int ret = -1;
+  sprintf(key, "kvbench%lu", index);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = (op == KVBENCH_GET) ? GETREQ : PUTREQ;
+  reqmsg.key = key;
+  reqmsg.value = (op == KVBENCH_GET) ? NULL : worker->value;
+  reqmsg.format = worker->config->format;
+  if ((respmsg = kvbench_request(worker, &reqmsg)) == NULL)
+    return -1;
+  if (op == KVBENCH_GET && respmsg->type == GETRESP)
+    ret = 0;
+  else if (respmsg->type == RESP && respmsg->message != NULL) {
+    if (op == KVBENCH_PUT && strcmp(respmsg->message, MSG_SUCCESS) == 0)
+      ret = 0;
+    else if (op == KVBENCH_GET && strcmp(respmsg->message, ERRMSG_NO_KEY) == 0)
+      ret = 1;
+  }
+  kvmessage_free(respmsg);
+  return ret;
+}
+
+/* The body of each connection's thread: PUTs its share of the keys if the
+ * run loads them, waits for the other connections to be ready, then sends
+ * requests until the run is stopped. */
+static void *kvbench_worker(void *aux) {
+  kvbench_worker_t *worker = aux;
+  kvbench_config_t *config = worker->config;
+  uint64_t interval = 0, due, start, end;
+  unsigned long index;
+  int op, ret;
+  if (config->load) {
+    for (index = worker->id; index < config->keys;
+        index += config->connections)
+      kvbench_op(worker, KVBENCH_PUT, index);
+  }
+  pthread_barrier_wait(&config->loaded);
+  if (config->rate > 0)
+    interval = (uint64_t) (1e9 * config->connections / config->rate);
+  /* Stagger the connections of an open-loop run over one interval. */
+  due = kvbench_now() + interval * worker->id / config->connections;
+  while (!__atomic_load_n(&kvbench_stop, __ATOMIC_ACQUIRE)) {
+    op = ((int) (kvbench_rand(worker) % 100) < config->read_percent)
+        ? KVBENCH_GET : KVBENCH_PUT;
+    index = kvbench_next_key(worker);
+    if (interval > 0) {
+      kvbench_sleep_until(due);
+      start = due;
+      due += interval;
+    } else {
+      start = kvbench_now();
+    }
+    ret = kvbench_op(worker, op, index);
+    end = kvbench_now();
+    if (ret < 0) {
+      worker->errors[op]++;
+      continue;
+    }
+    if (ret > 0)
+      worker->misses++;
+    kvhist_record(&worker->hists[op], end - start);
+  }
+  if (worker->connected) {
+    close(worker->conn.sockfd);
+    kvconn_destroy(&worker->conn);
+  }
+  return NULL;
+}
+
+/* Prints a line of the report for the operations recorded in HIST, of which
+ * MISSES missed and ERRORS more failed, over ELAPSED seconds. */
+static void kvbench_report(const char *name, kvhist_t *hist, uint64_t misses,
+    uint64_t errors, double elapsed) {
+  printf("%-4s %10llu %10.0f %8llu %8llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+      name, (unsigned long long) hist->total, hist->total / elapsed,
+      (unsigned long long) misses, (unsigned long long) errors,
+      kvhist_mean(hist) / 1000, kvhist_percentile(hist, 50) / 1000.0,
+      kvhist_percentile(hist, 90) / 1000.0, kvhist_percentile(hist, 99) / 1000.0,
+      kvhist_percentile(hist, 99.9) / 1000.0, hist->max / 1000.0);
+}
+
+int main(int argc, char **argv) {
+  kvbench_config_t config;
+  kvbench_worker_t *workers;
+  kvhist_t hists[3];
+  uint64_t misses = 0, errors[3] = {0}, start;
+  char *host = "localhost";
+  int port = 8888, binary = 0, load = 0, keep_alive = 0, c, i, j, op;
+  double elapsed;
+  struct option long_options[] = {
+      {"connections", required_argument, NULL, 'c'},
+      {"duration", required_argument, NULL, 'd'},
+      {"keys", required_argument, NULL, 'k'},
+      {"distribution", required_argument, NULL, 'D'},
+      {"zipf-theta", required_argument, NULL, 's'},
+      {"read-percent", required_argument, NULL, 'r'},
+      {"value-size", required_argument, NULL, 'v'},
+      {"rate", required_argument, NULL, 'R'},
+      {"load", no_argument, &load, 1},
+      {"keep-alive", no_argument, &keep_alive, 1},
+      {"binary", no_argument, &binary, 1},
+      {0,0,0,0}};
+
+  memset(&config, 0, sizeof(config));
+  config.connections = 4;
+  config.duration = 10;
+  config.keys = 100000;
+  config.dist = KVBENCH_ZIPFIAN;
+  config.theta = 0.99;
+  config.read_percent = 90;
+  config.value_size = 100;
+  while ((c = getopt_long(argc, argv, "c:d:k:D:s:r:v:R:lKb", long_options,
+      NULL)) != -1) {
+    switch (c) {
+      case 0:
+        break;
+      case 'c':
+        config.connections = atoi(optarg);
+        break;
+      case 'd':
+        config.duration = atoi(optarg);
+        break;
+      case 'k':
+        config.keys = strtoul(optarg, NULL, 10);
+        break;
+      case 'D':
+        for (i = KVBENCH_ZIPFIAN; i >= 0; i--) {
+          if (strcmp(optarg, DISTRIBUTIONS[i]) == 0)
+            break;
+        }
+        if (i < 0)
+          goto usage;
+        config.dist = i;
+        break;
+      case 's':
+        config.theta = atof(optarg);
+        break;
+      case 'r':
+        config.read_percent = atoi(optarg);
+        break;
+      case 'v':
+        config.value_size = atoi(optarg);
+        break;
+      case 'R':
+        config.rate = atof(optarg);
+        break;
+      case 'l':
+        load = 1;
+        break;
+      case 'K':
+        keep_alive = 1;
+        break;
+      case 'b':
+        binary = 1;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  if (optind < argc)
+    host = argv[optind++];
+  if (optind < argc)
+    port = atoi(argv[optind++]);
+  if (optind < argc || config.connections <= 0 || config.duration <= 0
+      || config.keys == 0 || config.theta <= 0 || config.theta >= 1
+      || config.read_percent < 0 || config.read_percent > 100
+      || config.value_size <= 0 || config.value_size > MAX_VALLEN
+      || config.rate < 0)
+    goto usage;
+  config.load = load;
+  config.keep_alive = keep_alive;
+  config.format = binary ? KVMESSAGE_BINARY : KVMESSAGE_JSON;
+  if (resolve_address(host, port, &config.addr) < 0) {
+    printf("Could not resolve host %s\n", host);
+    return 1;
+  }
+  if (config.dist == KVBENCH_ZIPFIAN)
+    kvbench_zipf_init(&config);
+
+  workers = calloc(config.connections, sizeof(kvbench_worker_t));
+  if (workers == NULL)
+    return 1;
+  for (i = 0; i < config.connections; i++) {
+    workers[i].config = &config;
+    workers[i].id = i;
+    workers[i].rand = kvbench_now() ^ ((uint64_t) i << 48);
+    workers[i].value = malloc(config.value_size + 1);
+    if (workers[i].value == NULL || kvhist_init(&workers[i].hists[KVBENCH_GET])
+        || kvhist_init(&workers[i].hists[KVBENCH_PUT]))
+      return 1;
+    for (j = 0; j < config.value_size; j++)
+      workers[i].value[j] = 'a' + kvbench_rand(&workers[i]) % 26;
+    workers[i].value[config.value_size] = '\0';
+  }
+
+  printf("kvbench: %s:%d, %d connections%s, %d s %s, %s",
+      host, port, config.connections, config.keep_alive ? " (kept alive)" : "",
+      config.duration, config.rate > 0 ? "open-loop" : "closed-loop",
+      DISTRIBUTIONS[config.dist]);
+  if (config.dist == KVBENCH_ZIPFIAN)
+    printf(" (theta %.2f)", config.theta);
+  printf(" over %lu keys, %d%% reads, %d byte values, %s\n", config.keys,
+      config.read_percent, config.value_size,
+      binary ? "binary" : "JSON");
+  if (config.rate > 0)
+    printf("target rate %.0f requests/s\n", config.rate);
+
+  pthread_barrier_init(&config.loaded, NULL, config.connections + 1);
+  for (i = 0; i < config.connections; i++)
+    pthread_create(&workers[i].thread, NULL, kvbench_worker, &workers[i]);
+  if (config.load)
+    printf("loading %lu keys...\n", config.keys);
+  pthread_barrier_wait(&config.loaded);
+  start = kvbench_now();
+  kvbench_sleep_until(start + (uint64_t) config.duration * 1000000000ULL);
+  __atomic_store_n(&kvbench_stop, 1, __ATOMIC_RELEASE);
+  for (i = 0; i < config.connections; i++)
+    pthread_join(workers[i].thread, NULL);
+  elapsed = (kvbench_now() - start) / 1e9;
+
+  for (op = 0; op < 3; op++)
+    kvhist_init(&hists[op]);
+  for (i = 0; i < config.connections; i++) {
+    for (op = KVBENCH_GET; op <= KVBENCH_PUT; op++) {
+      kvhist_merge(&hists[op], &workers[i].hists[op]);
+      kvhist_merge(&hists[2], &workers[i].hists[op]);
+      errors[op] += workers[i].errors[op];
+      errors[2] += workers[i].errors[op];
+    }
+    misses += workers[i].misses;
+  }
+  printf("%-4s %10s %10s %8s %8s %9s %9s %9s %9s %9s %9s\n", "op", "count",
+      "ops/s", "misses", "errors", "mean(us)", "p50", "p90", "p99", "p99.9",
+      "max");
+  kvbench_report("GET", &hists[KVBENCH_GET], misses, errors[KVBENCH_GET],
+      elapsed);
+  kvbench_report("PUT", &hists[KVBENCH_PUT], 0, errors[KVBENCH_PUT], elapsed);
+  kvbench_report("ALL", &hists[2], misses, errors[2], elapsed);
+  return errors[2] > 0 && hists[2].total == 0;
+
+usage:
+  printf("%s\n", USAGE);
+  return 1;
+}
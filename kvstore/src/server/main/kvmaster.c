@@ -4,22 +4,70 @@
 #include "socket_server.h"
 #include "kvserver.h"
 
-const char *USAGE = "Usage: kvmaster [port (default=8888)]";
+const char *USAGE = "Usage: kvmaster [-e] [--epoll] [-v vnodes] [--vnodes vnodes] "
+    "[-r policy] [--read-policy policy] [-H] [--hedge] "
+    "[port (default=8888)]\n"
+    "  read policies: primary, round-robin (default), least-outstanding, ewma";
+
+/* The names of the read policies, in tpcreadpolicy_t order. */
+const char *READ_POLICIES[] = {"primary", "round-robin", "least-outstanding",
+    "ewma"};
 
 int main(int argc, char** argv) {
-  int port = 8888;
+  int port = 8888, use_epoll = 0, vnodes = TPCMASTER_DEFAULT_VNODES, c;
+  int read_policy = TPCMASTER_READ_ROUND_ROBIN, hedge = 0;
   server_t server;
+  struct option long_options[] = {{"epoll", no_argument, &use_epoll, 1},
+      {"vnodes", required_argument, NULL, 'v'},
+      {"read-policy", required_argument, NULL, 'r'},
+      {"hedge", no_argument, &hedge, 1}, {0,0,0,0}};
 
-  if (argc > 1) {
-    if (argc > 2) {
+  while ((c = getopt_long(argc, argv, "ev:r:H", long_options, NULL)) != -1) {
+    switch (c) {
+      case 0:
+        break;
+      case 'e':
+        use_epoll = 1;
+        break;
+      case 'v':
+        vnodes = atoi(optarg);
+        if (vnodes <= 0) {
+          printf("%s\n", USAGE);
+          return 1;
+        }
+        break;
+      case 'r':
+        for (read_policy = TPCMASTER_READ_EWMA; read_policy >= 0; read_policy--) {
+          if (strcmp(optarg, READ_POLICIES[read_policy]) == 0)
+            break;
+        }
+        if (read_policy < 0) {
+          printf("%s\n", USAGE);
+          return 1;
+        }
+        break;
+      case 'H':
+        hedge = 1;
+        break;
+      default:
+        printf("%s\n", USAGE);
+        return 1;
+    }
+  }
+  if (optind < argc) {
+    if (optind + 1 < argc) {
       printf("%s\n", USAGE);
       return 1;
     }
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
   }
   server.master = 1;
-  server.max_threads = 3;
+  server.max_threads = SERVER_DEFAULT_THREADS;
+  server.use_epoll = use_epoll;
   tpcmaster_init(&server.tpcmaster, 2, 2, 4, 4);
+  server.tpcmaster.vnodes = vnodes;
+  server.tpcmaster.read_policy = read_policy;
+  server.tpcmaster.hedge_reads = hedge;
   printf("TPC Master server started listening on port %d...\n", port);
   server_run("localhost", port, &server, NULL);
 }
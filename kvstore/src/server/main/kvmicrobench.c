@@ -0,0 +1,668 @@
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "kvcache.h"
+#include "kvconstants.h"
+#include "kvstore.h"
+#include "tpclog.h"
+#include "wq.h"
+
+const char *USAGE = "Usage: kvmicrobench "
+    "[-t threads,...] [--threads threads,...] "
+    "[-r reps] [--reps reps] "
+    "[-s scale] [--scale scale] "
+    "[-S seed] [--seed seed] "
+    "[-D dir] [--dir dir] "
+    "[-c] [--csv] "
+    "[component ...]\n"
+    "  components: cache, store, log, wq (default: all of them)\n"
+    "  Each case runs a fixed number of operations per thread, multiplied by\n"
+    "  SCALE, REPS times (default 3), and reports the median rate along with\n"
+    "  the spread between the slowest and fastest repetition. Keys are drawn\n"
+    "  from per-thread generators seeded from SEED, so a run is repeatable.\n"
+    "  The store and log are kept in DIR (default kvmicrobench.tmp), which is\n"
+    "  removed afterwards; point it at the disk to be measured.";
+
+/* The components which can be benchmarked. */
+const char *COMPONENTS[] = {"cache", "store", "log", "wq"};
+#define KVMICRO_NUM_COMPONENTS 4
+
+/* The cache shapes benchmarked, as {num_sets, elem_per_set}. */
+static const unsigned int KVMICRO_CACHE_SHAPES[][2] = {
+  {1, 64}, {16, 4}, {16, 64}, {256, 16}
+};
+
+/* The hash chain lengths benchmarked, each a power of two. */
+static const unsigned int KVMICRO_CHAINS[] = {1, 4, 16};
+
+/* The capacities of the work queues benchmarked, 0 being unbounded. */
+static const int KVMICRO_WQ_CAPACITIES[] = {0, 64};
+
+/* The operations per thread of each case, before scaling. */
+#define KVMICRO_CACHE_OPS 200000
+#define KVMICRO_STORE_KEYS 512
+#define KVMICRO_LOG_APPENDS 500
+#define KVMICRO_LOG_ENTRIES 5000
+#define KVMICRO_WQ_ITEMS 100000
+
+/* The length of the values written. */
+#define KVMICRO_VALUE_SIZE 100
+
+/* The most repetitions of a case. */
+#define KVMICRO_MAX_REPS 64
+
+/* The most thread counts which may be given. */
+#define KVMICRO_MAX_THREADS 16
+
+struct kvmicro_case;
+
+/* Runs the share of CASE's operations given to thread ID. */
+typedef void (*kvmicro_run_t)(struct kvmicro_case *, int id);
+
+/* A single case: a workload on one component, with one set of parameters,
+ * run by a given number of threads. Every field up to SETUP is given by the
+ * caller; the others hold the state of a repetition. */
+typedef struct kvmicro_case {
+  char name[128];              /* Names the workload and its parameters. */
+  int threads;                 /* The number of threads running the workload. */
+  unsigned long ops;           /* The operations run by each thread. */
+  bool pairs;                  /* True if each thread is a producer and a consumer. */
+  unsigned int sets;           /* The cache's number of sets. */
+  unsigned int elems;          /* The cache's elements per set. */
+  unsigned int chain;          /* The length of the store's hash chains. */
+  int capacity;                /* The capacity of the work queue. */
+  uint64_t seed;               /* Seeds every thread's random numbers. */
+  char *dir;                   /* The directory holding the store and log. */
+  int (*setup)(struct kvmicro_case *); /* Prepares a repetition, untimed. */
+  kvmicro_run_t run;           /* The timed body of each thread. */
+  void (*teardown)(struct kvmicro_case *); /* Cleans up after a repetition. */
+  char **keys;                 /* The keys the workload uses. */
+  unsigned long num_keys;      /* The number of keys in KEYS. */
+  char *value;                 /* The value written. */
+  kvcache_t cache;             /* The cache under test. */
+  kvstore_t store;             /* The store under test. */
+  tpclog_t log;                /* The log under test. */
+  wq_t wq;                     /* The work queue under test. */
+  pthread_barrier_t start;     /* Passed by every thread once all are ready. */
+} kvmicro_case_t;
+
+/* A thread running part of a case. */
+typedef struct {
+  pthread_t thread;            /* The thread. */
+  kvmicro_case_t *bench;       /* The case being run. */
+  int id;                      /* The index of this thread. */
+  uint64_t start;              /* When this thread started its share. */
+  uint64_t end;                /* When this thread finished its share. */
+} kvmicro_worker_t;
+
+/* A run, as configured on the command line. */
+typedef struct {
+  int threads[KVMICRO_MAX_THREADS]; /* The thread counts to run each case at. */
+  int num_threads;             /* The number of entries in THREADS. */
+  int reps;                    /* The repetitions of each case. */
+  double scale;                /* Multiplies the operations of each case. */
+  uint64_t seed;               /* Seeds every case's random numbers. */
+  char *dir;                   /* The directory holding the store and log. */
+  bool csv;                    /* Whether to report as CSV. */
+  bool components[KVMICRO_NUM_COMPONENTS]; /* The components to benchmark. */
+} kvmicro_config_t;
+
+/* Returns the current time on the monotonic clock, in nanoseconds. */
+static uint64_t kvmicro_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Returns the next random number of the generator whose state is at STATE
+ * (splitmix64). */
+static uint64_t kvmicro_rand(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/* Returns the initial state of the random numbers of thread ID of CASE. */
+static uint64_t kvmicro_thread_seed(kvmicro_case_t *bench, int id) {
+  uint64_t state = bench->seed ^ ((uint64_t) (id + 1) << 32);
+  kvmicro_rand(&state);
+  return state;
+}
+
+/* Makes NUM_KEYS keys for CASE, named "keyN", and its value. Returns 0 if
+ * successful, else -1. */
+static int kvmicro_make_keys(kvmicro_case_t *bench, unsigned long num_keys) {
+  unsigned long i;
+  if ((bench->keys = calloc(num_keys, sizeof(char *))) == NULL)
+    return -1;
+  bench->num_keys = num_keys;
+  for (i = 0; i < num_keys; i++) {
+    if ((bench->keys[i] = malloc(24)) == NULL)
+      return -1;
+    sprintf(bench->keys[i], "key%lu", i);
+  }
+  if ((bench->value = malloc(KVMICRO_VALUE_SIZE + 1)) == NULL)
+    return -1;
+  memset(bench->value, 'v', KVMICRO_VALUE_SIZE);
+  bench->value[KVMICRO_VALUE_SIZE] = '\0';
+  return 0;
+}
+
+/* Makes the keys of a store case, in groups of CHAIN keys sharing the same
+ * djb2 hash, so that each group fills a hash chain of that length in a store
+ * of KVSTORE_FORMAT_DJB2. The blocks "Az" and "BY" hash alike, so keys made
+ * of the same prefix followed by any sequence of as many of them collide.
+ * Returns 0 if successful, else -1. */
+static int kvmicro_make_chain_keys(kvmicro_case_t *bench,
+    unsigned long num_keys) {
+  unsigned long i, bits, b;
+  if (kvmicro_make_keys(bench, num_keys) < 0)
+    return -1;
+  for (bits = 0; (1UL << bits) < bench->chain; bits++);
+  for (i = 0; i < num_keys; i++) {
+    sprintf(bench->keys[i], "k%06lu-", i / bench->chain);
+    for (b = 0; b < bits; b++)
+      strcat(bench->keys[i], ((i % bench->chain) >> b) & 1 ? "BY" : "Az");
+  }
+  return 0;
+}
+
+/* Frees the keys and value of CASE. */
+static void kvmicro_free_keys(kvmicro_case_t *bench) {
+  unsigned long i;
+  for (i = 0; bench->keys != NULL && i < bench->num_keys; i++)
+    free(bench->keys[i]);
+  free(bench->keys);
+  free(bench->value);
+  bench->keys = NULL;
+  bench->value = NULL;
+}
+
+/* Sets up a cache case: a cache of the case's shape, filled from a key space
+ * twice its capacity, so that GETs hit about half of the time. */
+static int kvmicro_cache_setup(kvmicro_case_t *bench) {
+  unsigned long i;
+  if (kvmicro_make_keys(bench, 2UL * bench->sets * bench->elems) < 0)
+    return -1;
+  if (kvcache_init(&bench->cache, bench->sets, bench->elems) != 0)
+    return -1;
+  for (i = 0; i < bench->num_keys; i++)
+    kvcache_put(&bench->cache, bench->keys[i], bench->value);
+  return 0;
+}
+
+static void kvmicro_cache_get(kvmicro_case_t *bench, int id) {
+  uint64_t state = kvmicro_thread_seed(bench, id);
+  unsigned long i;
+  char *value;
+  for (i = 0; i < bench->ops; i++) {
+    if (kvcache_get(&bench->cache, bench->keys[kvmicro_rand(&state)
+        % bench->num_keys], &value) == 0)
+      free(value);
+  }
+}
+
+static void kvmicro_cache_put(kvmicro_case_t *bench, int id) {
+  uint64_t state = kvmicro_thread_seed(bench, id);
+  unsigned long i;
+  for (i = 0; i < bench->ops; i++)
+    kvcache_put(&bench->cache, bench->keys[kvmicro_rand(&state)
+        % bench->num_keys], bench->value);
+}
+
+static void kvmicro_cache_teardown(kvmicro_case_t *bench) {
+  kvcache_clear(&bench->cache);
+  kvmicro_free_keys(bench);
+}
+
+/* Opens an empty store of KVSTORE_FORMAT_DJB2 in the case's directory.
+ * Returns 0 if successful, else -1. */
+static int kvmicro_store_open(kvmicro_case_t *bench) {
+  char dirname[MAX_FILENAME];
+  FILE *file;
+  snprintf(dirname, sizeof(dirname), "%s/store", bench->dir);
+  mkdir(bench->dir, 0700);
+  mkdir(dirname, 0700);
+  snprintf(dirname, sizeof(dirname), "%s/store/%s", bench->dir,
+      KVSTORE_FORMAT_FILENAME);
+  if ((file = fopen(dirname, "w")) == NULL)
+    return -1;
+  fprintf(file, "%d\n", KVSTORE_FORMAT_DJB2);
+  fclose(file);
+  snprintf(dirname, sizeof(dirname), "%s/store", bench->dir);
+  return kvstore_init(&bench->store, dirname) == 0 ? 0 : -1;
+}
+
+/* Sets up a case writing to an empty store. */
+static int kvmicro_store_setup_empty(kvmicro_case_t *bench) {
+  if (kvmicro_make_chain_keys(bench, bench->ops * bench->threads) < 0)
+    return -1;
+  return kvmicro_store_open(bench);
+}
+
+/* Sets up a case reading from or deleting out of a store holding every key
+ * of the case. */
+static int kvmicro_store_setup_full(kvmicro_case_t *bench) {
+  unsigned long i;
+  if (kvmicro_store_setup_empty(bench) < 0)
+    return -1;
+  for (i = 0; i < bench->num_keys; i++) {
+    if (kvstore_put(&bench->store, bench->keys[i], bench->value) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+/* Returns the key which thread ID of CASE uses for its Ith operation. Each
+ * thread has its own share of the keys; keys are visited in a scrambled but
+ * repeatable order, so that hash chains fill and empty from all positions. */
+static char *kvmicro_store_key(kvmicro_case_t *bench, int id, unsigned long i) {
+  /* A prime stride visits every key of the share once, out of order. */
+  return bench->keys[id * bench->ops + (i * 2654435761UL) % bench->ops];
+}
+
+static void kvmicro_store_put(kvmicro_case_t *bench, int id) {
+  unsigned long i;
+  for (i = 0; i < bench->ops; i++)
+    kvstore_put(&bench->store, kvmicro_store_key(bench, id, i), bench->value);
+}
+
+static void kvmicro_store_get(kvmicro_case_t *bench, int id) {
+  unsigned long i;
+  char *value;
+  for (i = 0; i < bench->ops; i++) {
+    if (kvstore_get(&bench->store, kvmicro_store_key(bench, id, i), &value)
+        == 0)
+      free(value);
+  }
+}
+
+static void kvmicro_store_del(kvmicro_case_t *bench, int id) {
+  unsigned long i;
+  for (i = 0; i < bench->ops; i++)
+    kvstore_del(&bench->store, kvmicro_store_key(bench, id, i));
+}
+
+static void kvmicro_store_teardown(kvmicro_case_t *bench) {
+  kvstore_clean(&bench->store);
+  kvmicro_free_keys(bench);
+  rmdir(bench->dir);
+}
+
+/* Opens an empty log in the case's directory. Returns 0 if successful, else
+ * -1. */
+static int kvmicro_log_setup(kvmicro_case_t *bench) {
+  char dirname[MAX_FILENAME];
+  if (kvmicro_make_keys(bench, 1) < 0)
+    return -1;
+  mkdir(bench->dir, 0700);
+  snprintf(dirname, sizeof(dirname), "%s/log", bench->dir);
+  if (tpclog_init(&bench->log, dirname) != 0)
+    return -1;
+  return tpclog_clear_log(&bench->log) == 0 ? 0 : -1;
+}
+
+/* Sets up a replay case: a log holding OPS entries per thread. */
+static int kvmicro_log_setup_full(kvmicro_case_t *bench) {
+  unsigned long i;
+  if (kvmicro_log_setup(bench) < 0)
+    return -1;
+  for (i = 0; i < bench->ops * bench->threads; i++) {
+    if (tpclog_log_txn(&bench->log, i + 1, PUTREQ, bench->keys[0],
+        bench->value, NULL) != 0)
+      return -1;
+  }
+  tpclog_iterate_begin(&bench->log);
+  return 0;
+}
+
+static void kvmicro_log_append(kvmicro_case_t *bench, int id) {
+  unsigned long i;
+  for (i = 0; i < bench->ops; i++)
+    tpclog_log_txn(&bench->log, id * bench->ops + i + 1, PUTREQ,
+        bench->keys[0], bench->value, NULL);
+}
+
+/* Replays the whole log; a replay is inherently single-threaded, so only
+ * thread 0 does any work. */
+static void kvmicro_log_replay(kvmicro_case_t *bench, int id) {
+  logentry_t *entry;
+  if (id != 0)
+    return;
+  while (tpclog_iterate_has_next(&bench->log)
+      && (entry = tpclog_iterate_next(&bench->log)) != NULL)
+    free(entry);
+}
+
+static void kvmicro_log_teardown(kvmicro_case_t *bench) {
+  char filename[MAX_FILENAME];
+  close(bench->log.fd);
+  snprintf(filename, sizeof(filename), "%s/%s", bench->log.dirname,
+      TPCLOG_FILENAME);
+  unlink(filename);
+  rmdir(bench->log.dirname);
+  free(bench->log.dirname);
+  kvmicro_free_keys(bench);
+  rmdir(bench->dir);
+}
+
+static int kvmicro_wq_setup(kvmicro_case_t *bench) {
+  wq_init_bounded(&bench->wq, bench->capacity);
+  return 0;
+}
+
+/* Pushes OPS items if ID is a producer, or pops OPS items if it is a
+ * consumer; the first half of the threads produce. */
+static void kvmicro_wq_push_pop(kvmicro_case_t *bench, int id) {
+  unsigned long i;
+  for (i = 0; i < bench->ops; i++) {
+    if (id < bench->threads)
+      wq_push(&bench->wq, (void *) (intptr_t) (i + 1));
+    else
+      wq_pop(&bench->wq);
+  }
+}
+
+static void kvmicro_wq_teardown(kvmicro_case_t *bench) {
+  pthread_mutex_destroy(&bench->wq.lock);
+  pthread_cond_destroy(&bench->wq.empty);
+  pthread_cond_destroy(&bench->wq.full);
+}
+
+/* The body of each thread of a case: waits for every thread to be ready,
+ * then runs its share, timing it. */
+static void *kvmicro_worker(void *aux) {
+  kvmicro_worker_t *worker = aux;
+  pthread_barrier_wait(&worker->bench->start);
+  worker->start = kvmicro_now();
+  worker->bench->run(worker->bench, worker->id);
+  worker->end = kvmicro_now();
+  return NULL;
+}
+
+/* Runs a single repetition of CASE. Returns the nanoseconds from the first
+ * thread starting its share to the last thread finishing its own, or 0 if
+ * it could not be run. */
+static uint64_t kvmicro_run_once(kvmicro_case_t *bench) {
+  int num_workers = bench->pairs ? 2 * bench->threads : bench->threads, i;
+  kvmicro_worker_t workers[num_workers];
+  uint64_t start = UINT64_MAX, end = 0, elapsed = 0;
+  if (bench->setup(bench) != 0)
+    goto done;
+  pthread_barrier_init(&bench->start, NULL, num_workers);
+  for (i = 0; i < num_workers; i++) {
+    workers[i].bench = bench;
+    workers[i].id = i;
+    if (pthread_create(&workers[i].thread, NULL, kvmicro_worker,
+        &workers[i]) != 0) {
+      fprintf(stderr, "kvmicrobench: cannot start thread %d\n", i);
+      exit(1);
+    }
+  }
+  for (i = 0; i < num_workers; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].start < start)
+      start = workers[i].start;
+    if (workers[i].end > end)
+      end = workers[i].end;
+  }
+  /* Never report a repetition as taking no time at all. */
+  elapsed = end > start ? end - start : 1;
+  pthread_barrier_destroy(&bench->start);
+done:
+  bench->teardown(bench);
+  return elapsed;
+}
+
+static int kvmicro_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Prints the header of the report of CONFIG. */
+static void kvmicro_header(kvmicro_config_t *config) {
+  if (config->csv) {
+    printf("benchmark,threads,ops,ops_per_sec,ns_per_op,spread_pct\n");
+  } else {
+    printf("# kvmicrobench reps=%d scale=%g seed=%llu\n", config->reps,
+        config->scale, (unsigned long long) config->seed);
+    printf("%-36s %7s %10s %12s %10s %7s\n", "benchmark", "threads", "ops",
+        "ops/s", "ns/op", "spread");
+  }
+}
+
+/* Runs CASE for REPS repetitions, as set in CONFIG, and reports the median
+ * rate, taking each thread's OPS operations as the work done, along with
+ * the spread between the slowest and fastest repetitions relative to it. */
+static void kvmicro_run(kvmicro_config_t *config, kvmicro_case_t *bench) {
+  uint64_t times[KVMICRO_MAX_REPS], median;
+  unsigned long ops = bench->ops * bench->threads;
+  double rate, spread;
+  int i;
+  bench->seed = config->seed;
+  bench->dir = config->dir;
+  for (i = 0; i < config->reps; i++) {
+    if ((times[i] = kvmicro_run_once(bench)) == 0) {
+      fprintf(stderr, "kvmicrobench: cannot set up %s\n", bench->name);
+      exit(1);
+    }
+  }
+  qsort(times, config->reps, sizeof(uint64_t), kvmicro_cmp);
+  median = times[config->reps / 2];
+  rate = ops * 1e9 / median;
+  spread = 100.0 * (times[config->reps - 1] - times[0]) / median;
+  if (config->csv)
+    printf("%s,%d,%lu,%.0f,%.1f,%.1f\n", bench->name, bench->threads, ops,
+        rate, (double) median / ops, spread);
+  else
+    printf("%-36s %7d %10lu %12.0f %10.1f %6.1f%%\n", bench->name,
+        bench->threads, ops, rate, (double) median / ops, spread);
+  fflush(stdout);
+}
+
+/* Returns COUNT operations scaled as CONFIG asks, but at least one. */
+static unsigned long kvmicro_scaled(kvmicro_config_t *config,
+    unsigned long count) {
+  unsigned long ops = (unsigned long) (count * config->scale);
+  return ops > 0 ? ops : 1;
+}
+
+/* Benchmarks GETs and PUTs of caches of several shapes. */
+static void kvmicro_bench_cache(kvmicro_config_t *config) {
+  kvmicro_case_t bench;
+  unsigned int s;
+  int t, op;
+  for (s = 0; s < sizeof(KVMICRO_CACHE_SHAPES) / sizeof(KVMICRO_CACHE_SHAPES[0]);
+      s++) {
+    for (op = 0; op < 2; op++) {
+      for (t = 0; t < config->num_threads; t++) {
+        memset(&bench, 0, sizeof(bench));
+        bench.sets = KVMICRO_CACHE_SHAPES[s][0];
+        bench.elems = KVMICRO_CACHE_SHAPES[s][1];
+        snprintf(bench.name, sizeof(bench.name), "cache_%s/sets=%u/elems=%u",
+            op ? "put" : "get", bench.sets, bench.elems);
+        bench.threads = config->threads[t];
+        bench.ops = kvmicro_scaled(config, KVMICRO_CACHE_OPS);
+        bench.setup = kvmicro_cache_setup;
+        bench.run = op ? kvmicro_cache_put : kvmicro_cache_get;
+        bench.teardown = kvmicro_cache_teardown;
+        kvmicro_run(config, &bench);
+      }
+    }
+  }
+}
+
+/* Benchmarks PUTs, GETs and DELs of a store whose keys form hash chains of
+ * several lengths. Each thread works on keys of its own. */
+static void kvmicro_bench_store(kvmicro_config_t *config) {
+  static const char *names[] = {"put", "get", "del"};
+  kvmicro_case_t bench;
+  unsigned int c;
+  int t, op;
+  for (c = 0; c < sizeof(KVMICRO_CHAINS) / sizeof(KVMICRO_CHAINS[0]); c++) {
+    for (op = 0; op < 3; op++) {
+      for (t = 0; t < config->num_threads; t++) {
+        memset(&bench, 0, sizeof(bench));
+        bench.chain = KVMICRO_CHAINS[c];
+        snprintf(bench.name, sizeof(bench.name), "store_%s/chain=%u",
+            names[op], bench.chain);
+        bench.threads = config->threads[t];
+        /* Whole chains per thread, so that threads share no chain. */
+        bench.ops = (kvmicro_scaled(config, KVMICRO_STORE_KEYS)
+            + bench.chain - 1) / bench.chain * bench.chain;
+        bench.setup = op == 0 ? kvmicro_store_setup_empty
+            : kvmicro_store_setup_full;
+        bench.run = op == 0 ? kvmicro_store_put
+            : op == 1 ? kvmicro_store_get : kvmicro_store_del;
+        bench.teardown = kvmicro_store_teardown;
+        kvmicro_run(config, &bench);
+      }
+    }
+  }
+}
+
+/* Benchmarks appending to the log, each append waiting for its entry to be
+ * synced, and replaying it. */
+static void kvmicro_bench_log(kvmicro_config_t *config) {
+  kvmicro_case_t bench;
+  int t;
+  for (t = 0; t < config->num_threads; t++) {
+    memset(&bench, 0, sizeof(bench));
+    strcpy(bench.name, "log_append");
+    bench.threads = config->threads[t];
+    bench.ops = kvmicro_scaled(config, KVMICRO_LOG_APPENDS);
+    bench.setup = kvmicro_log_setup;
+    bench.run = kvmicro_log_append;
+    bench.teardown = kvmicro_log_teardown;
+    kvmicro_run(config, &bench);
+  }
+  memset(&bench, 0, sizeof(bench));
+  strcpy(bench.name, "log_replay");
+  bench.threads = 1;
+  bench.ops = kvmicro_scaled(config, KVMICRO_LOG_ENTRIES);
+  bench.setup = kvmicro_log_setup_full;
+  bench.run = kvmicro_log_replay;
+  bench.teardown = kvmicro_log_teardown;
+  kvmicro_run(config, &bench);
+}
+
+/* Benchmarks items passed through unbounded and bounded work queues by as
+ * many consumers as there are producers. */
+static void kvmicro_bench_wq(kvmicro_config_t *config) {
+  kvmicro_case_t bench;
+  unsigned int c;
+  int t;
+  for (c = 0; c < sizeof(KVMICRO_WQ_CAPACITIES) / sizeof(int); c++) {
+    for (t = 0; t < config->num_threads; t++) {
+      memset(&bench, 0, sizeof(bench));
+      bench.capacity = KVMICRO_WQ_CAPACITIES[c];
+      snprintf(bench.name, sizeof(bench.name), "wq_push_pop/capacity=%d",
+          bench.capacity);
+      bench.threads = config->threads[t];
+      bench.pairs = true;
+      bench.ops = kvmicro_scaled(config, KVMICRO_WQ_ITEMS);
+      bench.setup = kvmicro_wq_setup;
+      bench.run = kvmicro_wq_push_pop;
+      bench.teardown = kvmicro_wq_teardown;
+      kvmicro_run(config, &bench);
+    }
+  }
+}
+
+/* Parses the comma-separated thread counts LIST into CONFIG. Returns 0 if
+ * successful, else -1. */
+static int kvmicro_parse_threads(kvmicro_config_t *config, char *list) {
+  char *token, *end;
+  long threads;
+  config->num_threads = 0;
+  for (token = strtok(list, ","); token != NULL; token = strtok(NULL, ",")) {
+    threads = strtol(token, &end, 10);
+    if (*end != '\0' || threads < 1 || threads > 1024
+        || config->num_threads == KVMICRO_MAX_THREADS)
+      return -1;
+    config->threads[config->num_threads++] = threads;
+  }
+  return config->num_threads > 0 ? 0 : -1;
+}
+
+int main(int argc, char **argv) {
+  static void (*benches[])(kvmicro_config_t *) = {
+    kvmicro_bench_cache, kvmicro_bench_store, kvmicro_bench_log,
+    kvmicro_bench_wq
+  };
+  static struct option long_options[] = {
+    {"threads", required_argument, 0, 't'},
+    {"reps", required_argument, 0, 'r'},
+    {"scale", required_argument, 0, 's'},
+    {"seed", required_argument, 0, 'S'},
+    {"dir", required_argument, 0, 'D'},
+    {"csv", no_argument, 0, 'c'},
+    {0, 0, 0, 0}
+  };
+  char default_threads[] = "1,2,4,8";
+  kvmicro_config_t config;
+  bool any = false;
+  int c, i;
+  memset(&config, 0, sizeof(config));
+  kvmicro_parse_threads(&config, default_threads);
+  config.reps = 3;
+  config.scale = 1;
+  config.seed = 1;
+  config.dir = "kvmicrobench.tmp";
+  while ((c = getopt_long(argc, argv, "t:r:s:S:D:c", long_options, NULL))
+      != -1) {
+    switch (c) {
+      case 't':
+        if (kvmicro_parse_threads(&config, optarg) < 0)
+          goto usage;
+        break;
+      case 'r':
+        config.reps = atoi(optarg);
+        if (config.reps < 1 || config.reps > KVMICRO_MAX_REPS)
+          goto usage;
+        break;
+      case 's':
+        config.scale = atof(optarg);
+        if (config.scale <= 0)
+          goto usage;
+        break;
+      case 'S':
+        config.seed = strtoull(optarg, NULL, 10);
+        break;
+      case 'D':
+        config.dir = optarg;
+        break;
+      case 'c':
+        config.csv = true;
+        break;
+      default:
+        goto usage;
+    }
+  }
+  for (; optind < argc; optind++) {
+    for (i = 0; i < KVMICRO_NUM_COMPONENTS
+        && strcmp(argv[optind], COMPONENTS[i]) != 0; i++);
+    if (i == KVMICRO_NUM_COMPONENTS)
+      goto usage;
+    config.components[i] = any = true;
+  }
+  kvmicro_header(&config);
+  for (i = 0; i < KVMICRO_NUM_COMPONENTS; i++) {
+    if (!any || config.components[i])
+      benches[i](&config);
+  }
+  return 0;
+
+usage:
+  fprintf(stderr, "%s\n", USAGE);
+  return 1;
+}
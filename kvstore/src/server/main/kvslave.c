@@ -7,29 +7,72 @@
 
 const char *USAGE = "Usage: kvslave "
     "[-t] [--tpc] "
+    "[-l] [--log-store] "
+    "[-e] [--epoll] "
+    "[-c policy] [--cache-policy policy] "
+    "[-w] [--write-back] [--wal] "
     "[slave_port (default=9000)] "
-    "[master_port (default=8888)]";
+    "[master_port (default=8888)]\n"
+    "  cache policies: clock (default), arc, tinylfu\n"
+    "  --write-back (non-TPC only) writes PUTs and DELs to the store in the\n"
+    "  background, and --wal also logs them first so that they survive a crash";
+
+/* The names of the cache policies, in kvpolicy_type_t order. */
+const char *CACHE_POLICIES[] = {"clock", "arc", "tinylfu"};
 
 int main(int argc, char **argv) {
   int tpc_mode = 0,
+      log_store = 0,
+      use_epoll = 0,
+      write_back = 0,
+      use_wal = 0,
       slave_port = 9000,
-      master_port = 8888;
+      master_port = 8888,
+      cache_policy = KVPOLICY_CLOCK;
   char *mode = "";
   char *slave_hostname = "localhost", *master_hostname = "localhost";
   int index = 0;
   int opt_ind;
   int c;
   struct option long_options[] = {{"tpc", no_argument, &tpc_mode, 1},
+      {"log-store", no_argument, &log_store, 1},
+      {"epoll", no_argument, &use_epoll, 1},
+      {"cache-policy", required_argument, NULL, 'c'},
+      {"write-back", no_argument, &write_back, 1},
+      {"wal", no_argument, &use_wal, 1},
       {0,0,0,0}};
-  if ((c = getopt_long (argc, argv, "t", long_options, &opt_ind)) != -1) {
+  while ((c = getopt_long (argc, argv, "tlec:w", long_options, &opt_ind)) != -1) {
     switch (c) {
       case 0:
+        index += 1;
         break;
       case 't':
         tpc_mode = 1;
         mode = "(tpc)";
         index += 1;
         break;
+      case 'l':
+        log_store = 1;
+        index += 1;
+        break;
+      case 'e':
+        use_epoll = 1;
+        index += 1;
+        break;
+      case 'w':
+        write_back = 1;
+        index += 1;
+        break;
+      case 'c':
+        for (cache_policy = KVPOLICY_TINYLFU; cache_policy >= 0; cache_policy--) {
+          if (strcmp(optarg, CACHE_POLICIES[cache_policy]) == 0)
+            break;
+        }
+        if (cache_policy < 0)
+          goto usage;
+        /* The policy may or may not be a separate argument. */
+        index = optind - 1;
+        break;
       default:
         goto usage;
     }
@@ -61,6 +104,11 @@ int main(int argc, char **argv) {
     }
   }
 
+  if (use_wal)
+    write_back = 1;
+  if (write_back && tpc_mode)
+    goto usage;
+
   if (tpc_mode) {
     printf("Slave server %s started on %d listening for master at "
         "%s:%d... \n", mode, slave_port, master_hostname, master_port);
@@ -71,13 +119,18 @@ int main(int argc, char **argv) {
   kvserver_t slave;
   server_t server;
   server.master = 0;
-  server.max_threads = 3;
+  server.max_threads = SERVER_DEFAULT_THREADS;
+  server.use_epoll = use_epoll;
 
   char slave_name[20];
   sprintf(slave_name, "slave-port%d", slave_port);
 
-  kvserver_init(&slave, slave_name, 4, 4, 2, slave_hostname, slave_port,
-      tpc_mode);
+  if (kvserver_init_backend(&slave, slave_name, 4, 4, 2, slave_hostname,
+        slave_port, tpc_mode, log_store ? KVSTORE_LOG : KVSTORE_FILES,
+        cache_policy) != 0) {
+    printf("Error initializing the store in %s\n", slave_name);
+    return 1;
+  }
   if (tpc_mode) {
     /* Need to send registration to the master.*/
     int ret, sockfd = connect_to(master_hostname, master_port, 0);
@@ -96,6 +149,12 @@ int main(int argc, char **argv) {
     close(sockfd);
   }
   server.kvserver = slave;
+  /* The flusher must be given the copy of the server which handles requests. */
+  if (write_back && kvserver_enable_write_back(&server.kvserver,
+        KVSERVER_FLUSH_INTERVAL, use_wal) != 0) {
+    printf("Error enabling write-back in %s\n", slave_name);
+    return 1;
+  }
   server_run(slave_hostname, slave_port, &server, NULL);
   return 0;
 
@@ -9,6 +9,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -16,93 +17,250 @@
 #include "kvserver.h"
 #include "kvconstants.h"
 #include "socket_server.h"
+#include "utlist.h"
 #include "wq.h"
 
 #define TIMEOUT 100
 
-/* Handles requests under the assumption that SERVER is a TPC Master. */
-void handle_master(server_t *server) {
-  int sockfd;
+/* Handles the request on SOCKFD under the assumption that SERVER is a TPC
+ * Master. */
+void handle_master(server_t *server, int sockfd) {
   tpcmaster_t *tpcmaster = &server->tpcmaster;
-  sockfd = (intptr_t) wq_pop(&server->wq);
   tpcmaster->handle(tpcmaster, sockfd, NULL);
 }
 
-/* Handles requests under the assumption that SERVER is a kvserver slave. */
-void handle_slave(server_t *server) {
-  int sockfd;
+/* Handles the request on SOCKFD under the assumption that SERVER is a kvserver
+ * slave. */
+void handle_slave(server_t *server, int sockfd) {
   kvserver_t *kvserver = &server->kvserver;
-  sockfd = (intptr_t) wq_pop(&server->wq);
   kvserver->handle(kvserver, sockfd, NULL);
 }
 
-/* Handles requests for _SERVER. */
+/* The body of each of _SERVER's worker threads. Repeatedly takes an accepted
+ * socket off the work queue, handles the request on it and closes it, until
+ * a negative fd is popped to signal that the server is shutting down. */
 void *handle(void *_server) {
   server_t *server = (server_t *) _server;
-  if (server->master) {
-    handle_master(server);
-  } else {
-    handle_slave(server);
+  int sockfd;
+  while ((sockfd = (intptr_t) wq_pop(&server->wq)) >= 0) {
+    if (server->master) {
+      handle_master(server, sockfd);
+    } else {
+      handle_slave(server, sockfd);
+    }
+    close(sockfd);
   }
-  pthread_mutex_lock(&server->countlock);
-  server->thread_count--;
-  pthread_cond_signal(&server->reachedmax);
-  pthread_mutex_unlock(&server->countlock);
   return NULL;
 }
 
-/* Connects to the host given at HOST:PORT using a TIMEOUT second timeout.
- * Returns a socket fd which should be closed, else -1 if unsuccessful. */
-int connect_to(const char *host, int port, int timeout) {
-  struct sockaddr_in addr;
+/* Hands CONN back to SERVER's event loop, which will queue it again once
+ * another request arrives on it. */
+static void server_conn_rearm(server_t *server, server_conn_t *conn) {
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = conn;
+  epoll_ctl(server->epollfd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+/* Closes CONN, which also removes it from SERVER's event loop. */
+static void server_conn_close(server_t *server, server_conn_t *conn) {
+  pthread_mutex_lock(&server->connlock);
+  DL_DELETE(server->conns, conn);
+  close(conn->fd);
+  pthread_mutex_unlock(&server->connlock);
+  free(conn);
+}
+
+/* The body of each of _SERVER's worker threads in epoll mode. Repeatedly
+ * takes a connection with a pending request off the work queue and handles
+ * up to SERVER_EPOLL_BATCH requests on it while more remain buffered, so
+ * pipelined requests are answered in the order they were sent. The
+ * connection is then either handed back to the event loop, which queues it
+ * again behind the others if requests remain, or, if the client has hung up,
+ * closed. Only one worker owns a connection at a time, since its epoll
+ * registration is one-shot. Stops once a NULL connection is popped. */
+void *handle_events(void *_server) {
+  server_t *server = (server_t *) _server;
+  server_conn_t *conn;
+  char byte;
+  ssize_t n;
+  int served;
+  while ((conn = (server_conn_t *) wq_pop(&server->wq)) != NULL) {
+    served = 0;
+    while ((n = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT)) > 0) {
+      if (served++ == SERVER_EPOLL_BATCH)
+        break;
+      if (server->master) {
+        handle_master(server, conn->fd);
+      } else {
+        handle_slave(server, conn->fd);
+      }
+    }
+    if (n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+      server_conn_rearm(server, conn);
+    else
+      server_conn_close(server, conn);
+  }
+  return NULL;
+}
+
+/* Runs SERVER's epoll event loop on the listening socket SOCK_FD until
+ * server_stop is called. New connections are registered with the loop, and
+ * given a receive timeout so that a client stalling mid-message only holds
+ * a worker for so long. Connections with a pending request are queued for
+ * the workers; the queue is unbounded, so the loop never waits for a worker,
+ * but holds each connection at most once. */
+static void server_run_epoll(server_t *server, int sock_fd) {
+  struct epoll_event event, events[64];
+  struct sockaddr_in client_address;
+  socklen_t client_address_length;
+  server_conn_t *conn;
+  struct timeval timeout;
+  int i, n, client_sock;
+
+  timeout.tv_sec = server->recv_timeout;
+  timeout.tv_usec = 0;
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  epoll_ctl(server->epollfd, EPOLL_CTL_ADD, sock_fd, &event);
+  while (server->listening) {
+    n = epoll_wait(server->epollfd, events, 64, TIMEOUT);
+    for (i = 0; i < n && server->listening; i++) {
+      if (events[i].data.ptr != NULL) {
+        wq_push(&server->wq, events[i].data.ptr);
+        continue;
+      }
+      client_address_length = sizeof(client_address);
+      client_sock = accept(sock_fd, (struct sockaddr *) &client_address,
+          &client_address_length);
+      if (client_sock < 0)
+        continue;
+      setsockopt(client_sock, SOL_SOCKET, SO_RCVTIMEO, (char *) &timeout,
+          sizeof(timeout));
+      conn = malloc(sizeof(server_conn_t));
+      if (conn == NULL) {
+        close(client_sock);
+        continue;
+      }
+      conn->fd = client_sock;
+      pthread_mutex_lock(&server->connlock);
+      DL_APPEND(server->conns, conn);
+      pthread_mutex_unlock(&server->connlock);
+      event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+      event.data.ptr = conn;
+      epoll_ctl(server->epollfd, EPOLL_CTL_ADD, client_sock, &event);
+    }
+  }
+  /* Wake any worker blocked reading from a client so the pool can exit. */
+  pthread_mutex_lock(&server->connlock);
+  DL_FOREACH(server->conns, conn)
+    shutdown(conn->fd, SHUT_RDWR);
+  pthread_mutex_unlock(&server->connlock);
+}
+
+/* Resolves HOST:PORT into ADDR. Returns 0 if successful, else -1. */
+int resolve_address(const char *host, int port, struct sockaddr_in *addr) {
   struct hostent *ent;
+  ent = gethostbyname(host);
+  if (ent == NULL) {
+    return -1;
+  }
+  bzero((char *) addr, sizeof(struct sockaddr_in));
+  addr->sin_family = AF_INET;
+  bcopy((char *)ent->h_addr, (char *)&addr->sin_addr.s_addr, ent->h_length);
+  addr->sin_port = htons(port);
+  return 0;
+}
+
+/* Connects to the already resolved address ADDR using a TIMEOUT second
+ * timeout. Returns a socket fd which should be closed, else -1 if
+ * unsuccessful. */
+int connect_to_address(const struct sockaddr_in *addr, int timeout) {
   int sockfd;
 
   sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  ent = gethostbyname(host);
-  if (ent == NULL) {
+  if (sockfd < 0) {
     return -1;
   }
-  bzero((char *) &addr, sizeof(addr));
-  addr.sin_family = AF_INET;
-  bcopy((char *)ent->h_addr, (char *)&addr.sin_addr.s_addr, ent->h_length);
-  addr.sin_port = htons(port);
   if (timeout > 0) {
     struct timeval t;
     t.tv_sec = timeout;
     t.tv_usec = 0;
     setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, (char *) &t, sizeof(t));
   }
-  if (connect(sockfd,(struct sockaddr *) &addr, sizeof(addr)) < 0) {
-    close(sockfd);     
+  if (connect(sockfd,(struct sockaddr *) addr, sizeof(struct sockaddr_in)) < 0) {
+    close(sockfd);
     return -1;
   }
   return sockfd;
 }
 
+/* Connects to the host given at HOST:PORT using a TIMEOUT second timeout.
+ * Returns a socket fd which should be closed, else -1 if unsuccessful. */
+int connect_to(const char *host, int port, int timeout) {
+  struct sockaddr_in addr;
+  if (resolve_address(host, port, &addr) < 0) {
+    return -1;
+  }
+  return connect_to_address(&addr, timeout);
+}
+
 /* Runs SERVER such that it indefinitely (until server_stop is called) listens
  * for incoming requests at HOSTNAME:PORT. If CALLBACK is not NULL, makes a
  * call to CALLBACK with NULL as its parameter once SERVER is actively
  * listening for requests (this is for testing purposes).
  *
- * As given, this function will synchronously handle only a single request
- * at a time. It is your task to modify it such that it can handle up to
- * SERVER->max_threads jobs at a time asynchronously. */
+ * Requests are handled by a fixed pool of SERVER->max_threads worker threads
+ * (SERVER_DEFAULT_THREADS if that is not positive), which are started before
+ * listening and joined once server_stop has been called. Accepted sockets are
+ * passed to the workers through a work queue holding at most one socket per
+ * worker; while it is full, no further connections are accepted and new
+ * clients wait in the listen backlog.
+ *
+ * If SERVER->use_epoll is set, connections are kept open and multiplexed by
+ * an epoll event loop instead, and the unbounded work queue holds connections
+ * with a pending request rather than freshly accepted sockets. A connection
+ * stalling mid-message for SERVER->recv_timeout seconds
+ * (SERVER_RECV_TIMEOUT if that is not positive) is closed. Any connections
+ * still open when the server stops are closed. */
 int server_run(const char *hostname, int port, server_t *server,
     callback_t callback) {
-  int sock_fd, client_sock, socket_option;
+  int sock_fd, client_sock, socket_option, i;
   struct sockaddr_in client_address;
-  pthread_mutex_init(&server->countlock, NULL);
-  pthread_cond_init(&server->reachedmax , NULL);  
   size_t client_address_length = sizeof(client_address);
-  wq_init(&server->wq);
+  /* A client hanging up mid-response must not kill the whole server. */
+  signal(SIGPIPE, SIG_IGN);
+  if (server->max_threads <= 0)
+    server->max_threads = SERVER_DEFAULT_THREADS;
+  if (server->recv_timeout <= 0)
+    server->recv_timeout = SERVER_RECV_TIMEOUT;
+  if (server->use_epoll)
+    wq_init(&server->wq);
+  else
+    wq_init_bounded(&server->wq, server->max_threads);
   server->listening = 1;
   server->port = port;
-  server->max_threads = 512; //reasonable amount of threads
-  server->thread_count = 1;
   server->hostname = (char *) malloc(strlen(hostname) + 1);
   strcpy(server->hostname, hostname);
-  
+  server->workers = malloc(server->max_threads * sizeof(pthread_t));
+  if (server->workers == NULL) {
+    fprintf(stderr, "Failed to allocate %d workers\n", server->max_threads);
+    exit(ENOMEM);
+  }
+  if (server->use_epoll) {
+    server->conns = NULL;
+    pthread_mutex_init(&server->connlock, NULL);
+    server->epollfd = epoll_create1(0);
+    if (server->epollfd == -1) {
+      fprintf(stderr, "Failed to create an epoll instance: error %d: %s\n",
+          errno, strerror(errno));
+      exit(errno);
+    }
+  }
+  for (i = 0; i < server->max_threads; i++)
+    pthread_create(&server->workers[i], NULL,
+        server->use_epoll ? handle_events : handle, server);
+
   sock_fd = socket(PF_INET, SOCK_STREAM, 0);
   server->sockfd = sock_fd;
   if (sock_fd == -1) {
@@ -138,31 +296,39 @@ int server_run(const char *hostname, int port, server_t *server,
     callback(NULL);
   }
   
-  while (server->listening) {
-    pthread_mutex_lock(&server->countlock);
-    while (server->thread_count >= server->max_threads) {
-      pthread_cond_wait(&server->reachedmax, &server->countlock);
-    }
-    client_sock = accept(sock_fd, (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
-    if (client_sock > 0) {
+  if (server->use_epoll) {
+    server_run_epoll(server, sock_fd);
+  } else {
+    while (server->listening) {
+      client_sock = accept(sock_fd, (struct sockaddr *) &client_address,
+          (socklen_t *) &client_address_length);
+      if (client_sock >= 0)
         wq_push(&server->wq, (void *) (intptr_t) client_sock);
-        pthread_t job;
-        server->thread_count++;
-        pthread_create(&job, NULL, handle, server);
-        pthread_detach(job);
     }
-    pthread_mutex_unlock(&server->countlock);
   }
 
   shutdown(sock_fd, SHUT_RDWR);
   close(sock_fd);
+  /* Let the workers finish any queued requests, then shut them down. */
+  for (i = 0; i < server->max_threads; i++)
+    wq_push(&server->wq, server->use_epoll ? NULL : (void *) (intptr_t) -1);
+  for (i = 0; i < server->max_threads; i++)
+    pthread_join(server->workers[i], NULL);
+  free(server->workers);
+  if (server->use_epoll) {
+    while (server->conns != NULL)
+      server_conn_close(server, server->conns);
+    close(server->epollfd);
+  }
   return 0;
 }
 
-/* Stops SERVER from continuing to listen for incoming requests. */
+/* Stops SERVER from continuing to listen for incoming requests. Shutting
+ * down the listening socket wakes server_run, which closes it and shuts down
+ * the workers; the socket is not closed here, since its fd could otherwise be
+ * reused by another socket before server_run closes it again. May be called
+ * from one of SERVER's own workers. */
 void server_stop(server_t *server) {
   server->listening = 0;
   shutdown(server->sockfd, SHUT_RDWR);
-  close(server->sockfd);
 }
@@ -1,6 +1,7 @@
 #ifndef __SOCKETSERVER__
 #define __SOCKETSERVER__
 
+#include <netinet/in.h>
 #include "kvserver.h"
 #include "tpcmaster.h"
 #include "wq.h"
@@ -8,34 +9,67 @@
 /* Socket Server defines helper functions for communicating over sockets.
  *
  * connect_to can be used to make a request to a listening host. You will not
- * need to modify this, but you will likely want to utilize it.
+ * need to modify this, but you will likely want to utilize it. A caller which
+ * contacts the same host repeatedly can resolve it once with resolve_address
+ * and then use connect_to_address.
  *
  * server_run can be used to start a server (containing a TPCMaster or KVServer)
  * listening on a given port. See the comment above server_run for more information.
  *
+ * By default, each accepted connection carries a single request. If USE_EPOLL
+ * is set, connections are instead kept open and may carry any number of
+ * requests back to back; an epoll event loop hands each connection with a
+ * pending request to a worker, which handles up to SERVER_EPOLL_BATCH of the
+ * requests already waiting on it in order before handing the connection back
+ * to the event loop, so one pipelining client cannot hold on to a worker. A
+ * client which stops partway through a message is disconnected once
+ * RECV_TIMEOUT seconds pass without more of it arriving.
+ *
  * The server struct stores extra information on top of the stored TPCMaster or
  * KVServer.
  */
 
+/* The number of worker threads used when MAX_THREADS is not positive. */
+#define SERVER_DEFAULT_THREADS 16
+
+/* The most requests a worker handles on a connection in epoll mode before
+ * handing it back to the event loop. */
+#define SERVER_EPOLL_BATCH 16
+
+/* The receive timeout, in seconds, used when RECV_TIMEOUT is not positive. */
+#define SERVER_RECV_TIMEOUT 5
+
 void *handle(void *_kvserver);
 
+/* A persistent connection held open by a server in epoll mode. */
+typedef struct server_conn {
+  int fd;                   /* The connection's socket. */
+  struct server_conn *prev; /* The previous connection in the server's list. */
+  struct server_conn *next; /* The next connection in the server's list. */
+} server_conn_t;
+
 typedef struct server {
   int master;               /* 1 if this server represents a TPC Master, else 0. */
   int listening;            /* 1 if this server is currently listening, else 0. */
   int sockfd;               /* The socket fd this server is operating on. */
-  int max_threads;          /* The maximum number of concurrent jobs that can run. */
-  int thread_count;         /* current amount of threads running */
-  pthread_mutex_t countlock;/* Lock for thread_count */ 
-  pthread_cond_t reachedmax;/* CV whether max was reached */ 
+  int max_threads;          /* The number of worker threads, which bounds concurrent jobs. */
+  pthread_t *workers;       /* The worker threads, MAX_THREADS of them. */
   int port;                 /* The port this server will listen on. */
   char *hostname;           /* The hostname this server will listen on. */
-  wq_t wq;                  /* The work queue this server will use to process jobs. */
+  wq_t wq;                  /* The work queue of sockets or connections waiting for a worker. */
+  int use_epoll;            /* 1 to keep connections open and multiplex them with epoll, else 0. */
+  int recv_timeout;         /* The seconds a connection may stall mid-message in epoll mode. */
+  int epollfd;              /* The epoll instance used in epoll mode. */
+  server_conn_t *conns;     /* Every open connection in epoll mode. */
+  pthread_mutex_t connlock; /* Lock for conns. */
   union {                   /* The kvserver OR tpcmaster this server represents. */
     kvserver_t kvserver;
     tpcmaster_t tpcmaster;
   };
 } server_t;
 
+int resolve_address(const char *host, int port, struct sockaddr_in *addr);
+int connect_to_address(const struct sockaddr_in *addr, int timeout);
 int connect_to(const char *host, int port, int timeout);
 int server_run(const char *hostname, int port, server_t *server,
     callback_t callback);
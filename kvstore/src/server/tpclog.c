@@ -7,16 +7,170 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <stddef.h>
 #include "kvconstants.h"
 #include "tpclog.h"
 
+/* The largest DATA a valid log entry can hold: a full batch. */
+#define TPCLOG_MAX_DATA (MAX_BATCHLEN * (MAX_KEYLEN + MAX_VALLEN + 2))
+
+/* The bytes of a record before its entry: the entry's checksum, padded so
+ * that the entry is 8-byte aligned. */
+#define TPCLOG_PREFIX 8
+
+/* The header of the checkpoint file, which is followed by SIZE bytes of
+ * entries, stored as in the log file. CHECKSUM covers LSN and SIZE. */
+typedef struct {
+  uint64_t lsn;              /* The checkpoint LSN. */
+  uint64_t size;             /* The number of bytes of entries. */
+  uint32_t checksum;         /* The FNV-1a checksum of the fields above. */
+} tpccheckpointheader_t;
+
+/* Computes the FNV-1a checksum of the SIZE bytes at BUF. */
+static uint32_t tpclog_checksum_bytes(const void *buf, size_t size) {
+  uint32_t sum = 2166136261u;
+  const unsigned char *p = buf;
+  size_t i;
+  for (i = 0; i < size; i++)
+    sum = (sum ^ p[i]) * 16777619u;
+  return sum;
+}
+
+/* Computes the FNV-1a checksum of ENTRY, including its header. */
+static uint32_t tpclog_checksum(logentry_t *entry) {
+  return tpclog_checksum_bytes(entry, sizeof(logentry_t) + entry->length);
+}
+
+/* Returns the size of the record holding an entry with LENGTH bytes of DATA:
+ * its prefix, the entry, and padding up to a multiple of 8 bytes, so that
+ * the entries of records stored back to back are all 8-byte aligned. */
+static size_t tpclog_record_size(size_t length) {
+  return (TPCLOG_PREFIX + sizeof(logentry_t) + length + 7) & ~(size_t) 7;
+}
+
+/* Reads exactly SIZE bytes at OFFSET of FD into BUF, retrying on short reads.
+ * Returns 0 if successful, else -1. */
+static int tpclog_pread_full(int fd, void *buf, size_t size, off_t offset) {
+  ssize_t ret;
+  size_t done = 0;
+  while (done < size) {
+    ret = pread(fd, (char *) buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return -1;
+    done += ret;
+  }
+  return 0;
+}
+
+/* Writes exactly SIZE bytes of BUF at OFFSET of FD, retrying on short writes.
+ * Returns 0 if successful, else -1. */
+static int tpclog_pwrite_full(int fd, const void *buf, size_t size,
+    off_t offset) {
+  ssize_t ret;
+  size_t done = 0;
+  while (done < size) {
+    ret = pwrite(fd, (const char *) buf + done, size - done, offset + done);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret <= 0)
+      return -1;
+    done += ret;
+  }
+  return 0;
+}
+
+/* Reads the entry stored at OFFSET of the SIZE byte log file FD into
+ * malloc()d memory which should later be free()d, and stores the offset of
+ * the following entry in NEXT. Returns NULL if there is no intact entry at
+ * OFFSET. */
+static logentry_t *tpclog_read_entry(int fd, off_t size, off_t offset,
+    off_t *next) {
+  logentry_t header, *entry;
+  uint32_t checksum;
+  off_t end = offset + TPCLOG_PREFIX + sizeof(logentry_t);
+  if (end > size
+      || tpclog_pread_full(fd, &checksum, sizeof(uint32_t), offset) < 0
+      || tpclog_pread_full(fd, &header, sizeof(logentry_t),
+          offset + TPCLOG_PREFIX) < 0)
+    return NULL;
+  if (header.length < 0 || header.length > TPCLOG_MAX_DATA
+      || offset + (off_t) tpclog_record_size(header.length) > size)
+    return NULL;
+  entry = malloc(sizeof(logentry_t) + header.length);
+  if (entry == NULL)
+    return NULL;
+  memcpy(entry, &header, sizeof(logentry_t));
+  if (tpclog_pread_full(fd, entry->data, header.length, end) < 0
+      || tpclog_checksum(entry) != checksum) {
+    free(entry);
+    return NULL;
+  }
+  *next = offset + tpclog_record_size(header.length);
+  return entry;
+}
+
+/* Returns the entry stored at OFFSET of the SIZE bytes of records at BUF,
+ * which must be 8-byte aligned, in place, and stores the offset of the
+ * following record in NEXT. Returns NULL if there is no intact entry at
+ * OFFSET. */
+static logentry_t *tpclog_entry_at(char *buf, size_t size, size_t offset,
+    size_t *next) {
+  logentry_t *entry;
+  uint32_t checksum;
+  if (offset + TPCLOG_PREFIX + sizeof(logentry_t) > size)
+    return NULL;
+  entry = (logentry_t *) (buf + offset + TPCLOG_PREFIX);
+  if (entry->length < 0 || entry->length > TPCLOG_MAX_DATA
+      || offset + tpclog_record_size(entry->length) > size)
+    return NULL;
+  memcpy(&checksum, buf + offset, sizeof(uint32_t));
+  if (tpclog_checksum(entry) != checksum)
+    return NULL;
+  *next = offset + tpclog_record_size(entry->length);
+  return entry;
+}
+
+/* Fills FILENAME with the path of the file named NAME within LOG's
+ * directory. */
+static void tpclog_path(tpclog_t *log, char *filename, const char *name) {
+  snprintf(filename, MAX_FILENAME, "%s/%s", log->dirname, name);
+}
+
+/* Opens LOG's checkpoint file, storing its descriptor in FD, which the
+ * caller should close, and reads its header into HEADER. FD is set to -1 if
+ * there is no checkpoint. Returns 0 if successful, else a negative error
+ * code if the checkpoint cannot be read or its header is corrupt. */
+static int tpclog_read_checkpoint_header(tpclog_t *log,
+    tpccheckpointheader_t *header, int *fd) {
+  char filename[MAX_FILENAME];
+  tpclog_path(log, filename, TPCLOG_CHECKPOINT_FILENAME);
+  if ((*fd = open(filename, O_RDONLY)) < 0)
+    return (errno == ENOENT) ? 0 : ERRFILACCESS;
+  if (tpclog_pread_full(*fd, header, sizeof(*header), 0) < 0
+      || header->checksum != tpclog_checksum_bytes(header,
+          offsetof(tpccheckpointheader_t, checksum))) {
+    close(*fd);
+    *fd = -1;
+    return ERRFILACCESS;
+  }
+  return 0;
+}
+
 /* Initialize TPCLog LOG to use the provided DIRNAME to store its associated
- * entries. Sets LOG's NEXTID field based on the entries that currently exist
- * in DIRNAME. */
+ * entries. Opens the log file in DIRNAME, since this log may be recovering
+ * from a crash, and sets LOG's NEXTLSN past the last intact entry in it, and
+ * no lower than the LSN of its checkpoint, if any. Any torn entry after that
+ * is cut off. Returns 0 if successful, else a negative
+ * error code. */
 int tpclog_init(tpclog_t *log, char *dirname) {
   struct stat st;
-  unsigned long nextid = 0;
   char filename[MAX_FILENAME];
+  tpccheckpointheader_t header;
+  logentry_t *entry;
+  off_t offset = 0, next;
+  int fd;
   if (stat(dirname, &st) == -1) {
     if (mkdir(dirname, 0700) == -1)
       return errno;
@@ -25,14 +179,69 @@ int tpclog_init(tpclog_t *log, char *dirname) {
   if (log->dirname == NULL)
     return ENOMEM;
   strcpy(log->dirname, dirname);
-  pthread_rwlock_init(&log->lock, NULL);
-
-  /* Iterate through entries to determine next available ID, since this log may
-   * be recovering from a crash. */
-  sprintf(filename, "%s/%lu%s", log->dirname, nextid++, TPCLOG_FILETYPE);
-  while (stat(filename, &st) != -1)
-    sprintf(filename, "%s/%lu%s", log->dirname, nextid++, TPCLOG_FILETYPE);
-  log->nextid = nextid - 1;
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->synced, NULL);
+  log->syncing = false;
+  log->iterpos = 0;
+  log->nextlsn = 1;
+  log->firstlsn = 0;
+  log->checkpointlsn = 0;
+
+  tpclog_path(log, filename, TPCLOG_FILENAME);
+  if ((log->fd = open(filename, O_RDWR | O_CREAT, 0600)) < 0)
+    return ERRFILACCESS;
+  if (fstat(log->fd, &st) < 0)
+    return ERRFILACCESS;
+  while ((entry = tpclog_read_entry(log->fd, st.st_size, offset, &next))
+      != NULL) {
+    if (offset == 0)
+      log->firstlsn = entry->lsn;
+    log->nextlsn = entry->lsn + 1;
+    offset = next;
+    free(entry);
+  }
+  if (offset < st.st_size && ftruncate(log->fd, offset) < 0)
+    return ERRFILACCESS;
+  log->size = offset;
+  if (offset == 0)
+    log->firstlsn = log->nextlsn;
+  if (tpclog_read_checkpoint_header(log, &header, &fd) < 0)
+    return ERRFILACCESS;
+  if (fd >= 0) {
+    close(fd);
+    log->checkpointlsn = header.lsn;
+    if (log->nextlsn < header.lsn)
+      log->nextlsn = log->firstlsn = header.lsn;
+  }
+  log->synclsn = log->nextlsn;
+  return 0;
+}
+
+/* Waits until every entry of LOG with an LSN up to LSN is on disk, syncing
+ * the log file if no other thread is already doing so. A single sync covers
+ * every entry appended before it starts. Must be called with LOG's lock held.
+ * Returns 0 if successful, else a negative error code. */
+static int tpclog_sync(tpclog_t *log, uint64_t lsn) {
+  uint64_t target;
+  int fd, ret;
+  while (log->synclsn <= lsn) {
+    if (log->syncing) {
+      pthread_cond_wait(&log->synced, &log->lock);
+      continue;
+    }
+    log->syncing = true;
+    target = log->nextlsn;
+    fd = log->fd;
+    pthread_mutex_unlock(&log->lock);
+    ret = fdatasync(fd);
+    pthread_mutex_lock(&log->lock);
+    log->syncing = false;
+    if (ret == 0 && target > log->synclsn)
+      log->synclsn = target;
+    pthread_cond_broadcast(&log->synced);
+    if (ret != 0)
+      return ERRFILACCESS;
+  }
   return 0;
 }
 
@@ -41,68 +250,122 @@ int tpclog_init(tpclog_t *log, char *dirname) {
  * not applicable). See tpclog.h for a complete description of how log entries
  * should be stored in the file system. */
 int tpclog_log(tpclog_t *log, msgtype_t type, char *key, char *value) {
-  char filename[MAX_FILENAME];
-  int fd, keylen, vallen;
+  return tpclog_log_txn(log, 0, type, key, value, NULL);
+}
+
+/* Appends the entry held by the SIZE byte RECORD, after room for its
+ * checksum, to LOG, giving it the next LSN. If LSN is not
+ * NULL, the entry's LSN is stored in it. Returns once the entry is on disk.
+ * Returns 0 if successful, else a negative error code. */
+static int tpclog_append(tpclog_t *log, char *record, size_t size,
+    uint64_t *lsn) {
+  logentry_t *entry = (logentry_t *) (record + TPCLOG_PREFIX);
+  uint32_t checksum;
+  int ret;
+  pthread_mutex_lock(&log->lock);
+  entry->lsn = log->nextlsn;
+  checksum = tpclog_checksum(entry);
+  memcpy(record, &checksum, sizeof(uint32_t));
+  if (tpclog_pwrite_full(log->fd, record, size, log->size) < 0) {
+    pthread_mutex_unlock(&log->lock);
+    return ERRFILACCESS;
+  }
+  log->size += size;
+  log->nextlsn++;
+  if (lsn != NULL)
+    *lsn = entry->lsn;
+  ret = tpclog_sync(log, entry->lsn);
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
+/* Add a log entry to LOG as with tpclog_log, recording that it belongs to
+ * transaction TXID. If LSN is not NULL, the entry's LSN is stored in it.
+ * Returns once the entry is on disk. Returns 0 if successful, else a negative
+ * error code. */
+int tpclog_log_txn(tpclog_t *log, uint64_t txid, msgtype_t type, char *key,
+    char *value, uint64_t *lsn) {
+  int keylen, vallen, ret;
   size_t size;
+  char *record;
   logentry_t *entry;
   if (type != PUTREQ && type != DELREQ && type != ABORT && type != COMMIT)
     return ERRINVLDMSG;
-  pthread_rwlock_wrlock(&log->lock);
-  sprintf(filename, "%s/%lu%s", log->dirname, log->nextid, TPCLOG_FILETYPE);
-  if ((fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR)) < 0) {
-    pthread_rwlock_unlock(&log->lock);
-    return ERRFILACCESS;
-  }
-  log->nextid++;
-
   keylen = (type == PUTREQ || type == DELREQ) ? (strlen(key) + 1) : 0;
   vallen = (type == PUTREQ) ? (strlen(value) + 1) : 0;
-  size = sizeof(logentry_t) + keylen + vallen;
-  entry = malloc(size);
-  if (entry == NULL) {
-    pthread_rwlock_unlock(&log->lock);
-    return ENOMEM;
-  }
+  if (keylen + vallen > TPCLOG_MAX_DATA)
+    return ERRINVLDMSG;
+  size = tpclog_record_size(keylen + vallen);
+  record = calloc(1, size);
+  if (record == NULL)
+    return -ENOMEM;
+  entry = (logentry_t *) (record + TPCLOG_PREFIX);
   entry->type = type;
+  entry->txid = txid;
   entry->length = keylen + vallen;
   if (type == PUTREQ || type == DELREQ)
     strcpy(entry->data, key);
   if (type == PUTREQ)
     strcpy(entry->data + keylen, value);
-  errno = 0;
-  if (write(fd, entry, size) < size) {
-    pthread_rwlock_unlock(&log->lock);
-    return ERRFILACCESS;
-  }
-  close(fd);
-  pthread_rwlock_unlock(&log->lock);
-  free(entry);
-  return 0;
+  ret = tpclog_append(log, record, size, lsn);
+  free(record);
+  return ret;
 }
 
-/* Load the logentry located at FILENAME into ENTRY, which will be set to
- * malloc()d memory which should be later free()d. Returns 0 if successful,
- * else a negative error code (and ENTRY will be NULL). */
-int tpclog_load_entry(logentry_t **entry, char *filename) {
-  logentry_t tmp;
-  int fd;
-  size_t size;
+/* Returns the length of the DATA of an entry holding the BATCH_SIZE pairs
+ * of BATCH, an MPUTREQ or MDELREQ as given by TYPE. */
+static size_t tpclog_batch_length(msgtype_t type, kvpair_t *batch,
+    unsigned int batch_size) {
+  size_t length = 0;
+  unsigned int i;
+  for (i = 0; i < batch_size; i++) {
+    length += strlen(batch[i].key) + 1;
+    if (type == MPUTREQ)
+      length += strlen(batch[i].value) + 1;
+  }
+  return length;
+}
 
-  if ((fd = open(filename, O_RDONLY)) < 0)
-    return ERRFILACCESS;
-  if (read(fd, &tmp, sizeof(logentry_t)) < sizeof(logentry_t))
-    return ERRFILACCESS;
-  lseek(fd, SEEK_SET, 0);
-  size = tmp.length + sizeof(logentry_t);
-  *entry = malloc(size);
-  if (*entry == NULL)
-    return ENOMEM;
-  if (read(fd, *entry, size) < size) {
-    free(*entry);
-    return ERRFILACCESS;
+/* Copies the BATCH_SIZE pairs of BATCH, an MPUTREQ or MDELREQ as given by
+ * TYPE, to DATA, as described in tpclog.h. */
+static void tpclog_batch_copy(char *data, msgtype_t type, kvpair_t *batch,
+    unsigned int batch_size) {
+  unsigned int i;
+  for (i = 0; i < batch_size; i++) {
+    data = stpcpy(data, batch[i].key) + 1;
+    if (type == MPUTREQ)
+      data = stpcpy(data, batch[i].value) + 1;
   }
-  close(fd);
-  return 0;
+}
+
+/* Add a single log entry to LOG holding the BATCH_SIZE pairs of BATCH,
+ * preparing transaction TXID, which is an MPUTREQ or MDELREQ as given by
+ * TYPE. If LSN is not NULL, the entry's LSN is stored in it. Returns once
+ * the entry is on disk. Returns 0 if successful, else a negative error
+ * code. */
+int tpclog_log_batch(tpclog_t *log, uint64_t txid, msgtype_t type,
+    kvpair_t *batch, unsigned int batch_size, uint64_t *lsn) {
+  size_t length, size;
+  char *record;
+  logentry_t *entry;
+  int ret;
+  if ((type != MPUTREQ && type != MDELREQ) || batch_size == 0)
+    return ERRINVLDMSG;
+  length = tpclog_batch_length(type, batch, batch_size);
+  if (length > TPCLOG_MAX_DATA)
+    return ERRINVLDMSG;
+  size = tpclog_record_size(length);
+  record = calloc(1, size);
+  if (record == NULL)
+    return -ENOMEM;
+  entry = (logentry_t *) (record + TPCLOG_PREFIX);
+  entry->type = type;
+  entry->txid = txid;
+  entry->length = length;
+  tpclog_batch_copy(entry->data, type, batch, batch_size);
+  ret = tpclog_append(log, record, size, lsn);
+  free(record);
+  return ret;
 }
 
 /* Prepare LOG to be iterated over. Once this is called, use the functions
@@ -116,12 +379,11 @@ void tpclog_iterate_begin(tpclog_t *log) {
  * true iff LOG has another entry that is more recent than the most previously
  * iterated over log entry. */
 bool tpclog_iterate_has_next(tpclog_t *log) {
-  struct stat st;
-  char filename[MAX_FILENAME];
-  sprintf(filename, "%s/%lu%s", log->dirname, log->iterpos, TPCLOG_FILETYPE);
-  if (stat(filename, &st) == -1)
-    return false;
-  return true;
+  bool ret;
+  pthread_mutex_lock(&log->lock);
+  ret = log->iterpos < log->size;
+  pthread_mutex_unlock(&log->lock);
+  return ret;
 }
 
 /* Must be called after tpclog_iterate_begin has been called on LOG. Attempts
@@ -131,38 +393,342 @@ bool tpclog_iterate_has_next(tpclog_t *log) {
  * free()d. Returns NULL if there is an error or no more recent entry exists
  * (i.e., all entries have been iterated over). */
 logentry_t *tpclog_iterate_next(tpclog_t *log) {
-  char filename[MAX_FILENAME];
   logentry_t *entry;
-  int ret;
-  pthread_rwlock_rdlock(&log->lock);
-  if (!tpclog_iterate_has_next(log)) {
-    pthread_rwlock_unlock(&log->lock);
-    return NULL;
+  off_t next;
+  pthread_mutex_lock(&log->lock);
+  entry = tpclog_read_entry(log->fd, log->size, log->iterpos, &next);
+  if (entry != NULL)
+    log->iterpos = next;
+  pthread_mutex_unlock(&log->lock);
+  return entry;
+}
+
+/* Returns the LSN which the next entry logged to LOG will be given. */
+uint64_t tpclog_next_lsn(tpclog_t *log) {
+  uint64_t lsn;
+  pthread_mutex_lock(&log->lock);
+  lsn = log->nextlsn;
+  pthread_mutex_unlock(&log->lock);
+  return lsn;
+}
+
+/* Returns the number of entries of LOG which must be replayed on top of its
+ * checkpoint, if any, to recreate state: those logged since the later of
+ * the checkpoint and the oldest entry left in the log file. A server can
+ * take a checkpoint once this grows too long. */
+uint64_t tpclog_tail_length(tpclog_t *log) {
+  uint64_t length;
+  pthread_mutex_lock(&log->lock);
+  length = log->nextlsn - ((log->firstlsn > log->checkpointlsn)
+      ? log->firstlsn : log->checkpointlsn);
+  pthread_mutex_unlock(&log->lock);
+  return length;
+}
+
+/* Copies the entries of LOG from OFFSET onward into a new log file, which
+ * then replaces the current one. Must be called with LOG's lock held and no
+ * sync in progress. Returns 0 if successful, else a negative error code. */
+static int tpclog_rewrite(tpclog_t *log, off_t offset) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME], buf[4096];
+  off_t pos;
+  size_t len;
+  int fd, dirfd;
+  tpclog_path(log, filename, TPCLOG_FILENAME);
+  tpclog_path(log, tmpname, TPCLOG_FILENAME ".tmp");
+  if ((fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+    return ERRFILACCESS;
+  for (pos = offset; pos < log->size; pos += len) {
+    len = (log->size - pos < (off_t) sizeof(buf)) ? log->size - pos : sizeof(buf);
+    if (tpclog_pread_full(log->fd, buf, len, pos) < 0
+        || tpclog_pwrite_full(fd, buf, len, pos - offset) < 0)
+      goto error;
+  }
+  if (fsync(fd) < 0 || rename(tmpname, filename) < 0)
+    goto error;
+  if ((dirfd = open(log->dirname, O_RDONLY)) >= 0) {
+    fsync(dirfd);
+    close(dirfd);
   }
-  sprintf(filename, "%s/%lu%s", log->dirname, log->iterpos++, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  pthread_rwlock_unlock(&log->lock);
-  return (ret < 0) ? NULL : entry;
+  close(log->fd);
+  log->fd = fd;
+  log->size -= offset;
+  log->iterpos = (log->iterpos > offset) ? log->iterpos - offset : 0;
+  log->synclsn = log->nextlsn;
+  return 0;
+
+error:
+  close(fd);
+  remove(tmpname);
+  return ERRFILACCESS;
 }
 
-/* Clear the log of all entries. Should be called periodically to keep the
- * number of entries from becoming too large, since a server rebuild will
- * iterate through all existing entries. */
+/* Drops the entries of LOG with an LSN below LSN by moving the rest to a new
+ * log file, if the log has grown past TPCLOG_REWRITE_SIZE bytes; until
+ * then, this does nothing. Must be called with LOG's lock held. Returns 0 if
+ * successful, else a negative error code. */
+static int tpclog_drop_before(tpclog_t *log, uint64_t lsn) {
+  logentry_t *entry;
+  off_t offset = 0, next;
+  int ret = 0;
+  while (log->syncing)
+    pthread_cond_wait(&log->synced, &log->lock);
+  if (log->size < TPCLOG_REWRITE_SIZE)
+    return 0;
+  while ((entry = tpclog_read_entry(log->fd, log->size, offset, &next))
+      != NULL && entry->lsn < lsn) {
+    offset = next;
+    free(entry);
+  }
+  if (offset > 0 && (ret = tpclog_rewrite(log, offset)) == 0)
+    log->firstlsn = (entry != NULL) ? entry->lsn : log->nextlsn;
+  free(entry);
+  return ret;
+}
+
+/* Truncates LOG at the checkpoint LSN, dropping every entry with an LSN
+ * below it. The caller promises that none of those entries will be needed
+ * to recreate state. If no entry is left, the log file is simply emptied,
+ * and the checkpoint file, if any, removed. Otherwise, if LOG has a
+ * checkpoint, it is truncated at the checkpoint's LSN instead, as the
+ * entries which follow it are needed along with the checkpoint. The entries
+ * which remain are moved to a new log file, which is only worthwhile once
+ * the log has grown past TPCLOG_REWRITE_SIZE bytes; until then, this does
+ * nothing. Returns 0 if successful, else a negative error code. */
+int tpclog_truncate(tpclog_t *log, uint64_t lsn) {
+  char filename[MAX_FILENAME];
+  int ret = 0;
+  pthread_mutex_lock(&log->lock);
+  while (log->syncing)
+    pthread_cond_wait(&log->synced, &log->lock);
+  if (lsn >= log->nextlsn) {
+    /* The checkpoint goes first: without the log, it would bring back
+     * transactions which have since been finished. */
+    tpclog_path(log, filename, TPCLOG_CHECKPOINT_FILENAME);
+    if (log->checkpointlsn > 0 && unlink(filename) < 0 && errno != ENOENT) {
+      ret = ERRFILACCESS;
+    } else if (log->size > 0 && ftruncate(log->fd, 0) < 0) {
+      ret = ERRFILACCESS;
+    } else {
+      log->size = log->iterpos = 0;
+      log->checkpointlsn = 0;
+      log->firstlsn = log->nextlsn;
+    }
+  } else {
+    ret = tpclog_drop_before(log, (log->checkpointlsn > 0)
+        ? log->checkpointlsn : lsn);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
+/* Clear the log of all entries. */
 int tpclog_clear_log(tpclog_t *log) {
+  return tpclog_truncate(log, UINT64_MAX);
+}
+
+/* Closes the log file of LOG and frees LOG's memory, leaving the file in
+ * place. */
+void tpclog_destroy(tpclog_t *log) {
+  close(log->fd);
+  free(log->dirname);
+  log->dirname = NULL;
+  pthread_cond_destroy(&log->synced);
+  pthread_mutex_destroy(&log->lock);
+}
+
+/* Initializes the empty checkpoint CKPT, which will have the checkpoint LSN
+ * LSN. */
+void tpclog_checkpoint_init(tpccheckpoint_t *ckpt, uint64_t lsn) {
+  ckpt->lsn = lsn;
+  ckpt->buf = NULL;
+  ckpt->size = ckpt->cap = 0;
+}
+
+/* Adds an entry to CKPT recording the BATCH_SIZE pairs of BATCH prepared by
+ * transaction TXID, which is an MPUTREQ or MDELREQ as given by TYPE, or
+ * recording that TXID is being committed if TYPE is COMMIT, in which case
+ * BATCH is ignored. The entry is given the LSN LSN, that of the entry which
+ * it stands for. Returns 0 if successful, else a negative error code. */
+int tpclog_checkpoint_add(tpccheckpoint_t *ckpt, uint64_t txid,
+    msgtype_t type, kvpair_t *batch, unsigned int batch_size, uint64_t lsn) {
+  logentry_t header;
+  size_t length = 0, size, cap;
+  uint32_t checksum;
+  char *record, *buf;
+  if (type == MPUTREQ || type == MDELREQ) {
+    if (batch_size == 0)
+      return ERRINVLDMSG;
+    length = tpclog_batch_length(type, batch, batch_size);
+  } else if (type != COMMIT) {
+    return ERRINVLDMSG;
+  }
+  if (length > TPCLOG_MAX_DATA)
+    return ERRINVLDMSG;
+  size = tpclog_record_size(length);
+  if (ckpt->size + size > ckpt->cap) {
+    for (cap = ckpt->cap ? ckpt->cap : 4096; cap < ckpt->size + size; cap *= 2);
+    if ((buf = realloc(ckpt->buf, cap)) == NULL)
+      return ENOMEM;
+    ckpt->buf = buf;
+    ckpt->cap = cap;
+  }
+  record = ckpt->buf + ckpt->size;
+  memset(&header, 0, sizeof(logentry_t));
+  header.type = type;
+  header.length = length;
+  header.txid = txid;
+  header.lsn = lsn;
+  memset(record, 0, size);
+  memcpy(record + TPCLOG_PREFIX, &header, sizeof(logentry_t));
+  if (length > 0)
+    tpclog_batch_copy(record + TPCLOG_PREFIX + sizeof(logentry_t), type,
+        batch, batch_size);
+  checksum = tpclog_checksum_bytes(record + TPCLOG_PREFIX,
+      sizeof(logentry_t) + length);
+  memcpy(record, &checksum, sizeof(uint32_t));
+  ckpt->size += size;
+  return 0;
+}
+
+/* Writes CKPT to LOG's checkpoint file, atomically replacing the previous
+ * checkpoint, and from then on keeps only the entries of LOG from CKPT's LSN
+ * on, rewriting the log file at once if it has grown past
+ * TPCLOG_REWRITE_SIZE bytes. The checkpoint is written to a temporary file
+ * and synced without holding LOG's lock, so appends carry on meanwhile. It
+ * is discarded if LOG has been truncated past its LSN, or given a later
+ * checkpoint, in the meantime. Returns 0 if successful, else a negative
+ * error code. */
+int tpclog_checkpoint_write(tpclog_t *log, tpccheckpoint_t *ckpt) {
+  char filename[MAX_FILENAME], tmpname[MAX_FILENAME];
+  tpccheckpointheader_t header;
+  int fd, dirfd, ret = 0;
+  memset(&header, 0, sizeof(header));
+  header.lsn = ckpt->lsn;
+  header.size = ckpt->size;
+  header.checksum = tpclog_checksum_bytes(&header,
+      offsetof(tpccheckpointheader_t, checksum));
+  tpclog_path(log, filename, TPCLOG_CHECKPOINT_FILENAME);
+  tpclog_path(log, tmpname, TPCLOG_CHECKPOINT_FILENAME ".tmp");
+  if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) < 0)
+    return ERRFILACCESS;
+  if (tpclog_pwrite_full(fd, &header, sizeof(header), 0) < 0
+      || (ckpt->size > 0 && tpclog_pwrite_full(fd, ckpt->buf, ckpt->size,
+          sizeof(header)) < 0)
+      || fsync(fd) < 0) {
+    close(fd);
+    remove(tmpname);
+    return ERRFILACCESS;
+  }
+  close(fd);
+
+  pthread_mutex_lock(&log->lock);
+  if (ckpt->lsn < log->firstlsn || ckpt->lsn <= log->checkpointlsn) {
+    remove(tmpname);
+  } else if (rename(tmpname, filename) < 0) {
+    remove(tmpname);
+    ret = ERRFILACCESS;
+  } else {
+    if ((dirfd = open(log->dirname, O_RDONLY)) >= 0) {
+      fsync(dirfd);
+      close(dirfd);
+    }
+    log->checkpointlsn = ckpt->lsn;
+    ret = tpclog_drop_before(log, ckpt->lsn);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return ret;
+}
+
+/* Frees the entries gathered in CKPT. */
+void tpclog_checkpoint_destroy(tpccheckpoint_t *ckpt) {
+  free(ckpt->buf);
+  ckpt->buf = NULL;
+  ckpt->size = ckpt->cap = 0;
+}
+
+/* Adds the intact entries of the SIZE bytes of entries at BUF with an LSN
+ * of at least LSN to IMAGE, stopping at the first entry which is not intact.
+ * If ENTRIES is NULL, they are only counted, in IMAGE's NUM_ENTRIES. Returns
+ * true iff every byte of BUF held an intact entry. */
+static bool tpclog_load_entries(tpclogimage_t *image, char *buf, size_t size,
+    uint64_t lsn) {
+  logentry_t *entry;
+  size_t offset = 0, next;
+  while ((entry = tpclog_entry_at(buf, size, offset, &next)) != NULL) {
+    if (entry->lsn >= lsn) {
+      if (image->entries != NULL)
+        image->entries[image->num_entries] = entry;
+      image->num_entries++;
+    }
+    offset = next;
+  }
+  return offset == size;
+}
+
+/* Reads everything needed to recreate the state logged to LOG into IMAGE:
+ * the entries of its checkpoint, if any, followed by the entries of the log
+ * file from the checkpoint LSN on, with a single read of each file. The
+ * entries are left in place in IMAGE's buffers, rather than each copied out
+ * on its own. IMAGE should later be freed with tpclog_image_destroy, even if
+ * this fails. Returns 0 if successful, else a negative error code. */
+int tpclog_load(tpclog_t *log, tpclogimage_t *image) {
+  tpccheckpointheader_t header;
   struct stat st;
-  char filename[MAX_FILENAME];
-  unsigned long count = 0;
+  size_t sizes[2] = {0, 0};
+  uint64_t lsn;
+  unsigned int pass;
+  int fd, ret = 0;
+  memset(image, 0, sizeof(tpclogimage_t));
+  pthread_mutex_lock(&log->lock);
+  lsn = log->checkpointlsn;
+  if (lsn > 0) {
+    if ((ret = tpclog_read_checkpoint_header(log, &header, &fd)) == 0
+        && fd < 0)
+      ret = ERRFILACCESS;
+    if (ret == 0 && (header.lsn != lsn || fstat(fd, &st) < 0
+        || header.size > (uint64_t) st.st_size - sizeof(header)))
+      ret = ERRFILACCESS;
+    if (ret == 0) {
+      sizes[0] = header.size;
+      if ((image->bufs[0] = malloc(sizes[0] + 1)) == NULL)
+        ret = ENOMEM;
+      else if (tpclog_pread_full(fd, image->bufs[0], sizes[0],
+          sizeof(header)) < 0)
+        ret = ERRFILACCESS;
+    }
+    if (fd >= 0)
+      close(fd);
+  }
+  if (ret == 0) {
+    sizes[1] = log->size;
+    if ((image->bufs[1] = malloc(sizes[1] + 1)) == NULL)
+      ret = ENOMEM;
+    else if (tpclog_pread_full(log->fd, image->bufs[1], sizes[1], 0) < 0)
+      ret = ERRFILACCESS;
+  }
+  pthread_mutex_unlock(&log->lock);
+  if (ret != 0)
+    return ret;
 
-  pthread_rwlock_wrlock(&log->lock);
-  sprintf(filename, "%s/%lu%s", log->dirname, count++, TPCLOG_FILETYPE);
-  while (stat(filename, &st) != -1) {
-    if (remove(filename) < 0) {
-      pthread_rwlock_unlock(&log->lock);
-      return errno;
+  /* Count the entries, then gather them. */
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      image->entries = malloc((image->num_entries + 1) * sizeof(logentry_t *));
+      if (image->entries == NULL)
+        return ENOMEM;
+      image->num_entries = 0;
     }
-    sprintf(filename, "%s/%lu%s", log->dirname, count++, TPCLOG_FILETYPE);
+    if (!tpclog_load_entries(image, image->bufs[0], sizes[0], 0))
+      return ERRFILACCESS;
+    tpclog_load_entries(image, image->bufs[1], sizes[1], lsn);
   }
-  pthread_rwlock_unlock(&log->lock);
-  log->nextid = 0;
   return 0;
 }
+
+/* Frees the buffers and entries of IMAGE. */
+void tpclog_image_destroy(tpclogimage_t *image) {
+  free(image->bufs[0]);
+  free(image->bufs[1]);
+  free(image->entries);
+  memset(image, 0, sizeof(tpclogimage_t));
+}
@@ -3,59 +3,138 @@
 
 #include <stdbool.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
 #include "kvconstants.h"
+#include "kvmessage.h"
 
 /* TPCLog defines a log which will log the TPC actions for a server such that
  * it can recreate its state after a crash.
  *
- * Entries in the log are stored within DIRNAME with an incrementing id. The
- * first entry has a filename of "0.log", the second has a filename of "1.log",
- * and so on. Files should always be sequential; for example, there should
- * never be a filename of "2.log" without a filename of "1.log"
+ * Entries are appended to a single file, TPCLOG_FILENAME within DIRNAME. Each
+ * entry is given a log sequence number (LSN) one greater than the entry
+ * before it, and is stored as a checksum of the entry, padded to 8 bytes,
+ * followed by the entry itself, padded to a multiple of 8 bytes, so that
+ * every entry is 8-byte aligned in a buffer holding the file. A torn or corrupted entry at the end of the file, left behind by a
+ * crash mid-append, is discarded when the log is next initialized.
+ *
+ * tpclog_log does not return until its entry is on disk. Appends which arrive
+ * while another thread is waiting on an fsync are gathered into the next one
+ * (group commit): the first appender to find no fsync in progress syncs
+ * everything appended so far on behalf of all waiting appenders, so
+ * concurrent transactions share the cost of each fsync.
  *
  * Servers can use the TPCLog to log each incoming action they receive, and
  * later use the tpclog_iterate methods to iterate over all entries in the log,
  * in order of receipt, to recreate their state as necessary. Because the
  * iterator will walk over all entries in the log, servers should call
- * tpclog_clear_log periodically to clear the log. This will erase all entries
- * in the log, so it should only be called when the server is confident that it
- * will not need any existing entry to recreate state.
+ * tpclog_truncate periodically with a checkpoint LSN, before which no entry
+ * will be needed to recreate state. tpclog_clear_log erases every entry.
+ *
+ * A server whose log cannot be truncated, because some transaction has been
+ * prepared for a long time, can take a checkpoint instead: the entries which,
+ * replayed on their own, recreate its state as of the checkpoint LSN, which
+ * must not be above the LSN of any entry logged after they were gathered.
+ * They are gathered into a TPCCheckpoint with tpclog_checkpoint_add and
+ * written with tpclog_checkpoint_write to TPCLOG_CHECKPOINT_FILENAME, whose
+ * header holds the checkpoint LSN, replacing the previous checkpoint
+ * atomically. From then on the entries below the checkpoint LSN are never
+ * needed, and tpclog_truncate only ever truncates the log at the checkpoint
+ * LSN, until it is asked to drop every entry, which also drops the
+ * checkpoint. A checkpoint is discarded if, by the time it is written, the
+ * log has already been truncated past its LSN.
+ *
+ * tpclog_load reads everything needed to recreate state at once, with a
+ * single read of each file: the entries of the checkpoint, if any, followed
+ * by those of the log from the checkpoint LSN on. The tpclog_iterate methods
+ * walk the entries of the log file alone.
  */
 
-/* Filetype to use as an extension for the filenames of entries in the TPCLog. */
-#define TPCLOG_FILETYPE ".log"
+/* The name of the log file within the log's directory. */
+#define TPCLOG_FILENAME "tpc.log"
+
+/* The name of the checkpoint file within the log's directory. */
+#define TPCLOG_CHECKPOINT_FILENAME "tpc.checkpoint"
+
+/* The size in bytes beyond which tpclog_truncate will rewrite the log to
+ * drop entries older than the checkpoint, when some entries must be kept. */
+#define TPCLOG_REWRITE_SIZE (1 << 20)
 
 /* A TPCLog. */
 typedef struct {
-  char *dirname;             /* The name of the directory in which to store log entries. */
-  unsigned long nextid;      /* The ID of the next entry to be stored in the log. */
-  unsigned long iterpos;     /* The position of the current iteration over the entries. */
-  pthread_rwlock_t lock;     /* A read-write lock used to make TPCLog thread-safe. */
+  char *dirname;             /* The name of the directory in which to store the log. */
+  int fd;                    /* The log file. */
+  off_t size;                /* The number of bytes of entries in the log file. */
+  uint64_t nextlsn;          /* The LSN of the next entry to be stored in the log. */
+  uint64_t firstlsn;         /* The LSN of the first entry in the log file, or NEXTLSN if it is empty. */
+  uint64_t checkpointlsn;    /* The LSN of the latest checkpoint, or 0 if there is none. */
+  uint64_t synclsn;          /* Every entry with an LSN below this is on disk. */
+  bool syncing;              /* True while an appender is syncing the log file. */
+  off_t iterpos;             /* The position of the current iteration over the entries. */
+  pthread_mutex_t lock;      /* Makes TPCLog thread-safe. */
+  pthread_cond_t synced;     /* Signalled whenever SYNCLSN advances. */
 } tpclog_t;
 
-/* A single log entry.
+/* A single log entry. TXID is the transaction the message belongs to, or 0
+ * for a message sent without a transaction ID. LSN is the entry's log
+ * sequence number.
  * For messages of type COMMIT and ABORT, data is empty.
  * For messages of type DELREQ, data holds the relevant key.
  * For messages of type PUTREQ, data holds both the key and the value, in the
  * form:
  *   key_string \0 value_string \0
- *   (that is, two concatenated and null terminated strings) */
+ *   (that is, two concatenated and null terminated strings)
+ * For messages of type MPUTREQ and MDELREQ, data holds every pair of the
+ * batch, one after the other, each as for a PUTREQ or DELREQ respectively,
+ * so that a whole batch is prepared by a single entry. */
 typedef struct {
   msgtype_t type;          /* The type of message this log entry represents. */
   int length;              /* Stores the total length of DATA, including null terminators. */
+  uint64_t txid;           /* The transaction this log entry belongs to. */
+  uint64_t lsn;            /* The log sequence number of this entry. */
   char data[0];            /* Described above. */
 } logentry_t;
 
+/* The entries of a checkpoint being gathered, stored as in the log file. */
+typedef struct {
+  uint64_t lsn;              /* The checkpoint LSN. */
+  char *buf;                 /* The entries gathered so far. */
+  size_t size;               /* The number of bytes of BUF in use. */
+  size_t cap;                /* The number of bytes allocated for BUF. */
+} tpccheckpoint_t;
+
+/* Everything tpclog_load reads to recreate state. */
+typedef struct {
+  char *bufs[2];             /* The contents of the checkpoint and log files. */
+  logentry_t **entries;      /* The entries to replay, in order, pointing into BUFS. */
+  unsigned int num_entries;  /* The number of entries in ENTRIES. */
+} tpclogimage_t;
+
 int tpclog_init(tpclog_t *, char *dirname);
 
 int tpclog_log(tpclog_t *, msgtype_t type, char *key, char *value);
-
-int tpclog_load_entry(logentry_t **entry, char *filename);
+int tpclog_log_txn(tpclog_t *, uint64_t txid, msgtype_t type, char *key,
+    char *value, uint64_t *lsn);
+int tpclog_log_batch(tpclog_t *, uint64_t txid, msgtype_t type,
+    kvpair_t *batch, unsigned int batch_size, uint64_t *lsn);
 
 void tpclog_iterate_begin(tpclog_t *log);
 bool tpclog_iterate_has_next(tpclog_t *log);
 logentry_t *tpclog_iterate_next(tpclog_t *log);
 
+uint64_t tpclog_next_lsn(tpclog_t *);
+uint64_t tpclog_tail_length(tpclog_t *);
+int tpclog_truncate(tpclog_t *, uint64_t lsn);
 int tpclog_clear_log(tpclog_t *);
+void tpclog_destroy(tpclog_t *);
+
+void tpclog_checkpoint_init(tpccheckpoint_t *, uint64_t lsn);
+int tpclog_checkpoint_add(tpccheckpoint_t *, uint64_t txid, msgtype_t type,
+    kvpair_t *batch, unsigned int batch_size, uint64_t lsn);
+int tpclog_checkpoint_write(tpclog_t *, tpccheckpoint_t *);
+void tpclog_checkpoint_destroy(tpccheckpoint_t *);
+
+int tpclog_load(tpclog_t *, tpclogimage_t *);
+void tpclog_image_destroy(tpclogimage_t *);
 
 #endif
@@ -1,14 +1,18 @@
+#include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <poll.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include "kvconstants.h"
+#include "kvhash.h"
 #include "kvmessage.h"
+#include "kvstats.h"
 #include "socket_server.h"
 #include "time.h"
 #include "tpcmaster.h"
-
-static tpc_state_t state = TPC_READY;
+#include "uthash.h"
 
 /* Initializes a tpcmaster. Will return 0 if successful, or a negative error
  * code if not. SLAVE_CAPACITY indicates the maximum number of slaves that
@@ -17,11 +21,22 @@ static tpc_state_t state = TPC_READY;
  * each with ELEM_PER_SET elements. */
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     unsigned int redundancy, unsigned int num_sets, unsigned int elem_per_set) {
-  int ret;
+  int i, ret;
   ret = kvcache_init(&master->cache, num_sets, elem_per_set);
   if (ret < 0) return ret;
+  ret = kvcache_init(&master->absent, num_sets, elem_per_set);
+  if (ret < 0) return ret;
+  ret = kvstats_init(&master->stats);
+  if (ret != 0) return ret;
   ret = pthread_rwlock_init(&master->slave_lock, NULL);
   if (ret < 0) return ret;
+  for (i = 0; i < TPCMASTER_KEY_LOCKS; i++) {
+    ret = pthread_mutex_init(&master->key_locks[i], NULL);
+    if (ret != 0) return -ret;
+  }
+  /* Start from the clock so that a restarted master does not reuse the IDs
+   * of transactions a slave may still hold. */
+  master->next_txid = (uint64_t) time(NULL) << 24;
   master->slave_count = 0;
   master->slave_capacity = slave_capacity;
   if (redundancy > slave_capacity) {
@@ -30,6 +45,24 @@ int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
     master->redundancy = redundancy;
   }
   master->slaves_head = NULL;
+  master->vnodes = TPCMASTER_DEFAULT_VNODES;
+  master->ring = NULL;
+  master->ring_size = 0;
+  master->ring_replicas = NULL;
+  master->ring_slaves = 0;
+  master->ring_stale = false;
+  master->written = false;
+  master->read_policy = TPCMASTER_READ_ROUND_ROBIN;
+  master->hedge_reads = false;
+  master->next_read = 0;
+  ret = pthread_mutex_init(&master->latency_lock, NULL);
+  if (ret != 0) return -ret;
+  master->num_latencies = 0;
+  master->next_latency = 0;
+  ret = pthread_mutex_init(&master->flight_lock, NULL);
+  if (ret != 0) return -ret;
+  master->flights = NULL;
+  memset(master->puts, 0, sizeof(master->puts));
   master->handle = tpcmaster_handle;
   return 0;
 }
@@ -46,96 +79,714 @@ int64_t hash_64_bit(char *s) {
   return h;
 }
 
+/* A ring of points, and the replicas of each point's segment. */
+typedef struct {
+  tpcvnode_t *points;           /* Every point on the ring, sorted by hash. */
+  unsigned int size;            /* The number of points in POINTS. */
+  tpcslave_t **replicas;        /* The REDUNDANCY replicas of each point's segment, in order. */
+  unsigned int slaves;          /* The number of slaves on the ring. */
+} tpcring_t;
+
+/* A set of segments of the ring to be moved off SOURCE by a MIGRATE. */
+typedef struct {
+  tpcslave_t *source;           /* The slave currently holding the segments. */
+  tpcslave_t *target;           /* The slave gaining them, or NULL if they are dropped. */
+  int64_t *ranges;              /* Exclusive lower and inclusive upper bound of each. */
+  unsigned int num_ranges;      /* The number of segments in RANGES. */
+  unsigned int cap;             /* The number of segments RANGES has room for. */
+} tpcmove_t;
+
+/* Orders two points on the ring by hash. */
+static int tpcmaster_vnode_cmp(const void *a, const void *b) {
+  int64_t x = ((const tpcvnode_t *) a)->point;
+  int64_t y = ((const tpcvnode_t *) b)->point;
+  return (x > y) - (x < y);
+}
+
+/* Orders two hashes. */
+static int tpcmaster_hash_cmp(const void *a, const void *b) {
+  int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Returns the position of KEY on a ring with VNODES points per slave. With a
+ * single point per slave, this is hash_64_bit(KEY), which slave IDs are
+ * compared against directly. hash_64_bit gives similar strings similar
+ * hashes, though, which would bunch many points and keys together on the
+ * ring, so with several points per slave its result is further scrambled by
+ * the splitmix64 finalizer. Slaves use it to find the keys named by a
+ * MIGRATE. */
+int64_t tpcmaster_ring_hash(unsigned int vnodes, char *key) {
+  uint64_t h = (uint64_t) hash_64_bit(key);
+  if (vnodes <= 1)
+    return (int64_t) h;
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return (int64_t) (h ^ (h >> 31));
+}
+
+/* Builds in RING a ring of every slave of MASTER which is not leaving. With
+ * a single point per slave, each slave's point is its ID. Otherwise, its
+ * points are the ring hashes of "PORT:HOST#N" for N from 0 up to VNODES - 1.
+ * Then records, for every point, the first REDUNDANCY distinct slaves found
+ * walking the ring clockwise from it. Must be called with MASTER's
+ * slave_lock held. Returns 0 if successful, else a negative error code. */
+static int tpcmaster_compute_ring(tpcmaster_t *master, tpcring_t *ring) {
+  unsigned int vnodes = master->vnodes ? master->vnodes : 1;
+  unsigned int slaves = 0, size, i, j, k, n, found;
+  unsigned int redundancy = master->redundancy;
+  tpcslave_t *slave, **list;
+  char name[512];
+  slave = master->slaves_head;
+  for (i = 0; i < master->slave_count; i++, slave = slave->next) {
+    if (!slave->leaving)
+      slaves++;
+  }
+  size = slaves * vnodes;
+  if (redundancy > slaves)
+    redundancy = slaves;
+  /* A ring without slaves still gets buffers, so that success is told
+   * apart from allocation failure. */
+  ring->points = malloc((size ? size : 1) * sizeof(tpcvnode_t));
+  ring->replicas = calloc((size ? size : 1) * master->redundancy,
+      sizeof(tpcslave_t *));
+  if (ring->points == NULL || ring->replicas == NULL) {
+    free(ring->points);
+    free(ring->replicas);
+    return -1;
+  }
+  slave = master->slaves_head;
+  for (i = 0, n = 0; i < master->slave_count; i++, slave = slave->next) {
+    if (slave->leaving)
+      continue;
+    for (j = 0; j < vnodes; j++, n++) {
+      ring->points[n].slave = slave;
+      if (vnodes == 1) {
+        ring->points[n].point = slave->id;
+      } else {
+        snprintf(name, sizeof(name), "%u:%s#%u", slave->port, slave->host, j);
+        ring->points[n].point = tpcmaster_ring_hash(vnodes, name);
+      }
+    }
+  }
+  qsort(ring->points, size, sizeof(tpcvnode_t), tpcmaster_vnode_cmp);
+  for (i = 0; i < size; i++) {
+    list = &ring->replicas[i * master->redundancy];
+    found = 0;
+    for (n = 0; n < size && found < redundancy; n++) {
+      slave = ring->points[(i + n) % size].slave;
+      for (k = 0; k < found && list[k] != slave; k++);
+      if (k == found)
+        list[found++] = slave;
+    }
+  }
+  ring->size = size;
+  ring->slaves = slaves;
+  return 0;
+}
+
+/* Stores MASTER's current ring in RING. */
+static void tpcmaster_current_ring(tpcmaster_t *master, tpcring_t *ring) {
+  ring->points = master->ring;
+  ring->size = master->ring_size;
+  ring->replicas = master->ring_replicas;
+  ring->slaves = master->ring_slaves;
+}
+
+/* Makes RING MASTER's ring, freeing the old one. Must be called with
+ * MASTER's slave_lock held for writing. */
+static void tpcmaster_install_ring(tpcmaster_t *master, tpcring_t *ring) {
+  free(master->ring);
+  free(master->ring_replicas);
+  master->ring = ring->points;
+  master->ring_size = ring->size;
+  master->ring_replicas = ring->replicas;
+  master->ring_slaves = ring->slaves;
+}
+
+/* Rebuilds MASTER's ring from its list of slaves. Must be called with
+ * MASTER's slave_lock held for writing. Returns 0 if successful, else a
+ * negative error code, in which case the old ring is kept. */
+static int tpcmaster_build_ring(tpcmaster_t *master) {
+  tpcring_t ring;
+  if (tpcmaster_compute_ring(master, &ring) < 0)
+    return -1;
+  tpcmaster_install_ring(master, &ring);
+  master->ring_stale = false;
+  return 0;
+}
+
+/* Rebuilds MASTER's ring from its current list of slaves at once, without
+ * moving any data. Returns 0 if successful, else a negative error code. */
+int tpcmaster_rebuild_ring(tpcmaster_t *master) {
+  int ret;
+  pthread_rwlock_wrlock(&master->slave_lock);
+  ret = tpcmaster_build_ring(master);
+  pthread_rwlock_unlock(&master->slave_lock);
+  return ret;
+}
+
+/* Returns the index in the SIZE sorted POINTS of the first point at or after
+ * HASH, wrapping around to the lowest point. SIZE must not be 0. */
+static unsigned int tpcmaster_ring_find(tpcvnode_t *points, unsigned int size,
+    int64_t hash) {
+  unsigned int lo = 0, hi = size, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (points[mid].point < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return (lo == size) ? 0 : lo;
+}
+
+/* Returns true if SLAVE has a point on RING. */
+static bool tpcmaster_ring_has(tpcring_t *ring, tpcslave_t *slave) {
+  unsigned int i;
+  for (i = 0; i < ring->size; i++) {
+    if (ring->points[i].slave == slave)
+      return true;
+  }
+  return false;
+}
+
+/* Returns the ID of the slave listening at HOST:PORT, the hash of a string in
+ * the format PORT:HOST. */
+static int64_t tpcmaster_slave_id(char *host, char *port) {
+  char name[512];
+  snprintf(name, sizeof(name), "%s:%s", port, host);
+  return hash_64_bit(name);
+}
+
+/* Returns the slave of MASTER with ID, or NULL if there is none. Must be
+ * called with MASTER's slave_lock held. */
+static tpcslave_t *tpcmaster_find_slave(tpcmaster_t *master, int64_t id) {
+  tpcslave_t *slave = master->slaves_head;
+  unsigned int i;
+  for (i = 0; i < master->slave_count; i++, slave = slave->next) {
+    if (slave->id == id)
+      return slave;
+  }
+  return NULL;
+}
+
+/* Returns true if FD, an idle connection, is still open at the other end
+ * and has nothing waiting to be read on it. */
+static bool tpcmaster_conn_healthy(int fd) {
+  char byte;
+  ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Returns a connection to SLAVE on which reads time out after TIMEOUT
+ * seconds. Unless REUSED is NULL, a healthy connection is taken from
+ * SLAVE's pool if there is one, and *REUSED is set to whether it was.
+ * Otherwise a new connection is opened to SLAVE's address, which is resolved
+ * the first time it is needed. Returns the connection's fd, which should be
+ * handed back with tpcmaster_slave_release, else -1 if SLAVE cannot be
+ * reached. */
+int tpcmaster_slave_connect(tpcslave_t *slave, int timeout, bool *reused) {
+  struct sockaddr_in addr;
+  struct timeval t;
+  bool resolved;
+  int fd = -1;
+  pthread_mutex_lock(&slave->pool_lock);
+  while (reused != NULL && fd == -1 && slave->pool_size > 0) {
+    fd = slave->pool[--slave->pool_size];
+    if (!tpcmaster_conn_healthy(fd)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+  if (fd == -1 && !slave->resolved)
+    slave->resolved = resolve_address(slave->host, slave->port,
+        &slave->addr) == 0;
+  addr = slave->addr;
+  resolved = slave->resolved;
+  pthread_mutex_unlock(&slave->pool_lock);
+  if (reused != NULL)
+    *reused = fd != -1;
+  if (fd != -1) {
+    t.tv_sec = timeout;
+    t.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *) &t, sizeof(t));
+    return fd;
+  }
+  if (!resolved)
+    return -1;
+  return connect_to_address(&addr, timeout);
+}
+
+/* Hands FD, a connection to SLAVE, back to SLAVE's pool if it is REUSABLE,
+ * that is if its last exchange was completed, and the pool has room.
+ * Otherwise closes it. */
+void tpcmaster_slave_release(tpcslave_t *slave, int fd, bool reusable) {
+  pthread_mutex_lock(&slave->pool_lock);
+  if (reusable && slave->pool_size < TPCMASTER_POOL_SIZE) {
+    slave->pool[slave->pool_size++] = fd;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&slave->pool_lock);
+  if (fd != -1)
+    close(fd);
+}
+
+/* Sends REQMSG to SLAVE and returns its response, or NULL if there was none
+ * within TIMEOUT seconds. A pooled connection is used if possible; if the
+ * request fails on one, it is tried again on another, since the slave may
+ * have closed it since its last use. Sets *REACHED to false if no
+ * connection to SLAVE could be opened, else true. */
+static kvmessage_t *tpcmaster_slave_request(tpcslave_t *slave,
+    kvmessage_t *reqmsg, int timeout, bool *reached) {
+  kvmessage_t *respmsg = NULL;
+  bool reused = true;
+  int fd;
+  *reached = true;
+  while (respmsg == NULL && reused) {
+    fd = tpcmaster_slave_connect(slave, timeout, &reused);
+    if (fd == -1) {
+      *reached = false;
+      return NULL;
+    }
+    if (kvmessage_send(reqmsg, fd) > 0)
+      respmsg = kvmessage_parse(fd);
+    tpcmaster_slave_release(slave, fd, respmsg != NULL);
+  }
+  return respmsg;
+}
+
+/* Takes a reference to SLAVE, which must be in its master's list of slaves
+ * or already referenced by the caller. */
+static void tpcmaster_slave_hold(tpcslave_t *slave) {
+  __atomic_add_fetch(&slave->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference to SLAVE, freeing it and closing its pooled connections
+ * if it was the last one. */
+static void tpcmaster_slave_put(tpcslave_t *slave) {
+  if (__atomic_sub_fetch(&slave->refs, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
+  while (slave->pool_size > 0)
+    close(slave->pool[--slave->pool_size]);
+  pthread_mutex_destroy(&slave->pool_lock);
+  free(slave->host);
+  free(slave);
+}
+
+/* Removes SLAVE from MASTER's list of slaves and drops the list's reference
+ * to it, so it is freed once no reader is using it. Must be called with
+ * MASTER's slave_lock held for writing. */
+static void tpcmaster_remove_slave(tpcmaster_t *master, tpcslave_t *slave) {
+  if (slave->next == slave) {
+    master->slaves_head = NULL;
+  } else {
+    if (slave->prev)
+      slave->prev->next = slave->next;
+    if (slave->next)
+      slave->next->prev = slave->prev;
+    if (master->slaves_head == slave)
+      master->slaves_head = slave->next;
+  }
+  master->slave_count--;
+  tpcmaster_slave_put(slave);
+}
+
+/* Brings MASTER's ring up to date after a slave joined or left. Until the
+ * first write no slave holds any data, so the ring is simply rebuilt;
+ * afterwards it is marked stale, to be rebuilt by tpcmaster_rebalance once
+ * the data has been moved. Must be called with MASTER's slave_lock held for
+ * writing. */
+static void tpcmaster_slaves_changed(tpcmaster_t *master) {
+  if (__atomic_load_n(&master->written, __ATOMIC_SEQ_CST))
+    master->ring_stale = true;
+  else
+    tpcmaster_build_ring(master);
+}
+
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs. Assigns an ID to the slave by hashing a string in the
  * format PORT:HOSTNAME, then tries to add its info to the MASTER's list of
- * slaves. If the slave is already in the list, do nothing (success).
- * There can never be more slaves than the MASTER's slave_capacity. RESPMSG
- * will have MSG_SUCCESS if registration succeeds, or an error otherwise.
+ * slaves. If the slave is already in the list, do nothing (success), other
+ * than keeping it if it had deregistered. There can never be more slaves
+ * than the MASTER's slave_capacity. RESPMSG will have MSG_SUCCESS if
+ * registration succeeds, or an error otherwise.
  *
  * Checkpoint 2 only. */
 void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
-  if (master->slave_count >= master->slave_capacity) {
-    respmsg->message = ERRMSG_GENERIC_ERROR;
-    return;
-  }
-  
-  //add stats
-  tpcslave_t * new = malloc(sizeof(tpcslave_t));
-  new->host = calloc(1, strlen(reqmsg->key) + 1);
-  memcpy(new->host, reqmsg->key, strlen(reqmsg->key));
-  new->port = (unsigned int) atoi(reqmsg->value);
-  char temp[512];
-  strcpy(temp, reqmsg->value);
-  strcat(temp, ":");
-  strcat(temp, new->host);
-  new->id = hash_64_bit(temp);
-  
-  //put in list
+  int64_t id = tpcmaster_slave_id(reqmsg->key, reqmsg->value);
+  tpcslave_t *new, *curr;
   pthread_rwlock_wrlock(&master->slave_lock);
-  if (!master->slaves_head){
-    master->slaves_head = new;
-    master->slave_count++;
+  if ((curr = tpcmaster_find_slave(master, id)) != NULL) {
+    if (curr->leaving) {
+      curr->leaving = false;
+      master->ring_stale = true;
+    }
     respmsg->message = MSG_SUCCESS;
     pthread_rwlock_unlock(&master->slave_lock);
     return;
   }
-  tpcslave_t * curr = master->slaves_head;
-  while (curr->next){
-    if (curr->next->id >= new->id) break;
-    curr = curr->next;
-  }
-  if (!curr->next){
-    if (curr->id == new->id){
-      respmsg->message = MSG_SUCCESS;
-      pthread_rwlock_unlock(&master->slave_lock);
-      return;
-    } else {
-      new->prev = curr;
-      curr->next = new;
-      master->slave_count++;
-      respmsg->message = MSG_SUCCESS;
-      pthread_rwlock_unlock(&master->slave_lock);
-      return;
-    }
+  if (master->slave_count >= master->slave_capacity) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    pthread_rwlock_unlock(&master->slave_lock);
+    return;
   }
-  if (curr->next->id == new->id){
-    respmsg->message = MSG_SUCCESS;
+  new = calloc(1, sizeof(tpcslave_t));
+  if (new == NULL || (new->host = malloc(strlen(reqmsg->key) + 1)) == NULL) {
+    free(new);
+    respmsg->message = ERRMSG_GENERIC_ERROR;
     pthread_rwlock_unlock(&master->slave_lock);
     return;
+  }
+  strcpy(new->host, reqmsg->key);
+  new->port = (unsigned int) atoi(reqmsg->value);
+  new->id = id;
+  new->refs = 1;
+  pthread_mutex_init(&new->pool_lock, NULL);
+
+  //put in list, sorted by id
+  if (!master->slaves_head || new->id < master->slaves_head->id) {
+    new->next = master->slaves_head;
+    if (new->next)
+      new->next->prev = new;
+    master->slaves_head = new;
   } else {
+    curr = master->slaves_head;
+    while (curr->next && curr->next->id < new->id)
+      curr = curr->next;
     new->prev = curr;
     new->next = curr->next;
+    if (curr->next)
+      curr->next->prev = new;
     curr->next = new;
-    new->next->prev = new;
-    master->slave_count++;
+  }
+  master->slave_count++;
+  tpcmaster_slaves_changed(master);
+  respmsg->message = MSG_SUCCESS;
+  pthread_rwlock_unlock(&master->slave_lock);
+}
+
+/* Handles an incoming DEREGISTER request REQMSG from the slave at KEY:VALUE,
+ * and populates the appropriate fields of RESPMSG as a response. The slave
+ * is taken off the ring, at once if nothing has been written yet, or else by
+ * the next tpcmaster_rebalance, which moves its data to the slaves taking
+ * over its segments. RESPMSG will have MSG_SUCCESS if the slave was
+ * registered, or an error otherwise. */
+void tpcmaster_deregister(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  int64_t id = tpcmaster_slave_id(reqmsg->key, reqmsg->value);
+  tpcslave_t *slave;
+  pthread_rwlock_wrlock(&master->slave_lock);
+  slave = tpcmaster_find_slave(master, id);
+  if (slave == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+  } else if (__atomic_load_n(&master->written, __ATOMIC_SEQ_CST)) {
+    slave->leaving = true;
+    master->ring_stale = true;
+    respmsg->message = MSG_SUCCESS;
+  } else {
+    tpcmaster_remove_slave(master, slave);
+    tpcmaster_build_ring(master);
     respmsg->message = MSG_SUCCESS;
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+}
+
+/* Adds the segment from LO (exclusive) to HI (inclusive) to the move from
+ * SOURCE to TARGET among the NUM_MOVES MOVES, adding that move if needed.
+ * Returns 0 if successful, else a negative error code. */
+static int tpcmaster_add_move(tpcmove_t **moves, unsigned int *num_moves,
+    tpcslave_t *source, tpcslave_t *target, int64_t lo, int64_t hi) {
+  tpcmove_t *move = NULL;
+  int64_t *ranges;
+  unsigned int i;
+  for (i = 0; i < *num_moves && move == NULL; i++) {
+    if ((*moves)[i].source == source && (*moves)[i].target == target)
+      move = &(*moves)[i];
+  }
+  if (move == NULL) {
+    move = realloc(*moves, (*num_moves + 1) * sizeof(tpcmove_t));
+    if (move == NULL)
+      return -1;
+    *moves = move;
+    move = &move[(*num_moves)++];
+    memset(move, 0, sizeof(tpcmove_t));
+    move->source = source;
+    move->target = target;
+  }
+  /* Segments are visited in order, so neighbours merge into one range. */
+  if (move->num_ranges > 0 && move->ranges[2 * move->num_ranges - 1] == lo) {
+    move->ranges[2 * move->num_ranges - 1] = hi;
+    return 0;
+  }
+  if (move->num_ranges == move->cap) {
+    ranges = realloc(move->ranges, 4 * (move->cap + 8) * sizeof(int64_t));
+    if (ranges == NULL)
+      return -1;
+    move->ranges = ranges;
+    move->cap = 2 * (move->cap + 8);
+  }
+  move->ranges[2 * move->num_ranges] = lo;
+  move->ranges[2 * move->num_ranges + 1] = hi;
+  move->num_ranges++;
+  return 0;
+}
+
+/* Frees the NUM_MOVES MOVES. */
+static void tpcmaster_free_moves(tpcmove_t *moves, unsigned int num_moves) {
+  unsigned int i;
+  for (i = 0; i < num_moves; i++)
+    free(moves[i].ranges);
+  free(moves);
+}
+
+/* Works out which segments of the ring change hands when MASTER's ring OLD
+ * is replaced by NEW, storing the moves in MOVES and their number in
+ * NUM_MOVES. Every point of either ring bounds a segment, so each segment
+ * has the same replicas throughout in both rings. A slave which gains a
+ * segment gets its keys from the first old replica which is not leaving, and
+ * an old replica which loses a segment, leaving or not, drops its keys, so
+ * that none are left to resurface should it own them again. Must be called with
+ * MASTER's slave_lock held. Returns 0 if successful, else a negative error
+ * code. */
+static int tpcmaster_plan_moves(tpcmaster_t *master, tpcring_t *old,
+    tpcring_t *new, tpcmove_t **moves, unsigned int *num_moves) {
+  unsigned int r = master->redundancy, m = 0, i, j, k;
+  tpcslave_t **oldrep, **newrep, *source;
+  int64_t *bounds, lo, hi;
+  int ret = 0;
+  *moves = NULL;
+  *num_moves = 0;
+  if (old->size == 0 || new->size == 0)
+    return 0;
+  bounds = malloc((old->size + new->size) * sizeof(int64_t));
+  if (bounds == NULL)
+    return -1;
+  for (i = 0; i < old->size; i++)
+    bounds[i] = old->points[i].point;
+  for (i = 0; i < new->size; i++)
+    bounds[old->size + i] = new->points[i].point;
+  qsort(bounds, old->size + new->size, sizeof(int64_t), tpcmaster_hash_cmp);
+  for (i = 0; i < old->size + new->size; i++) {
+    if (m == 0 || bounds[m - 1] != bounds[i])
+      bounds[m++] = bounds[i];
+  }
+  for (k = 0; k < m && ret == 0; k++) {
+    lo = bounds[(k + m - 1) % m];
+    hi = bounds[k];
+    oldrep = &old->replicas[tpcmaster_ring_find(old->points, old->size, hi) * r];
+    newrep = &new->replicas[tpcmaster_ring_find(new->points, new->size, hi) * r];
+    source = oldrep[0];
+    for (i = 0; i < r && oldrep[i] != NULL; i++) {
+      if (!oldrep[i]->leaving) {
+        source = oldrep[i];
+        break;
+      }
+    }
+    for (i = 0; i < r && newrep[i] != NULL && ret == 0; i++) {
+      for (j = 0; j < r && oldrep[j] != NULL && oldrep[j] != newrep[i]; j++);
+      if (j == r || oldrep[j] == NULL)
+        ret = tpcmaster_add_move(moves, num_moves, source, newrep[i], lo, hi);
+    }
+    for (j = 0; j < r && oldrep[j] != NULL && ret == 0; j++) {
+      for (i = 0; i < r && newrep[i] != NULL && newrep[i] != oldrep[j]; i++);
+      if (i == r || newrep[i] == NULL)
+        ret = tpcmaster_add_move(moves, num_moves, oldrep[j], NULL, lo, hi);
+    }
+  }
+  free(bounds);
+  if (ret < 0) {
+    tpcmaster_free_moves(*moves, *num_moves);
+    *moves = NULL;
+    *num_moves = 0;
+  }
+  return ret;
+}
+
+/* Sends MOVE to its source as a MIGRATE naming the ring MASTER uses, trying
+ * up to ATTEMPTS times, TPCMASTER_MIGRATE_DELAY microseconds apart. Moving
+ * keys again is harmless, so a failed attempt is simply repeated. Returns 0
+ * once the source reports success, else -1. */
+static int tpcmaster_send_move(tpcmaster_t *master, tpcmove_t *move,
+    int attempts) {
+  kvmessage_t reqmsg, *respmsg;
+  char port[16], *ranges, *pos;
+  bool reached;
+  int ret = -1;
+  unsigned int i;
+  ranges = malloc(16 + move->num_ranges * 2 * 24);
+  if (ranges == NULL)
+    return -1;
+  pos = ranges + sprintf(ranges, "%u", master->vnodes);
+  for (i = 0; i < 2 * move->num_ranges; i++)
+    pos += sprintf(pos, " %lld", (long long) move->ranges[i]);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = MIGRATE;
+  reqmsg.format = KVMESSAGE_BINARY;
+  reqmsg.message = ranges;
+  if (move->target != NULL) {
+    sprintf(port, "%u", move->target->port);
+    reqmsg.key = move->target->host;
+    reqmsg.value = port;
+  }
+  for (; attempts > 0 && ret < 0; attempts--) {
+    respmsg = tpcmaster_slave_request(move->source, &reqmsg,
+        TPCMASTER_MIGRATE_TIMEOUT, &reached);
+    if (respmsg != NULL) {
+      if (respmsg->message && strcmp(respmsg->message, MSG_SUCCESS) == 0)
+        ret = 0;
+      kvmessage_free(respmsg);
+    }
+    if (ret < 0 && attempts > 1)
+      usleep(TPCMASTER_MIGRATE_DELAY);
+  }
+  free(ranges);
+  return ret;
+}
+
+/* Rebuilds MASTER's ring if slaves have joined or left since it was built,
+ * first moving every segment which changes hands to its new owners. Holds
+ * every lock in the key lock table throughout, so that no PUT or DEL runs
+ * while data is moving; GETs are served from the old ring until the new one
+ * is installed. Old replicas, departing ones included, are then asked to
+ * drop the segments they lost, and departed slaves are forgotten; a failed
+ * drop only leaves unreachable keys behind. Returns 0 if successful, else a
+ * negative error code, in which case the old ring is kept and the rebalance
+ * is retried on the next call. */
+int tpcmaster_rebalance(tpcmaster_t *master) {
+  tpcring_t old, new;
+  tpcmove_t *moves = NULL;
+  tpcslave_t *slave, *next;
+  unsigned int num_moves = 0, i, n;
+  bool stale;
+  int ret;
+  pthread_rwlock_rdlock(&master->slave_lock);
+  stale = master->ring_stale;
+  pthread_rwlock_unlock(&master->slave_lock);
+  if (!stale)
+    return 0;
+  for (i = 0; i < TPCMASTER_KEY_LOCKS; i++)
+    pthread_mutex_lock(&master->key_locks[i]);
+
+  pthread_rwlock_wrlock(&master->slave_lock);
+  if (!master->ring_stale) {
+    ret = 0;
     pthread_rwlock_unlock(&master->slave_lock);
-    return;
+    goto done;
+  }
+  ret = tpcmaster_compute_ring(master, &new);
+  if (ret == 0) {
+    tpcmaster_current_ring(master, &old);
+    ret = tpcmaster_plan_moves(master, &old, &new, &moves, &num_moves);
+    if (ret < 0) {
+      free(new.points);
+      free(new.replicas);
+    } else {
+      master->ring_stale = false;
+    }
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  if (ret < 0)
+    goto done;
+
+  for (i = 0; i < num_moves && ret == 0; i++) {
+    if (moves[i].target != NULL)
+      ret = tpcmaster_send_move(master, &moves[i], TPCMASTER_MIGRATE_ATTEMPTS);
   }
+
+  pthread_rwlock_wrlock(&master->slave_lock);
+  if (ret < 0) {
+    master->ring_stale = true;
+    free(new.points);
+    free(new.replicas);
+  } else {
+    tpcmaster_install_ring(master, &new);
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  if (ret < 0)
+    goto done;
+
+  for (i = 0; i < num_moves; i++) {
+    if (moves[i].target == NULL)
+      tpcmaster_send_move(master, &moves[i], 1);
+  }
+  pthread_rwlock_wrlock(&master->slave_lock);
+  tpcmaster_current_ring(master, &new);
+  slave = master->slaves_head;
+  for (n = master->slave_count; n > 0; n--, slave = next) {
+    next = slave->next;
+    if (slave->leaving && !tpcmaster_ring_has(&new, slave))
+      tpcmaster_remove_slave(master, slave);
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+
+done:
+  tpcmaster_free_moves(moves, num_moves);
+  for (i = TPCMASTER_KEY_LOCKS; i > 0; i--)
+    pthread_mutex_unlock(&master->key_locks[i - 1]);
+  return ret;
 }
 
 /* Hashes KEY and finds the first slave that should contain it.
- * It should return the first slave whose ID is greater than the
- * KEY's hash, and the one with lowest ID if none matches the
- * requirement.
+ * It should return the owner of the first point on the ring at or after
+ * the KEY's ring hash, and of the lowest point if none matches the
+ * requirement. With one point per slave, that is the first slave whose ID is
+ * greater than the KEY's hash, and the one with lowest ID if none matches.
+ * Returns NULL if no slave has registered.
  *
  * Checkpoint 2 only. */
 tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key) {
-  int64_t hash = hash_64_bit(key);
-  tpcslave_t * curr = master->slaves_head;
+  tpcslave_t *slave = NULL;
   pthread_rwlock_rdlock(&master->slave_lock);
-  do{
-    if (hash <= curr->id) {
-      pthread_rwlock_unlock(&master->slave_lock);
-      return curr;
+  if (master->ring_size > 0)
+    slave = master->ring[tpcmaster_ring_find(master->ring, master->ring_size,
+        tpcmaster_ring_hash(master->vnodes, key))].slave;
+  pthread_rwlock_unlock(&master->slave_lock);
+  return slave;
+}
+
+/* As tpcmaster_get_replicas, taking a reference to each slave stored if
+ * HOLD is true. */
+static unsigned int tpcmaster_find_replicas(tpcmaster_t *master, char *key,
+    tpcslave_t **replicas, bool hold) {
+  unsigned int i, n = 0, idx;
+  pthread_rwlock_rdlock(&master->slave_lock);
+  if (master->ring_size > 0) {
+    idx = tpcmaster_ring_find(master->ring, master->ring_size,
+        tpcmaster_ring_hash(master->vnodes, key));
+    for (i = 0; i < master->redundancy; i++) {
+      replicas[n] = master->ring_replicas[idx * master->redundancy + i];
+      if (replicas[n] != NULL) {
+        if (hold)
+          tpcmaster_slave_hold(replicas[n]);
+        n++;
+      }
     }
-    curr = curr->next;
-  } while (curr->next);
+  }
   pthread_rwlock_unlock(&master->slave_lock);
-  return master->slaves_head;
+  return n;
+}
+
+/* Drops the references to the N slaves of REPLICAS. */
+static void tpcmaster_put_replicas(tpcslave_t **replicas, unsigned int n) {
+  unsigned int i;
+  for (i = 0; i < n; i++)
+    tpcmaster_slave_put(replicas[i]);
+}
+
+/* Stores in REPLICAS, which must have room for MASTER's redundancy, the
+ * distinct slaves which should contain KEY, starting with its primary and
+ * continuing clockwise around the ring. Returns the number of slaves
+ * stored, which is less than the redundancy only if there are fewer slaves.
+ * No reference is taken, so the slaves may only be used while holding KEY's
+ * lock, which keeps them from being removed.
+ *
+ * Checkpoint 2 only. */
+unsigned int tpcmaster_get_replicas(tpcmaster_t *master, char *key,
+    tpcslave_t **replicas) {
+  return tpcmaster_find_replicas(master, key, replicas, false);
 }
 
 /* Returns the slave whose ID comes after PREDECESSOR's, sorted
@@ -153,53 +804,633 @@ tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
   return predecessor->next;
 }
 
+/* Returns the index in a master's key lock table of the lock guarding the
+ * key whose kvhash_key is HASH. */
+static unsigned int tpcmaster_key_lock_index(uint64_t hash) {
+  return hash % TPCMASTER_KEY_LOCKS;
+}
+
+/* Returns the lock in MASTER's key lock table which guards KEY. */
+static pthread_mutex_t *tpcmaster_key_lock(tpcmaster_t *master, char *key) {
+  return &master->key_locks[tpcmaster_key_lock_index(kvhash_key(key))];
+}
+
+/* Returns true if MASTER's ring holds enough slaves to store REDUNDANCY
+ * copies of every key, so that client requests can be served. */
+static bool tpcmaster_ready(tpcmaster_t *master) {
+  bool ready;
+  pthread_rwlock_rdlock(&master->slave_lock);
+  ready = master->ring_slaves > 0 && master->ring_slaves >= master->redundancy;
+  pthread_rwlock_unlock(&master->slave_lock);
+  return ready;
+}
+
+/* Returns the current time in microseconds, for measuring latencies. */
+static uint64_t tpcmaster_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Reorders the NUM_REPLICAS REPLICAS of a key, primary first, so that the
+ * replica a GET should go to first under MASTER's read_policy leads. The
+ * others follow in ring order from a rotating starting point, so that ties,
+ * and fallbacks, are spread across the replicas as well. */
+void tpcmaster_order_replicas(tpcmaster_t *master, tpcslave_t **replicas,
+    unsigned int num_replicas) {
+  tpcslave_t *rotated[num_replicas];
+  unsigned int start, best = 0, i, j;
+  uint64_t value, best_value = 0;
+  if (num_replicas < 2 || master->read_policy == TPCMASTER_READ_PRIMARY)
+    return;
+  start = __atomic_fetch_add(&master->next_read, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < num_replicas; i++)
+    rotated[i] = replicas[(start + i) % num_replicas];
+  for (i = 0; i < num_replicas; i++) {
+    if (master->read_policy == TPCMASTER_READ_LEAST_OUTSTANDING)
+      value = __atomic_load_n(&rotated[i]->outstanding, __ATOMIC_RELAXED);
+    else if (master->read_policy == TPCMASTER_READ_EWMA)
+      value = __atomic_load_n(&rotated[i]->latency, __ATOMIC_RELAXED);
+    else
+      break;
+    if (i == 0 || value < best_value) {
+      best = i;
+      best_value = value;
+    }
+  }
+  replicas[0] = rotated[best];
+  for (i = 0, j = 1; i < num_replicas; i++) {
+    if (i != best)
+      replicas[j++] = rotated[i];
+  }
+}
+
+/* Folds LATENCY, in microseconds, into SLAVE's moving average. */
+static void tpcmaster_slave_latency(tpcslave_t *slave, uint64_t latency) {
+  uint64_t old = __atomic_load_n(&slave->latency, __ATOMIC_RELAXED);
+  if (old != 0)
+    latency = old - (old >> TPCMASTER_EWMA_SHIFT)
+        + (latency >> TPCMASTER_EWMA_SHIFT);
+  __atomic_store_n(&slave->latency, latency ? latency : 1, __ATOMIC_RELAXED);
+}
+
+/* Records that SLAVE answered a GET from MASTER in LATENCY microseconds. */
+void tpcmaster_record_latency(tpcmaster_t *master, tpcslave_t *slave,
+    uint64_t latency) {
+  tpcmaster_slave_latency(slave, latency);
+  pthread_mutex_lock(&master->latency_lock);
+  master->latencies[master->next_latency] = latency;
+  master->next_latency = (master->next_latency + 1) % TPCMASTER_LATENCY_SAMPLES;
+  if (master->num_latencies < TPCMASTER_LATENCY_SAMPLES)
+    master->num_latencies++;
+  pthread_mutex_unlock(&master->latency_lock);
+}
+
+/* Orders two latencies. */
+static int tpcmaster_latency_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
+
+/* Returns the number of microseconds a hedged GET waits for its first
+ * replica before also asking the next: the 95th percentile of MASTER's
+ * recent GET latencies, or TPCMASTER_HEDGE_DEFAULT_DELAY if too few have
+ * been recorded. */
+uint64_t tpcmaster_hedge_delay(tpcmaster_t *master) {
+  uint64_t latencies[TPCMASTER_LATENCY_SAMPLES];
+  unsigned int n;
+  pthread_mutex_lock(&master->latency_lock);
+  n = master->num_latencies;
+  memcpy(latencies, master->latencies, n * sizeof(uint64_t));
+  pthread_mutex_unlock(&master->latency_lock);
+  if (n < TPCMASTER_LATENCY_MIN_SAMPLES)
+    return TPCMASTER_HEDGE_DEFAULT_DELAY;
+  qsort(latencies, n, sizeof(uint64_t), tpcmaster_latency_cmp);
+  return latencies[n * 95 / 100];
+}
+
+/* The GETs a single request has in flight. At most two replicas are asked
+ * at once: the one asked first and, if hedging, one more. */
+typedef struct {
+  struct pollfd fds[2];         /* The connection to each replica asked. */
+  tpcslave_t *slaves[2];        /* The replicas asked. */
+  uint64_t started[2];          /* When each replica was asked. */
+  bool reused[2];               /* True for each GET sent on a pooled connection. */
+  int count;                    /* The number of GETs in flight. */
+} tpcreads_t;
+
+/* Sends REQMSG to SLAVE, adding it to READS. A pooled connection is used
+ * if POOLED is true and one can be sent on. If SLAVE cannot be reached it
+ * is charged a full timeout in its moving average, so that it is avoided
+ * by later GETs. Returns 0 if successful, else -1. */
+static int tpcmaster_read_start(tpcreads_t *reads, tpcslave_t *slave,
+    kvmessage_t *reqmsg, bool pooled) {
+  bool reused = false;
+  int fd;
+  do {
+    fd = tpcmaster_slave_connect(slave, TPCMASTER_TIMEOUT,
+        pooled ? &reused : NULL);
+    if (fd != -1 && kvmessage_send(reqmsg, fd) <= 0) {
+      tpcmaster_slave_release(slave, fd, false);
+      fd = -1;
+    }
+  } while (fd == -1 && reused);
+  if (fd == -1) {
+    tpcmaster_slave_latency(slave, (uint64_t) TPCMASTER_TIMEOUT * 1000000);
+    return -1;
+  }
+  __atomic_add_fetch(&slave->outstanding, 1, __ATOMIC_RELAXED);
+  reads->fds[reads->count].fd = fd;
+  reads->fds[reads->count].events = POLLIN;
+  reads->slaves[reads->count] = slave;
+  reads->started[reads->count] = tpcmaster_now();
+  reads->reused[reads->count] = reused;
+  reads->count++;
+  return 0;
+}
+
+/* Removes the I-th GET in flight from READS, handing its connection back to
+ * the pool if it was answered (ANSWERED is true), or else closing it. */
+static void tpcmaster_read_finish(tpcreads_t *reads, int i, bool answered) {
+  tpcmaster_slave_release(reads->slaves[i], reads->fds[i].fd, answered);
+  __atomic_sub_fetch(&reads->slaves[i]->outstanding, 1, __ATOMIC_RELAXED);
+  reads->count--;
+  reads->fds[i] = reads->fds[reads->count];
+  reads->slaves[i] = reads->slaves[reads->count];
+  reads->started[i] = reads->started[reads->count];
+  reads->reused[i] = reads->reused[reads->count];
+}
+
+/* Asks the replicas of the key of GET request REQMSG for its value, one after
+ * the other, in the order given by tpcmaster_order_replicas, until one
+ * returns it. Each is given TPCMASTER_TIMEOUT seconds to answer, unless
+ * hedging, in which case the next replica is also asked once the first has
+ * taken longer than tpcmaster_hedge_delay. Returns the GETRESP of the replica
+ * which answered, which should be freed, else NULL, setting *ABSENT to whether
+ * a replica reported the key absent. */
+static kvmessage_t *tpcmaster_fetch(tpcmaster_t *master, kvmessage_t *reqmsg,
+    bool *absent) {
+  kvmessage_t temp_reqmsg, *temp_respmsg = NULL;
+  memcpy(&temp_reqmsg, reqmsg, sizeof(kvmessage_t));
+  temp_reqmsg.format = KVMESSAGE_BINARY;
+  tpcslave_t *replicas[master->redundancy];
+  tpcreads_t reads;
+  tpcslave_t *slave;
+  uint64_t hedge_delay = 0;
+  int i, n, next = 0, ready, timeout;
+  bool hedge, retry;
+  *absent = false;
+  n = tpcmaster_find_replicas(master, reqmsg->key, replicas, true);
+  tpcmaster_order_replicas(master, replicas, n);
+  if (master->hedge_reads)
+    hedge_delay = tpcmaster_hedge_delay(master);
+  reads.count = 0;
+  while (temp_respmsg == NULL && (reads.count > 0 || next < n)) {
+    if (reads.count == 0) {
+      tpcmaster_read_start(&reads, replicas[next++], &temp_reqmsg, true);
+      continue;
+    }
+    hedge = master->hedge_reads && next < n && reads.count < 2;
+    timeout = hedge ? (int) ((hedge_delay + 999) / 1000)
+        : TPCMASTER_TIMEOUT * 1000;
+    ready = poll(reads.fds, reads.count, timeout);
+    if (ready == 0) {
+      /* Without hedging, a replica which times out is given up on. */
+      if (!hedge)
+        tpcmaster_read_finish(&reads, 0, false);
+      if (next < n)
+        tpcmaster_read_start(&reads, replicas[next++], &temp_reqmsg, true);
+      continue;
+    }
+    for (i = reads.count - 1; i >= 0 && temp_respmsg == NULL; i--) {
+      if (reads.fds[i].revents == 0)
+        continue;
+      temp_respmsg = kvmessage_parse(reads.fds[i].fd);
+      slave = reads.slaves[i];
+      retry = temp_respmsg == NULL && reads.reused[i];
+      if (temp_respmsg != NULL)
+        tpcmaster_record_latency(master, slave,
+            tpcmaster_now() - reads.started[i]);
+      tpcmaster_read_finish(&reads, i, temp_respmsg != NULL);
+      if (temp_respmsg != NULL && temp_respmsg->type != GETRESP) {
+        if (temp_respmsg->message != NULL
+            && strcmp(temp_respmsg->message, ERRMSG_NO_KEY) == 0)
+          *absent = true;
+        kvmessage_free(temp_respmsg);
+        temp_respmsg = NULL;
+      }
+      /* The slave may have closed the pooled connection since its last use,
+       * so it is asked again on a new one. */
+      if (retry)
+        tpcmaster_read_start(&reads, slave, &temp_reqmsg, false);
+    }
+  }
+  while (reads.count > 0)
+    tpcmaster_read_finish(&reads, 0, false);
+  tpcmaster_put_replicas(replicas, n);
+  return temp_respmsg;
+}
+
+/* A GET being fetched from the slaves, which other GETs of the same key wait
+ * on instead of asking the slaves themselves. */
+typedef struct tpcflight {
+  char *key;                    /* The key being fetched, also the hash key. */
+  pthread_cond_t cond;          /* Signalled once the fetch is DONE. */
+  bool done;                    /* True once the fetch has finished. */
+  bool found;                   /* True if a replica returned the key's value. */
+  char *value;                  /* A copy of that value, or NULL if it could not be made. */
+  unsigned int waiters;         /* The number of GETs waiting on the fetch. */
+  UT_hash_handle hh;            /* Makes this structure hashable. */
+} tpcflight_t;
+
+/* Allocates a flight fetching KEY. Returns the flight, or NULL if out of
+ * memory. */
+static tpcflight_t *tpcmaster_flight_new(char *key) {
+  tpcflight_t *flight = calloc(1, sizeof(tpcflight_t));
+  if (flight == NULL)
+    return NULL;
+  if ((flight->key = malloc(strlen(key) + 1)) == NULL) {
+    free(flight);
+    return NULL;
+  }
+  strcpy(flight->key, key);
+  pthread_cond_init(&flight->cond, NULL);
+  return flight;
+}
+
+/* Frees FLIGHT, which must no longer be in its master's table. */
+static void tpcmaster_flight_free(tpcflight_t *flight) {
+  pthread_cond_destroy(&flight->cond);
+  free(flight->key);
+  free(flight->value);
+  free(flight);
+}
+
+/* Populates RESPMSG with the answer to the GET fetched by FLIGHT, which must
+ * be DONE. */
+static void tpcmaster_flight_answer(tpcflight_t *flight, kvmessage_t *respmsg) {
+  if (!flight->found) {
+    respmsg->type = RESP;
+    respmsg->message = ERRMSG_NO_KEY;
+    return;
+  }
+  respmsg->key = malloc(strlen(flight->key) + 1);
+  if (flight->value != NULL)
+    respmsg->value = malloc(strlen(flight->value) + 1);
+  if (respmsg->key == NULL || respmsg->value == NULL) {
+    free(respmsg->key);
+    free(respmsg->value);
+    respmsg->key = respmsg->value = NULL;
+    respmsg->type = RESP;
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  strcpy(respmsg->key, flight->key);
+  strcpy(respmsg->value, flight->value);
+  respmsg->type = GETRESP;
+}
+
+/* Forgets that KEY was absent, once a PUT of it has committed on MASTER's
+ * slaves, and stops GETs of it already sent from recording it as absent. */
+static void tpcmaster_forget_absent(tpcmaster_t *master, char *key) {
+  uint64_t hash = kvhash_key(key);
+  pthread_mutex_lock(&master->flight_lock);
+  master->puts[tpcmaster_key_lock_index(hash)]++;
+  kvcache_del_hashed(&master->absent, key, hash);
+  pthread_mutex_unlock(&master->flight_lock);
+}
+
 /* Handles an incoming GET request REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
  * kvmessage_t structs.
  *
+ * A GET which misses both the cache and the keys known to be absent is sent
+ * to the slaves by tpcmaster_fetch, unless another GET of the same key
+ * already has been, in which case it waits for that GET's answer instead.
+ * The key's kvhash_key is computed once, and serves both caches and the key
+ * lock table.
+ *
  * Checkpoint 2 only. */
 void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
+  kvmessage_t *temp_respmsg;
+  tpcflight_t *flight;
+  kvchunk_t *chunk;
+  unsigned int lock;
+  uint64_t hash = kvhash_key(reqmsg->key), puts;
+  bool absent;
   //check cache (maybe return)
-  int check = kvcache_get(&master->cache, reqmsg->key, &respmsg->value);
+  int check = kvcache_get_hashed(&master->cache, reqmsg->key, hash,
+      &respmsg->value);
   if (!check){
+    kvstats_count(&master->stats, KVSTATS_CACHE_HIT);
     respmsg->type = GETRESP;
     respmsg->key = malloc(256);
     strcpy(respmsg->key, reqmsg->key);
     return;
   }
-  //check if right number of slaves
-  if (master->slave_count != master->slave_capacity) {
+  //check if known to be absent
+  if (kvcache_get_chunk_hashed(&master->absent, reqmsg->key, hash,
+      &chunk) == 0) {
+    kvstats_count(&master->stats, KVSTATS_CACHE_HIT);
+    kvchunk_release(chunk);
+    respmsg->type = RESP;
+    respmsg->message = ERRMSG_NO_KEY;
+    return;
+  }
+  kvstats_count(&master->stats, KVSTATS_CACHE_MISS);
+  //check if enough slaves
+  if (!tpcmaster_ready(master)) {
     respmsg->message = ERRMSG_GENERIC_ERROR;
     return;
   }
-  //go to slaves
-  kvmessage_t temp_reqmsg, *temp_respmsg;
-  memcpy(&temp_reqmsg, reqmsg, sizeof(kvmessage_t));
-  int i;
-  int success = 0;
-  tpcslave_t * curr = tpcmaster_get_primary(master, reqmsg->key);
-  for (i = 0; i < master->redundancy; i++){
-    int fd = connect_to(curr->host, curr->port, 100);
-    if (fd != -1) {
-      kvmessage_send(&temp_reqmsg, fd);
-      temp_respmsg = kvmessage_parse(fd);
-      if (temp_respmsg && temp_respmsg->type == GETRESP){
-        success = 1;
-        break;
-      }
-    }
-    curr = tpcmaster_get_successor(master, curr);
+  //join a GET of the same key already sent to the slaves
+  lock = tpcmaster_key_lock_index(hash);
+  pthread_mutex_lock(&master->flight_lock);
+  HASH_FIND_STR(master->flights, reqmsg->key, flight);
+  if (flight != NULL) {
+    flight->waiters++;
+    while (!flight->done)
+      pthread_cond_wait(&flight->cond, &master->flight_lock);
+    tpcmaster_flight_answer(flight, respmsg);
+    if (--flight->waiters == 0)
+      tpcmaster_flight_free(flight);
+    pthread_mutex_unlock(&master->flight_lock);
+    return;
   }
-  if (success){
+  /* Without memory for a flight, the GET is simply not shared. */
+  flight = tpcmaster_flight_new(reqmsg->key);
+  if (flight != NULL)
+    HASH_ADD_KEYPTR(hh, master->flights, flight->key, strlen(flight->key),
+        flight);
+  puts = master->puts[lock];
+  pthread_mutex_unlock(&master->flight_lock);
+  //go to slaves
+  temp_respmsg = tpcmaster_fetch(master, reqmsg, &absent);
+  if (temp_respmsg != NULL){
     memcpy(respmsg, temp_respmsg, sizeof(kvmessage_t));
+    free(temp_respmsg);
     //update cache
-    kvcache_put(&master->cache, respmsg->key, respmsg->value);
+    kvcache_put_hashed(&master->cache, reqmsg->key, hash, respmsg->value);
   }
   else{
     respmsg->type = RESP;
     respmsg->message = ERRMSG_NO_KEY;
   }
+  //share the answer with the GETs waiting on it
+  pthread_mutex_lock(&master->flight_lock);
+  if (temp_respmsg == NULL && absent && puts == master->puts[lock])
+    kvcache_put_hashed(&master->absent, reqmsg->key, hash, "");
+  if (flight != NULL) {
+    HASH_DEL(master->flights, flight);
+    flight->done = true;
+    flight->found = temp_respmsg != NULL;
+    if (flight->found
+        && (flight->value = malloc(strlen(respmsg->value) + 1)) != NULL)
+      strcpy(flight->value, respmsg->value);
+    if (flight->waiters > 0)
+      pthread_cond_broadcast(&flight->cond);
+    else
+      tpcmaster_flight_free(flight);
+  }
+  pthread_mutex_unlock(&master->flight_lock);
+}
+
+/* The keys of a batch GET which share the same replicas, and so are asked
+ * for together in a single MGETREQ. */
+typedef struct {
+  tpcmaster_t *master;          /* The master serving the batch. */
+  tpcslave_t **replicas;        /* The replicas of every key in the group. */
+  unsigned int num_replicas;    /* The number of slaves in REPLICAS. */
+  unsigned int *indices;        /* The position of each key in BATCH. */
+  unsigned int num_keys;        /* The number of keys in the group. */
+  kvpair_t *batch;              /* The batch being answered. */
+  bool answered;                /* True once a replica has answered. */
+} tpcmget_t;
+
+/* Asks the replicas of the group of keys _GROUP, in the order given by
+ * tpcmaster_order_replicas, for their values until one answers, and stores
+ * the values it returns in the group's batch. */
+static void *tpcmaster_mget_thread(void *_group) {
+  tpcmget_t *group = (tpcmget_t *) _group;
+  kvmessage_t reqmsg, *respmsg;
+  unsigned int i, j;
+  bool reached;
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = MGETREQ;
+  reqmsg.format = KVMESSAGE_BINARY;
+  reqmsg.batch = calloc(group->num_keys, sizeof(kvpair_t));
+  if (reqmsg.batch == NULL)
+    return NULL;
+  reqmsg.batch_size = group->num_keys;
+  for (i = 0; i < group->num_keys; i++)
+    reqmsg.batch[i].key = group->batch[group->indices[i]].key;
+  tpcmaster_order_replicas(group->master, group->replicas,
+      group->num_replicas);
+  for (i = 0; i < group->num_replicas && !group->answered; i++) {
+    respmsg = tpcmaster_slave_request(group->replicas[i], &reqmsg,
+        TPCMASTER_TIMEOUT, &reached);
+    if (respmsg == NULL)
+      continue;
+    if (respmsg->type == MGETRESP && respmsg->batch_size == group->num_keys) {
+      group->answered = true;
+      for (j = 0; j < group->num_keys; j++) {
+        if (strcmp(respmsg->batch[j].key, reqmsg.batch[j].key) != 0) {
+          group->answered = false;
+          break;
+        }
+      }
+      /* The values are handed over to the batch being answered. */
+      for (j = 0; group->answered && j < group->num_keys; j++) {
+        group->batch[group->indices[j]].value = respmsg->batch[j].value;
+        respmsg->batch[j].value = NULL;
+      }
+    }
+    kvmessage_free(respmsg);
+  }
+  free(reqmsg.batch);
+  return NULL;
+}
+
+/* Handles an incoming MGETREQ REQMSG, and populates the appropriate fields
+ * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
+ * kvmessage_t structs.
+ *
+ * Keys found in the cache are answered from it. The rest are split into
+ * groups of keys with the same replicas, and each group is sent to its
+ * replicas as a single MGETREQ, all groups at once, one thread per group.
+ * The answer is an MGETRESP holding every key of REQMSG, in order, with
+ * its value, or no value if the key does not exist; its batch shares its
+ * keys with REQMSG, but its values and the batch itself should be freed.
+ * If a group cannot be answered by any of its replicas, the whole request
+ * fails. */
+void tpcmaster_handle_mget(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg) {
+  unsigned int n = reqmsg->batch_size, num_groups = 0, num_replicas, i, j;
+  tpcslave_t *replicas[master->redundancy];
+  tpcmget_t *groups = NULL, *group;
+  kvpair_t *batch;
+  bool answered = true;
+  if (reqmsg->batch == NULL || n == 0) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  batch = calloc(n, sizeof(kvpair_t));
+  if (batch == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  for (i = 0; i < n; i++) {
+    batch[i].key = reqmsg->batch[i].key;
+    if (kvcache_get(&master->cache, batch[i].key, &batch[i].value) == 0) {
+      kvstats_count(&master->stats, KVSTATS_CACHE_HIT);
+      continue;
+    }
+    kvstats_count(&master->stats, KVSTATS_CACHE_MISS);
+    batch[i].value = NULL;
+    if (groups == NULL) {
+      if (!tpcmaster_ready(master)
+          || (groups = calloc(n, sizeof(tpcmget_t))) == NULL) {
+        answered = false;
+        break;
+      }
+    }
+    num_replicas = tpcmaster_find_replicas(master, batch[i].key, replicas,
+        true);
+    for (j = 0, group = NULL; j < num_groups && group == NULL; j++) {
+      if (groups[j].num_replicas == num_replicas && memcmp(groups[j].replicas,
+          replicas, num_replicas * sizeof(tpcslave_t *)) == 0)
+        group = &groups[j];
+    }
+    if (group != NULL) {
+      /* The group already holds references to the same replicas. */
+      tpcmaster_put_replicas(replicas, num_replicas);
+    } else {
+      group = &groups[num_groups++];
+      group->master = master;
+      group->batch = batch;
+      group->replicas = malloc(num_replicas * sizeof(tpcslave_t *));
+      group->indices = malloc(n * sizeof(unsigned int));
+      if (group->replicas == NULL || group->indices == NULL) {
+        tpcmaster_put_replicas(replicas, num_replicas);
+        answered = false;
+        break;
+      }
+      group->num_replicas = num_replicas;
+      memcpy(group->replicas, replicas, num_replicas * sizeof(tpcslave_t *));
+    }
+    group->indices[group->num_keys++] = i;
+  }
+  if (answered && num_groups > 0) {
+    pthread_t threads[num_groups];
+    bool started[num_groups];
+    for (j = 0; j < num_groups; j++) {
+      started[j] = pthread_create(&threads[j], NULL, tpcmaster_mget_thread,
+          &groups[j]) == 0;
+      if (!started[j])
+        tpcmaster_mget_thread(&groups[j]);
+    }
+    for (j = 0; j < num_groups; j++) {
+      if (started[j])
+        pthread_join(threads[j], NULL);
+      if (!groups[j].answered)
+        answered = false;
+    }
+  }
+  for (j = 0; j < num_groups; j++) {
+    for (i = 0; answered && i < groups[j].num_keys; i++) {
+      if (batch[groups[j].indices[i]].value != NULL)
+        kvcache_put(&master->cache, batch[groups[j].indices[i]].key,
+            batch[groups[j].indices[i]].value);
+    }
+    tpcmaster_put_replicas(groups[j].replicas, groups[j].num_replicas);
+    free(groups[j].replicas);
+    free(groups[j].indices);
+  }
+  free(groups);
+  if (!answered) {
+    for (i = 0; i < n; i++)
+      free(batch[i].value);
+    free(batch);
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  respmsg->type = MGETRESP;
+  respmsg->batch = batch;
+  respmsg->batch_size = n;
+}
+
+/* One slave's part in a single phase of a TPC transaction. Each phase
+ * contacts all of a key's replicas at once, one thread per replica. */
+typedef struct {
+  tpcslave_t *slave;              /* The slave to contact. */
+  kvmessage_t *reqmsg;            /* The message to send it. */
+  bool retry;                     /* True to keep trying until the slave responds. */
+  callback_t callback;            /* Called with SLAVE whenever it cannot be reached. */
+  pthread_mutex_t *callback_lock; /* Serializes calls to CALLBACK across slaves. */
+  kvmessage_t *respmsg;           /* The slave's response, or NULL if there was none. */
+} tpcfanout_t;
+
+/* Sends the request held by _FANOUT to its slave and waits up to
+ * TPCMASTER_TIMEOUT seconds for the response. If the slave cannot be reached
+ * or does not respond and the fanout is set to retry, tries again after
+ * TPCMASTER_RETRY_DELAY microseconds, forever. */
+static void *tpcmaster_fanout_thread(void *_fanout) {
+  tpcfanout_t *fanout = (tpcfanout_t *) _fanout;
+  tpcslave_t *slave = fanout->slave;
+  bool reached;
+  while (true) {
+    fanout->respmsg = tpcmaster_slave_request(slave, fanout->reqmsg,
+        TPCMASTER_TIMEOUT, &reached);
+    if (fanout->respmsg)
+      return NULL;
+    if (!reached && fanout->callback) {
+      pthread_mutex_lock(fanout->callback_lock);
+      fanout->callback(slave);
+      pthread_mutex_unlock(fanout->callback_lock);
+    }
+    if (!fanout->retry)
+      return NULL;
+    usleep(TPCMASTER_RETRY_DELAY);
+  }
+}
+
+/* Sends REQMSG to each of the NUM_SLAVES slaves in SLAVES concurrently and
+ * waits until every one has responded or given up, storing each slave's
+ * response (or NULL) in the matching FANOUTS entry. If REQMSG is NULL, each
+ * slave is instead sent the request already set in its FANOUTS entry. See
+ * tpcfanout_t. */
+static void tpcmaster_fanout(tpcslave_t **slaves, tpcfanout_t *fanouts,
+    int num_slaves, kvmessage_t *reqmsg, bool retry, callback_t callback,
+    pthread_mutex_t *callback_lock) {
+  pthread_t threads[num_slaves];
+  bool started[num_slaves];
+  int i;
+  for (i = 0; i < num_slaves; i++) {
+    fanouts[i].slave = slaves[i];
+    if (reqmsg != NULL)
+      fanouts[i].reqmsg = reqmsg;
+    fanouts[i].retry = retry;
+    fanouts[i].callback = callback;
+    fanouts[i].callback_lock = callback_lock;
+    fanouts[i].respmsg = NULL;
+    started[i] = pthread_create(&threads[i], NULL, tpcmaster_fanout_thread,
+        &fanouts[i]) == 0;
+    /* Fall back to contacting the slave from this thread. */
+    if (!started[i])
+      tpcmaster_fanout_thread(&fanouts[i]);
+  }
+  for (i = 0; i < num_slaves; i++) {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+  }
+}
+
+/* Counts the vote RESPMSG of a slave, or its failure to vote if RESPMSG is
+ * NULL, in MASTER's stats. */
+static void tpcmaster_count_vote(tpcmaster_t *master, kvmessage_t *respmsg) {
+  kvstats_count(&master->stats, (respmsg && respmsg->type == VOTE_COMMIT)
+      ? KVSTATS_VOTE_COMMIT : KVSTATS_VOTE_ABORT);
 }
 
 /* Handles an incoming TPC request REQMSG, and populates the appropriate fields
@@ -207,6 +1438,15 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
  * kvmessage_t structs. Implements the TPC algorithm, polling all the slaves
  * for a vote first and sending a COMMIT or ABORT message in the second phase.
  * Must wait for an ACK from every slave after sending the second phase messages. 
+ *
+ * Both phases contact every replica of the key at once. The first phase
+ * gives each slave TPCMASTER_TIMEOUT seconds to vote, and any slave which
+ * cannot be reached or does not vote in time counts as a VOTE_ABORT. The
+ * second phase retries each slave until it has acknowledged the decision.
+ *
+ * Each call runs a new transaction. It waits for any other transaction on
+ * the same key to finish first, but runs alongside transactions on other
+ * keys.
  * 
  * The CALLBACK field is used for testing purposes. You MUST include the following
  * calls to the CALLBACK function whenever CALLBACK is not null, or you will fail
@@ -216,126 +1456,500 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
  *   slave is a pointer to the tpcslave you are attempting to contact.
  * - Between the two phases, call CALLBACK(NULL) to indicate that you are transitioning
  *   between the two phases.  
+ * Calls to CALLBACK made by the same transaction are never made concurrently.
  * 
  * Checkpoint 2 only. */
 void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg, callback_t callback) {
-  if (master->slave_count != master->slave_capacity) {
+  pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
+  pthread_mutex_t *key_lock;
+  if (!tpcmaster_ready(master)) {
     respmsg->message = ERRMSG_GENERIC_ERROR;
     return;
   }
-  if (state != TPC_READY){
+  key_lock = tpcmaster_key_lock(master, reqmsg->key);
+  pthread_mutex_lock(key_lock);
+  /* From now on the slaves may hold data, which must follow the ring. */
+  __atomic_store_n(&master->written, true, __ATOMIC_SEQ_CST);
+  int i, n;
+  tpcslave_t *slaves[master->redundancy];
+  tpcfanout_t fanouts[master->redundancy];
+  n = tpcmaster_get_replicas(master, reqmsg->key, slaves);
+  kvmessage_t temp_reqmsg;
+  memcpy(&temp_reqmsg, reqmsg, sizeof(kvmessage_t));
+  temp_reqmsg.format = KVMESSAGE_BINARY;
+  temp_reqmsg.txid = __atomic_add_fetch(&master->next_txid, 1, __ATOMIC_RELAXED);
+  //have slaves vote
+  int commit = 1;
+  uint64_t start = kvstats_now();
+  tpcmaster_fanout(slaves, fanouts, n, &temp_reqmsg, false, callback,
+      &callback_lock);
+  kvstats_time(&master->stats, KVSTATS_PREPARE, start);
+  for (i = 0; i < n; i++) {
+    if (!fanouts[i].respmsg || fanouts[i].respmsg->type != VOTE_COMMIT)
+      commit = 0;
+    tpcmaster_count_vote(master, fanouts[i].respmsg);
+    if (fanouts[i].respmsg)
+      kvmessage_free(fanouts[i].respmsg);
+  }
+  //phase change
+  if (callback) callback(NULL);
+  temp_reqmsg.type = commit ? COMMIT : ABORT;
+  kvstats_count(&master->stats, commit ? KVSTATS_COMMIT : KVSTATS_ABORT);
+  //send out command, waiting for every ACK
+  start = kvstats_now();
+  tpcmaster_fanout(slaves, fanouts, n, &temp_reqmsg, true, callback,
+      &callback_lock);
+  kvstats_time(&master->stats, KVSTATS_DECIDE, start);
+  for (i = 0; i < n; i++)
+    kvmessage_free(fanouts[i].respmsg);
+  //populate respmsg
+  if (commit) {
+    respmsg->message = MSG_SUCCESS;
+    if (reqmsg->type == DELREQ) kvcache_del(&master->cache, reqmsg->key);
+    else tpcmaster_forget_absent(master, reqmsg->key);
+  }
+  else respmsg->message = ERRMSG_GENERIC_ERROR;
+  pthread_mutex_unlock(key_lock);
+}
+
+/* Handles an incoming MPUTREQ or MDELREQ REQMSG, and populates the
+ * appropriate fields of RESPMSG as a response. RESPMSG and REQMSG both must
+ * point to valid kvmessage_t structs.
+ *
+ * The whole batch is run as a single TPC transaction, so either every write
+ * is committed or none is; where a key is written more than once, the last
+ * write wins. The batch is split by slave, and each replica of any key in it
+ * is sent the writes to its keys as a single MPUTREQ or MDELREQ, which it
+ * prepares under a single log entry. Both phases contact every slave
+ * involved at once, just as tpcmaster_handle_tpc does, and CALLBACK is
+ * called in the same way. The locks in the key lock table guarding the
+ * batch's keys are taken in order, so batches and single writes sharing keys
+ * are serialized without deadlocking. */
+void tpcmaster_handle_mtpc(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg, callback_t callback) {
+  pthread_mutex_t callback_lock = PTHREAD_MUTEX_INITIALIZER;
+  bool locked[TPCMASTER_KEY_LOCKS] = {false}, commit = true;
+  tpcslave_t *replicas[master->redundancy], **slaves = NULL;
+  kvmessage_t *reqmsgs = NULL, decision;
+  tpcfanout_t *fanouts = NULL;
+  kvpair_t *pairs = NULL;
+  unsigned int num_slaves = 0, num_replicas, i, j, k;
+  uint64_t start;
+  int n;
+  for (i = 0; reqmsg->batch != NULL && i < reqmsg->batch_size; i++) {
+    if (reqmsg->batch[i].key == NULL
+        || (reqmsg->type == MPUTREQ && reqmsg->batch[i].value == NULL))
+      break;
+  }
+  if (reqmsg->batch == NULL || reqmsg->batch_size == 0
+      || i < reqmsg->batch_size) {
     respmsg->message = ERRMSG_INVALID_REQUEST;
     return;
   }
-  state = TPC_INIT;
+  if (!tpcmaster_ready(master)) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  /* The batch is left as it was sent, so its last writes are picked out of
+   * a copy. */
+  pairs = malloc(reqmsg->batch_size * sizeof(kvpair_t));
+  if (pairs != NULL)
+    memcpy(pairs, reqmsg->batch, reqmsg->batch_size * sizeof(kvpair_t));
+  if (pairs == NULL
+      || (n = kvmessage_last_writes(pairs, reqmsg->batch_size)) < 0) {
+    free(pairs);
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  for (i = 0; i < (unsigned int) n; i++)
+    locked[tpcmaster_key_lock_index(kvhash_key(pairs[i].key))] = true;
+  for (i = 0; i < TPCMASTER_KEY_LOCKS; i++) {
+    if (locked[i])
+      pthread_mutex_lock(&master->key_locks[i]);
+  }
+  /* From now on the slaves may hold data, which must follow the ring. */
+  __atomic_store_n(&master->written, true, __ATOMIC_SEQ_CST);
+
+  /* Split the batch by slave. */
+  slaves = malloc(n * master->redundancy * sizeof(tpcslave_t *));
+  reqmsgs = calloc(n * master->redundancy, sizeof(kvmessage_t));
+  fanouts = malloc(n * master->redundancy * sizeof(tpcfanout_t));
+  if (slaves == NULL || reqmsgs == NULL || fanouts == NULL) {
+    commit = false;
+    goto done;
+  }
+  for (i = 0; i < (unsigned int) n; i++) {
+    num_replicas = tpcmaster_get_replicas(master, pairs[i].key, replicas);
+    for (j = 0; j < num_replicas; j++) {
+      for (k = 0; k < num_slaves && slaves[k] != replicas[j]; k++);
+      if (k == num_slaves) {
+        slaves[num_slaves++] = replicas[j];
+        reqmsgs[k].type = reqmsg->type;
+        reqmsgs[k].format = KVMESSAGE_BINARY;
+        if ((reqmsgs[k].batch = malloc(n * sizeof(kvpair_t))) == NULL) {
+          commit = false;
+          goto done;
+        }
+      }
+      reqmsgs[k].batch[reqmsgs[k].batch_size++] = pairs[i];
+    }
+  }
+  memset(&decision, 0, sizeof(kvmessage_t));
+  decision.format = KVMESSAGE_BINARY;
+  decision.txid = __atomic_add_fetch(&master->next_txid, 1, __ATOMIC_RELAXED);
+  for (k = 0; k < num_slaves; k++) {
+    reqmsgs[k].txid = decision.txid;
+    if (reqmsg->type == MDELREQ) {
+      for (i = 0; i < reqmsgs[k].batch_size; i++)
+        reqmsgs[k].batch[i].value = NULL;
+    }
+    fanouts[k].reqmsg = &reqmsgs[k];
+  }
+
   //have slaves vote
-  tpcslave_t * curr = tpcmaster_get_primary(master, reqmsg->key);
-  kvmessage_t temp_reqmsg, *temp_respmsg;
-  memcpy(&temp_reqmsg, reqmsg, sizeof(kvmessage_t));
-  int i, fd;
-  int commit = 1;
-  for (i = 0; i < master->redundancy; i++){
-    fd = connect_to(curr->host, curr->port, 100);
-    if (fd == -1 && callback) callback(curr);
-    kvmessage_send(&temp_reqmsg, fd);
-    temp_respmsg = kvmessage_parse(fd);
-    if (!temp_respmsg || temp_respmsg->type == VOTE_ABORT) commit = 0;
-    curr = tpcmaster_get_successor(master, curr);
+  start = kvstats_now();
+  tpcmaster_fanout(slaves, fanouts, num_slaves, NULL, false, callback,
+      &callback_lock);
+  kvstats_time(&master->stats, KVSTATS_PREPARE, start);
+  for (k = 0; k < num_slaves; k++) {
+    if (!fanouts[k].respmsg || fanouts[k].respmsg->type != VOTE_COMMIT)
+      commit = false;
+    tpcmaster_count_vote(master, fanouts[k].respmsg);
+    if (fanouts[k].respmsg)
+      kvmessage_free(fanouts[k].respmsg);
   }
   //phase change
   if (callback) callback(NULL);
+  decision.type = commit ? COMMIT : ABORT;
+  kvstats_count(&master->stats, commit ? KVSTATS_COMMIT : KVSTATS_ABORT);
+  //send out command, waiting for every ACK
+  start = kvstats_now();
+  tpcmaster_fanout(slaves, fanouts, num_slaves, &decision, true, callback,
+      &callback_lock);
+  kvstats_time(&master->stats, KVSTATS_DECIDE, start);
+  for (k = 0; k < num_slaves; k++)
+    kvmessage_free(fanouts[k].respmsg);
   if (commit) {
-    state = TPC_COMMIT;
-    temp_reqmsg.type = COMMIT;
-  } else {
-    state = TPC_ABORT;
-    temp_reqmsg.type = ABORT;
-  }
-  //send out command
-  for (i = 0; i < master->redundancy; i++){
-    temp_respmsg = NULL;
-    while (!temp_respmsg){
-      fd = connect_to(curr->host, curr->port, 100);
-      if (fd == -1) callback(curr);
-      kvmessage_send(&temp_reqmsg, fd);
-      temp_respmsg = kvmessage_parse(fd);
+    for (i = 0; i < (unsigned int) n; i++) {
+      kvcache_del(&master->cache, pairs[i].key);
+      if (reqmsg->type == MPUTREQ)
+        tpcmaster_forget_absent(master, pairs[i].key);
     }
-    curr = tpcmaster_get_successor(master, curr);
   }
-  //populate respmsg
-  if (state == TPC_COMMIT) {
-    respmsg->message = MSG_SUCCESS;
-    if (reqmsg->type == DELREQ) kvcache_del(&master->cache, reqmsg->key);
+
+done:
+  respmsg->message = commit ? MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
+  for (i = 0; i < TPCMASTER_KEY_LOCKS; i++) {
+    if (locked[i])
+      pthread_mutex_unlock(&master->key_locks[i]);
   }
-  else respmsg->message = ERRMSG_GENERIC_ERROR;
-  state = TPC_READY;
+  for (k = 0; reqmsgs != NULL && k < num_slaves; k++)
+    free(reqmsgs[k].batch);
+  free(reqmsgs);
+  free(fanouts);
+  free(slaves);
+  free(pairs);
 }
 
 /* Handles an incoming kvmessage REQMSG, and populates the appropriate fields
  * of RESPMSG as a response. RESPMSG and REQMSG both must point to valid
- * kvmessage_t structs. Provides information about the slaves that are
- * currently alive.
+ * kvmessage_t structs. Provides the time, the slaves registered with MASTER
+ * and MASTER's stats, in JSON if REQMSG's key is KVSTATS_JSON. The slaves
+ * are listed as the master knows them, without contacting any. RESPMSG's
+ * message is malloced and should later be freed, unless it is
+ * ERRMSG_GENERIC_ERROR.
  *
  * Checkpoint 2 only. */
 void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg) {
+  json_object *json, *slaves, *slave_json;
+  tpcslave_t *slave;
   time_t clk = time(NULL);
-  respmsg->message = malloc(sizeof("TIMESTAMP: "));
-  strcpy(respmsg->message, "TIMESTAMP: ");
-  respmsg->message = realloc(respmsg->message, strlen(respmsg->message) + strlen(ctime(&clk)) + strlen("Slaves:\n"));
-  strcat(respmsg->message, ctime(&clk));
-  strcat(respmsg->message, "Slaves:");
+  char *stats, *info;
+  unsigned int i;
+  size_t len;
+  respmsg->type = RESP;
+  respmsg->message = ERRMSG_GENERIC_ERROR;
+  if (reqmsg->key != NULL && strcmp(reqmsg->key, KVSTATS_JSON) == 0) {
+    json = kvstats_json(&master->stats);
+    json_object_object_add(json, "timestamp", json_object_new_int64(clk));
+    slaves = json_object_new_array();
+    pthread_rwlock_rdlock(&master->slave_lock);
+    slave = master->slaves_head;
+    for (i = 0; i < master->slave_count; i++, slave = slave->next) {
+      if (slave->leaving)
+        continue;
+      slave_json = json_object_new_object();
+      json_object_object_add(slave_json, "host",
+          json_object_new_string(slave->host));
+      json_object_object_add(slave_json, "port",
+          json_object_new_int(slave->port));
+      json_object_object_add(slave_json, "outstanding",
+          json_object_new_int(slave->outstanding));
+      json_object_object_add(slave_json, "latency_us",
+          json_object_new_int64(slave->latency));
+      json_object_array_add(slaves, slave_json);
+    }
+    pthread_rwlock_unlock(&master->slave_lock);
+    json_object_object_add(json, "slaves", slaves);
+    stats = (char *) json_object_to_json_string(json);
+    if ((info = malloc(strlen(stats) + 1)) != NULL) {
+      strcpy(info, stats);
+      respmsg->message = info;
+    }
+    json_object_put(json);
+    return;
+  }
 
-  tpcslave_t * curr = master->slaves_head;
-  int i;
-  for (i = 0; i < master->slave_count; i++){
-    int fd = connect_to(curr->host, curr->port, 2);
-    if (fd != -1) {
-      respmsg->message = realloc(respmsg->message, strlen(respmsg->message) + strlen(curr->host)+8);
-      strcat(respmsg->message, "\n{");
-      strcat(respmsg->message, curr->host);
-      strcat(respmsg->message, ", ");
-      char x[6];
-      sprintf(x, "%d", curr->port);
-      strcat(respmsg->message, x);
-      strcat(respmsg->message, "}");
+  if ((stats = kvstats_text(&master->stats)) == NULL)
+    return;
+  pthread_rwlock_rdlock(&master->slave_lock);
+  len = strlen("TIMESTAMP: ") + strlen(ctime(&clk)) + strlen("Slaves:")
+      + strlen("\nStats:\n") + strlen(stats) + 1;
+  slave = master->slaves_head;
+  for (i = 0; i < master->slave_count; i++, slave = slave->next)
+    len += strlen(slave->host) + 16;
+  if ((info = malloc(len)) != NULL) {
+    strcpy(info, "TIMESTAMP: ");
+    strcat(info, ctime(&clk));
+    strcat(info, "Slaves:");
+    slave = master->slaves_head;
+    for (i = 0; i < master->slave_count; i++, slave = slave->next) {
+      if (!slave->leaving)
+        sprintf(info + strlen(info), "\n{%s, %u}", slave->host, slave->port);
+    }
+    strcat(info, "\nStats:\n");
+    strcat(info, stats);
+    respmsg->message = info;
+  }
+  pthread_rwlock_unlock(&master->slave_lock);
+  free(stats);
+}
+
+/* A slave's stream of SCANRESPs being merged into a scan. */
+typedef struct {
+  tpcslave_t *slave;        /* The slave streaming its keys. */
+  int fd;                   /* The connection to SLAVE, or -1 if there is none. */
+  kvmessage_t *chunk;       /* The SCANRESP being consumed, or NULL. */
+  unsigned int pos;         /* The next pair of CHUNK. */
+  bool done;                /* True once SLAVE has ended its stream successfully. */
+} tpcscan_t;
+
+/* Makes sure SCAN has a pair at hand unless its stream has ended, reading
+ * the slave's next SCANRESP if need be. Returns 0 if successful, else -1 if
+ * the stream failed. */
+static int tpcmaster_scan_fill(tpcscan_t *scan) {
+  while (!scan->done
+      && (scan->chunk == NULL || scan->pos == scan->chunk->batch_size)) {
+    if (scan->chunk != NULL)
+      kvmessage_free(scan->chunk);
+    scan->pos = 0;
+    if ((scan->chunk = kvmessage_parse(scan->fd)) == NULL)
+      return -1;
+    if (scan->chunk->type == RESP && scan->chunk->message != NULL
+        && strcmp(scan->chunk->message, MSG_SUCCESS) == 0) {
+      kvmessage_free(scan->chunk);
+      scan->chunk = NULL;
+      scan->done = true;
+    } else if (scan->chunk->type != SCANRESP || scan->chunk->batch == NULL) {
+      kvmessage_free(scan->chunk);
+      scan->chunk = NULL;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Sends the pairs gathered in the SCANRESP OUT on SOCKFD, if there are any,
+ * and frees them. Returns 0 if successful, else -1. */
+static int tpcmaster_scan_flush(kvmessage_t *out, int sockfd) {
+  unsigned int i;
+  int ret = 0;
+  if (out->batch_size > 0 && kvmessage_send(out, sockfd) <= 0)
+    ret = -1;
+  for (i = 0; i < out->batch_size; i++) {
+    free(out->batch[i].key);
+    free(out->batch[i].value);
+  }
+  out->batch_size = 0;
+  return ret;
+}
+
+/* Handles an incoming SCANREQ REQMSG, streaming the keys in its range and
+ * their values to the client on SOCKFD as SCANRESPs, and ending the stream
+ * with RESPMSG.
+ *
+ * Every slave on the ring is sent the SCANREQ, limit included, and answers
+ * with its keys in order; the streams are merged, a key held by several
+ * replicas being sent once, until the range or the limit is exhausted. The
+ * scan is not a snapshot: keys written or moved between slaves while it runs
+ * may or may not be seen. If any slave fails, RESPMSG reports an error,
+ * although some keys may already have been sent. */
+void tpcmaster_handle_scan(tpcmaster_t *master, kvmessage_t *reqmsg,
+    int sockfd, kvmessage_t *respmsg) {
+  kvpair_t pairs[TPCMASTER_SCAN_CHUNK], *pair;
+  tpcslave_t *slave;
+  tpcscan_t *scans = NULL, *next;
+  kvmessage_t slavereq, out;
+  unsigned int limit, sent = 0, num_scans = 0, i, j;
+  int ret = 0;
+  respmsg->type = RESP;
+  if (kvmessage_scan_limit(reqmsg, &limit) != 0) {
+    respmsg->message = ERRMSG_INVALID_REQUEST;
+    return;
+  }
+  if (!tpcmaster_ready(master)) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+  pthread_rwlock_rdlock(&master->slave_lock);
+  scans = calloc(master->ring_slaves, sizeof(tpcscan_t));
+  for (i = 0; scans != NULL && i < master->ring_size; i++) {
+    slave = master->ring[i].slave;
+    for (j = 0; j < num_scans && scans[j].slave != slave; j++);
+    if (j == num_scans && num_scans < master->ring_slaves) {
+      tpcmaster_slave_hold(slave);
+      scans[num_scans++].slave = slave;
     }
-    curr = curr->next;
   }
+  pthread_rwlock_unlock(&master->slave_lock);
+  if (scans == NULL) {
+    respmsg->message = ERRMSG_GENERIC_ERROR;
+    return;
+  }
+
+  memset(&slavereq, 0, sizeof(kvmessage_t));
+  slavereq.type = SCANREQ;
+  slavereq.key = reqmsg->key;
+  slavereq.value = reqmsg->value;
+  slavereq.message = reqmsg->message;
+  slavereq.format = KVMESSAGE_BINARY;
+  for (i = 0; i < num_scans; i++) {
+    scans[i].fd = tpcmaster_slave_connect(scans[i].slave, TPCMASTER_TIMEOUT,
+        NULL);
+    if (scans[i].fd == -1 || kvmessage_send(&slavereq, scans[i].fd) <= 0)
+      ret = -1;
+  }
+
+  memset(&out, 0, sizeof(kvmessage_t));
+  out.type = SCANRESP;
+  out.format = reqmsg->format;
+  out.batch = pairs;
+  while (ret == 0 && (limit == 0 || sent < limit)) {
+    /* Find the stream with the smallest key at hand. */
+    for (i = 0, next = NULL; i < num_scans && ret == 0; i++) {
+      if (tpcmaster_scan_fill(&scans[i]) != 0)
+        ret = -1;
+      else if (!scans[i].done && (next == NULL
+          || strcmp(scans[i].chunk->batch[scans[i].pos].key,
+            next->chunk->batch[next->pos].key) < 0))
+        next = &scans[i];
+    }
+    if (ret != 0 || next == NULL)
+      break;
+    pair = &pairs[out.batch_size++];
+    *pair = next->chunk->batch[next->pos];
+    memset(&next->chunk->batch[next->pos++], 0, sizeof(kvpair_t));
+    /* Skip the same key held by other replicas. */
+    for (i = 0; i < num_scans; i++) {
+      if (!scans[i].done && &scans[i] != next
+          && strcmp(scans[i].chunk->batch[scans[i].pos].key, pair->key) == 0)
+        scans[i].pos++;
+    }
+    sent++;
+    if (out.batch_size == TPCMASTER_SCAN_CHUNK)
+      ret = tpcmaster_scan_flush(&out, sockfd);
+  }
+  if (tpcmaster_scan_flush(&out, sockfd) != 0)
+    ret = -1;
+
+  for (i = 0; i < num_scans; i++) {
+    if (scans[i].fd != -1)
+      tpcmaster_slave_release(scans[i].slave, scans[i].fd, scans[i].done);
+    if (scans[i].chunk != NULL)
+      kvmessage_free(scans[i].chunk);
+    tpcmaster_slave_put(scans[i].slave);
+  }
+  free(scans);
+  respmsg->message = (ret == 0) ? MSG_SUCCESS : ERRMSG_GENERIC_ERROR;
 }
 
 /* Generic entrypoint for this MASTER. Takes in a socket on SOCKFD, which
  * should already be connected to an incoming request. Processes the request
  * and sends back a response message.  This should call out to the appropriate
- * internal handler. */
+ * internal handler. A REGISTER or DEREGISTER is answered before the ring is
+ * rebalanced, so that a joining slave can start listening for its data.
+ * GETs, PUTs and DELs, in batches or not, are timed in MASTER's stats, from
+ * the moment they have been read until their response has been sent. */
 void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
   kvmessage_t *reqmsg, respmsg;
+  kvtimer_t timer = KVSTATS_NUM_TIMERS;
+  unsigned int i;
+  uint64_t start;
+  bool rebalance = false;
   reqmsg = kvmessage_parse(sockfd);
+  start = kvstats_now();
   memset(&respmsg, 0, sizeof(kvmessage_t));
   respmsg.type = RESP;
-  if (reqmsg->key != NULL) {
-    respmsg.key = calloc(1, strlen(reqmsg->key));
+  if (reqmsg != NULL && reqmsg->key != NULL) {
+    respmsg.key = calloc(1, strlen(reqmsg->key) + 1);
     strcpy(respmsg.key, reqmsg->key);
   }
-  if (reqmsg->type == INFO) {
+  if (reqmsg != NULL && (reqmsg->type == GETREQ || reqmsg->type == MGETREQ))
+    timer = KVSTATS_GET;
+  else if (reqmsg != NULL
+      && (reqmsg->type == PUTREQ || reqmsg->type == MPUTREQ))
+    timer = KVSTATS_PUT;
+  else if (reqmsg != NULL
+      && (reqmsg->type == DELREQ || reqmsg->type == MDELREQ))
+    timer = KVSTATS_DEL;
+  if (reqmsg != NULL && reqmsg->type == INFO) {
     tpcmaster_info(master, reqmsg, &respmsg);
-  } else if (reqmsg == NULL || reqmsg->key == NULL) {
+  } else if (reqmsg != NULL && reqmsg->type == SCANREQ) {
+    tpcmaster_handle_scan(master, reqmsg, sockfd, &respmsg);
+  } else if (reqmsg == NULL
+      || (reqmsg->key == NULL && reqmsg->batch == NULL)) {
     respmsg.message = ERRMSG_INVALID_REQUEST;
   } else if (reqmsg->type == REGISTER) {
     tpcmaster_register(master, reqmsg, &respmsg);
+    rebalance = true;
+  } else if (reqmsg->type == DEREGISTER) {
+    tpcmaster_deregister(master, reqmsg, &respmsg);
+    rebalance = true;
   } else if (reqmsg->type == GETREQ) {
     tpcmaster_handle_get(master, reqmsg, &respmsg);
+  } else if (reqmsg->type == MGETREQ) {
+    tpcmaster_handle_mget(master, reqmsg, &respmsg);
+  } else if (reqmsg->type == MPUTREQ || reqmsg->type == MDELREQ) {
+    tpcmaster_handle_mtpc(master, reqmsg, &respmsg, callback);
   } else {
     tpcmaster_handle_tpc(master, reqmsg, &respmsg, callback);
   }
+  /* Answer in the encoding the client used, whatever the slaves spoke. */
+  if (reqmsg != NULL)
+    respmsg.format = reqmsg->format;
   kvmessage_send(&respmsg, sockfd);
-  kvmessage_free(reqmsg);
+  if (timer != KVSTATS_NUM_TIMERS)
+    kvstats_time(&master->stats, timer, start);
+  if (reqmsg != NULL && reqmsg->type == INFO
+      && strcmp(respmsg.message, ERRMSG_GENERIC_ERROR) != 0)
+    free(respmsg.message);
+  if (reqmsg != NULL)
+    kvmessage_free(reqmsg);
   if (respmsg.key != NULL)
     free(respmsg.key);
+  if (respmsg.batch != NULL) {
+    for (i = 0; i < respmsg.batch_size; i++)
+      free(respmsg.batch[i].value);
+    free(respmsg.batch);
+  }
+  if (rebalance)
+    tpcmaster_rebalance(master);
 }
 
 /* Completely clears this TPCMaster's cache. For testing purposes. */
 void tpcmaster_clear_cache(tpcmaster_t *tpcmaster) {
   kvcache_clear(&tpcmaster->cache);
+  kvcache_clear(&tpcmaster->absent);
 }
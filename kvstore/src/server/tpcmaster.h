@@ -1,8 +1,12 @@
 #ifndef __KV_MASTER__
 #define __KV_MASTER__
 
+#include <netinet/in.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include "kvcache.h"
+#include "kvstats.h"
 
 /* TPCMaster defines a master server which will communicate with multiple
  * slave servers.
@@ -15,29 +19,177 @@
  * ABORT.
  *
  * The TPCMaster will need to listen for registration requests from KVServers
- * acting as its slaves, before it can handle any client request.
+ * acting as its slaves, before it can handle any client request. Client
+ * requests are served as soon as the ring holds REDUNDANCY slaves, and slaves
+ * may keep registering, up to SLAVE_CAPACITY, or deregister at any time.
+ *
+ * Until the first PUT or DEL, the ring is simply rebuilt whenever a slave
+ * registers or deregisters, as no slave holds any data yet. After that, a
+ * membership change only marks the ring stale, and tpcmaster_rebalance, run
+ * after the change has been acknowledged, moves the data to match: it holds
+ * every lock in the key lock table, so no transaction runs meanwhile (GETs
+ * are still served from the old ring), and compares the replicas of every
+ * segment of the old and new rings. For each slave which gains a segment, a
+ * slave already holding it is sent a MIGRATE message asking it to TRANSFER
+ * the keys hashing into those segments straight to the new owner. Once every
+ * move has succeeded the new ring is installed, slaves which lost segments
+ * are sent a MIGRATE without a target, asking them to drop those keys, and
+ * departing slaves are forgotten. If a move fails, the old ring is
+ * kept and the rebalance is retried on the next membership change.
+ *
+ * Keys are assigned to slaves by consistent hashing. Each slave is given
+ * VNODES points (virtual nodes) on a ring of 64-bit hashes, and a key is
+ * stored on the slaves owning the first REDUNDANCY distinct points at or
+ * after the key's hash, wrapping around. With a single point per slave, that
+ * point is the slave's ID and the ring is the list of slaves itself. The
+ * ring is kept as a sorted array, rebuilt whenever the slaves change, so a
+ * key's primary is found by binary search; the full replica list of every
+ * segment of the ring is precomputed alongside it. The more points each slave
+ * has, the more evenly keys spread across slaves.
  *
  * The TPCMaster has an associated KVCache, which should be updated on PUT
  * and DEL requests, and accessed on GET requests before going to the slaves.
  *
+ * A GET which misses the cache may be served by any replica of its key. The
+ * master's READ_POLICY picks the replica asked first: the primary, the
+ * replicas in turn, the replica with the fewest GETs in flight, or the one
+ * with the lowest moving average (EWMA) of recent GET latencies. The other
+ * replicas follow in ring order, each tried in turn if the one before fails.
+ * With HEDGE_READS set, a GET which has not been answered within the 95th
+ * percentile of recent GET latencies is also sent to the next replica, and
+ * the first value returned wins.
+ *
+ * GETs which miss the cache on the same key at the same time are coalesced:
+ * the first is sent to the slaves, and the others wait for it and share its
+ * answer, so a burst of GETs on a cold key costs the slaves a single GET. A
+ * key the slaves report absent is remembered in a second KVCache, ABSENT, as
+ * large as the first, and later GETs of it are answered from there until a
+ * PUT of it commits. A GET only records a key as absent if no PUT guarded by
+ * the same key lock has committed since the GET was sent, so an absence seen
+ * before a PUT cannot outlive it.
+ *
+ * Clients may also send batches of keys. An MGETREQ is answered from the
+ * cache where possible, and its other keys are grouped by their replicas,
+ * each group being sent to its replicas as a single MGETREQ, all groups in
+ * parallel. An MPUTREQ or MDELREQ is run as a single transaction, in which
+ * each slave involved is sent all of the batch's writes it holds a replica
+ * of as a single message.
+ *
+ * A SCANREQ is sent to every slave on the ring, and the sorted streams of
+ * SCANRESPs they answer with are merged, dropping the copies held by other
+ * replicas, into a single sorted stream for the client, sent on in
+ * SCANRESPs of up to TPCMASTER_SCAN_CHUNK pairs.
+ *
+ * Connections to each slave are pooled. A slave's address is resolved the
+ * first time it is contacted and kept in its tpcslave_t, and a connection
+ * which carried a complete exchange is kept open, up to
+ * TPCMASTER_POOL_SIZE per slave, for the next request to that slave. Idle
+ * connections are checked before reuse, and one the slave has since closed
+ * is discarded; a request which fails on a reused connection is retried once
+ * on a new one, as the slave may have closed it after its last response.
+ *
+ * Slaves are reference counted. The list of slaves holds a reference to each
+ * slave in it, and a GET, MGETREQ or SCANREQ takes a reference to each slave
+ * it will contact, under the slave_lock, and drops them once it is done, so
+ * a slave removed from the list meanwhile is freed by whichever drops the
+ * last reference. Transactions need no references, as they hold their keys'
+ * locks, which a rebalance takes before removing any slave.
+ *
+ * Each PUT and DEL is run as a transaction with its own ID, which is sent in
+ * every message of both phases. Transactions on the same key are run one at a
+ * time, in the order they take the key's lock in the key lock table, while
+ * transactions on unrelated keys are free to overlap.
+ *
+ * The TPCMaster keeps stats (see kvstats.h) of its cache hits and misses,
+ * the votes it receives and the decisions it makes, and the time taken by
+ * each request and by each phase of each transaction, and answers an INFO
+ * request with them and the slaves it knows of, in JSON if the request's key
+ * is KVSTATS_JSON.
+ *
  * For this project, you can assume that the TPCMaster will never fail. Thus,
  * you don't need to maintain a TPCLog for it.
  * 
  * Checkpoint 2 only.
  */
 
+/* The number of seconds a slave has to respond to a TPC message. */
+#define TPCMASTER_TIMEOUT 5
+
+/* The number of microseconds to wait before contacting a slave again after it
+ * failed to acknowledge a COMMIT or ABORT. */
+#define TPCMASTER_RETRY_DELAY 10000
+
+/* The number of seconds a slave has to finish a MIGRATE. */
+#define TPCMASTER_MIGRATE_TIMEOUT 60
+
+/* The number of times a MIGRATE is attempted before a rebalance gives up,
+ * and the number of microseconds to wait between attempts. A new slave may
+ * take a moment after registering to start listening for its data. */
+#define TPCMASTER_MIGRATE_ATTEMPTS 50
+#define TPCMASTER_MIGRATE_DELAY 100000
+
+/* The number of recent GET latencies kept to estimate their 95th
+ * percentile, and the number needed before the estimate is used. */
+#define TPCMASTER_LATENCY_SAMPLES 128
+#define TPCMASTER_LATENCY_MIN_SAMPLES 16
+
+/* The number of microseconds after which a hedged GET is sent to another
+ * replica, until enough latencies have been recorded. */
+#define TPCMASTER_HEDGE_DEFAULT_DELAY 10000
+
+/* Each new latency is given a weight of 1 / 2^TPCMASTER_EWMA_SHIFT in a
+ * slave's moving average. */
+#define TPCMASTER_EWMA_SHIFT 3
+
+/* The number of idle connections kept open to each slave. */
+#define TPCMASTER_POOL_SIZE 8
+
+/* The number of pairs sent to the client in each SCANRESP. */
+#define TPCMASTER_SCAN_CHUNK 128
+
+/* The number of points each slave is given on the ring by default. */
+#define TPCMASTER_DEFAULT_VNODES 64
+
+/* The number of locks in a master's key lock table. Transactions on keys
+ * which map to different locks run concurrently. */
+#define TPCMASTER_KEY_LOCKS 64
+
 typedef void (*callback_t)(void*);
 
+/* The ways of picking the replica which a GET is sent to first. */
+typedef enum {
+  TPCMASTER_READ_PRIMARY,           /* Always the primary. */
+  TPCMASTER_READ_ROUND_ROBIN,       /* Each replica in turn. */
+  TPCMASTER_READ_LEAST_OUTSTANDING, /* The replica with the fewest GETs in flight. */
+  TPCMASTER_READ_EWMA               /* The replica with the lowest average latency. */
+} tpcreadpolicy_t;
+
 /* A struct used to represent the slaves which this TPC Master is aware of. */
 typedef struct tpcslave {
   int64_t id;                   /* The unique ID for this slave. */
   char *host;                   /* The host where this slave can be reached. */
   unsigned int port;            /* The port where this slave can be reached. */
+  bool leaving;                 /* True once deregistered, until the ring is rebalanced. */
+  unsigned int refs;            /* One for the list of slaves while in it, plus one per reader. */
+  unsigned int outstanding;     /* The number of GETs in flight to this slave. */
+  uint64_t latency;             /* The EWMA of its GET latencies in microseconds, or 0. */
+  struct sockaddr_in addr;      /* The slave's address, once RESOLVED. */
+  bool resolved;                /* True once HOST has been resolved into ADDR. */
+  pthread_mutex_t pool_lock;    /* Protects ADDR, RESOLVED and POOL. */
+  int pool[TPCMASTER_POOL_SIZE]; /* Idle connections to this slave. */
+  unsigned int pool_size;       /* The number of connections in POOL. */
   struct tpcslave *next;        /* The next slave in the list of slaves. */
   struct tpcslave *prev;        /* The previous slave in the list of slaves. */
 } tpcslave_t;
 
+/* A single point on the ring. */
+typedef struct {
+  int64_t point;                /* The hash at which this point sits. */
+  tpcslave_t *slave;            /* The slave owning this point. */
+} tpcvnode_t;
+
 struct tpcmaster;
+struct tpcflight;
 
 typedef void (*tpchandle_t)(struct tpcmaster *, int sockfd, callback_t callback);
 
@@ -47,9 +199,30 @@ typedef struct tpcmaster {
   unsigned int slave_count;     /* The current number of slaves this master is aware of. */
   unsigned int redundancy;      /* The number of slaves a single value will be stored on. */
   tpcslave_t *slaves_head;      /* The head of the list of slaves. */
-  pthread_rwlock_t slave_lock;  /* A lock used to protect the list of slaves. */
+  pthread_rwlock_t slave_lock;  /* A lock used to protect the list of slaves and the ring. */
+  unsigned int vnodes;          /* The number of points each slave has on the ring. */
+  tpcvnode_t *ring;             /* Every point on the ring, sorted by hash. */
+  unsigned int ring_size;       /* The number of points in RING. */
+  tpcslave_t **ring_replicas;   /* The REDUNDANCY replicas of each point's segment, in order. */
+  unsigned int ring_slaves;     /* The number of slaves on the ring. */
+  bool ring_stale;              /* True if the slaves have changed since the ring was built. */
+  bool written;                 /* True once a PUT or DEL has been sent to the slaves. */
   kvcache_t cache;              /* The cache this master will use. */
+  kvcache_t absent;             /* Keys the slaves have lately reported absent. */
   tpchandle_t handle;           /* The function this master will use to handle requests. */
+  pthread_mutex_t key_locks[TPCMASTER_KEY_LOCKS]; /* Serializes transactions on each key. */
+  uint64_t next_txid;           /* The ID of the next transaction. */
+  tpcreadpolicy_t read_policy;  /* How the replica a GET goes to first is picked. */
+  bool hedge_reads;             /* True to send slow GETs to a second replica. */
+  unsigned int next_read;       /* Rotates the replicas GETs go to first. */
+  pthread_mutex_t latency_lock; /* Protects LATENCIES. */
+  uint64_t latencies[TPCMASTER_LATENCY_SAMPLES]; /* Recent GET latencies in microseconds. */
+  unsigned int num_latencies;   /* The number of latencies recorded, up to the size of LATENCIES. */
+  unsigned int next_latency;    /* The slot in LATENCIES for the next latency. */
+  pthread_mutex_t flight_lock;  /* Protects FLIGHTS, PUTS and the filling of ABSENT. */
+  struct tpcflight *flights;    /* The GETs being fetched from the slaves, by key. */
+  uint64_t puts[TPCMASTER_KEY_LOCKS]; /* The number of PUTs committed under each key lock. */
+  kvstats_t stats;              /* Counts this master's events and times its requests. */
 } tpcmaster_t;
 
 int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
@@ -57,9 +230,23 @@ int tpcmaster_init(tpcmaster_t *master, unsigned int slave_capacity,
 
 void tpcmaster_register(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
+void tpcmaster_deregister(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg);
+int tpcmaster_rebuild_ring(tpcmaster_t *master);
+int tpcmaster_rebalance(tpcmaster_t *master);
+int64_t tpcmaster_ring_hash(unsigned int vnodes, char *key);
 tpcslave_t *tpcmaster_get_primary(tpcmaster_t *master, char *key);
+unsigned int tpcmaster_get_replicas(tpcmaster_t *master, char *key,
+    tpcslave_t **replicas);
 tpcslave_t *tpcmaster_get_successor(tpcmaster_t *master,
     tpcslave_t *predecessor);
+int tpcmaster_slave_connect(tpcslave_t *slave, int timeout, bool *reused);
+void tpcmaster_slave_release(tpcslave_t *slave, int fd, bool reusable);
+void tpcmaster_order_replicas(tpcmaster_t *master, tpcslave_t **replicas,
+    unsigned int num_replicas);
+void tpcmaster_record_latency(tpcmaster_t *master, tpcslave_t *slave,
+    uint64_t latency);
+uint64_t tpcmaster_hedge_delay(tpcmaster_t *master);
 
 void tpcmaster_handle(tpcmaster_t *master, int sockfd, callback_t callback);
 
@@ -67,6 +254,12 @@ void tpcmaster_handle_get(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
 void tpcmaster_handle_tpc(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg, callback_t callback);
+void tpcmaster_handle_mget(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg);
+void tpcmaster_handle_mtpc(tpcmaster_t *master, kvmessage_t *reqmsg,
+    kvmessage_t *respmsg, callback_t callback);
+void tpcmaster_handle_scan(tpcmaster_t *master, kvmessage_t *reqmsg,
+    int sockfd, kvmessage_t *respmsg);
 
 void tpcmaster_info(tpcmaster_t *master, kvmessage_t *reqmsg,
     kvmessage_t *respmsg);
@@ -5,39 +5,49 @@
 
 /* Initializes a work queue WQ. Sets up any necessary synchronization constructs. */
 void wq_init(wq_t *wq) {
+  wq_init_bounded(wq, 0);
+}
+
+/* Initializes a work queue WQ which holds at most CAPACITY items, or any
+ * number of items if CAPACITY is 0. */
+void wq_init_bounded(wq_t *wq, int capacity) {
   wq->head = NULL;
+  wq->size = 0;
+  wq->capacity = capacity;
   pthread_mutex_init(&wq->lock, NULL);
   pthread_cond_init(&wq->empty, NULL);  
+  pthread_cond_init(&wq->full, NULL);
 }
 
-/* Remove an item from the WQ. Currently, this immediately attempts
- * to remove the item at the head of the list, and will fail if there are
- * no items in the list.
- *
- * It is your task to make it so that this function will wait until the queue
- * contains at least one item, then remove that item from the list and
- * return it. */
+/* Remove an item from the WQ. Waits until the queue contains at least one
+ * item, then removes the item at the head of the list and returns it. */
 void *wq_pop(wq_t *wq) {
   pthread_mutex_lock(&wq->lock); //tries to grab 'writer' lock              
   void *job;
   while (wq->head == NULL) {
     pthread_cond_wait(&wq->empty, &wq->lock);
   }                
-  job = wq->head->item;
+  wq_item_t *wq_item = wq->head;
+  job = wq_item->item;
   DL_DELETE(wq->head,wq->head);
+  free(wq_item);
+  wq->size--;
+  pthread_cond_signal(&wq->full);
   pthread_mutex_unlock(&wq->lock);
   return job;
 }
 
-/* Add ITEM to WQ. Currently, this just adds ITEM to the list.
- *
- * It is your task to perform any necessary operations to properly
- * perform synchronization. */
+/* Add ITEM to WQ. If WQ is bounded and full, waits until an item has been
+ * removed first. */
 void wq_push(wq_t *wq, void *item) {
   pthread_mutex_lock(&wq->lock); //tries to grab lock      
+  while (wq->capacity > 0 && wq->size >= wq->capacity) {
+    pthread_cond_wait(&wq->full, &wq->lock);
+  }
   wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
   wq_item->item = item;
   DL_APPEND(wq->head, wq_item);
+  wq->size++;
   pthread_cond_signal(&wq->empty);
   pthread_mutex_unlock(&wq->lock);
 }
\ No newline at end of file
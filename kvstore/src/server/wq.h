@@ -9,6 +9,10 @@
  * threads to be waiting for items to fill the work queue. For each item added to the queue,
  * exactly one thread should receive the item. When the queue is empty, there should be no
  * busy waiting.
+ *
+ * A WQ may optionally be bounded. Once a bounded WQ holds CAPACITY items,
+ * pushes wait until an item has been popped, which applies backpressure to
+ * whoever is producing work.
  */
 
 typedef struct wq_item {
@@ -21,10 +25,14 @@ typedef struct wq {
   wq_item_t *head;         /* The head of the list of items. */
   pthread_mutex_t lock;  /* Lock on the work queue. */
   pthread_cond_t empty;    /* Conditional for waiting */ 
+  pthread_cond_t full;     /* Signalled when a bounded queue has room again. */
+  int size;                /* The number of items in the queue. */
+  int capacity;            /* The max number of items in the queue, 0 if unbounded. */
 } wq_t;
 
 
 void wq_init(wq_t *wq);
+void wq_init_bounded(wq_t *wq, int capacity);
 
 void wq_push(wq_t *wq, void *item);
 
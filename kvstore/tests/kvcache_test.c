@@ -1,8 +1,10 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <pthread.h>
 #include "kvcache.h"
 #include "kvconstants.h"
+#include "kvhash.h"
 #include "tester.h"
 
 kvcache_t testcache;
@@ -90,17 +92,83 @@ int kvcache_set_locks(void) {
   l4 = kvcache_getlock(&testcache, "mykey4");
   l5 = kvcache_getlock(&testcache, "mykey5");
   l6 = kvcache_getlock(&testcache, "mykey6");
-  ASSERT_NOT_EQUAL(l1, l2);
-  ASSERT_NOT_EQUAL(l1, l3);
-  ASSERT_EQUAL(l1, l4);
-  ASSERT_NOT_EQUAL(l3, l5);
-  ASSERT_EQUAL(l3, l6);
-  ASSERT_EQUAL(l5, l2);
+  /* Under kvhash_key, mykey1-3 share a set, as do mykey4 and mykey6. */
+  ASSERT_EQUAL(l1, l2);
+  ASSERT_EQUAL(l1, l3);
+  ASSERT_NOT_EQUAL(l1, l4);
+  ASSERT_NOT_EQUAL(l4, l5);
+  ASSERT_EQUAL(l4, l6);
+  ASSERT_NOT_EQUAL(l5, l2);
   ASSERT_NOT_EQUAL(l6, l2);
   return 1;
 }
 
 
+int kvcache_hash_spread(void) {
+  unsigned int high[16] = {0}, low[16] = {0}, i, j;
+  char key[64], other[64];
+  /* Similar keys spread evenly over both the sets and the indexes in them. */
+  for (i = 0; i < 16384; i++) {
+    sprintf(key, "key%u", i);
+    high[(kvhash_key(key) >> 32) % 16]++;
+    low[kvhash_key(key) & 15]++;
+  }
+  for (i = 0; i < 16; i++) {
+    ASSERT_TRUE(high[i] > 920 && high[i] < 1128);
+    ASSERT_TRUE(low[i] > 920 && low[i] < 1128);
+  }
+  /* Every byte of keys of every length is compared. */
+  for (i = 1; i <= 48; i++) {
+    memset(key, 'a', i);
+    memcpy(other, key, i);
+    ASSERT_TRUE(kvhash_equals(key, other, i));
+    for (j = 0; j < i; j++) {
+      other[j] = 'b';
+      ASSERT_FALSE(kvhash_equals(key, other, i));
+      other[j] = 'a';
+    }
+  }
+  return 1;
+}
+
+int kvcache_policies(void) {
+  kvpolicy_type_t policies[] = {KVPOLICY_CLOCK, KVPOLICY_ARC, KVPOLICY_TINYLFU};
+  char key[32], value[32], *retval;
+  unsigned int p;
+  int i, cached;
+  for (p = 0; p < sizeof(policies) / sizeof(policies[0]); p++) {
+    ASSERT_EQUAL(kvcache_init_policy(&testcache, 2, 4, policies[p]), 0);
+    ASSERT_EQUAL(testcache.policy, policies[p]);
+    for (i = 0; i < 32; i++) {
+      sprintf(key, "key%d", i);
+      sprintf(value, "val%d", i);
+      if (kvcache_get(&testcache, key, &retval) == 0)
+        return 0;
+      ASSERT_EQUAL(kvcache_put(&testcache, key, value), 0);
+      /* The entry just added is never the one evicted. */
+      ASSERT_EQUAL(kvcache_get(&testcache, key, &retval), 0);
+      ASSERT_STRING_EQUAL(retval, value);
+      free(retval);
+    }
+    /* Every set is full, and holds no more than its share. */
+    for (i = 0, cached = 0; i < 32; i++) {
+      sprintf(key, "key%d", i);
+      if (kvcache_get(&testcache, key, &retval) == 0) {
+        free(retval);
+        cached++;
+      }
+    }
+    ASSERT_EQUAL(cached, 8);
+    ASSERT_EQUAL(kvcache_put(&testcache, "key31", "new"), 0);
+    ASSERT_EQUAL(kvcache_get(&testcache, "key31", &retval), 0);
+    ASSERT_STRING_EQUAL(retval, "new");
+    free(retval);
+    ASSERT_EQUAL(kvcache_del(&testcache, "key31"), 0);
+    ASSERT_EQUAL(kvcache_get(&testcache, "key31", &retval), ERRNOKEY);
+  }
+  return 1;
+}
+
 test_info_t kvcache_tests[] = {
   {"Simple PUT and GET of a single value", kvcache_simple_put_get_single},
   {"Simple PUT and GET of multiple values, filling to capacity",
@@ -109,6 +177,8 @@ test_info_t kvcache_tests[] = {
   {"Simple DEL test", kvcache_del_simple},
   {"Testing that locks are same for keys in same set, diff for keys in "
     "diff sets", kvcache_set_locks},
+  {"Keys are hashed evenly and compared exactly", kvcache_hash_spread},
+  {"PUT, GET and DEL under every replacement policy", kvcache_policies},
   NULL_TEST_INFO
 };
 
@@ -1,7 +1,12 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
 #include "tester.h"
 #include "kvcacheset.h"
 #include "kvconstants.h"
+#include "kvhash.h"
+#include "kvsketch.h"
 
 kvcacheset_t testset;
 
@@ -13,8 +18,8 @@ int kvcacheset_test_init(void) {
 int kvcacheset_simple_put_get_single(void) {
   char *retval;
   int ret;
-  ret = kvcacheset_put(&testset, "mykey", "myvalue");
-  ret += kvcacheset_get(&testset, "mykey", &retval);
+  ret = kvcacheset_put(&testset, "mykey", kvhash_key("mykey"), "myvalue");
+  ret += kvcacheset_get(&testset, "mykey", kvhash_key("mykey"), &retval);
   ASSERT_STRING_EQUAL(retval, "myvalue");
   ASSERT_EQUAL(ret, 0);
   free(retval);
@@ -24,16 +29,16 @@ int kvcacheset_simple_put_get_single(void) {
 int kvcacheset_simple_put_get_multiple(void) {
   char *retval;
   int ret;
-  ret = kvcacheset_put(&testset, "mykey1", "myvalue1");
-  ret += kvcacheset_put(&testset, "mykey2", "myvalue2");
-  ret += kvcacheset_put(&testset, "mykey3", "myvalue3");
-  ret += kvcacheset_get(&testset, "mykey1", &retval);
+  ret = kvcacheset_put(&testset, "mykey1", kvhash_key("mykey1"), "myvalue1");
+  ret += kvcacheset_put(&testset, "mykey2", kvhash_key("mykey2"), "myvalue2");
+  ret += kvcacheset_put(&testset, "mykey3", kvhash_key("mykey3"), "myvalue3");
+  ret += kvcacheset_get(&testset, "mykey1", kvhash_key("mykey1"), &retval);
   ASSERT_STRING_EQUAL(retval, "myvalue1");
   free(retval);
-  ret += kvcacheset_get(&testset, "mykey2", &retval);
+  ret += kvcacheset_get(&testset, "mykey2", kvhash_key("mykey2"), &retval);
   ASSERT_STRING_EQUAL(retval, "myvalue2");
   free(retval);
-  ret += kvcacheset_get(&testset, "mykey3", &retval);
+  ret += kvcacheset_get(&testset, "mykey3", kvhash_key("mykey3"), &retval);
   ASSERT_STRING_EQUAL(retval, "myvalue3");
   free(retval);
   ASSERT_EQUAL(ret, 0);
@@ -43,17 +48,17 @@ int kvcacheset_simple_put_get_multiple(void) {
 int kvcacheset_del_simple(void) {
   char *retval = NULL;
   int ret;
-  ret = kvcacheset_put(&testset, "mykey1", "myvalue1");
-  ret += kvcacheset_put(&testset, "mykey2", "myvalue2");
-  ret += kvcacheset_del(&testset, "mykey1");
-  ret += kvcacheset_get(&testset, "mykey2", &retval);
+  ret = kvcacheset_put(&testset, "mykey1", kvhash_key("mykey1"), "myvalue1");
+  ret += kvcacheset_put(&testset, "mykey2", kvhash_key("mykey2"), "myvalue2");
+  ret += kvcacheset_del(&testset, "mykey1", kvhash_key("mykey1"));
+  ret += kvcacheset_get(&testset, "mykey2", kvhash_key("mykey2"), &retval);
   ASSERT_PTR_NOT_NULL(retval);
   ASSERT_STRING_EQUAL(retval, "myvalue2");
   ASSERT_EQUAL(ret, 0);
   if (retval != NULL)
     free(retval);
   retval = NULL;
-  ret = kvcacheset_get(&testset, "mykey1", &retval);
+  ret = kvcacheset_get(&testset, "mykey1", kvhash_key("mykey1"), &retval);
   ASSERT_PTR_NULL(retval);
   ASSERT_EQUAL(ret, ERRNOKEY);
   return 1;
@@ -62,9 +67,10 @@ int kvcacheset_del_simple(void) {
 int kvcacheset_put_overwrite(void) {
   char *retval = NULL;
   int ret;
-  ret = kvcacheset_put(&testset, "mykey", "initial value");
-  ret += kvcacheset_put(&testset, "mykey", "updated value");
-  ret += kvcacheset_get(&testset, "mykey", &retval);
+  ret = kvcacheset_put(&testset, "mykey", kvhash_key("mykey"), "initial value");
+  ret += kvcacheset_put(&testset, "mykey", kvhash_key("mykey"),
+      "updated value");
+  ret += kvcacheset_get(&testset, "mykey", kvhash_key("mykey"), &retval);
   ASSERT_PTR_NOT_NULL(retval);
   ASSERT_STRING_EQUAL(retval, "updated value");
   ASSERT_EQUAL(ret, 0);
@@ -74,19 +80,19 @@ int kvcacheset_put_overwrite(void) {
 int kvcacheset_replacement_no_ref_bits(void) {
   char *retval = NULL;
   int ret;
-  kvcacheset_put(&testset, "key1", "val1");
-  kvcacheset_put(&testset, "key2", "val2");
-  kvcacheset_put(&testset, "key3", "val3");
-  kvcacheset_put(&testset, "key4", "val4");
-  ret = kvcacheset_get(&testset, "key1", &retval);
+  kvcacheset_put(&testset, "key1", kvhash_key("key1"), "val1");
+  kvcacheset_put(&testset, "key2", kvhash_key("key2"), "val2");
+  kvcacheset_put(&testset, "key3", kvhash_key("key3"), "val3");
+  kvcacheset_put(&testset, "key4", kvhash_key("key4"), "val4");
+  ret = kvcacheset_get(&testset, "key1", kvhash_key("key1"), &retval);
   ASSERT_EQUAL(ret, ERRNOKEY);
-  kvcacheset_get(&testset, "key2", &retval);
+  kvcacheset_get(&testset, "key2", kvhash_key("key2"), &retval);
   ASSERT_STRING_EQUAL(retval, "val2");
   free(retval);
-  kvcacheset_get(&testset, "key3", &retval);
+  kvcacheset_get(&testset, "key3", kvhash_key("key3"), &retval);
   ASSERT_STRING_EQUAL(retval, "val3");
   free(retval);
-  kvcacheset_get(&testset, "key4", &retval);
+  kvcacheset_get(&testset, "key4", kvhash_key("key4"), &retval);
   ASSERT_STRING_EQUAL(retval, "val4");
   free(retval);
   return 1;
@@ -95,24 +101,24 @@ int kvcacheset_replacement_no_ref_bits(void) {
 int kvcacheset_replacement_all_ref_bits(void) {
   char *retval = NULL;
   int ret;
-  kvcacheset_put(&testset, "key1", "val1");
-  kvcacheset_put(&testset, "key2", "val2");
-  kvcacheset_put(&testset, "key3", "val3");
-  kvcacheset_get(&testset, "key2", &retval);
+  kvcacheset_put(&testset, "key1", kvhash_key("key1"), "val1");
+  kvcacheset_put(&testset, "key2", kvhash_key("key2"), "val2");
+  kvcacheset_put(&testset, "key3", kvhash_key("key3"), "val3");
+  kvcacheset_get(&testset, "key2", kvhash_key("key2"), &retval);
   free(retval);
-  kvcacheset_get(&testset, "key3", &retval);
+  kvcacheset_get(&testset, "key3", kvhash_key("key3"), &retval);
   free(retval);
-  kvcacheset_put(&testset, "key1", "val1new");
-  kvcacheset_put(&testset, "key4", "val4");
-  ret = kvcacheset_get(&testset, "key1", &retval);
+  kvcacheset_put(&testset, "key1", kvhash_key("key1"), "val1new");
+  kvcacheset_put(&testset, "key4", kvhash_key("key4"), "val4");
+  ret = kvcacheset_get(&testset, "key1", kvhash_key("key1"), &retval);
   ASSERT_EQUAL(ret, ERRNOKEY);
-  kvcacheset_get(&testset, "key2", &retval);
+  kvcacheset_get(&testset, "key2", kvhash_key("key2"), &retval);
   ASSERT_STRING_EQUAL(retval, "val2");
   free(retval);
-  kvcacheset_get(&testset, "key3", &retval);
+  kvcacheset_get(&testset, "key3", kvhash_key("key3"), &retval);
   ASSERT_STRING_EQUAL(retval, "val3");
   free(retval);
-  kvcacheset_get(&testset, "key4", &retval);
+  kvcacheset_get(&testset, "key4", kvhash_key("key4"), &retval);
   ASSERT_STRING_EQUAL(retval, "val4");
   free(retval);
   return 1;
@@ -121,27 +127,335 @@ int kvcacheset_replacement_all_ref_bits(void) {
 int kvcacheset_clear_all(void) {
   char *retval = NULL;
   int ret;
-  kvcacheset_put(&testset, "key1", "val1");
-  kvcacheset_put(&testset, "key2", "val2");
-  kvcacheset_put(&testset, "key3", "val3");
+  kvcacheset_put(&testset, "key1", kvhash_key("key1"), "val1");
+  kvcacheset_put(&testset, "key2", kvhash_key("key2"), "val2");
+  kvcacheset_put(&testset, "key3", kvhash_key("key3"), "val3");
   /* Ensure everything got put into the cache */
-  kvcacheset_get(&testset, "key1", &retval);
+  kvcacheset_get(&testset, "key1", kvhash_key("key1"), &retval);
   ASSERT_PTR_NOT_NULL(retval); 
   kvcacheset_clear(&testset);
 
   retval = NULL;
-  ret = kvcacheset_get(&testset, "key1", &retval);
+  ret = kvcacheset_get(&testset, "key1", kvhash_key("key1"), &retval);
   ASSERT_PTR_NULL(retval); 
   ASSERT_EQUAL(ret, ERRNOKEY);
-  ret = kvcacheset_get(&testset, "key2", &retval);
+  ret = kvcacheset_get(&testset, "key2", kvhash_key("key2"), &retval);
   ASSERT_PTR_NULL(retval); 
   ASSERT_EQUAL(ret, ERRNOKEY);
-  ret = kvcacheset_get(&testset, "key3", &retval);
+  ret = kvcacheset_get(&testset, "key3", kvhash_key("key3"), &retval);
   ASSERT_PTR_NULL(retval); 
   ASSERT_EQUAL(ret, ERRNOKEY);
   return 1;
 }
 
+int kvcacheset_large_set(void) {
+  kvcacheset_t bigset;
+  char key[32], value[32], *retval;
+  int i, ret = 0;
+  kvcacheset_init(&bigset, 1000);
+  for (i = 0; i < 1500; i++) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    ret += kvcacheset_put(&bigset, key, kvhash_key(key), value);
+  }
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(bigset.num_entries, 1000);
+  /* The first 500 entries were never referenced, so they were evicted. */
+  for (i = 0; i < 500; i++) {
+    sprintf(key, "key%d", i);
+    ASSERT_EQUAL(kvcacheset_get(&bigset, key, kvhash_key(key),
+        &retval), ERRNOKEY);
+  }
+  for (i = 500; i < 1500; i += 2) {
+    sprintf(key, "key%d", i);
+    ASSERT_EQUAL(kvcacheset_del(&bigset, key, kvhash_key(key)), 0);
+  }
+  for (i = 501; i < 1500; i += 2) {
+    sprintf(key, "key%d", i);
+    sprintf(value, "val%d", i);
+    ASSERT_EQUAL(kvcacheset_get(&bigset, key, kvhash_key(key), &retval), 0);
+    ASSERT_STRING_EQUAL(retval, value);
+    free(retval);
+  }
+  kvcacheset_clear(&bigset);
+  return 1;
+}
+
+int kvcacheset_get_chunk_held(void) {
+  kvchunk_t *chunk, *again;
+  ASSERT_EQUAL(kvcacheset_put(&testset, "key1", kvhash_key("key1"),
+      "value1"), 0);
+  ASSERT_EQUAL(kvcacheset_get_chunk(&testset, "key1", kvhash_key("key1"),
+      &chunk), 0);
+  ASSERT_STRING_EQUAL(chunk->data, "value1");
+  ASSERT_EQUAL(chunk->length, 6);
+  /* The held value must outlive both an overwrite and an eviction. */
+  ASSERT_EQUAL(kvcacheset_put(&testset, "key1", kvhash_key("key1"),
+      "value2"), 0);
+  ASSERT_STRING_EQUAL(chunk->data, "value1");
+  ASSERT_EQUAL(kvcacheset_get_chunk(&testset, "key1", kvhash_key("key1"),
+      &again), 0);
+  ASSERT_STRING_EQUAL(again->data, "value2");
+  ASSERT_EQUAL(kvcacheset_del(&testset, "key1", kvhash_key("key1")), 0);
+  ASSERT_STRING_EQUAL(again->data, "value2");
+  kvchunk_release(again);
+  ASSERT_EQUAL(kvcacheset_get_chunk(&testset, "key1", kvhash_key("key1"),
+      &again), ERRNOKEY);
+  kvchunk_release(chunk);
+  /* Once released, the chunk is handed out again by the next PUT. */
+  ASSERT_EQUAL(kvcacheset_put(&testset, "key2", kvhash_key("key2"),
+      "value3"), 0);
+  ASSERT_EQUAL(kvcacheset_get_chunk(&testset, "key2", kvhash_key("key2"),
+      &again), 0);
+  ASSERT_EQUAL(again, chunk);
+  ASSERT_STRING_EQUAL(again->data, "value3");
+  kvchunk_release(again);
+  return 1;
+}
+
+/* The write-backs made by the set under test, as "key=value", or "key=-" for
+ * a deletion, and the result each of them returns. */
+char kvcacheset_written[4][16];
+int kvcacheset_num_written;
+int kvcacheset_write_back_ret;
+
+int kvcacheset_record_write_back(char *key, char *value, void *aux) {
+  if (kvcacheset_write_back_ret == 0)
+    sprintf(kvcacheset_written[kvcacheset_num_written++ % 4], "%s=%s", key,
+        value != NULL ? value : "-");
+  return kvcacheset_write_back_ret;
+}
+
+int kvcacheset_write_back(void) {
+  kvcacheset_t set;
+  char *retval;
+  kvcacheset_init(&set, 2);
+  set.write_back = kvcacheset_record_write_back;
+  kvcacheset_num_written = 0;
+  kvcacheset_write_back_ret = 0;
+  /* Writes to a dirty entry are coalesced, and deletes are held. */
+  ASSERT_EQUAL(kvcacheset_put_dirty(&set, "a", kvhash_key("a"), "1"), 0);
+  ASSERT_EQUAL(kvcacheset_put_dirty(&set, "a", kvhash_key("a"), "2"), 0);
+  ASSERT_EQUAL(kvcacheset_del_dirty(&set, "b", kvhash_key("b")), 0);
+  ASSERT_EQUAL(kvcacheset_get(&set, "b", kvhash_key("b"), &retval),
+      ERRDELETED);
+  ASSERT_EQUAL(set.num_dirty, 2);
+  /* A clean PUT leaves a dirty entry alone. */
+  ASSERT_EQUAL(kvcacheset_put(&set, "a", kvhash_key("a"), "stale"), 0);
+  ASSERT_EQUAL(kvcacheset_get(&set, "a", kvhash_key("a"), &retval), 0);
+  ASSERT_STRING_EQUAL(retval, "2");
+  free(retval);
+  ASSERT_EQUAL(kvcacheset_flush(&set), 0);
+  ASSERT_EQUAL(kvcacheset_num_written, 2);
+  ASSERT_STRING_EQUAL(kvcacheset_written[0], "a=2");
+  ASSERT_STRING_EQUAL(kvcacheset_written[1], "b=-");
+  ASSERT_EQUAL(set.num_dirty, 0);
+  ASSERT_EQUAL(kvcacheset_flush(&set), 0);
+  ASSERT_EQUAL(kvcacheset_num_written, 2);
+  /* A dirty victim which cannot be written back is not evicted. */
+  ASSERT_EQUAL(kvcacheset_put_dirty(&set, "a", kvhash_key("a"), "3"), 0);
+  ASSERT_EQUAL(kvcacheset_del_dirty(&set, "b", kvhash_key("b")), 0);
+  kvcacheset_write_back_ret = -1;
+  ASSERT_EQUAL(kvcacheset_put(&set, "c", kvhash_key("c"), "4"), -1);
+  ASSERT_EQUAL(kvcacheset_get(&set, "a", kvhash_key("a"), &retval), 0);
+  ASSERT_STRING_EQUAL(retval, "3");
+  free(retval);
+  ASSERT_EQUAL(kvcacheset_get(&set, "b", kvhash_key("b"), &retval),
+      ERRDELETED);
+  ASSERT_EQUAL(set.num_dirty, 2);
+  kvcacheset_write_back_ret = 0;
+  ASSERT_EQUAL(kvcacheset_put(&set, "c", kvhash_key("c"), "4"), 0);
+  ASSERT_EQUAL(kvcacheset_num_written, 3);
+  ASSERT_EQUAL(set.num_dirty, 1);
+  ASSERT_EQUAL(set.num_entries, 2);
+  kvcacheset_clear(&set);
+  return 1;
+}
+
+int kvcacheset_concurrent_done;
+
+/* Repeatedly overwrites a single key with values made of a single repeated
+ * character, varying both the character and the length. */
+void *kvcacheset_writer_thread(void *aux) {
+  char value[MAX_VALLEN + 1];
+  int i, len;
+  for (i = 0; i < 20000; i++) {
+    len = 1 + (i * 7) % MAX_VALLEN;
+    memset(value, 'a' + i % 26, len);
+    value[len] = '\0';
+    pthread_rwlock_wrlock(&testset.lock);
+    kvcacheset_put(&testset, "shared", kvhash_key("shared"), value);
+    pthread_rwlock_unlock(&testset.lock);
+  }
+  __atomic_store_n(&kvcacheset_concurrent_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+int kvcacheset_concurrent_get(void) {
+  pthread_t writer;
+  char *retval;
+  size_t i;
+  int torn = 0;
+  kvcacheset_put(&testset, "shared", kvhash_key("shared"), "a");
+  kvcacheset_concurrent_done = 0;
+  pthread_create(&writer, NULL, kvcacheset_writer_thread, NULL);
+  while (!__atomic_load_n(&kvcacheset_concurrent_done, __ATOMIC_ACQUIRE)) {
+    if (kvcacheset_get(&testset, "shared", kvhash_key("shared"), &retval) != 0)
+      return 0;
+    for (i = 1; retval[i] != '\0'; i++) {
+      if (retval[i] != retval[0])
+        torn = 1;
+    }
+    free(retval);
+  }
+  pthread_join(writer, NULL);
+  ASSERT_FALSE(torn);
+  return 1;
+}
+
+int kvcacheset_concurrent_get_chunk(void) {
+  pthread_t writer;
+  kvchunk_t *chunk;
+  size_t i;
+  int torn = 0;
+  kvcacheset_put(&testset, "shared", kvhash_key("shared"), "a");
+  kvcacheset_concurrent_done = 0;
+  pthread_create(&writer, NULL, kvcacheset_writer_thread, NULL);
+  while (!__atomic_load_n(&kvcacheset_concurrent_done, __ATOMIC_ACQUIRE)) {
+    if (kvcacheset_get_chunk(&testset, "shared", kvhash_key("shared"),
+        &chunk) != 0)
+      return 0;
+    /* The writer keeps replacing the value; a held chunk must not change. */
+    for (i = 1; chunk->data[i] != '\0'; i++) {
+      if (chunk->data[i] != chunk->data[0])
+        torn = 1;
+    }
+    if (i != chunk->length)
+      torn = 1;
+    kvchunk_release(chunk);
+  }
+  pthread_join(writer, NULL);
+  ASSERT_FALSE(torn);
+  return 1;
+}
+
+/* Runs a workload of 4 hot keys and a scan through a set of 8 slots evicting
+ * with POLICY. The hot keys are put and read once; then in each of 8 rounds
+ * every hot key is read, and put back if it was missed, and 8 keys never seen
+ * before are each missed and put, as a server would. Returns the number of
+ * times a hot key was missed. */
+int kvcacheset_scan_hot_misses(kvpolicy_type_t policy) {
+  kvcacheset_t set;
+  char key[32], *retval;
+  int round, i, misses = 0;
+  kvcacheset_init_policy(&set, 8, policy);
+  for (i = 0; i < 4; i++) {
+    sprintf(key, "hot%d", i);
+    kvcacheset_put(&set, key, kvhash_key(key), "hot");
+    if (kvcacheset_get(&set, key, kvhash_key(key), &retval) != 0)
+      return -1;
+    free(retval);
+  }
+  for (round = 0; round < 8; round++) {
+    for (i = 0; i < 4; i++) {
+      sprintf(key, "hot%d", i);
+      if (kvcacheset_get(&set, key, kvhash_key(key), &retval) == 0) {
+        free(retval);
+        continue;
+      }
+      misses++;
+      kvcacheset_put(&set, key, kvhash_key(key), "hot");
+    }
+    for (i = 0; i < 8; i++) {
+      sprintf(key, "scan%d-%d", round, i);
+      if (kvcacheset_get(&set, key, kvhash_key(key), &retval) == 0)
+        return -1;
+      kvcacheset_put(&set, key, kvhash_key(key), "cold");
+    }
+  }
+  kvpolicy_destroy(&set.policy);
+  return misses;
+}
+
+int kvcacheset_scan_resistance(void) {
+  /* Second chance clears the hot keys' reference bits on its way through the
+   * scan, then evicts them. */
+  ASSERT_TRUE(kvcacheset_scan_hot_misses(KVPOLICY_CLOCK) > 0);
+  ASSERT_EQUAL(kvcacheset_scan_hot_misses(KVPOLICY_ARC), 0);
+  ASSERT_EQUAL(kvcacheset_scan_hot_misses(KVPOLICY_TINYLFU), 0);
+  return 1;
+}
+
+int kvcacheset_arc_adapts(void) {
+  kvcacheset_t set;
+  char *retval;
+  kvcacheset_init_policy(&set, 2, KVPOLICY_ARC);
+  /* KEY1 is read again, so it moves to T2 with the next write. */
+  kvcacheset_put(&set, "key1", kvhash_key("key1"), "val1");
+  ASSERT_EQUAL(kvcacheset_get(&set, "key1", kvhash_key("key1"), &retval), 0);
+  free(retval);
+  kvcacheset_put(&set, "key2", kvhash_key("key2"), "val2");
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T2], 1);
+  /* T1 is over its target of 0, so KEY2 is evicted and leaves a ghost. */
+  kvcacheset_put(&set, "key3", kvhash_key("key3"), "val3");
+  ASSERT_EQUAL(kvcacheset_get(&set, "key2", kvhash_key("key2"), &retval),
+      ERRNOKEY);
+  ASSERT_EQUAL(set.policy.arc.sizes[KVPOLICY_ARC_B1], 1);
+  /* KEY2 coming back through its ghost grows the target of T1, so T2 gives
+   * up KEY1, and KEY2 goes to T2. */
+  kvcacheset_put(&set, "key2", kvhash_key("key2"), "val2");
+  ASSERT_EQUAL(set.policy.arc.target, 1);
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T1], 1);
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T2], 1);
+  ASSERT_EQUAL(set.policy.arc.sizes[KVPOLICY_ARC_B2], 1);
+  ASSERT_EQUAL(kvcacheset_get(&set, "key1", kvhash_key("key1"), &retval),
+      ERRNOKEY);
+  /* A ghost hit in B2 shrinks the target again, and KEY3 makes room. */
+  kvcacheset_put(&set, "key1", kvhash_key("key1"), "val1");
+  ASSERT_EQUAL(set.policy.arc.target, 0);
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T2], 2);
+  ASSERT_EQUAL(kvcacheset_get(&set, "key3", kvhash_key("key3"), &retval),
+      ERRNOKEY);
+  ASSERT_EQUAL(kvcacheset_get(&set, "key1", kvhash_key("key1"), &retval), 0);
+  ASSERT_STRING_EQUAL(retval, "val1");
+  free(retval);
+  /* A DEL leaves no ghost behind. */
+  ASSERT_EQUAL(kvcacheset_del(&set, "key2", kvhash_key("key2")), 0);
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T2], 1);
+  ASSERT_EQUAL(set.policy.arc.sizes[KVPOLICY_ARC_B1], 1);
+  ASSERT_EQUAL(set.policy.arc.sizes[KVPOLICY_ARC_B2], 0);
+  kvcacheset_clear(&set);
+  ASSERT_EQUAL(set.policy.arc.sizes[KVPOLICY_ARC_B1], 0);
+  ASSERT_EQUAL(set.policy.sizes[KVPOLICY_ARC_T2], 0);
+  kvpolicy_destroy(&set.policy);
+  return 1;
+}
+
+int kvcacheset_frequency_sketch(void) {
+  kvsketch_t sketch;
+  uint64_t a = kvhash_key("a"), b = kvhash_key("b"), c = kvhash_key("c");
+  int i;
+  ASSERT_EQUAL(kvsketch_init(&sketch, 8), 0);
+  for (i = 0; i < 3; i++)
+    kvsketch_increment(&sketch, a);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, a), 3);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, b), 0);
+  /* Counters saturate. */
+  for (i = 0; i < 17; i++)
+    kvsketch_increment(&sketch, a);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, a), KVSKETCH_MAX_COUNT);
+  /* The 80th increment, 10 per expected key, halves every counter. */
+  for (i = 0; i < 59; i++)
+    kvsketch_increment(&sketch, c);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, a), KVSKETCH_MAX_COUNT);
+  kvsketch_increment(&sketch, c);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, a), KVSKETCH_MAX_COUNT / 2);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, c), KVSKETCH_MAX_COUNT / 2);
+  kvsketch_clear(&sketch);
+  ASSERT_EQUAL(kvsketch_estimate(&sketch, a), 0);
+  kvsketch_destroy(&sketch);
+  return 1;
+}
 
 test_info_t kvcacheset_tests[] = {
   {"Simple PUT and GET of a single value", kvcacheset_simple_put_get_single},
@@ -154,6 +468,20 @@ test_info_t kvcacheset_tests[] = {
   {"PUT with overfull cache, replacement policy when all ref bits set",
     kvcacheset_replacement_all_ref_bits},
   {"Clearing the cache set", kvcacheset_clear_all},
+  {"PUT, GET and DEL on a large cache set", kvcacheset_large_set},
+  {"Lock-free GETs never observe a partially written value",
+    kvcacheset_concurrent_get},
+  {"Zero-copy GETs hold their value across overwrite and DEL",
+    kvcacheset_get_chunk_held},
+  {"Zero-copy GETs never observe a value being rewritten",
+    kvcacheset_concurrent_get_chunk},
+  {"ARC and W-TinyLFU keep hot keys through a scan",
+    kvcacheset_scan_resistance},
+  {"ARC adapts its target size on ghost hits", kvcacheset_arc_adapts},
+  {"The frequency sketch counts, saturates and ages",
+    kvcacheset_frequency_sketch},
+  {"Dirty entries are coalesced, held and written back",
+    kvcacheset_write_back},
   NULL_TEST_INFO
 };
 
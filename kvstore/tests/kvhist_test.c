@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "kvhist.h"
+#include "tester.h"
+
+kvhist_t testhist;
+
+int kvhist_test_init(void) {
+  kvhist_init(&testhist);
+  return 0;
+}
+
+int kvhist_small_values(void) {
+  uint64_t i;
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 50), 0);
+  for (i = 1; i <= 100; i++)
+    kvhist_record(&testhist, i);
+  /* Values below 2^KVHIST_SUB_BITS are recorded exactly. */
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 0), 1);
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 50), 50);
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 99), 99);
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 99.9), 100);
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 100), 100);
+  ASSERT_EQUAL(testhist.total, 100);
+  ASSERT_EQUAL(testhist.min, 1);
+  ASSERT_EQUAL(testhist.max, 100);
+  ASSERT_TRUE(kvhist_mean(&testhist) == 50.5);
+  return 1;
+}
+
+int kvhist_precision(void) {
+  uint64_t value, p50;
+  /* Every value is reported at most 1/128th above itself, from the smallest
+   * to the largest. */
+  for (value = 1; value < UINT64_MAX / 3; value = value * 3 + 1) {
+    kvhist_reset(&testhist);
+    kvhist_record(&testhist, value);
+    kvhist_record(&testhist, UINT64_MAX);
+    p50 = kvhist_percentile(&testhist, 50);
+    ASSERT_TRUE(p50 >= value);
+    ASSERT_TRUE(p50 - value <= value / 128);
+    ASSERT_EQUAL(kvhist_percentile(&testhist, 100), UINT64_MAX);
+  }
+  return 1;
+}
+
+int kvhist_merge_reset(void) {
+  kvhist_t other;
+  uint64_t i;
+  kvhist_init(&other);
+  for (i = 0; i < 1000; i++) {
+    kvhist_record(&testhist, 1000 + i);
+    kvhist_record(&other, 1000000 + i);
+  }
+  kvhist_merge(&testhist, &other);
+  ASSERT_EQUAL(testhist.total, 2000);
+  ASSERT_EQUAL(testhist.min, 1000);
+  ASSERT_EQUAL(testhist.max, 1000999);
+  ASSERT_TRUE(kvhist_percentile(&testhist, 50) < 2000);
+  ASSERT_TRUE(kvhist_percentile(&testhist, 51) >= 1000000);
+  kvhist_reset(&testhist);
+  ASSERT_EQUAL(testhist.total, 0);
+  ASSERT_EQUAL(kvhist_percentile(&testhist, 99), 0);
+  kvhist_destroy(&other);
+  return 1;
+}
+
+int kvhist_mean_fraction(void) {
+  double mean;
+  ASSERT_TRUE(kvhist_mean(&testhist) == 0);
+  kvhist_record(&testhist, 1);
+  kvhist_record(&testhist, 2);
+  kvhist_record(&testhist, 2);
+  mean = kvhist_mean(&testhist);
+  ASSERT_TRUE(mean > 1.6666 && mean < 1.6667);
+  kvhist_record(&testhist, 1000000000);
+  mean = kvhist_mean(&testhist);
+  ASSERT_TRUE(mean == 250000001.25);
+  return 1;
+}
+
+test_info_t kvhist_tests[] = {
+  {"Small values are recorded exactly", kvhist_small_values},
+  {"Large values are recorded within the histogram's precision",
+    kvhist_precision},
+  {"Histograms can be merged and reset", kvhist_merge_reset},
+  {"The mean keeps the fraction of its values' average", kvhist_mean_fraction},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvhist_suite = {"KVHist Tests", kvhist_test_init, NULL,
+  kvhist_tests};
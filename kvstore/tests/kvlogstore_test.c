@@ -0,0 +1,252 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "kvstore.h"
+#include "tester.h"
+
+#define KVLOGSTORE_DIRNAME "kvlogstore-test"
+
+kvstore_t testlogstore;
+
+/* Deletes all current segments and removes the store directory. */
+int kvlogstore_test_clean(void) {
+  return kvstore_clean(&testlogstore);
+}
+
+int kvlogstore_test_init(void) {
+  return kvstore_init_backend(&testlogstore, KVLOGSTORE_DIRNAME, KVSTORE_LOG);
+}
+
+/* Simulates a restart by opening the same directory with a fresh store. */
+int kvlogstore_test_reopen(void) {
+  memset(&testlogstore, 0, sizeof(kvstore_t));
+  return kvlogstore_test_init();
+}
+
+int kvlogstore_put_get_del(void) {
+  char *retval = NULL;
+  int ret;
+  ret = kvstore_put(&testlogstore, "KEY1", "VALUE1");
+  ret += kvstore_put(&testlogstore, "KEY2", "");
+  ret += kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE1");
+  free(retval);
+  ret += kvstore_get(&testlogstore, "KEY2", &retval);
+  ASSERT_STRING_EQUAL(retval, "");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(kvstore_del_check(&testlogstore, "KEY1"), 0);
+  ret = kvstore_del(&testlogstore, "KEY1");
+  ASSERT_EQUAL(ret, 0);
+  retval = NULL;
+  ret = kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_EQUAL(ret, ERRNOKEY);
+  ASSERT_PTR_NULL(retval);
+  ASSERT_EQUAL(kvstore_del(&testlogstore, "KEY1"), ERRNOKEY);
+  ASSERT_EQUAL(kvstore_del_check(&testlogstore, "KEY1"), ERRNOKEY);
+  return 1;
+}
+
+int kvlogstore_overwrite_and_reopen(void) {
+  char *retval;
+  int ret;
+  ret = kvstore_put(&testlogstore, "mykey", "initial value");
+  ret += kvstore_put(&testlogstore, "mykey", "updated value");
+  ret += kvstore_put(&testlogstore, "gone", "soon");
+  ret += kvstore_del(&testlogstore, "gone");
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ret = kvstore_get(&testlogstore, "mykey", &retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(retval, "updated value");
+  free(retval);
+  ASSERT_FALSE(kvstore_haskey(&testlogstore, "gone"));
+  return 1;
+}
+
+int kvlogstore_compaction(void) {
+  char *retval, filename[MAX_FILENAME];
+  struct stat st;
+  int ret;
+  ret = kvstore_put(&testlogstore, "KEY1", "old");
+  ret += kvstore_put(&testlogstore, "KEY1", "new");
+  ret += kvstore_put(&testlogstore, "KEY2", "VALUE2");
+  ret += kvstore_put(&testlogstore, "KEY3", "VALUE3");
+  ret += kvstore_del(&testlogstore, "KEY3");
+  ret += kvlogstore_compact(testlogstore.logstore, 0);
+  ASSERT_EQUAL(ret, 0);
+  sprintf(filename, "%s/0%s", KVLOGSTORE_DIRNAME, KVLOGSTORE_FILETYPE);
+  ASSERT_EQUAL(stat(filename, &st), -1);
+  ret = kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "new");
+  free(retval);
+  ret += kvstore_get(&testlogstore, "KEY2", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE2");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  /* The compacted state must survive a restart without resurrecting KEY3. */
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ret = kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "new");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_FALSE(kvstore_haskey(&testlogstore, "KEY3"));
+  return 1;
+}
+
+int kvlogstore_torn_tail(void) {
+  char *retval, filename[MAX_FILENAME], garbage[] = "\x11\x22\x33\x44\x05";
+  int fd, ret;
+  ret = kvstore_put(&testlogstore, "KEY1", "VALUE1");
+  ASSERT_EQUAL(ret, 0);
+  /* Simulate a crash in the middle of appending a record. */
+  sprintf(filename, "%s/0%s", KVLOGSTORE_DIRNAME, KVLOGSTORE_FILETYPE);
+  fd = open(filename, O_WRONLY | O_APPEND);
+  ASSERT_TRUE(fd >= 0);
+  write(fd, garbage, sizeof(garbage));
+  close(fd);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ret = kvstore_put(&testlogstore, "KEY2", "VALUE2");
+  ret += kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE1");
+  free(retval);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ret += kvstore_get(&testlogstore, "KEY2", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE2");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  return 1;
+}
+
+int kvlogstore_segment_table_full(void) {
+  char filename[MAX_FILENAME];
+  int fd;
+  ASSERT_EQUAL(kvstore_put(&testlogstore, "KEY1", "VALUE1"), 0);
+  /* A segment ID this large cannot fit in the segment table. */
+  sprintf(filename, "%s/3000000000%s", KVLOGSTORE_DIRNAME, KVLOGSTORE_FILETYPE);
+  fd = open(filename, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+  ASSERT_TRUE(fd >= 0);
+  close(fd);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), -ENOMEM);
+  ASSERT_PTR_NULL(testlogstore.logstore);
+  remove(filename);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ASSERT_TRUE(kvstore_haskey(&testlogstore, "KEY1"));
+  return 1;
+}
+
+int kvlogstore_roll_failure(void) {
+  char *retval, filename[MAX_FILENAME];
+  int ret;
+  ASSERT_EQUAL(kvstore_put(&testlogstore, "KEY1", "VALUE1"), 0);
+  /* Keep the next segment from being created, so it cannot be rolled to. */
+  sprintf(filename, "%s/1%s", KVLOGSTORE_DIRNAME, KVLOGSTORE_FILETYPE);
+  ASSERT_EQUAL(mkdir(filename, 0700), 0);
+  ASSERT_EQUAL(kvlogstore_compact(testlogstore.logstore, 0), ERRFILACCESS);
+  ASSERT_EQUAL(testlogstore.logstore->active, 0);
+  ret = kvstore_put(&testlogstore, "KEY2", "VALUE2");
+  ret += kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE1");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  rmdir(filename);
+  return 1;
+}
+
+int kvlogstore_compact_corrupt(void) {
+  char *retval, filename[MAX_FILENAME];
+  struct stat st;
+  int fd, ret;
+  ret = kvstore_put(&testlogstore, "KEY1", "VALUE1");
+  ret += kvstore_put(&testlogstore, "KEY2", "VALUE2");
+  ASSERT_EQUAL(ret, 0);
+  /* Corrupt the last byte of KEY2's value, ending the copy of segment 0. */
+  sprintf(filename, "%s/0%s", KVLOGSTORE_DIRNAME, KVLOGSTORE_FILETYPE);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  fd = open(filename, O_WRONLY);
+  ASSERT_TRUE(fd >= 0);
+  ASSERT_EQUAL(pwrite(fd, "X", 1, st.st_size - 2), 1);
+  close(fd);
+  ASSERT_EQUAL(kvlogstore_compact(testlogstore.logstore, 0), ERRFILACCESS);
+  ASSERT_EQUAL(stat(filename, &st), 0);
+  ret = kvstore_get(&testlogstore, "KEY1", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUE1");
+  free(retval);
+  ret += kvstore_get(&testlogstore, "KEY2", &retval);
+  ASSERT_STRING_EQUAL(retval, "VALUEX");
+  free(retval);
+  ASSERT_EQUAL(ret, 0);
+  return 1;
+}
+
+int kvlogstore_invalid_requests(void) {
+  char *retval = NULL, oversizedkey[MAX_KEYLEN + 2];
+  int ret;
+  memset(oversizedkey, 'a', MAX_KEYLEN + 1);
+  oversizedkey[MAX_KEYLEN + 1] = '\0';
+  ret = kvstore_put(&testlogstore, oversizedkey, "value");
+  ASSERT_EQUAL(ret, ERRKEYLEN);
+  ret = kvstore_get(&testlogstore, oversizedkey, &retval);
+  ASSERT_EQUAL(ret, ERRKEYLEN);
+  kvstore_clean(&testlogstore);
+  ret = kvstore_get(&testlogstore, "KEY", &retval);
+  ASSERT_EQUAL(ret, ERRFILACCESS);
+  ret = kvstore_put(&testlogstore, "KEY", "VALUE");
+  ASSERT_EQUAL(ret, ERRFILACCESS);
+  ASSERT_PTR_NULL(retval);
+  return 1;
+}
+
+/* Appends each key visited to the string _KEYS. */
+int kvlogstore_scan_collect(char *key, char *value, void *_keys) {
+  strcat((char *) _keys, key);
+  strcat((char *) _keys, "=");
+  strcat((char *) _keys, value);
+  strcat((char *) _keys, " ");
+  return 0;
+}
+
+int kvlogstore_scan_ordered(void) {
+  char keys[256] = "";
+  int ret;
+  ret = kvstore_put(&testlogstore, "b", "2");
+  ret += kvstore_put(&testlogstore, "c", "3");
+  ret += kvstore_put(&testlogstore, "a", "1");
+  ret += kvstore_put(&testlogstore, "b", "two");
+  ret += kvstore_del(&testlogstore, "c");
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(kvlogstore_test_reopen(), 0);
+  ret = kvstore_scan(&testlogstore, NULL, NULL, 0, kvlogstore_scan_collect,
+      keys);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(keys, "a=1 b=two ");
+  return 1;
+}
+
+test_info_t kvlogstore_tests[] = {
+  {"Simple PUT, GET and DEL on a log-structured store", kvlogstore_put_get_del},
+  {"Overwrites and deletes persist across a restart",
+    kvlogstore_overwrite_and_reopen},
+  {"Compacting a segment keeps live entries and drops dead ones",
+    kvlogstore_compaction},
+  {"A torn record at the end of a segment is discarded on restart",
+    kvlogstore_torn_tail},
+  {"A segment table which cannot grow fails the store's init",
+    kvlogstore_segment_table_full},
+  {"A segment which cannot be rolled to leaves the active segment in place",
+    kvlogstore_roll_failure},
+  {"Compaction keeps a segment whose records cannot all be copied",
+    kvlogstore_compact_corrupt},
+  {"Oversized keys and uninitialized stores are rejected",
+    kvlogstore_invalid_requests},
+  {"Scanning a log-structured store visits its keys in order",
+    kvlogstore_scan_ordered},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvlogstore_suite = {"KVLogStore Tests", kvlogstore_test_init,
+  kvlogstore_test_clean, kvlogstore_tests};
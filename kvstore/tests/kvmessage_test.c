@@ -0,0 +1,204 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "kvmessage.h"
+#include "tester.h"
+
+int kvmessage_fds[2];
+
+int kvmessage_test_init(void) {
+  return socketpair(AF_UNIX, SOCK_STREAM, 0, kvmessage_fds);
+}
+
+int kvmessage_test_clean(void) {
+  close(kvmessage_fds[0]);
+  close(kvmessage_fds[1]);
+  return 0;
+}
+
+/* Sends a message in FORMAT and checks that it is received intact. */
+int kvmessage_roundtrip(kvformat_t format) {
+  kvmessage_t msg, *recvd;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = PUTREQ;
+  msg.key = "key \"with\" quotes";
+  msg.value = "";
+  msg.txid = 0x0123456789abcdefULL;
+  msg.format = format;
+  kvmessage_send(&msg, kvmessage_fds[0]);
+  recvd = kvmessage_parse(kvmessage_fds[1]);
+  ASSERT_PTR_NOT_NULL(recvd);
+  ASSERT_EQUAL(recvd->type, PUTREQ);
+  ASSERT_EQUAL(recvd->format, format);
+  ASSERT_STRING_EQUAL(recvd->key, msg.key);
+  ASSERT_STRING_EQUAL(recvd->value, "");
+  ASSERT_PTR_NULL(recvd->message);
+  ASSERT_TRUE(recvd->txid == msg.txid);
+  kvmessage_free(recvd);
+  return 1;
+}
+
+int kvmessage_json_roundtrip(void) {
+  return kvmessage_roundtrip(KVMESSAGE_JSON);
+}
+
+int kvmessage_binary_roundtrip(void) {
+  return kvmessage_roundtrip(KVMESSAGE_BINARY);
+}
+
+/* Sends a batch message in FORMAT and checks that it is received intact. */
+int kvmessage_batch_roundtrip(kvformat_t format) {
+  kvmessage_t msg, *recvd;
+  kvpair_t batch[3] = {{"one", "1"}, {"two", NULL}, {"three", ""}};
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = MGETRESP;
+  msg.batch = batch;
+  msg.batch_size = 3;
+  msg.txid = 42;
+  msg.format = format;
+  kvmessage_send(&msg, kvmessage_fds[0]);
+  recvd = kvmessage_parse(kvmessage_fds[1]);
+  ASSERT_PTR_NOT_NULL(recvd);
+  ASSERT_EQUAL(recvd->type, MGETRESP);
+  ASSERT_PTR_NULL(recvd->key);
+  ASSERT_TRUE(recvd->txid == 42);
+  ASSERT_EQUAL(recvd->batch_size, 3);
+  ASSERT_STRING_EQUAL(recvd->batch[0].key, "one");
+  ASSERT_STRING_EQUAL(recvd->batch[0].value, "1");
+  ASSERT_STRING_EQUAL(recvd->batch[1].key, "two");
+  ASSERT_PTR_NULL(recvd->batch[1].value);
+  ASSERT_STRING_EQUAL(recvd->batch[2].key, "three");
+  ASSERT_STRING_EQUAL(recvd->batch[2].value, "");
+  kvmessage_free(recvd);
+  return 1;
+}
+
+int kvmessage_json_batch(void) {
+  return kvmessage_batch_roundtrip(KVMESSAGE_JSON);
+}
+
+int kvmessage_binary_batch(void) {
+  return kvmessage_batch_roundtrip(KVMESSAGE_BINARY);
+}
+
+int kvmessage_mixed_back_to_back(void) {
+  kvmessage_t msg, *first, *second;
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = RESP;
+  msg.message = MSG_SUCCESS;
+  kvmessage_send(&msg, kvmessage_fds[0]);
+  msg.format = KVMESSAGE_BINARY;
+  msg.type = GETRESP;
+  msg.key = "k";
+  msg.value = "v";
+  msg.message = NULL;
+  kvmessage_send(&msg, kvmessage_fds[0]);
+  first = kvmessage_parse(kvmessage_fds[1]);
+  second = kvmessage_parse(kvmessage_fds[1]);
+  ASSERT_PTR_NOT_NULL(first);
+  ASSERT_PTR_NOT_NULL(second);
+  ASSERT_EQUAL(first->format, KVMESSAGE_JSON);
+  ASSERT_STRING_EQUAL(first->message, MSG_SUCCESS);
+  ASSERT_EQUAL(second->format, KVMESSAGE_BINARY);
+  ASSERT_EQUAL(second->type, GETRESP);
+  ASSERT_STRING_EQUAL(second->key, "k");
+  ASSERT_STRING_EQUAL(second->value, "v");
+  ASSERT_PTR_NULL(second->message);
+  ASSERT_TRUE(first->txid == 0 && second->txid == 0);
+  kvmessage_free(first);
+  kvmessage_free(second);
+  return 1;
+}
+
+int kvmessage_binary_truncated(void) {
+  /* A key whose length runs past the end of the body. */
+  unsigned char frame[] = {0, 0, 0, 9, KVMESSAGE_BINARY_V1, GETREQ,
+    KVMESSAGE_HAS_KEY, 0, 0, 0, 100, 'a', 'b'};
+  uint32_t size = htonl(sizeof(frame) - 4);
+  memcpy(frame, &size, 4);
+  ASSERT_EQUAL(write(kvmessage_fds[0], frame, sizeof(frame)), sizeof(frame));
+  ASSERT_PTR_NULL(kvmessage_parse(kvmessage_fds[1]));
+  return 1;
+}
+
+/* Writes a JSON GETREQ one byte at a time, pausing between bytes. */
+void *kvmessage_trickle_thread(void *aux) {
+  const char *body = "{ \"type\": 0, \"key\": \"trickled\" }";
+  uint32_t size = htonl(strlen(body));
+  size_t i;
+  for (i = 0; i < 4; i++) {
+    write(kvmessage_fds[0], (char *) &size + i, 1);
+    usleep(1000);
+  }
+  for (i = 0; i < strlen(body); i++) {
+    write(kvmessage_fds[0], body + i, 1);
+    usleep(100);
+  }
+  return NULL;
+}
+
+int kvmessage_partial_reads(void) {
+  pthread_t writer;
+  kvmessage_t *recvd;
+  pthread_create(&writer, NULL, kvmessage_trickle_thread, NULL);
+  recvd = kvmessage_parse(kvmessage_fds[1]);
+  pthread_join(writer, NULL);
+  ASSERT_PTR_NOT_NULL(recvd);
+  ASSERT_EQUAL(recvd->type, GETREQ);
+  ASSERT_STRING_EQUAL(recvd->key, "trickled");
+  kvmessage_free(recvd);
+  return 1;
+}
+
+int kvmessage_kvconn_buffer(void) {
+  kvconn_t sender, receiver;
+  kvmessage_t msg, *recvd;
+  char *buf, value[MAX_VALLEN + 1];
+  int i;
+  kvconn_init(&sender, kvmessage_fds[0]);
+  kvconn_init(&receiver, kvmessage_fds[1]);
+  memset(&msg, 0, sizeof(kvmessage_t));
+  msg.type = PUTREQ;
+  msg.key = "key";
+  msg.value = value;
+  for (i = 0; i < 3; i++) {
+    memset(value, 'a' + i, MAX_VALLEN);
+    value[MAX_VALLEN] = '\0';
+    msg.format = (i % 2) ? KVMESSAGE_BINARY : KVMESSAGE_JSON;
+    ASSERT_TRUE(kvconn_send(&sender, &msg) > MAX_VALLEN);
+    recvd = kvconn_parse(&receiver);
+    ASSERT_PTR_NOT_NULL(recvd);
+    ASSERT_STRING_EQUAL(recvd->value, value);
+    kvmessage_free(recvd);
+    /* The buffer is allocated once and then reused. */
+    if (i == 0)
+      buf = receiver.buf;
+    ASSERT_PTR_NOT_NULL(receiver.buf);
+    ASSERT_EQUAL(receiver.buf, buf);
+  }
+  kvconn_destroy(&sender);
+  kvconn_destroy(&receiver);
+  return 1;
+}
+
+test_info_t kvmessage_tests[] = {
+  {"JSON messages survive a round trip", kvmessage_json_roundtrip},
+  {"Binary messages survive a round trip", kvmessage_binary_roundtrip},
+  {"JSON batch messages survive a round trip", kvmessage_json_batch},
+  {"Binary batch messages survive a round trip", kvmessage_binary_batch},
+  {"JSON and binary messages can be sent back to back",
+    kvmessage_mixed_back_to_back},
+  {"Truncated binary messages are rejected", kvmessage_binary_truncated},
+  {"Messages arriving a byte at a time are reassembled",
+    kvmessage_partial_reads},
+  {"A kvconn reuses its buffer across messages", kvmessage_kvconn_buffer},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvmessage_suite = {"KVMessage Tests", kvmessage_test_init,
+  kvmessage_test_clean, kvmessage_tests};
@@ -56,6 +56,61 @@ int kvserver_single_put_get(void) {
   return 1;
 }
 
+int kvserver_batch_put_get_del(void) {
+  kvpair_t puts[2] = {{"KEY1", "VALUE1"}, {"KEY2", "VALUE2"}};
+  kvpair_t gets[3] = {{"KEY1", NULL}, {"NOKEY", NULL}, {"KEY2", NULL}};
+  kvpair_t dels[2] = {{"KEY1", NULL}, {"NOKEY", NULL}};
+  kvpair_t dups[2] = {{"KEY3", "VALUE3"}, {"KEY3", "VALUE4"}};
+  char *value;
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = puts;
+  reqmsg.batch_size = 2;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+
+  reqmsg.type = MGETREQ;
+  reqmsg.batch = gets;
+  reqmsg.batch_size = 3;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, MGETRESP);
+  ASSERT_EQUAL(respmsg.batch_size, 3);
+  ASSERT_STRING_EQUAL(respmsg.batch[0].key, "KEY1");
+  ASSERT_STRING_EQUAL(respmsg.batch[0].value, "VALUE1");
+  ASSERT_PTR_NULL(respmsg.batch[1].value);
+  ASSERT_STRING_EQUAL(respmsg.batch[2].value, "VALUE2");
+
+  /* A batch with a DEL which cannot succeed is not applied at all. */
+  reqmsg.type = MDELREQ;
+  reqmsg.batch = dels;
+  reqmsg.batch_size = 2;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY1"));
+
+  reqmsg.batch_size = 1;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY1"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY2"));
+
+  /* Where a batch names a key twice, the last write wins. */
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = dups;
+  reqmsg.batch_size = 2;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "KEY3", &value), 0);
+  ASSERT_STRING_EQUAL(value, "VALUE4");
+  free(value);
+  reqmsg.type = MDELREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY3"));
+  return 1;
+}
+
 int kvserver_del_simple(void) {
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY";
@@ -336,6 +391,128 @@ int kvserver_cache_concurrent_get_cache_writes(void) {
 }
 
 
+/* Sends a SCANREQ for the keys from START to END, at most LIMIT of them if
+ * it is not NULL, to TESTSERVER over a socket pair, and checks that the
+ * stream of SCANRESPs returned holds the keys KEY<FIRST> to KEY<LAST - 1> in
+ * order, in NUM_CHUNKS chunks. Returns 1 if so, else 0. */
+int kvserver_check_scan(char *start, char *end, char *limit, int first,
+    int last, int num_chunks) {
+  kvmessage_t *msg;
+  char key[16];
+  int fds[2], next = first, chunks = 0;
+  unsigned int i;
+  ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  reqmsg.type = SCANREQ;
+  reqmsg.key = start;
+  reqmsg.value = end;
+  reqmsg.message = limit;
+  kvmessage_send(&reqmsg, fds[0]);
+  kvserver_handle(&testserver, fds[1], NULL);
+  while ((msg = kvmessage_parse(fds[0])) != NULL && msg->type == SCANRESP) {
+    for (i = 0; i < msg->batch_size; i++, next++) {
+      sprintf(key, "KEY%03d", next);
+      ASSERT_STRING_EQUAL(msg->batch[i].key, key);
+      ASSERT_STRING_EQUAL(msg->batch[i].value, key + 3);
+    }
+    chunks++;
+    kvmessage_free(msg);
+  }
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_EQUAL(msg->type, RESP);
+  ASSERT_STRING_EQUAL(msg->message, MSG_SUCCESS);
+  kvmessage_free(msg);
+  ASSERT_EQUAL(next, last);
+  ASSERT_EQUAL(chunks, num_chunks);
+  close(fds[0]);
+  close(fds[1]);
+  return 1;
+}
+
+int kvserver_scan_stream(void) {
+  char key[16];
+  int i;
+  for (i = 199; i >= 0; i--) {
+    sprintf(key, "KEY%03d", i);
+    ASSERT_EQUAL(kvserver_put(&testserver, key, key + 3), 0);
+  }
+  kvserver_del(&testserver, "KEY190");
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY190"));
+  ASSERT_EQUAL(kvserver_check_scan("KEY050", "KEY180", NULL, 50, 180, 2), 1);
+  ASSERT_EQUAL(kvserver_check_scan(NULL, NULL, "5", 0, 5, 1), 1);
+  ASSERT_EQUAL(kvserver_check_scan("KEY185", "KEY190", NULL, 185, 190, 1), 1);
+  ASSERT_EQUAL(kvserver_check_scan("KEY5", NULL, NULL, 0, 0, 0), 1);
+  return 1;
+}
+
+int kvserver_info_stats(void) {
+  char *info;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY";
+  reqmsg.value = "MYVALUE";
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  kvcache_clear(&testserver.cache);
+  reqmsg.type = GETREQ;
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  kvserver_handle_no_tpc(&testserver, &reqmsg, &respmsg);
+  info = kvserver_get_info_message(&testserver, NULL);
+  ASSERT_PTR_NOT_NULL(info);
+  ASSERT_PTR_NOT_NULL(strstr(info, "{localhost, 8162}\nStats:\n"));
+  ASSERT_PTR_NOT_NULL(strstr(info, "cache_hits: 1\n"));
+  ASSERT_PTR_NOT_NULL(strstr(info, "cache_misses: 1\n"));
+  ASSERT_PTR_NOT_NULL(strstr(info, "store_read: count=1 "));
+  ASSERT_PTR_NOT_NULL(strstr(info, "store_write: count=1 "));
+  free(info);
+  info = kvserver_get_info_message(&testserver, KVSTATS_JSON);
+  ASSERT_PTR_NOT_NULL(info);
+  ASSERT_EQUAL(info[0], '{');
+  ASSERT_PTR_NOT_NULL(strstr(info, "\"cache_hits\": 1"));
+  ASSERT_PTR_NOT_NULL(strstr(info, "\"port\": 8162"));
+  free(info);
+  return 1;
+}
+
+int kvserver_write_back_flush(void) {
+  char *value;
+  ASSERT_EQUAL(kvserver_enable_write_back(&testserver, 60000, false), 0);
+  ASSERT_EQUAL(kvserver_put(&testserver, "WBKEY", "WBVALUE"), 0);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "WBKEY"));
+  ASSERT_EQUAL(kvserver_get(&testserver, "WBKEY", &value), 0);
+  ASSERT_STRING_EQUAL(value, "WBVALUE");
+  free(value);
+  ASSERT_EQUAL(kvserver_flush(&testserver), 0);
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "WBKEY"));
+  /* A DEL is held by the cache until the next flush. */
+  ASSERT_EQUAL(kvserver_del(&testserver, "WBKEY"), 0);
+  ASSERT_EQUAL(kvserver_get(&testserver, "WBKEY", &value), ERRNOKEY);
+  ASSERT_EQUAL(kvserver_del(&testserver, "WBKEY"), ERRNOKEY);
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "WBKEY"));
+  ASSERT_EQUAL(kvserver_disable_write_back(&testserver), 0);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "WBKEY"));
+  return 1;
+}
+
+int kvserver_write_back_wal(void) {
+  kvserver_t restarted;
+  ASSERT_EQUAL(kvserver_enable_write_back(&testserver, 60000, true), 0);
+  ASSERT_EQUAL(kvserver_put(&testserver, "WALKEY", "WALVALUE"), 0);
+  ASSERT_EQUAL(kvserver_put(&testserver, "WALGONE", "WALVALUE"), 0);
+  ASSERT_EQUAL(kvserver_del(&testserver, "WALGONE"), 0);
+  /* Crash, losing every dirty entry, and restart on the same directory. */
+  kvcache_clear(&testserver.cache);
+  kvserver_init(&restarted, KVSERVER_DIRNAME, 4, 4, 1, KVSERVER_HOSTNAME,
+      KVSERVER_PORT, false);
+  ASSERT_EQUAL(kvserver_enable_write_back(&restarted, 60000, true), 0);
+  ASSERT_TRUE(kvstore_haskey(&restarted.store, "WALKEY"));
+  ASSERT_FALSE(kvstore_haskey(&restarted.store, "WALGONE"));
+  ASSERT_EQUAL(kvserver_disable_write_back(&restarted), 0);
+  kvstore_del(&restarted.store, "WALKEY");
+  ASSERT_EQUAL(kvserver_disable_write_back(&testserver), 0);
+  kvserver_clean(&restarted);
+  kvstats_destroy(&restarted.stats);
+  free(restarted.hostname);
+  return 1;
+}
+
 test_info_t kvserver_tests[] = {
   {"Simple PUT and GET of a single value", kvserver_single_put_get},
   {"Simple PUT and GET of multiple values", kvserver_multiple_put_get},
@@ -344,6 +521,13 @@ test_info_t kvserver_tests[] = {
   {"GET requests fill the cache", kvserver_get_fills_cache},
   {"PUT on an oversized key or value", kvserver_put_oversized_fields},
   {"Simple DEL on a value", kvserver_del_simple},
+  {"Batch PUT, GET and DEL", kvserver_batch_put_get_del},
+  {"SCAN streams a range of keys in order", kvserver_scan_stream},
+  {"INFO reports the server's stats", kvserver_info_stats},
+  {"Write-back PUTs and DELs reach the store once flushed",
+    kvserver_write_back_flush},
+  {"Write-back PUTs and DELs in the WAL survive a crash",
+    kvserver_write_back_wal},
   {"PUT request cannot complete when a lock is held on cacheset",
     kvserver_cache_concurrent_puts},
   {"GET request can complete when a read lock is held on cacheset",
@@ -10,6 +10,7 @@
 #include "kvmessage.h"
 #include "kvserver.h"
 #include "socket_server.h"
+#include "tpcmaster.h"
 #include "tester.h"
 
 #define KVSERVER_TPC_HOSTNAME "localhost"
@@ -243,6 +244,75 @@ int kvserver_tpc_concurrent_del_put(void) {
   return 1;
 }
 
+int kvserver_tpc_concurrent_txns(void) {
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE1";
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* An unrelated key can be prepared alongside the first transaction. */
+  reqmsg.key = "MYKEY2";
+  reqmsg.value = "MYVALUE2";
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* A key which is already being written cannot. */
+  reqmsg.type = DELREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = NULL;
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  reqmsg.type = ABORT;
+  reqmsg.key = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = COMMIT;
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY2";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE2");
+  reqmsg.key = "MYKEY1";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, ERRMSG_NO_KEY);
+
+  /* Simulate a crash + rebuild; transaction 1 is still prepared. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+  kvserver_rebuild_state(&testserver);
+
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "MYKEY1";
+  reqmsg.value = "MYVALUE3";
+  reqmsg.txid = 4;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+
+  reqmsg.type = COMMIT;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+
+  reqmsg.type = GETREQ;
+  reqmsg.key = "MYKEY1";
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "MYVALUE1");
+  return 1;
+}
+
 int kvserver_tpc_rebuild_single_put(void) {
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY1";
@@ -397,6 +467,89 @@ int kvserver_tpc_rebuild_put_commit(void) {
   return 1;
 }
 
+int kvserver_tpc_batch_commit(void) {
+  kvpair_t puts[3] = {{"KEY1", "VALUE1"}, {"KEY2", "VALUE2"}, {"KEY3", "VALUE3"}};
+  kvpair_t dups[2] = {{"KEY4", "VALUE4"}, {"KEY4", "VALUE5"}};
+  char *value;
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = puts;
+  reqmsg.batch_size = 3;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* Every key of the batch is held by its transaction. */
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEY2";
+  reqmsg.value = "OTHER";
+  reqmsg.batch = NULL;
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY1"));
+
+  reqmsg.type = COMMIT;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY1"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY2"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY3"));
+
+  /* Where a batch names a key twice, the last write wins. */
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = dups;
+  reqmsg.batch_size = 2;
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.type = COMMIT;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "KEY4", &value), 0);
+  ASSERT_STRING_EQUAL(value, "VALUE5");
+  free(value);
+  return 1;
+}
+
+int kvserver_tpc_rebuild_batch(void) {
+  kvpair_t puts[2] = {{"KEY1", "VALUE1"}, {"KEY2", "VALUE2"}};
+  kvpair_t dels[2] = {{"KEY1", NULL}, {"KEY2", NULL}};
+  char *value;
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = puts;
+  reqmsg.batch_size = 2;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.type = COMMIT;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = MDELREQ;
+  reqmsg.batch = dels;
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* Simulate a crash before the DELs are committed. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+  kvserver_rebuild_state(&testserver);
+  ASSERT_EQUAL(kvstore_get(&testserver.store, "KEY2", &value), 0);
+  ASSERT_STRING_EQUAL(value, "VALUE2");
+  free(value);
+
+  reqmsg.type = COMMIT;
+  reqmsg.batch = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY1"));
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY2"));
+  return 1;
+}
+
 int kvserver_tpc_rebuild_multiple_commits(void) {
   reqmsg.type = PUTREQ;
   reqmsg.key = "MYKEY1";
@@ -440,6 +593,188 @@ int kvserver_tpc_rebuild_multiple_commits(void) {
   return 1;
 }
 
+int kvserver_tpc_rebuild_checkpoint(void) {
+  kvpair_t puts[2] = {{"KEY2", "VALUE2"}, {"KEY3", "VALUE3"}};
+  char filename[MAX_FILENAME];
+  tpctxn_t *txn;
+  uint64_t txid = 5;
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEY1";
+  reqmsg.value = "VALUE1";
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = puts;
+  reqmsg.batch_size = 2;
+  reqmsg.txid = 2;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.type = COMMIT;
+  reqmsg.batch = NULL;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEY4";
+  reqmsg.value = "VALUE4";
+  reqmsg.txid = 5;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* Transaction 5 is caught by the checkpoint mid-commit. */
+  HASH_FIND(hh, testserver.txns, &txid, sizeof(uint64_t), txn);
+  ASSERT_PTR_NOT_NULL(txn);
+  txn->committing = true;
+  ASSERT_EQUAL(kvserver_checkpoint(&testserver), 0);
+  txn->committing = false;
+  sprintf(filename, "%s/%s", KVSERVER_TPC_DIRNAME, TPCLOG_CHECKPOINT_FILENAME);
+  ASSERT_EQUAL(access(filename, F_OK), 0);
+  ASSERT_EQUAL(tpclog_tail_length(&testserver.log), 0);
+
+  /* Entries after the checkpoint: a committed DEL and a prepared PUT. */
+  reqmsg.type = DELREQ;
+  reqmsg.key = "KEY2";
+  reqmsg.value = NULL;
+  reqmsg.txid = 3;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.type = COMMIT;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEY5";
+  reqmsg.value = "VALUE5";
+  reqmsg.txid = 4;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+
+  /* Simulate a crash before the DEL and transaction 5 reach the store. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+  kvstore_put(&testserver.store, "KEY2", "VALUE2");
+  ASSERT_EQUAL(kvserver_rebuild_state(&testserver), 0);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY2"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY3"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY4"));
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY5"));
+
+  /* Transactions 1 and 4 are still prepared. */
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEY1";
+  reqmsg.value = "VALUE6";
+  reqmsg.txid = 6;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_ABORT);
+  reqmsg.type = COMMIT;
+  reqmsg.key = reqmsg.value = NULL;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  reqmsg.type = ABORT;
+  reqmsg.txid = 4;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "KEY1"));
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEY5"));
+  ASSERT_PTR_NULL(testserver.txns);
+  reqmsg.txid = 0;
+  return 1;
+}
+
+int kvserver_tpc_rebuild_parallel(void) {
+  kvpair_t first[4] = {{"KEYA", "A1"}, {"KEYB", "B1"}, {"KEYC", "C1"},
+      {"KEYD", "D1"}};
+  kvpair_t second[1] = {{"KEYA", "A2"}};
+  kvpair_t third[2] = {{"KEYA", "A3"}, {"KEYE", "E1"}};
+  kvpair_t fourth[1] = {{"KEYD", NULL}};
+  kvpair_t fifth[2] = {{"KEYC", "C2"}, {"KEYF", "F1"}};
+  kvpair_t *batches[5] = {first, second, third, fourth, fifth};
+  unsigned int sizes[5] = {4, 1, 2, 1, 2};
+  char *keys[6] = {"KEYA", "KEYB", "KEYC", "KEYD", "KEYE", "KEYF"};
+  char *values[6] = {"A3", "B1", "C2", NULL, "E1", "F1"};
+  char *value;
+  unsigned int i;
+
+  /* Transaction 1 stays prepared, so the log keeps the others. */
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "KEYG";
+  reqmsg.value = "G1";
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+  reqmsg.key = reqmsg.value = NULL;
+  for (i = 0; i < 5; i++) {
+    reqmsg.type = (batches[i][0].value != NULL) ? MPUTREQ : MDELREQ;
+    reqmsg.batch = batches[i];
+    reqmsg.batch_size = sizes[i];
+    reqmsg.txid = i + 2;
+    kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+    ASSERT_EQUAL(respmsg.type, VOTE_COMMIT);
+    reqmsg.type = COMMIT;
+    reqmsg.batch = NULL;
+    kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+    ASSERT_EQUAL(respmsg.type, ACK);
+  }
+
+  /* Simulate a crash which lost every write to the store, and left a stale
+   * value behind. */
+  memset(&testserver, 0, sizeof(kvserver_t));
+  kvserver_init(&testserver, KVSERVER_TPC_DIRNAME, 4, 4, 1,
+      KVSERVER_TPC_HOSTNAME, KVSERVER_TPC_PORT, true);
+  for (i = 0; i < 6; i++)
+    kvstore_del(&testserver.store, keys[i]);
+  kvstore_put(&testserver.store, "KEYD", "D1");
+  ASSERT_EQUAL(kvserver_rebuild_state(&testserver), 0);
+
+  /* The writes to each key were applied in the order they committed. */
+  for (i = 0; i < 6; i++) {
+    if (values[i] == NULL) {
+      ASSERT_FALSE(kvstore_haskey(&testserver.store, keys[i]));
+      continue;
+    }
+    ASSERT_EQUAL(kvstore_get(&testserver.store, keys[i], &value), 0);
+    ASSERT_STRING_EQUAL(value, values[i]);
+    free(value);
+  }
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "KEYG"));
+  reqmsg.type = ABORT;
+  reqmsg.txid = 1;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, ACK);
+  ASSERT_PTR_NULL(testserver.txns);
+  reqmsg.txid = 0;
+  return 1;
+}
+
+int kvserver_tpc_migrate_drop(void) {
+  char message[64];
+  int64_t hash = tpcmaster_ring_hash(1, "MYKEY1");
+  kvserver_put(&testserver, "MYKEY1", "MYVALUE1");
+  kvserver_put(&testserver, "MYKEY2", "MYVALUE2");
+  kvserver_put(&testserver, "MYKEY3", "MYVALUE3");
+
+  /* Drop the segment of the ring ending at the hash of MYKEY1. */
+  reqmsg.type = MIGRATE;
+  reqmsg.key = reqmsg.value = NULL;
+  sprintf(message, "1 %lld %lld", (long long) hash - 1, (long long) hash);
+  reqmsg.message = message;
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, RESP);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "MYKEY1"));
+  ASSERT_TRUE(kvstore_haskey(&testserver.store, "MYKEY2"));
+
+  /* A segment with equal bounds wraps all the way around the ring. */
+  sprintf(message, "1 %lld %lld", (long long) hash, (long long) hash);
+  kvserver_handle_tpc(&testserver, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "MYKEY2"));
+  ASSERT_FALSE(kvstore_haskey(&testserver.store, "MYKEY3"));
+  reqmsg.message = NULL;
+  return 1;
+}
+
 void dummy_registration_handle(kvserver_t *server, int sockfd, void *extra) {
   kvmessage_t *register_msg, respmsg;
   pthread_mutex_lock(&kvserver_tpc_lock);
@@ -522,6 +857,8 @@ test_info_t kvserver_tpc_tests[] = {
   {"Invalid DEL request (key length)", kvserver_tpc_del_invalid_keylen},
   {"Valid DEL request followed by a PUT before COMMIT (not allowed)",
     kvserver_tpc_concurrent_del_put},
+  {"Transactions on different keys can be prepared at once",
+    kvserver_tpc_concurrent_txns},
   {"Rebuild from a TPCLog with just a single PUT entry",
     kvserver_tpc_rebuild_single_put},
   {"Rebuild from a TPCLog with multiple entries and a final DEL",
@@ -531,6 +868,16 @@ test_info_t kvserver_tpc_tests[] = {
     "transaction is completed", kvserver_tpc_rebuild_put_commit},
   {"Rebuild from a TPCLog with transactions ending in multiple COMMITs",
     kvserver_tpc_rebuild_multiple_commits},
+  {"A batch PUT is prepared and committed as one transaction",
+    kvserver_tpc_batch_commit},
+  {"Rebuild from a TPCLog with a prepared batch DEL",
+    kvserver_tpc_rebuild_batch},
+  {"Rebuild from a checkpoint and the entries logged after it",
+      kvserver_tpc_rebuild_checkpoint},
+  {"Rebuild writes committed transactions from several threads in order",
+      kvserver_tpc_rebuild_parallel},
+  {"MIGRATE without a target drops the keys in its segments",
+    kvserver_tpc_migrate_drop},
   {"KVServer registering with master", kvserver_tpc_registration},
   NULL_TEST_INFO
 };
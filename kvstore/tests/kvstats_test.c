@@ -0,0 +1,87 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "kvstats.h"
+#include "tester.h"
+
+/* More threads than there are shards, so that some share one. */
+#define KVSTATS_TEST_THREADS (2 * KVSTATS_SHARDS)
+#define KVSTATS_TEST_COUNTS 10000
+
+kvstats_t teststats;
+
+int kvstats_test_init(void) {
+  return kvstats_init(&teststats);
+}
+
+void *kvstats_test_thread(void *arg) {
+  unsigned int i;
+  for (i = 0; i < KVSTATS_TEST_COUNTS; i++) {
+    kvstats_count(&teststats, KVSTATS_CACHE_HIT);
+    kvstats_record(&teststats, KVSTATS_GET, 1000);
+  }
+  return NULL;
+}
+
+int kvstats_concurrent_counts(void) {
+  pthread_t threads[KVSTATS_TEST_THREADS];
+  kvtiming_t timing;
+  unsigned int i;
+  for (i = 0; i < KVSTATS_TEST_THREADS; i++)
+    pthread_create(&threads[i], NULL, kvstats_test_thread, NULL);
+  for (i = 0; i < KVSTATS_TEST_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  ASSERT_EQUAL(kvstats_counter(&teststats, KVSTATS_CACHE_HIT),
+      KVSTATS_TEST_THREADS * KVSTATS_TEST_COUNTS);
+  ASSERT_EQUAL(kvstats_counter(&teststats, KVSTATS_CACHE_MISS), 0);
+  kvstats_timing(&teststats, KVSTATS_GET, &timing);
+  ASSERT_EQUAL(timing.count, KVSTATS_TEST_THREADS * KVSTATS_TEST_COUNTS);
+  ASSERT_TRUE(timing.mean == 1.0);
+  ASSERT_TRUE(timing.max == 1.0);
+  return 1;
+}
+
+int kvstats_percentiles(void) {
+  kvtiming_t timing;
+  unsigned int i;
+  kvstats_timing(&teststats, KVSTATS_PUT, &timing);
+  ASSERT_EQUAL(timing.count, 0);
+  /* 1us to 1000us. */
+  for (i = 1; i <= 1000; i++)
+    kvstats_record(&teststats, KVSTATS_PUT, i * 1000);
+  kvstats_timing(&teststats, KVSTATS_PUT, &timing);
+  ASSERT_EQUAL(timing.count, 1000);
+  ASSERT_TRUE(timing.mean == 500.5);
+  ASSERT_TRUE(timing.p50 >= 500 && timing.p50 <= 500 * 1.125);
+  ASSERT_TRUE(timing.p99 >= 990 && timing.p99 <= 1000);
+  ASSERT_TRUE(timing.max == 1000);
+  kvstats_timing(&teststats, KVSTATS_DEL, &timing);
+  ASSERT_EQUAL(timing.count, 0);
+  return 1;
+}
+
+int kvstats_report(void) {
+  char *text;
+  kvstats_count(&teststats, KVSTATS_COMMIT);
+  kvstats_record(&teststats, KVSTATS_LOG_WRITE, 2500);
+  text = kvstats_text(&teststats);
+  ASSERT_PTR_NOT_NULL(text);
+  ASSERT_PTR_NOT_NULL(strstr(text, "commits: 1\n"));
+  ASSERT_PTR_NOT_NULL(strstr(text, "aborts: 0\n"));
+  ASSERT_PTR_NOT_NULL(strstr(text, "log_write: count=1 mean=2.5us"));
+  ASSERT_EQUAL(text[strlen(text) - 1], 's');
+  free(text);
+  return 1;
+}
+
+test_info_t kvstats_tests[] = {
+  {"Counts from many threads are all kept", kvstats_concurrent_counts},
+  {"Percentiles are reported within the timers' precision",
+    kvstats_percentiles},
+  {"Stats are reported as text", kvstats_report},
+  NULL_TEST_INFO
+};
+
+suite_info_t kvstats_suite = {"KVStats Tests", kvstats_test_init, NULL,
+  kvstats_tests};
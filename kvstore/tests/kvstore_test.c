@@ -1,6 +1,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/stat.h>
+#include "kvhash.h"
 #include "kvstore.h"
 #include "tester.h"
 
@@ -17,6 +19,21 @@ int kvstore_test_init(void) {
   return kvstore_init(&teststore, KVSTORE_DIRNAME);
 }
 
+/* Recreates the store in the djb2 format, in which the keys used by the hash
+ * conflict tests collide. */
+int kvstore_test_init_djb2(void) {
+  char filename[MAX_FILENAME];
+  FILE *file;
+  kvstore_clean(&teststore);
+  mkdir(KVSTORE_DIRNAME, 0700);
+  sprintf(filename, "%s/%s", KVSTORE_DIRNAME, KVSTORE_FORMAT_FILENAME);
+  if ((file = fopen(filename, "w")) == NULL)
+    return -1;
+  fprintf(file, "%d\n", KVSTORE_FORMAT_DJB2);
+  fclose(file);
+  return kvstore_init(&teststore, KVSTORE_DIRNAME);
+}
+
 int kvstore_del_simple(void) {
   char *retval;
   int ret;
@@ -37,6 +54,8 @@ int kvstore_get_put_with_hash_conflicts(void) {
   /* hash("abD") == hash("aae") == hash("ac#") */
   char *retval, *key1 = "abD", *key2 = "aae", *key3 = "ac#";
   int ret;
+  ASSERT_EQUAL(kvstore_test_init_djb2(), 0);
+  ASSERT_EQUAL(kvstore_hash(&teststore, key1), kvstore_hash(&teststore, key2));
   ret = kvstore_put(&teststore, key1, "value1");
   ret += kvstore_put(&teststore, key2, "value2");
   ret += kvstore_put(&teststore, key3, "value3");
@@ -51,8 +70,7 @@ int kvstore_get_put_with_hash_conflicts(void) {
   free(retval);
   /* Clean the store and do it again in a different order to ensure that
      the above success wasn't just because of a lucky ordering. */
-  kvstore_clean(&teststore);
-  kvstore_init(&teststore, KVSTORE_DIRNAME);
+  kvstore_test_init_djb2();
   ret = kvstore_put(&teststore, key2, "value2");
   ret += kvstore_put(&teststore, key3, "value3");
   ret += kvstore_put(&teststore, key1, "value1");
@@ -73,6 +91,8 @@ int kvstore_del_hash_conflicts(void) {
   /* hash("abD") == hash("aae") == hash("ac#") */
   char *retval = NULL, *key1 = "abD", *key2 = "aae", *key3 = "ac#";
   int ret;
+  ASSERT_EQUAL(kvstore_test_init_djb2(), 0);
+  ASSERT_EQUAL(kvstore_hash(&teststore, key2), kvstore_hash(&teststore, key3));
   ret = kvstore_put(&teststore, key1, "value1");
   ret += kvstore_put(&teststore, key2, "value2");
   ret += kvstore_put(&teststore, key3, "value3");
@@ -90,8 +110,7 @@ int kvstore_del_hash_conflicts(void) {
   ASSERT_EQUAL(ret, 0);
   /* Clean store and do operations again with a different insertion order to
    * help ensure that success wasn't due to a lucky ordering. */
-  kvstore_clean(&teststore);
-  kvstore_init(&teststore, KVSTORE_DIRNAME);
+  kvstore_test_init_djb2();
   ret = kvstore_put(&teststore, key2, "value2");
   ret += kvstore_put(&teststore, key1, "value1");
   ret += kvstore_put(&teststore, key3, "value3");
@@ -221,6 +240,172 @@ int kvstore_multiple_put_get(void) {
   return 1;
 }
 
+/* Counts the entries visited in *_COUNT, checking each value matches its
+ * key. */
+int kvstore_iterate_count(char *key, char *value, void *_count) {
+  if (strncmp(key, "KEY", 3) != 0 || strcmp(key + 3, value + 5) != 0)
+    return -1;
+  (*(int *) _count)++;
+  return 0;
+}
+
+/* Counts the first entry visited in *_COUNT, then stops. */
+int kvstore_iterate_stop(char *key, char *value, void *_count) {
+  (*(int *) _count)++;
+  return 7;
+}
+
+int kvstore_iterate_all(void) {
+  int ret, count = 0;
+  ret = kvstore_put(&teststore, "KEY1", "VALUE1");
+  ret += kvstore_put(&teststore, "KEY2", "VALUE2");
+  ret += kvstore_put(&teststore, "KEY3", "VALUE3");
+  ret += kvstore_del(&teststore, "KEY2");
+  ASSERT_EQUAL(ret, 0);
+  ret = kvstore_iterate(&teststore, kvstore_iterate_count, &count);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(count, 2);
+  count = 0;
+  ret = kvstore_iterate(&teststore, kvstore_iterate_stop, &count);
+  ASSERT_EQUAL(ret, 7);
+  ASSERT_EQUAL(count, 1);
+  return 1;
+}
+
+/* Appends each key visited to the string _KEYS, checking its value. */
+int kvstore_scan_collect(char *key, char *value, void *_keys) {
+  if (strncmp(key, "KEY", 3) != 0 || strcmp(key + 3, value + 5) != 0)
+    return -1;
+  strcat((char *) _keys, key);
+  strcat((char *) _keys, " ");
+  return 0;
+}
+
+int kvstore_scan_range(void) {
+  char keys[256] = "";
+  int ret;
+  ret = kvstore_put(&teststore, "KEY4", "VALUE4");
+  ret += kvstore_put(&teststore, "KEY1", "VALUE1");
+  ret += kvstore_put(&teststore, "KEY5", "VALUE5");
+  ret += kvstore_put(&teststore, "KEY3", "VALUE3");
+  ret += kvstore_put(&teststore, "KEY2", "VALUE2");
+  ret += kvstore_put(&teststore, "KEY3", "VALUE3");
+  ASSERT_EQUAL(ret, 0);
+  ret = kvstore_scan(&teststore, NULL, NULL, 0, kvstore_scan_collect, keys);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_STRING_EQUAL(keys, "KEY1 KEY2 KEY3 KEY4 KEY5 ");
+  keys[0] = '\0';
+  ret = kvstore_scan(&teststore, "KEY2", "KEY5", 0, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY2 KEY3 KEY4 ");
+  keys[0] = '\0';
+  ret = kvstore_scan(&teststore, "KEY10", NULL, 2, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY2 KEY3 ");
+  ret = kvstore_del(&teststore, "KEY3");
+  ASSERT_EQUAL(ret, 0);
+  keys[0] = '\0';
+  ret = kvstore_scan(&teststore, "KEY2", NULL, 2, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY2 KEY4 ");
+  return 1;
+}
+
+int kvstore_scan_reopen(void) {
+  char keys[256] = "", filename[MAX_FILENAME];
+  int ret;
+  ret = kvstore_put(&teststore, "KEY2", "VALUE2");
+  ret += kvstore_put(&teststore, "KEY1", "VALUE1");
+  ret += kvstore_put(&teststore, "KEY3", "VALUE3");
+  ret += kvstore_del(&teststore, "KEY2");
+  ASSERT_EQUAL(ret, 0);
+  /* The index is reloaded from its file. */
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), 0);
+  kvstore_scan(&teststore, NULL, NULL, 0, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY1 KEY3 ");
+  /* Without its file, the index is rebuilt from the entries. */
+  sprintf(filename, "%s/%s", KVSTORE_DIRNAME, KVSTORE_INDEX_FILENAME);
+  ASSERT_EQUAL(remove(filename), 0);
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), 0);
+  keys[0] = '\0';
+  kvstore_scan(&teststore, NULL, NULL, 0, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY1 KEY3 ");
+  return 1;
+}
+
+int kvstore_index_compact(void) {
+  char key[16], keys[256] = "";
+  int i, ret = kvstore_put(&teststore, "KEY9", "VALUE9");
+  for (i = 0; i < KVINDEX_COMPACT_MIN; i++) {
+    sprintf(key, "GONE%d", i);
+    ret += kvstore_put(&teststore, key, "VALUE");
+    ret += kvstore_del(&teststore, key);
+  }
+  ASSERT_EQUAL(ret, 0);
+  /* The file is compacted as keys are removed, not only when reopened. */
+  ASSERT_TRUE(teststore.index->records < KVINDEX_COMPACT_MIN);
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), 0);
+  kvstore_scan(&teststore, "KEY9", "KEYA", 0, kvstore_scan_collect, keys);
+  ASSERT_STRING_EQUAL(keys, "KEY9 ");
+  return 1;
+}
+
+int kvstore_bloom_misses(void) {
+  char *retval, filename[MAX_FILENAME];
+  FILE *file;
+  int ret;
+  ret = kvstore_put(&teststore, "KEY1", "VALUE1");
+  ret += kvstore_put(&teststore, "KEY2", "VALUE2");
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_TRUE(kvbloom_may_contain(teststore.bloom, kvhash_key("KEY1")));
+  ASSERT_FALSE(kvbloom_may_contain(teststore.bloom, kvhash_key("KEY3")));
+  /* An entry the filter rules out is never looked for on disk. */
+  sprintf(filename, "%s/%lu-0%s", KVSTORE_DIRNAME,
+      kvstore_hash(&teststore, "KEY3"), KVSTORE_FILETYPE);
+  file = fopen(filename, "w");
+  fclose(file);
+  ASSERT_EQUAL(kvstore_get(&teststore, "KEY3", &retval), ERRNOKEY);
+  ASSERT_FALSE(kvstore_haskey(&teststore, "KEY3"));
+  remove(filename);
+  ASSERT_EQUAL(kvstore_del(&teststore, "KEY1"), 0);
+  ASSERT_FALSE(kvbloom_may_contain(teststore.bloom, kvhash_key("KEY1")));
+  /* The filter is rebuilt from the index when the store is reopened. */
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), 0);
+  ASSERT_FALSE(kvbloom_may_contain(teststore.bloom, kvhash_key("KEY1")));
+  ASSERT_EQUAL(kvstore_get(&teststore, "KEY2", &retval), 0);
+  ASSERT_STRING_EQUAL(retval, "VALUE2");
+  free(retval);
+  return 1;
+}
+
+int kvstore_format_versions(void) {
+  char *retval, filename[MAX_FILENAME];
+  FILE *file;
+  ASSERT_EQUAL(teststore.format, KVSTORE_FORMAT_CURRENT);
+  ASSERT_EQUAL(kvstore_hash(&teststore, "KEY1"), kvhash_key("KEY1"));
+  ASSERT_EQUAL(kvstore_test_init_djb2(), 0);
+  ASSERT_EQUAL(kvstore_hash(&teststore, "KEY1"), hash("KEY1"));
+  ASSERT_EQUAL(kvstore_put(&teststore, "KEY1", "VALUE1"), 0);
+  /* A directory of entries without a format file predates it, so its
+   * entries are named by djb2. */
+  sprintf(filename, "%s/%s", KVSTORE_DIRNAME, KVSTORE_FORMAT_FILENAME);
+  ASSERT_EQUAL(remove(filename), 0);
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), 0);
+  ASSERT_EQUAL(teststore.format, KVSTORE_FORMAT_DJB2);
+  ASSERT_EQUAL(kvstore_get(&teststore, "KEY1", &retval), 0);
+  ASSERT_STRING_EQUAL(retval, "VALUE1");
+  free(retval);
+  /* An unknown format is refused. */
+  file = fopen(filename, "w");
+  fprintf(file, "%d\n", KVSTORE_FORMAT_CURRENT + 1);
+  fclose(file);
+  memset(&teststore, 0, sizeof(kvstore_t));
+  ASSERT_EQUAL(kvstore_init(&teststore, KVSTORE_DIRNAME), ERRFILACCESS);
+  return 1;
+}
+
 test_info_t kvstore_tests[] = {
   {"Simple PUT and GET of a single value", kvstore_single_put_get},
   {"Simple PUT and GET of multiple values", kvstore_multiple_put_get},
@@ -237,6 +422,15 @@ test_info_t kvstore_tests[] = {
   {"Simple DEL on a value", kvstore_del_simple},
   {"DEL on a key that does not exist", kvstore_del_no_key},
   {"DEL on keys which have hash conflicts", kvstore_del_hash_conflicts},
+  {"Iterate over every entry in the store", kvstore_iterate_all},
+  {"Scan a range of keys in order", kvstore_scan_range},
+  {"Scan after reopening a store, with and without its index file",
+    kvstore_scan_reopen},
+  {"The index file is compacted as keys are removed",
+    kvstore_index_compact},
+  {"GETs of keys ruled out by the bloom filter skip the disk",
+    kvstore_bloom_misses},
+  {"Stores are hashed according to their format", kvstore_format_versions},
   NULL_TEST_INFO
 };
 
@@ -4,17 +4,20 @@
 #include <stdbool.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include "kvmessage.h"
 #include "socket_server.h"
 #include "tester.h"
 
 #define SOCKET_SERVER_PORT 8162
 #define SOCKET_SERVER_HOST "localhost"
+#define SOCKET_SERVER_EPOLL_PORT 8164
+#define SOCKET_SERVER_STALL_PORT 8165
 
 int synch, server_running, concurrent, complete;
 pthread_mutex_t socket_server_test_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t socket_server_test_cond = PTHREAD_COND_INITIALIZER,
   socket_server_completion_cond = PTHREAD_COND_INITIALIZER;
-server_t testserver;
+server_t testserver, epollserver, stallserver;
 
 int socket_server_test_init(void) {
   synch = 0;
@@ -97,8 +100,128 @@ int socket_server_multiple_test(void) {
   return 1;
 }
 
+/* Answers each request with a RESP whose message is the request's key. */
+void socket_server_echo_handler(kvserver_t *server, int sockfd, void *extra) {
+  kvmessage_t *reqmsg, respmsg;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  respmsg.type = RESP;
+  reqmsg = kvmessage_parse(sockfd);
+  respmsg.message = (reqmsg != NULL) ? reqmsg->key : ERRMSG_INVALID_REQUEST;
+  kvmessage_send(&respmsg, sockfd);
+  if (reqmsg != NULL)
+    kvmessage_free(reqmsg);
+}
+
+void *socket_server_epoll_thread(void* aux) {
+  server_run(SOCKET_SERVER_HOST, SOCKET_SERVER_EPOLL_PORT, &epollserver,
+      socket_server_run_callback);
+  return NULL;
+}
+
+int socket_server_epoll_pipeline_test(void) {
+  pthread_t server_thread;
+  kvmessage_t reqmsg, *respmsg;
+  char key[16];
+  int sockfds[2], i, j, ok = 1;
+
+  server_running = 0;
+  epollserver.master = 0;
+  epollserver.max_threads = 2;
+  epollserver.use_epoll = 1;
+  epollserver.kvserver.handle = &socket_server_echo_handler;
+  pthread_create(&server_thread, NULL, socket_server_epoll_thread, NULL);
+  pthread_mutex_lock(&socket_server_test_lock);
+  while (!server_running)
+    pthread_cond_wait(&socket_server_test_cond, &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+
+  for (i = 0; i < 2; i++)
+    sockfds[i] = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_EPOLL_PORT, 3);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = GETREQ;
+  reqmsg.key = key;
+  /* Send several requests on each connection before reading any responses;
+   * they must come back in order on the connection they were sent on. */
+  for (j = 0; j < 3; j++) {
+    for (i = 0; i < 2; i++) {
+      sprintf(key, "conn%d-req%d", i, j);
+      kvmessage_send(&reqmsg, sockfds[i]);
+    }
+  }
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < 3; j++) {
+      sprintf(key, "conn%d-req%d", i, j);
+      respmsg = kvmessage_parse(sockfds[i]);
+      if (respmsg == NULL || respmsg->message == NULL
+          || strcmp(respmsg->message, key) != 0)
+        ok = 0;
+      if (respmsg != NULL)
+        kvmessage_free(respmsg);
+    }
+  }
+  close(sockfds[0]);
+  /* Stopping the server must close the connection which is still open. */
+  server_stop(&epollserver);
+  pthread_join(server_thread, NULL);
+  ASSERT_EQUAL(read(sockfds[1], key, 1), 0);
+  close(sockfds[1]);
+  ASSERT_TRUE(ok);
+  return 1;
+}
+
+void *socket_server_stall_thread(void* aux) {
+  server_run(SOCKET_SERVER_HOST, SOCKET_SERVER_STALL_PORT, &stallserver,
+      socket_server_run_callback);
+  return NULL;
+}
+
+int socket_server_epoll_stall_test(void) {
+  pthread_t server_thread;
+  kvmessage_t reqmsg, *respmsg;
+  int stalled, sockfd, ok;
+
+  server_running = 0;
+  stallserver.master = 0;
+  stallserver.max_threads = 1;
+  stallserver.use_epoll = 1;
+  stallserver.recv_timeout = 1;
+  stallserver.kvserver.handle = &socket_server_echo_handler;
+  pthread_create(&server_thread, NULL, socket_server_stall_thread, NULL);
+  pthread_mutex_lock(&socket_server_test_lock);
+  while (!server_running)
+    pthread_cond_wait(&socket_server_test_cond, &socket_server_test_lock);
+  pthread_mutex_unlock(&socket_server_test_lock);
+
+  /* Send half of a message's length, then stall, leaving the server's only
+   * worker waiting for the rest. */
+  stalled = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_STALL_PORT, 5);
+  ASSERT_EQUAL(write(stalled, "\0\0", 2), 2);
+  usleep(100000);
+  sockfd = connect_to(SOCKET_SERVER_HOST, SOCKET_SERVER_STALL_PORT, 5);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = GETREQ;
+  reqmsg.key = "after-stall";
+  kvmessage_send(&reqmsg, sockfd);
+  respmsg = kvmessage_parse(sockfd);
+  ok = respmsg != NULL && respmsg->message != NULL
+      && strcmp(respmsg->message, "after-stall") == 0;
+  if (respmsg != NULL)
+    kvmessage_free(respmsg);
+  /* The stalled connection is closed once its timeout expires. */
+  ASSERT_EQUAL(read(stalled, &reqmsg, 1), 0);
+  close(stalled);
+  close(sockfd);
+  server_stop(&stallserver);
+  pthread_join(server_thread, NULL);
+  ASSERT_TRUE(ok);
+  return 1;
+}
+
 test_info_t socket_server_tests[] = {
   {"Tests that multiple requests can be handled simultaneously", socket_server_multiple_test},
+  {"Tests that epoll mode answers pipelined requests in order", socket_server_epoll_pipeline_test},
+  {"Tests that a client stalling mid-message only holds a worker until it times out",
+    socket_server_epoll_stall_test},
   NULL_TEST_INFO
 };
 
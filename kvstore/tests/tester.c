@@ -8,8 +8,12 @@
 #include <string.h>
 #include "tester.h"
 #include "kvstore_test.h"
+#include "kvlogstore_test.h"
 #include "kvcacheset_test.h"
 #include "kvcache_test.h"
+#include "kvhist_test.h"
+#include "kvstats_test.h"
+#include "kvmessage_test.h"
 #include "kvserver_test.h"
 #include "wq_test.h"
 #include "socket_server_test.h"
@@ -113,8 +117,12 @@ int main(int argc, const char *argv[]) {
 
   struct suite_desc suite_table[] = {
     {kvstore_suite, "kvstore"},
+    {kvlogstore_suite, "kvlogstore"},
     {kvcacheset_suite, "kvcacheset"},
     {kvcache_suite, "kvcache"},
+    {kvhist_suite, "kvhist"},
+    {kvstats_suite, "kvstats"},
+    {kvmessage_suite, "kvmessage"},
     {kvserver_suite, "kvserver"},
     {wq_suite, "wq"},
     {socket_server_suite, "socket_server"},
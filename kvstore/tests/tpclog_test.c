@@ -1,7 +1,10 @@
 #include <dirent.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "tpclog.h"
 #include "tester.h"
 
@@ -31,71 +34,101 @@ int tpclog_test_init(void) {
   return 0;
 }
 
+/* Reopens the log, as a server recovering from a crash would. */
+void tpclog_reopen(void) {
+  close(testlog.fd);
+  tpclog_init(&testlog, TPCLOG_DIRNAME);
+}
+
 int tpclog_log_load(void) {
   int ret;
-  char filename[MAX_FILENAME];
   logentry_t *entry;
   ret = tpclog_log(&testlog, PUTREQ, "MYKEY", "MYVALUE");
   ASSERT_EQUAL(ret, 0);
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/0");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  tpclog_reopen();
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, PUTREQ);
+  ASSERT_EQUAL(entry->lsn, 1);
   ASSERT_EQUAL(entry->length, 14);
   ASSERT_STRING_EQUAL(entry->data, "MYKEY");
   ASSERT_STRING_EQUAL(entry->data + 6, "MYVALUE");
   free(entry);
+  ASSERT_PTR_NULL(tpclog_iterate_next(&testlog));
+  return 1;
+}
+
+int tpclog_log_load_batch(void) {
+  int ret;
+  logentry_t *entry;
+  kvpair_t batch[2] = {{"KEY1", "VALUE1"}, {"KEY2", "VALUE2"}};
+  ret = tpclog_log_batch(&testlog, 7, MPUTREQ, batch, 2, NULL);
+  ASSERT_EQUAL(ret, 0);
+  ret = tpclog_log_batch(&testlog, 8, MDELREQ, batch, 2, NULL);
+  ASSERT_EQUAL(ret, 0);
+  ret = tpclog_log_batch(&testlog, 9, PUTREQ, batch, 2, NULL);
+  ASSERT_EQUAL(ret, ERRINVLDMSG);
+  tpclog_reopen();
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, MPUTREQ);
+  ASSERT_TRUE(entry->txid == 7);
+  ASSERT_EQUAL(entry->length, 24);
+  ASSERT_STRING_EQUAL(entry->data, "KEY1");
+  ASSERT_STRING_EQUAL(entry->data + 5, "VALUE1");
+  ASSERT_STRING_EQUAL(entry->data + 12, "KEY2");
+  ASSERT_STRING_EQUAL(entry->data + 17, "VALUE2");
+  free(entry);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->type, MDELREQ);
+  ASSERT_EQUAL(entry->length, 10);
+  ASSERT_STRING_EQUAL(entry->data, "KEY1");
+  ASSERT_STRING_EQUAL(entry->data + 5, "KEY2");
+  free(entry);
+  ASSERT_PTR_NULL(tpclog_iterate_next(&testlog));
   return 1;
 }
 
 int tpclog_log_load_multiple(void) {
   int ret;
-  char filename[MAX_FILENAME];
   logentry_t *entry;
   ret = tpclog_log(&testlog, PUTREQ, "MYKEY", "MYVALUE");
   ret += tpclog_log(&testlog, DELREQ, "MYKEY", NULL);
   ret += tpclog_log(&testlog, COMMIT, NULL, NULL);
   ret += tpclog_log(&testlog, ABORT, NULL, NULL);
   ASSERT_EQUAL(ret, 0);
+  tpclog_reopen();
+  ASSERT_EQUAL(tpclog_next_lsn(&testlog), 5);
+  tpclog_iterate_begin(&testlog);
 
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/0");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, PUTREQ);
   ASSERT_EQUAL(entry->length, 14);
   ASSERT_STRING_EQUAL(entry->data, "MYKEY");
   ASSERT_STRING_EQUAL(entry->data + 6, "MYVALUE");
   free(entry);
 
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/1");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, DELREQ);
   ASSERT_EQUAL(entry->length, 6);
   ASSERT_STRING_EQUAL(entry->data, "MYKEY");
   free(entry);
 
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/2");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, COMMIT);
   ASSERT_EQUAL(entry->length, 0);
   free(entry);
 
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/3");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, ABORT);
+  ASSERT_EQUAL(entry->lsn, 4);
   ASSERT_EQUAL(entry->length, 0);
   free(entry);
   return 1;
@@ -103,7 +136,6 @@ int tpclog_log_load_multiple(void) {
 
 int tpclog_test_clear_log(void) {
   int ret;
-  char filename[MAX_FILENAME];
   logentry_t *entry;
   ret = tpclog_log(&testlog, ABORT, NULL, NULL);
   ret += tpclog_log(&testlog, PUTREQ, "MYKEY", "MYVALUE");
@@ -114,18 +146,123 @@ int tpclog_test_clear_log(void) {
   ret += tpclog_clear_log(&testlog);
   ret += tpclog_log(&testlog, PUTREQ, "NEWKEY", "NEWVALUE");
   ASSERT_EQUAL(ret, 0);
+  tpclog_reopen();
 
   /* After clearing the log, our new log entry should be the first one. */
-  strcpy(filename, TPCLOG_DIRNAME);
-  strcat(filename, "/0");
-  strcat(filename, TPCLOG_FILETYPE);
-  ret = tpclog_load_entry(&entry, filename);
-  ASSERT_EQUAL(ret, 0);
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
   ASSERT_EQUAL(entry->type, PUTREQ);
+  ASSERT_EQUAL(entry->lsn, 7);
   ASSERT_EQUAL(entry->length, 16);
   ASSERT_STRING_EQUAL(entry->data, "NEWKEY");
   ASSERT_STRING_EQUAL(entry->data + 7, "NEWVALUE");
   free(entry);
+  ASSERT_FALSE(tpclog_iterate_has_next(&testlog));
+  return 1;
+}
+
+int tpclog_torn_entry(void) {
+  char filename[MAX_FILENAME];
+  logentry_t *entry;
+  FILE *file;
+  ASSERT_EQUAL(tpclog_log(&testlog, DELREQ, "MYKEY", NULL), 0);
+  ASSERT_EQUAL(tpclog_log(&testlog, COMMIT, NULL, NULL), 0);
+
+  /* Simulate a crash part of the way through appending a third entry. */
+  sprintf(filename, "%s/%s", TPCLOG_DIRNAME, TPCLOG_FILENAME);
+  file = fopen(filename, "a");
+  ASSERT_PTR_NOT_NULL(file);
+  fwrite("\x12\x34\x56\x78\x01", 1, 5, file);
+  fclose(file);
+  tpclog_reopen();
+  ASSERT_EQUAL(tpclog_next_lsn(&testlog), 3);
+
+  ASSERT_EQUAL(tpclog_log(&testlog, ABORT, NULL, NULL), 0);
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_EQUAL(entry->type, DELREQ);
+  free(entry);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_EQUAL(entry->type, COMMIT);
+  free(entry);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_EQUAL(entry->type, ABORT);
+  ASSERT_EQUAL(entry->lsn, 3);
+  free(entry);
+  ASSERT_PTR_NULL(tpclog_iterate_next(&testlog));
+  return 1;
+}
+
+int tpclog_truncate_checkpoint(void) {
+  char value[MAX_VALLEN + 1];
+  logentry_t *entry;
+  uint64_t lsn, checkpoint = 0;
+  int i;
+  memset(value, 'v', MAX_VALLEN);
+  value[MAX_VALLEN] = '\0';
+
+  /* Below TPCLOG_REWRITE_SIZE, a checkpoint which keeps entries is ignored. */
+  ASSERT_EQUAL(tpclog_log(&testlog, PUTREQ, "MYKEY", value), 0);
+  ASSERT_EQUAL(tpclog_log(&testlog, COMMIT, NULL, NULL), 0);
+  ASSERT_EQUAL(tpclog_truncate(&testlog, 2), 0);
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->lsn, 1);
+  free(entry);
+
+  for (i = 0; i < TPCLOG_REWRITE_SIZE / MAX_VALLEN; i++) {
+    ASSERT_EQUAL(tpclog_log_txn(&testlog, i, PUTREQ, "MYKEY", value, &lsn), 0);
+    if (i == 10)
+      checkpoint = lsn;
+  }
+  ASSERT_EQUAL(tpclog_truncate(&testlog, checkpoint), 0);
+  tpclog_reopen();
+  ASSERT_EQUAL(tpclog_next_lsn(&testlog), lsn + 1);
+  tpclog_iterate_begin(&testlog);
+  entry = tpclog_iterate_next(&testlog);
+  ASSERT_PTR_NOT_NULL(entry);
+  ASSERT_EQUAL(entry->lsn, checkpoint);
+  ASSERT_EQUAL(entry->txid, 10);
+  ASSERT_STRING_EQUAL(entry->data + 6, value);
+  free(entry);
+  return 1;
+}
+
+/* Logs a run of entries for the transaction whose ID is pointed to by AUX. */
+void *tpclog_logger_thread(void *aux) {
+  uint64_t txid = *(uint64_t *) aux;
+  int i;
+  for (i = 0; i < 25; i++)
+    tpclog_log_txn(&testlog, txid, (i % 2) ? COMMIT : DELREQ, "MYKEY", NULL,
+        NULL);
+  return NULL;
+}
+
+int tpclog_group_commit(void) {
+  pthread_t threads[4];
+  uint64_t txids[4], lsn = 0;
+  int counts[4] = {0}, i;
+  logentry_t *entry;
+  for (i = 0; i < 4; i++) {
+    txids[i] = i;
+    pthread_create(&threads[i], NULL, tpclog_logger_thread, &txids[i]);
+  }
+  for (i = 0; i < 4; i++)
+    pthread_join(threads[i], NULL);
+
+  /* Every entry made it into the log intact, in LSN order. */
+  tpclog_reopen();
+  tpclog_iterate_begin(&testlog);
+  while ((entry = tpclog_iterate_next(&testlog)) != NULL) {
+    ASSERT_EQUAL(entry->lsn, lsn + 1);
+    lsn = entry->lsn;
+    counts[entry->txid]++;
+    free(entry);
+  }
+  for (i = 0; i < 4; i++)
+    ASSERT_EQUAL(counts[i], 25);
   return 1;
 }
 
@@ -187,12 +324,74 @@ int tpclog_iterate_entries(void) {
   return 1;
 }
 
+int tpclog_checkpoint_load(void) {
+  kvpair_t batch[2] = {{"KEY1", "VALUE1"}, {"KEY2", "VALUE2"}};
+  tpccheckpoint_t ckpt;
+  tpclogimage_t image;
+  unsigned int i;
+  int ret;
+  ret = tpclog_log_batch(&testlog, 1, MPUTREQ, batch, 2, NULL);
+  ret += tpclog_log_txn(&testlog, 2, PUTREQ, "KEY3", "VALUE3", NULL);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(tpclog_tail_length(&testlog), 2);
+
+  /* Only transaction 1 is still prepared as of LSN 3. */
+  tpclog_checkpoint_init(&ckpt, tpclog_next_lsn(&testlog));
+  ret = tpclog_checkpoint_add(&ckpt, 1, MPUTREQ, batch, 2, 1);
+  ret += tpclog_checkpoint_add(&ckpt, 1, COMMIT, NULL, 0, 1);
+  ASSERT_EQUAL(ret, 0);
+  ASSERT_EQUAL(tpclog_checkpoint_write(&testlog, &ckpt), 0);
+  tpclog_checkpoint_destroy(&ckpt);
+  ASSERT_EQUAL(tpclog_tail_length(&testlog), 0);
+  ret = tpclog_log_txn(&testlog, 1, COMMIT, NULL, NULL, NULL);
+  ASSERT_EQUAL(ret, 0);
+
+  /* A checkpoint older than the current one is discarded. */
+  tpclog_checkpoint_init(&ckpt, 2);
+  ASSERT_EQUAL(tpclog_checkpoint_write(&testlog, &ckpt), 0);
+  tpclog_checkpoint_destroy(&ckpt);
+
+  /* The checkpoint survives a crash, and the entries before it are not
+   * loaded. */
+  tpclog_reopen();
+  ASSERT_EQUAL(tpclog_next_lsn(&testlog), 4);
+  ASSERT_EQUAL(tpclog_tail_length(&testlog), 1);
+  ASSERT_EQUAL(tpclog_load(&testlog, &image), 0);
+  ASSERT_EQUAL(image.num_entries, 3);
+  /* The entries are used in place, so each must be aligned. */
+  for (i = 0; i < image.num_entries; i++)
+    ASSERT_EQUAL((uintptr_t) image.entries[i] % 8, 0);
+  ASSERT_EQUAL(image.entries[0]->type, MPUTREQ);
+  ASSERT_EQUAL(image.entries[0]->txid, 1);
+  ASSERT_STRING_EQUAL(image.entries[0]->data + 12, "KEY2");
+  ASSERT_EQUAL(image.entries[1]->type, COMMIT);
+  ASSERT_EQUAL(image.entries[2]->type, COMMIT);
+  ASSERT_EQUAL(image.entries[2]->lsn, 3);
+  tpclog_image_destroy(&image);
+
+  /* Clearing the log drops the checkpoint too. */
+  ASSERT_EQUAL(tpclog_clear_log(&testlog), 0);
+  tpclog_reopen();
+  ASSERT_EQUAL(tpclog_next_lsn(&testlog), 1);
+  ASSERT_EQUAL(tpclog_load(&testlog, &image), 0);
+  ASSERT_EQUAL(image.num_entries, 0);
+  tpclog_image_destroy(&image);
+  return 1;
+}
+
 test_info_t tpclog_tests[] = {
   {"Simple test of logging an entry and loading it back", tpclog_log_load},
   {"Simple test of logging multiple entries and loading them back",
     tpclog_log_load_multiple},
+  {"A batch is logged as a single entry", tpclog_log_load_batch},
   {"Simple test of clearing out the log", tpclog_test_clear_log},
   {"Iterate through entries", tpclog_iterate_entries},
+  {"A torn entry at the end of the log is discarded", tpclog_torn_entry},
+  {"Truncating the log at a checkpoint LSN", tpclog_truncate_checkpoint},
+  {"A checkpoint replaces the entries logged before it",
+      tpclog_checkpoint_load},
+  {"Concurrent appends share fsyncs without losing entries",
+    tpclog_group_commit},
   NULL_TEST_INFO
 };
 
@@ -17,14 +17,17 @@ kvserver_t testslaves[10];
 char buf[20];
 kvmessage_t reqmsg, respmsg;
 int done = 0; /* Used for synchronizing some of the concurrency tests. */
+int votes_pending = 0; /* The number of votes the dummy slaves are holding back. */
 
 typedef enum {
   GET_SIMPLE,
   GET_REPLICA,
   GET_FAIL,
+  GET_HEDGED,
   PUT_SIMPLE,
   PUT_ABORT,
   PUT_FAIL,
+  PUT_PARALLEL,
   DEL_SIMPLE,
   DEL_ABORT,
   DEL_FAIL,
@@ -56,6 +59,8 @@ int tpcmaster_test_init(void) {
   memset(&reqmsg, 0, sizeof(kvmessage_t));
   memset(&respmsg, 0, sizeof(kvmessage_t));
   tpcmaster_init(&testmaster, 4, 2, 4, 4);
+  /* The expected primaries below assume one point per slave. */
+  testmaster.vnodes = 1;
   return 1;
 }
 
@@ -90,6 +95,39 @@ int tpcmaster_register_fail(void) {
   return 1;
 }
 
+/* Registers the slaves on PORTS at 123.45.67.89, in order, and checks the
+ * master's list of slaves is sorted by id. Returns 1 if it is, else 0. */
+static int tpcmaster_register_ports(char **ports) {
+  tpcslave_t *slave;
+  int i;
+  tpcmaster_init(&testmaster, 4, 2, 4, 4);
+  reqmsg.type = REGISTER;
+  reqmsg.key = "123.45.67.89";
+  for (i = 0; i < 4; i++) {
+    reqmsg.value = ports[i];
+    tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  }
+  ASSERT_PTR_NULL(testmaster.slaves_head->prev);
+  for (i = 1, slave = testmaster.slaves_head; slave->next != NULL; i++) {
+    ASSERT_TRUE(slave->next->id > slave->id);
+    ASSERT_TRUE(slave->next->prev == slave);
+    slave = slave->next;
+  }
+  ASSERT_EQUAL(i, 4);
+  return 1;
+}
+
+int tpcmaster_register_sorted(void) {
+  char *ports[4] = {"1234", "2345", "3456", "4567"};
+  char *reversed[4] = {"4567", "3456", "2345", "1234"};
+  /* Whichever slave has the lowest id joins after another in one of these
+   * orders, and so goes in front of the head. */
+  ASSERT_TRUE(tpcmaster_register_ports(ports));
+  ASSERT_TRUE(tpcmaster_register_ports(reversed));
+  return 1;
+}
+
 int tpcmaster_get_slave_for_key(void) {
   setup_slaves();
   // hash is -1848860354761560747
@@ -140,6 +178,426 @@ int tpcmaster_get_successor_for_slave(void) {
   return 1;
 }
 
+int tpcmaster_ring_vnodes(void) {
+  tpcslave_t *replicas[2], *slave;
+  int counts[4] = {0}, i, j;
+  char key[32];
+  testmaster.vnodes = TPCMASTER_DEFAULT_VNODES;
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  for (i = 0; i < 4; i++) {
+    sprintf(buf, "%d", 9000 + i);
+    reqmsg.value = buf;
+    tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  }
+  ASSERT_EQUAL(testmaster.ring_size, 4 * TPCMASTER_DEFAULT_VNODES);
+  for (i = 1; i < testmaster.ring_size; i++)
+    ASSERT_TRUE(testmaster.ring[i - 1].point <= testmaster.ring[i].point);
+
+  for (i = 0; i < 4000; i++) {
+    sprintf(key, "key%d", i);
+    ASSERT_EQUAL(tpcmaster_get_replicas(&testmaster, key, replicas), 2);
+    ASSERT_EQUAL(replicas[0], tpcmaster_get_primary(&testmaster, key));
+    ASSERT_NOT_EQUAL(replicas[0], replicas[1]);
+    for (j = 0, slave = testmaster.slaves_head; slave != replicas[0];
+        slave = slave->next)
+      j++;
+    counts[j]++;
+  }
+  /* Each slave owns roughly a quarter of the keys. */
+  for (j = 0; j < 4; j++)
+    ASSERT_TRUE(counts[j] > 600 && counts[j] < 1400);
+  return 1;
+}
+
+#define REBALANCE_PORT 9100
+
+server_t rebalance_slaves[2];
+int rebalance_listening = 0;
+
+void tpcmaster_rebalance_listening(void *aux) {
+  pthread_mutex_lock(&tpcmaster_lock);
+  rebalance_listening++;
+  pthread_cond_signal(&tpcmaster_cond);
+  pthread_mutex_unlock(&tpcmaster_lock);
+}
+
+void *tpcmaster_rebalance_runner(void *_slave) {
+  intptr_t i = (intptr_t) _slave;
+  server_run("localhost", REBALANCE_PORT + i, &rebalance_slaves[i],
+      tpcmaster_rebalance_listening);
+  return NULL;
+}
+
+/* Checks that each of the first NUM_KEYS keys is stored on the slave owning
+ * it, and only there. Returns the number of keys stored on the second slave,
+ * or -1 if a key is misplaced. */
+int tpcmaster_rebalance_check(int num_keys) {
+  tpcslave_t *replicas[1];
+  char key[32], *value;
+  int i, j, moved = 0;
+  for (i = 0; i < num_keys; i++) {
+    sprintf(key, "key%d", i);
+    if (tpcmaster_get_replicas(&testmaster, key, replicas) != 1)
+      return -1;
+    j = replicas[0]->port - REBALANCE_PORT;
+    if (kvstore_get(&rebalance_slaves[j].kvserver.store, key, &value) != 0)
+      return -1;
+    if (strcmp(value, key) != 0)
+      return -1;
+    free(value);
+    if (kvstore_haskey(&rebalance_slaves[1 - j].kvserver.store, key))
+      return -1;
+    moved += j;
+  }
+  return moved;
+}
+
+int tpcmaster_rebalance_join_leave(void) {
+  pthread_t threads[2];
+  char name[32], key[32];
+  intptr_t i;
+  int moved;
+  tpcmaster_init(&testmaster, 2, 1, 4, 4);
+  testmaster.vnodes = 16;
+  for (i = 0; i < 2; i++) {
+    sprintf(name, "tpcmaster-rebalance%d", (int) i);
+    rebalance_slaves[i].master = 0;
+    rebalance_slaves[i].max_threads = 2;
+    kvserver_init(&rebalance_slaves[i].kvserver, name, 4, 4, 2, "localhost",
+        REBALANCE_PORT + i, true);
+    pthread_create(&threads[i], NULL, tpcmaster_rebalance_runner, (void *) i);
+  }
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (rebalance_listening < 2)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  sprintf(buf, "%d", REBALANCE_PORT);
+  reqmsg.value = buf;
+  tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  /* Pretend clients have written everything to the only slave. */
+  testmaster.written = true;
+  for (i = 0; i < 200; i++) {
+    sprintf(key, "key%d", (int) i);
+    kvserver_put(&rebalance_slaves[0].kvserver, key, key);
+  }
+
+  /* The new slave only joins the ring once it has been given its keys. */
+  sprintf(buf, "%d", REBALANCE_PORT + 1);
+  tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(testmaster.ring_slaves, 1);
+  ASSERT_EQUAL(tpcmaster_rebalance(&testmaster), 0);
+  ASSERT_EQUAL(testmaster.ring_slaves, 2);
+  moved = tpcmaster_rebalance_check(200);
+  ASSERT_TRUE(moved > 0 && moved < 200);
+
+  /* When it leaves, its keys go back to the first slave. */
+  reqmsg.type = DEREGISTER;
+  tpcmaster_deregister(&testmaster, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(tpcmaster_rebalance(&testmaster), 0);
+  ASSERT_EQUAL(testmaster.ring_slaves, 1);
+  ASSERT_EQUAL(testmaster.slave_count, 1);
+  ASSERT_EQUAL(tpcmaster_rebalance_check(200), 0);
+
+  for (i = 0; i < 2; i++) {
+    server_stop(&rebalance_slaves[i]);
+    kvserver_clean(&rebalance_slaves[i].kvserver);
+  }
+  return 1;
+}
+
+int tpcmaster_batch_across_slaves(void) {
+  pthread_t threads[2];
+  kvpair_t batch[101];
+  char name[32], keys[101][16];
+  intptr_t i;
+  tpcmaster_init(&testmaster, 2, 1, 4, 4);
+  testmaster.vnodes = 16;
+  for (i = 0; i < 2; i++) {
+    sprintf(name, "tpcmaster-batch%d", (int) i);
+    rebalance_slaves[i].master = 0;
+    rebalance_slaves[i].max_threads = 2;
+    kvserver_init(&rebalance_slaves[i].kvserver, name, 4, 4, 2, "localhost",
+        REBALANCE_PORT + i, true);
+    pthread_create(&threads[i], NULL, tpcmaster_rebalance_runner, (void *) i);
+  }
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (rebalance_listening < 2)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  reqmsg.value = buf;
+  for (i = 0; i < 2; i++) {
+    sprintf(buf, "%d", REBALANCE_PORT + (int) i);
+    tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  }
+
+  /* Each key lands on its own slave, whichever that is. */
+  for (i = 0; i < 101; i++) {
+    sprintf(keys[i], "key%d", (int) i);
+    batch[i].key = batch[i].value = keys[i];
+  }
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = batch;
+  reqmsg.batch_size = 100;
+  tpcmaster_handle_mtpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_TRUE(tpcmaster_rebalance_check(100) > 0);
+
+  for (i = 0; i < 101; i++)
+    batch[i].value = NULL;
+  reqmsg.type = MGETREQ;
+  reqmsg.batch_size = 101;
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  tpcmaster_handle_mget(&testmaster, &reqmsg, &respmsg);
+  ASSERT_EQUAL(respmsg.type, MGETRESP);
+  ASSERT_EQUAL(respmsg.batch_size, 101);
+  for (i = 0; i < 100; i++)
+    ASSERT_STRING_EQUAL(respmsg.batch[i].value, keys[i]);
+  ASSERT_PTR_NULL(respmsg.batch[100].value);
+
+  reqmsg.type = MDELREQ;
+  reqmsg.batch_size = 100;
+  tpcmaster_handle_mtpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  for (i = 0; i < 100; i++) {
+    ASSERT_FALSE(kvstore_haskey(&rebalance_slaves[0].kvserver.store, keys[i]));
+    ASSERT_FALSE(kvstore_haskey(&rebalance_slaves[1].kvserver.store, keys[i]));
+  }
+
+  /* Where a batch writes a key twice, the last write wins. */
+  batch[0].value = "first";
+  batch[1].value = keys[1];
+  batch[2].key = keys[0];
+  batch[2].value = "last";
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch_size = 3;
+  tpcmaster_handle_mtpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  reqmsg.type = GETREQ;
+  reqmsg.key = keys[0];
+  memset(&respmsg, 0, sizeof(kvmessage_t));
+  tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.value, "last");
+  free(respmsg.value);
+
+  for (i = 0; i < 2; i++) {
+    server_stop(&rebalance_slaves[i]);
+    kvserver_clean(&rebalance_slaves[i].kvserver);
+  }
+  return 1;
+}
+
+int tpcmaster_scan_merged(void) {
+  pthread_t threads[2];
+  kvpair_t batch[150];
+  kvmessage_t *msg;
+  char name[32], keys[150][16];
+  int fds[2], next;
+  intptr_t i;
+  tpcmaster_init(&testmaster, 2, 1, 4, 4);
+  testmaster.vnodes = 16;
+  for (i = 0; i < 2; i++) {
+    sprintf(name, "tpcmaster-scan%d", (int) i);
+    rebalance_slaves[i].master = 0;
+    rebalance_slaves[i].max_threads = 2;
+    kvserver_init(&rebalance_slaves[i].kvserver, name, 4, 4, 2, "localhost",
+        REBALANCE_PORT + i, true);
+    pthread_create(&threads[i], NULL, tpcmaster_rebalance_runner, (void *) i);
+  }
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (rebalance_listening < 2)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  reqmsg.value = buf;
+  for (i = 0; i < 2; i++) {
+    sprintf(buf, "%d", REBALANCE_PORT + (int) i);
+    tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+    ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  }
+  for (i = 0; i < 150; i++) {
+    sprintf(keys[i], "key%03d", (int) i);
+    batch[i].key = batch[i].value = keys[i];
+  }
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = MPUTREQ;
+  reqmsg.batch = batch;
+  reqmsg.batch_size = 150;
+  tpcmaster_handle_mtpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  /* Both slaves hold part of the range. */
+  ASSERT_TRUE(kvindex_size(rebalance_slaves[0].kvserver.store.index) > 0);
+  ASSERT_TRUE(kvindex_size(rebalance_slaves[1].kvserver.store.index) > 0);
+  /* A key held by both slaves, as replicas would, is only sent once. */
+  kvstore_put(&rebalance_slaves[0].kvserver.store, "key020", "key020");
+  kvstore_put(&rebalance_slaves[1].kvserver.store, "key020", "key020");
+
+  ASSERT_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds), 0);
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = SCANREQ;
+  reqmsg.key = "key010";
+  reqmsg.message = "135";
+  kvmessage_send(&reqmsg, fds[0]);
+  tpcmaster_handle(&testmaster, fds[1], NULL);
+  next = 10;
+  while ((msg = kvmessage_parse(fds[0])) != NULL && msg->type == SCANRESP) {
+    for (i = 0; i < msg->batch_size; i++, next++) {
+      ASSERT_STRING_EQUAL(msg->batch[i].key, keys[next]);
+      ASSERT_STRING_EQUAL(msg->batch[i].value, keys[next]);
+    }
+    kvmessage_free(msg);
+  }
+  ASSERT_PTR_NOT_NULL(msg);
+  ASSERT_STRING_EQUAL(msg->message, MSG_SUCCESS);
+  kvmessage_free(msg);
+  ASSERT_EQUAL(next, 145);
+  close(fds[0]);
+  close(fds[1]);
+
+  for (i = 0; i < 2; i++) {
+    server_stop(&rebalance_slaves[i]);
+    kvserver_clean(&rebalance_slaves[i].kvserver);
+  }
+  return 1;
+}
+
+#define HERD_PORT 9120
+#define HERD_CLIENTS 8
+
+server_t herd_slave;
+int herd_listening = 0;
+int herd_gets = 0;              /* The number of GETs the herd slave has answered. */
+bool herd_stored = false;       /* True once a PUT has committed on the herd slave. */
+kvmessage_t herd_respmsgs[HERD_CLIENTS];
+
+/* Answers a single message as a slave which only holds "HERD" once a PUT of
+ * it has committed, and which is slow to answer GETs. */
+void tpcmaster_herd_handle(tpcmaster_t *master, int sockfd, callback_t callback) {
+  kvmessage_t *req, resp;
+  if ((req = kvmessage_parse(sockfd)) == NULL)
+    return;
+  memset(&resp, 0, sizeof(kvmessage_t));
+  resp.type = ACK;
+  if (req->type == GETREQ) {
+    usleep(300000);
+    pthread_mutex_lock(&tpcmaster_lock);
+    herd_gets++;
+    if (herd_stored) {
+      resp.type = GETRESP;
+      resp.key = "HERD";
+      resp.value = "VAL";
+    } else {
+      resp.type = RESP;
+      resp.message = ERRMSG_NO_KEY;
+    }
+    pthread_mutex_unlock(&tpcmaster_lock);
+  } else if (req->type == PUTREQ) {
+    resp.type = VOTE_COMMIT;
+  } else if (req->type == COMMIT) {
+    pthread_mutex_lock(&tpcmaster_lock);
+    herd_stored = true;
+    pthread_mutex_unlock(&tpcmaster_lock);
+  }
+  kvmessage_send(&resp, sockfd);
+  kvmessage_free(req);
+}
+
+void tpcmaster_herd_listening(void *aux) {
+  pthread_mutex_lock(&tpcmaster_lock);
+  herd_listening = 1;
+  pthread_cond_signal(&tpcmaster_cond);
+  pthread_mutex_unlock(&tpcmaster_lock);
+}
+
+void *tpcmaster_herd_runner(void *aux) {
+  server_run("localhost", HERD_PORT, &herd_slave, tpcmaster_herd_listening);
+  return NULL;
+}
+
+void *tpcmaster_herd_client(void *_i) {
+  intptr_t i = (intptr_t) _i;
+  kvmessage_t req;
+  memset(&req, 0, sizeof(kvmessage_t));
+  memset(&herd_respmsgs[i], 0, sizeof(kvmessage_t));
+  req.type = GETREQ;
+  req.key = "HERD";
+  tpcmaster_handle_get(&testmaster, &req, &herd_respmsgs[i]);
+  return NULL;
+}
+
+/* Sends HERD_CLIENTS GETs of "HERD" to the master at once. */
+void tpcmaster_herd(void) {
+  pthread_t clients[HERD_CLIENTS];
+  intptr_t i;
+  for (i = 0; i < HERD_CLIENTS; i++)
+    pthread_create(&clients[i], NULL, tpcmaster_herd_client, (void *) i);
+  for (i = 0; i < HERD_CLIENTS; i++)
+    pthread_join(clients[i], NULL);
+}
+
+int tpcmaster_get_coalesced(void) {
+  pthread_t runner;
+  int i;
+  tpcmaster_init(&testmaster, 2, 1, 4, 4);
+  memset(&herd_slave, 0, sizeof(server_t));
+  herd_slave.master = 1;
+  herd_slave.max_threads = 2;
+  herd_slave.tpcmaster.handle = tpcmaster_herd_handle;
+  pthread_create(&runner, NULL, tpcmaster_herd_runner, NULL);
+  pthread_mutex_lock(&tpcmaster_lock);
+  while (!herd_listening)
+    pthread_cond_wait(&tpcmaster_cond, &tpcmaster_lock);
+  pthread_mutex_unlock(&tpcmaster_lock);
+  reqmsg.type = REGISTER;
+  reqmsg.key = "localhost";
+  reqmsg.value = buf;
+  sprintf(buf, "%d", HERD_PORT);
+  tpcmaster_register(&testmaster, &reqmsg, &respmsg);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+
+  /* A herd of GETs on a missing key costs the slave a single GET. */
+  tpcmaster_herd();
+  ASSERT_EQUAL(herd_gets, 1);
+  for (i = 0; i < HERD_CLIENTS; i++)
+    ASSERT_STRING_EQUAL(herd_respmsgs[i].message, ERRMSG_NO_KEY);
+  /* After which the key is known to be absent. */
+  tpcmaster_herd_client((void *) 0);
+  ASSERT_STRING_EQUAL(herd_respmsgs[0].message, ERRMSG_NO_KEY);
+  ASSERT_EQUAL(herd_gets, 1);
+
+  /* Until a PUT of it commits. */
+  memset(&reqmsg, 0, sizeof(kvmessage_t));
+  reqmsg.type = PUTREQ;
+  reqmsg.key = "HERD";
+  reqmsg.value = "VAL";
+  tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  tpcmaster_herd();
+  ASSERT_EQUAL(herd_gets, 2);
+  for (i = 0; i < HERD_CLIENTS; i++) {
+    ASSERT_EQUAL(herd_respmsgs[i].type, GETRESP);
+    ASSERT_STRING_EQUAL(herd_respmsgs[i].value, "VAL");
+    free(herd_respmsgs[i].key);
+    free(herd_respmsgs[i].value);
+  }
+
+  server_stop(&herd_slave);
+  pthread_join(runner, NULL);
+  return 1;
+}
+
 int tpcmaster_get_cached(void) {
   int ret;
   pthread_rwlock_t *cachelock = kvcache_getlock(&testmaster.cache, "KEY");
@@ -165,12 +623,46 @@ void tpcmaster_dummy_handle(tpcmaster_t *master, int sockfd, callback_t callback
       resp.key = "KEY";
       resp.value = "VAL";
       break;
+    case GET_HEDGED:
+      /* The first replica asked is slow to answer. */
+      pthread_mutex_lock(&tpcmaster_lock);
+      if (votes_pending++ == 0) {
+        pthread_mutex_unlock(&tpcmaster_lock);
+        sleep(2);
+      } else {
+        pthread_mutex_unlock(&tpcmaster_lock);
+      }
+      resp.type = GETRESP;
+      resp.key = "KEY";
+      resp.value = "VAL";
+      break;
     case PUT_SIMPLE: case DEL_SIMPLE:
       if (req->type == PUTREQ || req->type == DELREQ)
         resp.type = VOTE_COMMIT;
       else
         resp.type = ACK;
       break;
+    case PUT_PARALLEL:
+      resp.type = ACK;
+      if (req->type == PUTREQ) {
+        /* Only vote to commit once every replica has been asked to vote,
+         * which can only happen if the master asks them all at once. */
+        int i;
+        resp.type = VOTE_ABORT;
+        pthread_mutex_lock(&tpcmaster_lock);
+        votes_pending++;
+        pthread_mutex_unlock(&tpcmaster_lock);
+        for (i = 0; i < 200; i++) {
+          pthread_mutex_lock(&tpcmaster_lock);
+          if (votes_pending == testmaster.redundancy)
+            resp.type = VOTE_COMMIT;
+          pthread_mutex_unlock(&tpcmaster_lock);
+          if (resp.type == VOTE_COMMIT)
+            break;
+          usleep(10000);
+        }
+      }
+      break;
     default:
       return;
   }
@@ -186,11 +678,26 @@ void *tpcmaster_thread(void *aux) {
       reqmsg.type = GETREQ;
       tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
       break;
+    case GET_HEDGED:
+      reqmsg.type = GETREQ;
+      /* The dummy slaves need this lock to spot the first GET. */
+      pthread_mutex_unlock(&tpcmaster_lock);
+      tpcmaster_handle_get(&testmaster, &reqmsg, &respmsg);
+      pthread_mutex_lock(&tpcmaster_lock);
+      break;
     case PUT_SIMPLE:
       reqmsg.type = PUTREQ;
       reqmsg.value = "VAL";
       tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
       break;
+    case PUT_PARALLEL:
+      reqmsg.type = PUTREQ;
+      reqmsg.value = "VAL";
+      /* The dummy slaves need this lock to count their votes. */
+      pthread_mutex_unlock(&tpcmaster_lock);
+      tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
+      pthread_mutex_lock(&tpcmaster_lock);
+      break;
     case DEL_SIMPLE:
       reqmsg.type = DELREQ;
       tpcmaster_handle_tpc(&testmaster, &reqmsg, &respmsg, NULL);
@@ -216,6 +723,134 @@ int tpcmaster_get_simple(void) {
   return 1;
 }
 
+int tpcmaster_get_hedged(void) {
+  struct timeval start, end;
+  current_test = GET_HEDGED;
+  testmaster.hedge_reads = true;
+  gettimeofday(&start, NULL);
+  tpcmaster_run_test();
+  gettimeofday(&end, NULL);
+  ASSERT_EQUAL(respmsg.type, GETRESP);
+  ASSERT_STRING_EQUAL(respmsg.value, "VAL");
+  /* The answer came from the second replica, well before the first's. */
+  ASSERT_TRUE(end.tv_sec - start.tv_sec < 2);
+  return 1;
+}
+
+int tpcmaster_read_policies(void) {
+  tpcslave_t a, b, *replicas[2];
+  int i, firsts = 0;
+  memset(&a, 0, sizeof(tpcslave_t));
+  memset(&b, 0, sizeof(tpcslave_t));
+
+  testmaster.read_policy = TPCMASTER_READ_PRIMARY;
+  for (i = 0; i < 4; i++) {
+    replicas[0] = &a;
+    replicas[1] = &b;
+    tpcmaster_order_replicas(&testmaster, replicas, 2);
+    ASSERT_TRUE(replicas[0] == &a && replicas[1] == &b);
+  }
+
+  testmaster.read_policy = TPCMASTER_READ_ROUND_ROBIN;
+  for (i = 0; i < 4; i++) {
+    replicas[0] = &a;
+    replicas[1] = &b;
+    tpcmaster_order_replicas(&testmaster, replicas, 2);
+    ASSERT_NOT_EQUAL(replicas[0], replicas[1]);
+    firsts += (replicas[0] == &a);
+  }
+  ASSERT_EQUAL(firsts, 2);
+
+  testmaster.read_policy = TPCMASTER_READ_LEAST_OUTSTANDING;
+  a.outstanding = 3;
+  for (i = 0; i < 4; i++) {
+    replicas[0] = &a;
+    replicas[1] = &b;
+    tpcmaster_order_replicas(&testmaster, replicas, 2);
+    ASSERT_TRUE(replicas[0] == &b && replicas[1] == &a);
+  }
+
+  testmaster.read_policy = TPCMASTER_READ_EWMA;
+  tpcmaster_record_latency(&testmaster, &a, 500);
+  tpcmaster_record_latency(&testmaster, &b, 100);
+  replicas[0] = &a;
+  replicas[1] = &b;
+  tpcmaster_order_replicas(&testmaster, replicas, 2);
+  ASSERT_EQUAL(replicas[0], &b);
+  /* B slows down, and its average soon follows. */
+  for (i = 0; i < 16; i++)
+    tpcmaster_record_latency(&testmaster, &b, 10000);
+  replicas[0] = &a;
+  replicas[1] = &b;
+  tpcmaster_order_replicas(&testmaster, replicas, 2);
+  ASSERT_EQUAL(replicas[0], &a);
+  return 1;
+}
+
+int tpcmaster_hedge_delay_p95(void) {
+  tpcslave_t slave;
+  int i;
+  memset(&slave, 0, sizeof(tpcslave_t));
+  ASSERT_EQUAL(tpcmaster_hedge_delay(&testmaster), TPCMASTER_HEDGE_DEFAULT_DELAY);
+  for (i = 100; i > 0; i--)
+    tpcmaster_record_latency(&testmaster, &slave, i * 1000);
+  ASSERT_EQUAL(tpcmaster_hedge_delay(&testmaster), 96000);
+  /* Only the most recent latencies count. */
+  for (i = 0; i < TPCMASTER_LATENCY_SAMPLES; i++)
+    tpcmaster_record_latency(&testmaster, &slave, 50);
+  ASSERT_EQUAL(tpcmaster_hedge_delay(&testmaster), 50);
+  return 1;
+}
+
+#define POOL_PORT 9110
+
+int tpcmaster_connection_pool(void) {
+  struct sockaddr_in addr;
+  tpcslave_t slave;
+  int listenfd, peer, fd, first, opt = 1;
+  bool reused;
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(POOL_PORT);
+  ASSERT_EQUAL(bind(listenfd, (struct sockaddr *) &addr, sizeof(addr)), 0);
+  ASSERT_EQUAL(listen(listenfd, 8), 0);
+  memset(&slave, 0, sizeof(tpcslave_t));
+  pthread_mutex_init(&slave.pool_lock, NULL);
+  slave.host = "localhost";
+  slave.port = POOL_PORT;
+
+  first = tpcmaster_slave_connect(&slave, 1, &reused);
+  ASSERT_TRUE(first >= 0);
+  ASSERT_FALSE(reused);
+  ASSERT_TRUE(slave.resolved);
+  tpcmaster_slave_release(&slave, first, true);
+  ASSERT_EQUAL(slave.pool_size, 1);
+
+  /* An idle connection is handed out again. */
+  fd = tpcmaster_slave_connect(&slave, 1, &reused);
+  ASSERT_EQUAL(fd, first);
+  ASSERT_TRUE(reused);
+  tpcmaster_slave_release(&slave, fd, true);
+
+  /* Unless it has since been closed by the slave. */
+  peer = accept(listenfd, NULL, NULL);
+  close(peer);
+  usleep(10000);
+  fd = tpcmaster_slave_connect(&slave, 1, &reused);
+  ASSERT_TRUE(fd >= 0);
+  ASSERT_FALSE(reused);
+  ASSERT_EQUAL(slave.pool_size, 0);
+
+  /* A connection which did not finish its exchange is not kept. */
+  tpcmaster_slave_release(&slave, fd, false);
+  ASSERT_EQUAL(slave.pool_size, 0);
+  close(listenfd);
+  return 1;
+}
+
 int tpcmaster_put_simple(void) {
   current_test = PUT_SIMPLE;
   tpcmaster_run_test();
@@ -223,6 +858,29 @@ int tpcmaster_put_simple(void) {
   return 1;
 }
 
+int tpcmaster_put_stats(void) {
+  kvtiming_t timing;
+  current_test = PUT_SIMPLE;
+  tpcmaster_run_test();
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  ASSERT_EQUAL(kvstats_counter(&testmaster.stats, KVSTATS_VOTE_COMMIT), 2);
+  ASSERT_EQUAL(kvstats_counter(&testmaster.stats, KVSTATS_VOTE_ABORT), 0);
+  ASSERT_EQUAL(kvstats_counter(&testmaster.stats, KVSTATS_COMMIT), 1);
+  kvstats_timing(&testmaster.stats, KVSTATS_PREPARE, &timing);
+  ASSERT_EQUAL(timing.count, 1);
+  kvstats_timing(&testmaster.stats, KVSTATS_DECIDE, &timing);
+  ASSERT_EQUAL(timing.count, 1);
+  ASSERT_TRUE(timing.max > 0);
+  return 1;
+}
+
+int tpcmaster_put_parallel(void) {
+  current_test = PUT_PARALLEL;
+  tpcmaster_run_test();
+  ASSERT_STRING_EQUAL(respmsg.message, MSG_SUCCESS);
+  return 1;
+}
+
 int tpcmaster_del_simple(void) {
   current_test = DEL_SIMPLE;
   tpcmaster_run_test();
@@ -262,8 +920,11 @@ int tpcmaster_put_fail(void) {
 int tpcmaster_info_check(void) {
   current_test = INFO_SIMPLE;
   tpcmaster_run_test();
-  char buf[100], pbuf[10], expected[100];
+  char buf[4096], pbuf[10], expected[100];
   strcpy(buf, respmsg.message + strcspn(respmsg.message, "\n") + 1);
+  /* The slaves are followed by the master's stats. */
+  ASSERT_PTR_NOT_NULL(strstr(buf, "\nStats:\n"));
+  *strstr(buf, "\nStats:\n") = '\0';
   sprintf(pbuf, "%d", SLAVE_PORT);
   strcpy(expected, "Slaves:\n{localhost, ");
   strcat(expected, pbuf);
@@ -308,22 +969,26 @@ int tpcmaster_run_test(void) {
 
 void setup_slaves() {
   int port = SLAVE_PORT;
-  tpcslave_t *first = malloc(sizeof(tpcslave_t));
+  tpcslave_t *first = calloc(1, sizeof(tpcslave_t));
   first->host = "localhost";
   first->port = port;
   first->id = -5397345852215556464;
-  tpcslave_t *second = malloc(sizeof(tpcslave_t));
+  first->refs = 1;
+  tpcslave_t *second = calloc(1, sizeof(tpcslave_t));
   second->host = "localhost";
   second->port = port;
   second->id = -2561935789451811312;
-  tpcslave_t *third = malloc(sizeof(tpcslave_t));
+  second->refs = 1;
+  tpcslave_t *third = calloc(1, sizeof(tpcslave_t));
   third->host = "localhost";
   third->port = port;
   third->id = 2561935789451811312;
-  tpcslave_t *fourth = malloc(sizeof(tpcslave_t));
+  third->refs = 1;
+  tpcslave_t *fourth = calloc(1, sizeof(tpcslave_t));
   fourth->host = "localhost";
   fourth->port = port;
   fourth->id = 5397345852215556464;
+  fourth->refs = 1;
   first->next = second;
   first->prev = fourth;
   second->next = third;
@@ -334,6 +999,7 @@ void setup_slaves() {
   fourth->prev = third;
   testmaster.slaves_head = first;
   testmaster.slave_count = 4;
+  tpcmaster_rebuild_ring(&testmaster);
 }
 
 void cleanup_slaves() {
@@ -351,11 +1017,30 @@ void cleanup_slaves() {
 test_info_t tpcmaster_tests[] = {
   {"Register a single slave", tpcmaster_register_single},
   {"Register one too many slaves", tpcmaster_register_fail},
+  {"Registered slaves are kept sorted by id", tpcmaster_register_sorted},
   {"Identify first replica for multiple keys", tpcmaster_get_slave_for_key},
   {"Identify successor for multiple slaves", tpcmaster_get_successor_for_slave},
+  {"Virtual nodes spread keys evenly across slaves", tpcmaster_ring_vnodes},
+  {"Slaves joining and leaving move only the keys they gain or lose",
+    tpcmaster_rebalance_join_leave},
   {"Master GET value from master cache", tpcmaster_get_cached},
   {"Master GET value from main slave", tpcmaster_get_simple},
+  {"Master GET is hedged to a second replica when slow", tpcmaster_get_hedged},
+  {"Read policies pick the replica a GET goes to first",
+    tpcmaster_read_policies},
+  {"Hedging delay follows the 95th percentile of GET latencies",
+    tpcmaster_hedge_delay_p95},
+  {"Connections to a slave are pooled while healthy",
+    tpcmaster_connection_pool},
+  {"Batches are split across slaves and run as one transaction",
+    tpcmaster_batch_across_slaves},
+  {"A scan merges the sorted streams of every slave",
+    tpcmaster_scan_merged},
+  {"Concurrent GETs of a key share one fetch, and absent keys are cached",
+    tpcmaster_get_coalesced},
   {"Master PUT value", tpcmaster_put_simple},
+  {"Master PUT is counted and timed in its stats", tpcmaster_put_stats},
+  {"Master PUT asks every replica to vote at once", tpcmaster_put_parallel},
   {"Master DEL value", tpcmaster_del_simple},
   {"Get information, all slaves", tpcmaster_info_check},
   NULL_TEST_INFO
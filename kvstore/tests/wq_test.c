@@ -90,9 +90,45 @@ int wq_wait_single_test(void) {
   return 1;
 }
 
+wq_t boundedwq;
+int bounded_pushed;
+
+void *wq_push_test_thread_bounded(void* aux) {
+  wq_push(&boundedwq, (void *) 2);
+  pthread_mutex_lock(&wq_test_lock);
+  bounded_pushed = 1;
+  pthread_cond_signal(&wq_test_cond);
+  pthread_mutex_unlock(&wq_test_lock);
+  return NULL;
+}
+
+int wq_bounded_push_test(void) {
+  pthread_t push_thread;
+  int pushed;
+  bounded_pushed = 0;
+  wq_init_bounded(&boundedwq, 1);
+  wq_push(&boundedwq, (void *) 1);
+  pthread_create(&push_thread, NULL, wq_push_test_thread_bounded, NULL);
+  usleep(10000);
+  pthread_mutex_lock(&wq_test_lock);
+  pushed = bounded_pushed;
+  pthread_mutex_unlock(&wq_test_lock);
+  /* The queue is full, so the second push must still be waiting. */
+  ASSERT_EQUAL(pushed, 0);
+  ASSERT_EQUAL((intptr_t) wq_pop(&boundedwq), 1);
+  pthread_mutex_lock(&wq_test_lock);
+  while (!bounded_pushed)
+    pthread_cond_wait(&wq_test_cond, &wq_test_lock);
+  pthread_mutex_unlock(&wq_test_lock);
+  pthread_join(push_thread, NULL);
+  ASSERT_EQUAL((intptr_t) wq_pop(&boundedwq), 2);
+  return 1;
+}
+
 test_info_t wq_tests[] = {
   {"Tests that a thread popping will wait until there is an item in the queue", wq_wait_single_test},
   {"Tests that multiple threads waiting will get one item each", wq_wait_multiple_test},
+  {"Tests that pushing to a full bounded queue waits for a pop", wq_bounded_push_test},
   NULL_TEST_INFO
 };
 